@@ -0,0 +1,97 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* First chunk size; each new chunk doubles up to ARENA_CHUNK_MAX. */
+#define ARENA_CHUNK_MIN		4096
+#define ARENA_CHUNK_MAX		(1 << 20)
+
+/**
+ * struct arena_chunk - One block of arena memory.
+ * @next: Chunk allocated before this one.
+ * @size: Usable bytes in @data.
+ * @used: Bytes of @data handed out so far.
+ * @data: The memory itself.
+ */
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			 size;
+	size_t			 used;
+	union {
+		void		*p;
+		double		 d;
+		long		 l;
+	} data[];
+};
+
+/**
+ * struct arena - Bump allocator whose memory is released all at once.
+ * @head:  Chunk allocations are currently carved from; NULL while empty.
+ * @next:  Size of the next chunk to allocate.
+ * @total: Bytes handed out over the arena's lifetime.
+ *
+ * Allocation moves a cursor through the current chunk and takes a new,
+ * larger one when it runs out; nothing is freed on its own.  Chunks
+ * come from calloc() and are never reused, so every allocation starts
+ * out zeroed without a memset.
+ */
+struct arena {
+	struct arena_chunk	*head;
+	size_t			 next;
+	size_t			 total;
+};
+
+/**
+ * arena_create() - Allocate an empty arena.
+ *
+ * No chunk is allocated until the first arena_alloc().
+ *
+ * Return: Pointer to arena, or NULL on allocation failure.
+ */
+struct arena *arena_create(void);
+
+/**
+ * arena_destroy() - Release an arena and everything allocated from it.
+ * @arena: Arena to destroy.  Safe to call with NULL.
+ *
+ * Walks the chunk list, not the objects, so it costs one free() per
+ * chunk however many objects (or how deep a tree) the arena holds.
+ */
+void arena_destroy(struct arena *arena);
+
+/**
+ * arena_alloc() - Take @size zeroed bytes from @arena.
+ * @arena: Arena to allocate from.
+ * @size:  Bytes wanted.
+ *
+ * The memory is aligned for any pointer or double and stays valid
+ * until arena_destroy().
+ *
+ * Return: Pointer to memory, or NULL on allocation failure.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * arena_strndup() - Copy @n bytes of @s into @arena as a C string.
+ * @arena: Arena to allocate from.
+ * @s:     Bytes to copy; need not be NUL-terminated.
+ * @n:     Number of bytes to copy.
+ *
+ * Return: NUL-terminated copy, or NULL on allocation failure.
+ */
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+
+/**
+ * arena_merge() - Move everything allocated from @src into @dst.
+ * @dst: Arena that takes over @src's memory.
+ * @src: Arena to empty and free.  Safe to call with NULL.
+ *
+ * Arenas are not safe to share between threads, so each thread builds
+ * in an arena of its own; merging afterwards lets the results be
+ * released together with @dst.  Costs one step per chunk of @src;
+ * pointers into @src stay valid.
+ */
+void arena_merge(struct arena *dst, struct arena *src);
+
+#endif /* ARENA_H */
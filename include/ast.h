@@ -2,6 +2,7 @@
 #define AST_H
 
 #include "token.h"
+#include "arena.h"
 
 /**
  * enum ast_node_type - Discriminator tag for every AST node variant.
@@ -23,18 +24,39 @@ enum ast_node_type {
 	AST_BLOCK		/* indented statement sequence */
 };
 
+/**
+ * enum ast_shared - Whether a node may have more than one parent.
+ * @AST_UNSHARED:      Built for its one parent.
+ * @AST_SHARED_NUMBER: Hash-consed constant (see hashcons.h) whose value
+ *                     is a number.
+ * @AST_SHARED_STRING: Hash-consed constant whose value is a string.
+ */
+enum ast_shared {
+	AST_UNSHARED,
+	AST_SHARED_NUMBER,
+	AST_SHARED_STRING
+};
+
 /**
  * struct ast_node - A single node in the abstract syntax tree.
- * @type:        Which variant this node represents.
- * @line_number: Source line for error reporting.
- * @data:        Variant-specific payload (anonymous union).
+ * @type:   Which variant this node represents.
+ * @shared: An enum ast_shared; packed into the padding after @type.
+ *          A shared node is reachable from every place its constant
+ *          was written, so nothing may modify it in place.
+ * @offset: Byte offset of the node's first token, for error reporting;
+ *          see struct line_index for turning it into a line.
+ * @data:   Variant-specific payload (anonymous union).
  *
- * Every heap-allocated string inside @data is owned by the node
- * and must be released by ast_free().
+ * Nodes, their child arrays and their strings all live in the arena
+ * they were created in and are released together by arena_destroy();
+ * a tree has no per-node teardown.  Names are atoms from the
+ * compilation's intern table (see intern.h), so comparing two names
+ * is a single integer compare and nodes never copy them.
  */
 struct ast_node {
 	enum ast_node_type	 type;
-	int			 line_number;
+	uint8_t			 shared;
+	size_t			 offset;
 
 	union {
 		/* Literals */
@@ -47,7 +69,7 @@ struct ast_node {
 		} string;
 
 		struct {
-			char *name;
+			uint32_t name;
 		} identifier;
 
 		/* Expressions */
@@ -64,7 +86,7 @@ struct ast_node {
 
 		/* Statements */
 		struct {
-			char			*variable;
+			uint32_t		 variable;
 			struct ast_node		*value;
 		} assignment;
 
@@ -80,14 +102,15 @@ struct ast_node {
 		} while_stmt;
 
 		struct {
-			char			 *name;
-			char			**parameters;
+			uint32_t		  name;
 			int			  param_count;
-			struct ast_node		 *body;
+			uint32_t		 *parameters;
+			struct ast_node		 *body; /* NULL if deferred */
+			int			  body_start; /* its INDENT */
 		} function_def;
 
 		struct {
-			char			 *function_name;
+			uint32_t		  function_name;
 			struct ast_node		**arguments;
 			int			  arg_count;
 		} function_call;
@@ -104,13 +127,11 @@ struct ast_node {
 		struct {
 			struct ast_node		**statements;
 			int			  count;
-			int			  capacity;
 		} block;
 
 		struct {
 			struct ast_node		**statements;
 			int			  count;
-			int			  capacity;
 		} program;
 	} data;
 };
@@ -118,63 +139,90 @@ struct ast_node {
 /* Hard limit on function parameters and call arguments. */
 #define AST_MAX_PARAMS		64
 
-/* Initial statement capacity for blocks; doubles on overflow. */
-#define AST_BLOCK_INIT_CAP	16
-
 /**
  * ast_create_node() - Allocate and zero-initialise a new AST node.
- * @type:        Node discriminator.
- * @line_number: Source line (for diagnostics).
+ * @arena:  Arena the node is allocated from.
+ * @type:   Node discriminator.
+ * @offset: Source offset (for diagnostics).
  *
  * Return: Pointer to node on success, NULL on allocation failure.
  */
-struct ast_node *ast_create_node(enum ast_node_type type, int line_number);
+struct ast_node *ast_create_node(struct arena *arena,
+				 enum ast_node_type type, size_t offset);
 
 /**
  * ast_create_number() - Convenience constructor for a numeric literal.
+ * @arena: Arena the node is allocated from.
  * @value: The numeric value.
- * @line:  Source line.
+ * @offset: Source offset.
  *
  * Return: Pointer to node, or NULL on failure.
  */
-struct ast_node *ast_create_number(double value, int line);
+struct ast_node *ast_create_number(struct arena *arena, double value,
+				   size_t offset);
 
 /**
  * ast_create_string() - Convenience constructor for a string literal.
- * @value: String content (copied into the node).
- * @line:  Source line.
+ * @arena:  Arena the node and its text are allocated from.
+ * @value:  String content (copied into @arena).
+ * @length: Bytes of @value to copy; @value need not be NUL-terminated.
+ * @offset: Source offset.
  *
  * Return: Pointer to node, or NULL on failure.
  */
-struct ast_node *ast_create_string(const char *value, int line);
+struct ast_node *ast_create_string(struct arena *arena, const char *value,
+				   int length, size_t offset);
 
 /**
  * ast_create_identifier() - Convenience constructor for an identifier.
- * @name: Identifier text (copied into the node).
- * @line: Source line.
+ * @arena:  Arena the node is allocated from.
+ * @name:   Interned identifier atom.
+ * @offset: Source offset.
  *
  * Return: Pointer to node, or NULL on failure.
  */
-struct ast_node *ast_create_identifier(const char *name, int line);
+struct ast_node *ast_create_identifier(struct arena *arena, uint32_t name,
+				       size_t offset);
 
 /**
  * ast_create_binary_op() - Convenience constructor for a binary expression.
- * @left:  Left-hand sub-tree (ownership transferred to the new node).
+ * @arena: Arena the node is allocated from.
+ * @left:  Left-hand sub-tree.
  * @op:    Operator token type.
- * @right: Right-hand sub-tree (ownership transferred to the new node).
- * @line:  Source line.
+ * @right: Right-hand sub-tree.
+ * @offset: Source offset.
  *
  * Return: Pointer to node, or NULL on failure.
  */
-struct ast_node *ast_create_binary_op(struct ast_node *left,
+struct ast_node *ast_create_binary_op(struct arena *arena,
+				      struct ast_node *left,
 				      enum token_type op,
 				      struct ast_node *right,
-				      int line);
+				      size_t offset);
 
 /**
- * ast_free() - Recursively free a node and all of its descendants.
- * @node: Root of the sub-tree to free.  Safe to call with NULL.
+ * ast_create_list() - Copy a list of child nodes into @arena.
+ * @arena: Arena the array is allocated from.
+ * @nodes: Children, e.g. gathered on the parser's scratch stack.
+ * @count: Number of entries in @nodes.
+ *
+ * Lists are built elsewhere and copied here once, at their final
+ * length, so the arena never holds the leftovers of a growing array.
+ *
+ * Return: Pointer to the copy, or NULL on allocation failure.
+ */
+struct ast_node **ast_create_list(struct arena *arena,
+				  struct ast_node *const *nodes, int count);
+
+/**
+ * ast_shift_offsets() - Add @delta to the offset of every node.
+ * @node:  Root of the sub-tree to move.  Safe to call with NULL.
+ * @delta: Bytes to add; may be negative.
+ *
+ * Used when a reused statement moves because text above it was edited.
+ * Shared nodes are left alone: they may hang under statements that did
+ * not move, and their offsets are never reported.
  */
-void ast_free(struct ast_node *node);
+void ast_shift_offsets(struct ast_node *node, ptrdiff_t delta);
 
 #endif /* AST_H */
@@ -0,0 +1,129 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+#include "flat_ast.h"
+#include "intern.h"
+#include "sha256.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Environment variable naming the cache directory when no option does. */
+#define AST_CACHE_ENV		"PYTHON_COMPILER_CACHE"
+
+/* Entries are evicted, oldest use first, once the directory holds more. */
+#ifndef AST_CACHE_MAX_BYTES
+#define AST_CACHE_MAX_BYTES	(64 << 20)
+#endif
+
+/* Bumped whenever the image layout or the meaning of a tree changes. */
+#define AST_IMAGE_VERSION	2
+
+/**
+ * struct ast_image - A flat tree loaded from the cache.
+ * @ast:  The tree; its arrays point into @map.
+ * @map:  Read-only mapping of the cache entry.
+ * @size: Bytes mapped.
+ */
+struct ast_image {
+	struct flat_ast	 ast;
+	void		*map;
+	size_t		 size;
+};
+
+/**
+ * ast_cache_load() - Look up the tree compiled from a source.
+ * @dir:    Cache directory.
+ * @key:    SHA-256 of the source text.
+ * @length: Length of the source text, checked against the entry.
+ * @atoms:  Empty intern table.  On a hit it is filled with the names
+ *          the tree was built with, so its atoms mean the same again.
+ *
+ * The entry is mapped, not read: its header, node, offset, number,
+ * list and string sections are used where they lie, and only the
+ * names are copied out.  An entry written by another version, for
+ * other sizes of the layout's types, for a different source, that
+ * fails the bounds checks or whose bytes no longer match the digest
+ * stored with them is treated as a miss and left to be overwritten.  A hit refreshes the entry's modification time, which
+ * eviction takes as its last use.
+ *
+ * Return: Loaded image, or NULL on a miss.  Misses print nothing.
+ */
+struct ast_image *ast_cache_load(const char *dir,
+				 const uint8_t key[SHA256_BYTES],
+				 size_t length, struct intern_table *atoms);
+
+/**
+ * ast_cache_release() - Unmap an image from ast_cache_load().
+ * @image: Image to release.  Safe to call with NULL.
+ */
+void ast_cache_release(struct ast_image *image);
+
+/**
+ * ast_image_open() - Use an image that is already in memory.
+ * @ast:    Receives the tree; its arrays point into @data.
+ * @data:   The image, aligned to at least 8 bytes, e.g. mapped.
+ * @size:   Bytes in the image.
+ * @key:    SHA-256 the image must have been stored under, or NULL to
+ *          accept any source.
+ * @length: Source length checked along with @key.
+ * @atoms:  Empty intern table, filled as by ast_cache_load().
+ *
+ * The checks are those of ast_cache_load(), which maps its entry and
+ * calls this; an image embedded elsewhere is opened the same way.
+ *
+ * Return: 1 if the image is usable, 0 if not.
+ */
+int ast_image_open(struct flat_ast *ast, const void *data, size_t size,
+		   const uint8_t key[SHA256_BYTES], size_t length,
+		   struct intern_table *atoms);
+
+/**
+ * ast_image_size() - Bytes ast_image_write() would write.
+ * @ast:   Tree to measure.
+ * @atoms: Intern table the tree's atoms refer to.
+ *
+ * Return: Size of the image.
+ */
+uint64_t ast_image_size(const struct flat_ast *ast,
+			const struct intern_table *atoms);
+
+/**
+ * ast_image_write() - Write the image of a tree to a stream.
+ * @file:   Stream positioned where the image starts.  Sections are
+ *          aligned relative to that position, so it must be a multiple
+ *          of 8 for the image to be usable in place.
+ * @key:    SHA-256 of the source text.
+ * @length: Length of the source text.
+ * @ast:    Tree built from the source.
+ * @atoms:  Intern table the tree's atoms refer to.
+ *
+ * Return: 1 on success, 0 on a write error.  Nothing is printed.
+ */
+int ast_image_write(FILE *file, const uint8_t key[SHA256_BYTES],
+		    size_t length, const struct flat_ast *ast,
+		    const struct intern_table *atoms);
+
+/**
+ * ast_cache_store() - Save a tree under the key of its source.
+ * @dir:    Cache directory; created if missing, but not its parents.
+ * @key:    SHA-256 of the source text.
+ * @length: Length of the source text.
+ * @ast:    Tree built from the source.
+ * @atoms:  Intern table the tree's atoms refer to.
+ *
+ * The entry is written to a temporary file and renamed into place, so
+ * a concurrent ast_cache_load() sees either the old entry or the whole
+ * new one.  Afterwards the least recently used entries are removed
+ * until the directory holds at most AST_CACHE_MAX_BYTES of them.
+ *
+ * A cache is only an optimisation, so failure is reported once on
+ * stderr and otherwise ignored.
+ *
+ * Return: 1 if the entry was written, 0 otherwise.
+ */
+int ast_cache_store(const char *dir, const uint8_t key[SHA256_BYTES],
+		    size_t length, const struct flat_ast *ast,
+		    const struct intern_table *atoms);
+
+#endif /* AST_CACHE_H */
@@ -0,0 +1,78 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "flat_ast.h"
+#include "intern.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the running executable can be opened; see bundle_open(). */
+#define BUNDLE_SELF		"/proc/self/exe"
+
+/*
+ * The payload starts at a multiple of this, so it can be mapped from
+ * the executable on any page size up to 64 KiB.
+ */
+#define BUNDLE_ALIGN		65536
+
+/**
+ * struct bundle - A program embedded in the running executable.
+ * @ast:    Its tree, pointing into @map.
+ * @source: The source it was compiled from, for diagnostics only.
+ * @length: Bytes at @source.
+ * @map:    Read-only mapping of the payload.
+ * @size:   Bytes mapped.
+ *
+ * A bundle is a copy of the interpreter with a payload appended: the
+ * tree's image (see ast_cache.h), then the source, then a fixed-size
+ * trailer ending the file that says where both are.
+ */
+struct bundle {
+	struct flat_ast	 ast;
+	const char	*source;
+	size_t		 length;
+	void		*map;
+	size_t		 size;
+};
+
+/**
+ * bundle_open() - Find the program embedded in an executable.
+ * @exe:    Path of the executable, normally BUNDLE_SELF.
+ * @atoms:  Empty intern table, filled with the tree's names.
+ * @bundle: Receives the bundle when there is one.
+ *
+ * An executable without a trailer costs one open() and one pread().
+ * With one, the payload is mapped and used in place: nothing is read,
+ * lexed or parsed.
+ *
+ * Return: 1 if @bundle was set, 0 if @exe has no program embedded, or
+ *         -1, after a message on stderr, if it has a damaged one.
+ */
+int bundle_open(const char *exe, struct intern_table *atoms,
+		struct bundle **bundle);
+
+/**
+ * bundle_close() - Unmap a bundle from bundle_open().
+ * @bundle: Bundle to release.  Safe to call with NULL.
+ */
+void bundle_close(struct bundle *bundle);
+
+/**
+ * bundle_write() - Write a standalone executable that runs a program.
+ * @out:    Path of the executable to create; replaced atomically.
+ * @exe:    The interpreter to copy, normally BUNDLE_SELF.
+ * @source: Program text, stored for the line numbers of diagnostics.
+ * @length: Bytes at @source.
+ * @ast:    The program's tree.
+ * @atoms:  Intern table the tree's atoms refer to.
+ *
+ * The result only runs on builds with the same image layout, which a
+ * copy of @exe always has.
+ *
+ * Return: 1 on success, 0 after a message on stderr.
+ */
+int bundle_write(const char *out, const char *exe, const char *source,
+		 size_t length, const struct flat_ast *ast,
+		 const struct intern_table *atoms);
+
+#endif /* BUNDLE_H */
@@ -0,0 +1,98 @@
+#ifndef FLAT_AST_H
+#define FLAT_AST_H
+
+#include "ast.h"
+#include <stdint.h>
+
+/* Child index meaning "no node": a missing else block or return value. */
+#define FLAT_NONE		UINT32_MAX
+
+/**
+ * struct flat_node - The fields of one node that evaluation reads.
+ * @kind:  enum ast_node_type of the node.
+ * @op:    enum token_type operator of a binary or unary op; else 0.
+ * @spare: Always 0.
+ * @a:     First operand, see below.
+ * @b:     Second operand.
+ * @c:     Third operand.
+ *
+ * Operands are node indices, atoms or positions in the pools of
+ * struct flat_ast, depending on @kind:
+ *
+ *   NUMBER         a = index into @numbers
+ *   STRING         a = byte offset into @strings
+ *   IDENTIFIER     a = name atom
+ *   BINARY_OP      a = left, b = right
+ *   UNARY_OP       a = operand
+ *   ASSIGNMENT     a = variable atom, b = value
+ *   IF_STMT        a = condition, b = then block, c = else block
+ *   WHILE_STMT     a = condition, b = body
+ *   FUNCTION_DEF   a = name atom, b/c = span of parameter atoms in
+ *                  @lists; the body is the next node
+ *   FUNCTION_CALL  a = function atom, b/c = span of arguments
+ *   RETURN_STMT    a = value
+ *   PRINT_STMT     a = value
+ *   BLOCK, PROGRAM b/c = span of statements
+ *
+ * A span is a start index into @lists and a count.  Absent children
+ * are FLAT_NONE.
+ */
+struct flat_node {
+	uint8_t		 kind;
+	uint8_t		 op;
+	uint16_t	 spare;
+	uint32_t	 a;
+	uint32_t	 b;
+	uint32_t	 c;
+};
+
+/**
+ * struct flat_ast - A whole tree flattened into index-linked arrays.
+ * @nodes:        Hot node fields, in pre-order; the root is node 0.
+ * @offsets:      Cold field: source offset of each node, parallel to
+ *                @nodes and read only for diagnostics.
+ * @numbers:      Numeric literal values.
+ * @lists:        Statement, argument and parameter spans, back to back.
+ * @strings:      String literals, each NUL-terminated.
+ * @node_count:   Entries in @nodes and @offsets.
+ * @number_count: Entries in @numbers.
+ * @list_count:   Entries in @lists.
+ * @string_bytes: Bytes in @strings.
+ * @bytes:        Size of the single allocation holding all of the above.
+ *
+ * Nodes are laid out in the order the interpreter visits them, so a
+ * statement and its sub-expressions share a few cache lines instead of
+ * being scattered over arena chunks, and a child costs 4 bytes instead
+ * of an 8-byte pointer.  Everything lives in one block with no internal
+ * pointers besides the array bases, so the tree is freed in one call.
+ * Names stay atoms from the intern table the tree was parsed with.
+ */
+struct flat_ast {
+	struct flat_node	*nodes;
+	size_t			*offsets;
+	double			*numbers;
+	uint32_t		*lists;
+	char			*strings;
+	uint32_t		 node_count;
+	uint32_t		 number_count;
+	uint32_t		 list_count;
+	uint32_t		 string_bytes;
+	size_t			 bytes;
+};
+
+/**
+ * flat_ast_build() - Flatten the tree under @root.
+ * @root: Tree to copy, usually an AST_PROGRAM.  The result does not
+ *        refer to it, so its arena may be destroyed straight after.
+ *
+ * Return: Pointer to the flat tree, or NULL on allocation failure.
+ */
+struct flat_ast *flat_ast_build(const struct ast_node *root);
+
+/**
+ * flat_ast_destroy() - Free a flat tree.
+ * @ast: Tree to free.  Safe to call with NULL.
+ */
+void flat_ast_destroy(struct flat_ast *ast);
+
+#endif /* FLAT_AST_H */
@@ -0,0 +1,118 @@
+#ifndef HASHCONS_H
+#define HASHCONS_H
+
+#include "ast.h"
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct hashcons_slot - One constant known to a hash-cons table.
+ * @node: The shared node; NULL marks an empty slot.
+ * @hash: Cached hash of @node, reused when the slots are rebuilt.
+ */
+struct hashcons_slot {
+	struct ast_node	*node;
+	uint32_t	 hash;
+};
+
+/**
+ * struct hashcons - Constants already built in one arena, by value.
+ * @slots: Open-addressed slots; NULL until the first constant.
+ * @mask:  Number of slots minus one.
+ * @count: Slots in use.
+ * @arena: Arena every node in @slots lives in.
+ *
+ * The table only ever hands out nodes from the arena it is asked to
+ * build in: switching to another arena forgets what it knew.  A zeroed
+ * struct is an empty table.
+ */
+struct hashcons {
+	struct hashcons_slot	*slots;
+	uint32_t		 mask;
+	uint32_t		 count;
+	struct arena		*arena;
+};
+
+/**
+ * hashcons_reset() - Forget every constant, keeping the slots.
+ * @hc: Table to empty.
+ *
+ * Needed before the table's arena is released if another arena could
+ * later be allocated at the same address.
+ */
+void hashcons_reset(struct hashcons *hc);
+
+/**
+ * hashcons_release() - Free the table's slots; the nodes stay.
+ * @hc: Table to release.  It is left empty and may be used again.
+ */
+void hashcons_release(struct hashcons *hc);
+
+/**
+ * hashcons_number() - Return the number literal @value in @arena.
+ * @hc:     Table of constants built so far.
+ * @arena:  Arena the tree is being built in.
+ * @value:  Literal value; equal means bit for bit, so 0 and -0 differ.
+ * @offset: Offset recorded if a new node has to be built.
+ *
+ * Return: A shared AST_NUMBER node, or NULL on allocation failure.
+ */
+struct ast_node *hashcons_number(struct hashcons *hc, struct arena *arena,
+				 double value, size_t offset);
+
+/**
+ * hashcons_string() - Return the string literal @value in @arena.
+ * @hc:     Table of constants built so far.
+ * @arena:  Arena the tree is being built in.
+ * @value:  Literal text, already unescaped; need not be NUL-terminated.
+ * @length: Bytes at @value.
+ * @offset: Offset recorded if a new node has to be built.
+ *
+ * Return: A shared AST_STRING node, or NULL on allocation failure.
+ */
+struct ast_node *hashcons_string(struct hashcons *hc, struct arena *arena,
+				 const char *value, int length,
+				 size_t offset);
+
+/**
+ * hashcons_unary() - Build, or find, a unary expression.
+ * @hc:      Table of constants built so far.
+ * @arena:   Arena the tree is being built in.
+ * @op:      Prefix operator.
+ * @operand: Its operand.
+ * @offset:  Offset recorded if a new node has to be built.
+ *
+ * Only a sign applied to a shared number is a constant; anything else
+ * gets a node of its own, exactly as ast_create_node() would build it.
+ *
+ * Return: The node, or NULL on allocation failure or NULL @operand.
+ */
+struct ast_node *hashcons_unary(struct hashcons *hc, struct arena *arena,
+				enum token_type op, struct ast_node *operand,
+				size_t offset);
+
+/**
+ * hashcons_binary() - Build, or find, a binary expression.
+ * @hc:     Table of constants built so far.
+ * @arena:  Arena the tree is being built in.
+ * @left:   Left operand.
+ * @op:     Operator.
+ * @right:  Right operand.
+ * @offset: Offset recorded if a new node has to be built.
+ *
+ * Operands are compared by address, which is enough because shared
+ * operands are themselves unique per value.  Only expressions that
+ * cannot fail at run time are shared: arithmetic and comparisons of
+ * shared numbers, except division by anything but a non-zero literal,
+ * and the concatenation of shared strings.  A shared node's offset is
+ * therefore never needed for a diagnostic.  Anything else gets a node
+ * of its own, as from ast_create_binary_op().
+ *
+ * Return: The node, or NULL on allocation failure or a NULL operand.
+ */
+struct ast_node *hashcons_binary(struct hashcons *hc, struct arena *arena,
+				 struct ast_node *left, enum token_type op,
+				 struct ast_node *right, size_t offset);
+
+#endif /* HASHCONS_H */
@@ -0,0 +1,138 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "ast.h"
+#include "arena.h"
+#include "intern.h"
+#include "lexer.h"
+
+/**
+ * struct incr_arena - Arena holding the trees parsed by one update.
+ * @arena: The memory.
+ * @live:  Statements of the session whose tree is in @arena.
+ *
+ * Trees cannot be freed one by one, so an update's arena is released
+ * when the last statement it parsed is replaced.
+ */
+struct incr_arena {
+	struct arena	*arena;
+	int		 live;
+};
+
+/**
+ * struct incr_stmt - One top-level statement of an edit session.
+ * @offset:     Byte offset of the statement's first token.
+ * @ast_offset: Offset the statement's tree was built for; it lags
+ *              @offset after an edit above it until
+ *              incremental_program() moves the tree.
+ * @resumable:  Non-zero when the first token opens its line at column
+ *              1, so lexing can restart here with a fresh indent stack.
+ * @node:       Parsed statement, in @mem.
+ * @mem:        Arena of the update that parsed @node.
+ */
+struct incr_stmt {
+	int		 offset;
+	int		 ast_offset;
+	int		 resumable;
+	struct ast_node	*node;
+	struct incr_arena *mem;
+};
+
+/**
+ * struct incr_stats - Work done by the most recent update.
+ * @relexed:  Source bytes lexed again.
+ * @reparsed: Top-level statements parsed again.
+ * @reused:   Top-level statements kept from the previous tree.
+ */
+struct incr_stats {
+	int relexed;
+	int reparsed;
+	int reused;
+};
+
+/**
+ * struct incremental - Front-end state kept alive across edits.
+ * @text:          Current source, NUL-terminated (owned).
+ * @length:        strlen(@text).
+ * @capacity:      Allocated size of @text.
+ * @atoms:         Intern table shared by every parse in the session.
+ * @lexer:         Lexer restarted at each update.
+ * @stmts:         Top-level statements in source order.
+ * @count:         Number of entries in @stmts.
+ * @stmt_capacity: Allocated length of @stmts.
+ * @program:       AST_PROGRAM node handed out by incremental_program();
+ *                 its statement array is the session's.
+ * @program_cap:   Allocated length of @program's statement array.
+ * @valid:         Zero while the source fails to parse; the next edit
+ *                 then parses the whole file again.
+ * @stats:         What the last update cost.
+ *
+ * Every top-level statement that starts at column 1 is a point where
+ * the lexer's indent stack is known to be empty, so an edit is handled
+ * by lexing and parsing from the nearest such statement before it
+ * until a statement boundary lines up with the old tree again.  The
+ * statements after that point are kept as they are, with their offsets
+ * shifted.
+ */
+struct incremental {
+	char			*text;
+	int			 length;
+	int			 capacity;
+	struct intern_table	*atoms;
+	struct lexer		*lexer;
+	struct incr_stmt	*stmts;
+	int			 count;
+	int			 stmt_capacity;
+	struct ast_node		 program;
+	int			 program_cap;
+	int			 valid;
+	struct incr_stats	 stats;
+};
+
+/**
+ * incremental_create() - Start an edit session and parse @source.
+ * @source: NUL-terminated source; copied into the session.
+ *
+ * A parse error or ill-formed UTF-8 is reported on stderr and leaves
+ * the session with @valid cleared rather than failing, so a broken
+ * file can be edited back into shape.
+ *
+ * Return: Pointer to session, or NULL on allocation failure or when
+ *         @source is INT_MAX bytes or longer.
+ */
+struct incremental *incremental_create(const char *source);
+
+/**
+ * incremental_destroy() - Free a session and every tree it owns.
+ * @session: Session to destroy.  Safe to call with NULL.
+ */
+void incremental_destroy(struct incremental *session);
+
+/**
+ * incremental_edit() - Replace a byte range and bring the AST up to date.
+ * @session: Active session.
+ * @start:   First byte to replace.
+ * @end:     One past the last byte to replace; @start for an insert.
+ * @text:    Replacement bytes; need not be NUL-terminated.
+ * @len:     Length of @text; 0 for a deletion.
+ *
+ * Return: 0 on success, -1 if the range is invalid, the edited source
+ *         would reach INT_MAX bytes, memory runs out or the edited
+ *         source is not valid UTF-8 or fails to parse.  The edit itself
+ *         is kept in every case except the first two.
+ */
+int incremental_edit(struct incremental *session, int start, int end,
+		     const char *text, int len);
+
+/**
+ * incremental_program() - Return the up-to-date program tree.
+ * @session: Active session.
+ *
+ * The node and the statements under it stay owned by the session and
+ * remain valid until the next edit.
+ *
+ * Return: AST_PROGRAM node, or NULL while the source fails to parse.
+ */
+struct ast_node *incremental_program(struct incremental *session);
+
+#endif /* INCREMENTAL_H */
@@ -0,0 +1,82 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Returned by intern() when the table cannot grow. */
+#define ATOM_INVALID	UINT32_MAX
+
+/**
+ * struct intern_entry - Where one interned name lives.
+ * @offset: Byte offset of the name in the table's character pool.
+ * @length: Name length in bytes, excluding the NUL terminator.
+ * @hash:   Cached hash, reused when the slot array is rebuilt.
+ */
+struct intern_entry {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t hash;
+};
+
+/**
+ * struct intern_table - Per-compilation map from names to atoms.
+ * @slots:     Open-addressed hash slots holding atom + 1; 0 is empty.
+ * @slot_mask: Number of slots minus one (a power of two minus one).
+ * @entries:   Name records indexed by atom.
+ * @count:     Number of distinct names interned.
+ * @capacity:  Allocated length of @entries.
+ * @chars:     Pool of NUL-terminated names, back to back.
+ * @chars_len: Bytes used in @chars.
+ * @chars_cap: Allocated length of @chars.
+ *
+ * An atom is a dense 32-bit index, so two names are equal exactly when
+ * their atoms are, and downstream tables can index arrays by atom.
+ */
+struct intern_table {
+	uint32_t		*slots;
+	uint32_t		 slot_mask;
+	struct intern_entry	*entries;
+	uint32_t		 count;
+	uint32_t		 capacity;
+	char			*chars;
+	size_t			 chars_len;
+	size_t			 chars_cap;
+};
+
+/**
+ * intern_create() - Allocate an empty intern table.
+ *
+ * Return: Pointer to table, or NULL on allocation failure.
+ */
+struct intern_table *intern_create(void);
+
+/**
+ * intern_destroy() - Free a table and every name in it.
+ * @table: Table to destroy.  Safe to call with NULL.
+ */
+void intern_destroy(struct intern_table *table);
+
+/**
+ * intern() - Return the atom for a name, adding it on first sight.
+ * @table: Intern table.
+ * @name:  Name bytes; need not be NUL-terminated.
+ * @len:   Length of @name in bytes.
+ *
+ * Return: The atom, or ATOM_INVALID on allocation failure.
+ */
+uint32_t intern(struct intern_table *table, const char *name, size_t len);
+
+/**
+ * intern_name() - Return the NUL-terminated text of an atom.
+ * @table: Intern table the atom came from.
+ * @atom:  Atom to look up.
+ *
+ * The pointer is invalidated by the next intern() call that adds a
+ * name; use it for printing, not for keeping.
+ *
+ * Return: The name, or "?" for an unknown atom.
+ */
+const char *intern_name(const struct intern_table *table, uint32_t atom);
+
+#endif /* INTERN_H */
@@ -3,6 +3,11 @@
 
 #include "symbol_table.h"
 #include "ast.h"
+#include "flat_ast.h"
+#include "intern.h"
+#include "line_index.h"
+#include "memo.h"
+#include "parser.h"
 
 /*
  * Hard limit on call-stack depth.
@@ -15,27 +20,49 @@
 
 /**
  * struct interpreter - All mutable state for one execution run.
- * @global_scope:  Module-level symbol table.
- * @current_scope: Innermost active scope; equals @global_scope at
- *                 the top level.
+ * @symbols:       Bindings of every name; calls push and pop their
+ *                 locals on it.
  * @return_value:  Holds the pending return value while a call unwinds.
  * @has_returned:  Non-zero once a return statement has executed.
  * @call_depth:    Current call-stack depth; guarded by MAX_CALL_DEPTH.
+ * @call_peak:     Deepest @call_depth reached since the innermost call
+ *                 began, counting a result taken from @memo as deep as
+ *                 the calls it stands for.
+ * @atoms:         Intern table the AST's names came from; used to
+ *                 print names in runtime errors.
+ * @lines:         Line table for the source, used to turn node offsets
+ *                 into line numbers in runtime errors (not owned).
+ * @flat:          Tree being run by interpreter_run_flat(); NULL when
+ *                 walking a pointer tree.
+ * @parser:        Parser that deferred function bodies, to parse each
+ *                 on first call (not owned); see parser_set_lazy().
+ * @memo:          Results of pure function calls, or NULL to call
+ *                 every function (not owned); see interpreter_set_memo().
+ * @errors:        Runtime errors reported so far.
  */
 struct interpreter {
-	struct symbol_table	*global_scope;
-	struct symbol_table	*current_scope;
+	struct symbol_table	*symbols;
 	struct value		 return_value;
 	int			 has_returned;
 	int			 call_depth;
+	int			 call_peak;
+	const struct intern_table *atoms;
+	struct line_index	*lines;
+	const struct flat_ast	*flat;
+	struct parser		*parser;
+	struct memo		*memo;
+	size_t			 errors;
 };
 
 /**
  * interpreter_create() - Allocate and initialise a new interpreter.
+ * @atoms: Intern table shared with the lexer that produced the AST.
+ * @lines: Line table for the AST's source; NULL reports line 0.
  *
  * Return: Pointer to interpreter, or NULL on allocation failure.
  */
-struct interpreter *interpreter_create(void);
+struct interpreter *interpreter_create(const struct intern_table *atoms,
+				       struct line_index *lines);
 
 /**
  * interpreter_destroy() - Free an interpreter and its global scope.
@@ -43,6 +70,36 @@ struct interpreter *interpreter_create(void);
  */
 void interpreter_destroy(struct interpreter *interp);
 
+/**
+ * interpreter_set_parser() - Name the parser of a lazily parsed tree.
+ * @interp: Interpreter about to run the tree.
+ * @parser: Parser the tree came from, after parser_set_lazy(); must
+ *          outlive the run.
+ *
+ * A deferred function body is parsed when the function is first
+ * called; it is run like any other afterwards.
+ */
+void interpreter_set_parser(struct interpreter *interp,
+			    struct parser *parser);
+
+/**
+ * interpreter_set_memo() - Memoise calls to pure functions.
+ * @interp: Interpreter about to run a tree.
+ * @memo:   Memo the tree has been scanned into (see memo_scan_ast() and
+ *          memo_scan_flat()); must outlive the run.
+ *
+ * A call to a function memo_pure_ast() accepts, with as many numeric
+ * arguments as it has parameters, is looked up in @memo first and its
+ * result stored there afterwards, unless the call reported a runtime
+ * error.  Function bodies parsed on first call are scanned into @memo
+ * before they run.
+ *
+ * Output is unchanged, errors included: a result is stored with the
+ * depth of the calls it took, and not used where repeating them would
+ * exceed MAX_CALL_DEPTH.
+ */
+void interpreter_set_memo(struct interpreter *interp, struct memo *memo);
+
 /**
  * interpreter_evaluate() - Recursively evaluate an AST node.
  * @interp: Active interpreter state.
@@ -54,4 +111,18 @@ void interpreter_destroy(struct interpreter *interp);
 struct value interpreter_evaluate(struct interpreter *interp,
 				  struct ast_node *node);
 
+/**
+ * interpreter_run_flat() - Run a program flattened by flat_ast_build().
+ * @interp: Active interpreter state; not to be mixed with
+ *          interpreter_evaluate() on another tree.
+ * @ast:    Flat tree; must outlive @interp's use of it.
+ *
+ * Behaves exactly like interpreter_evaluate() on the tree @ast was
+ * built from, output and runtime errors included.
+ *
+ * Return: Value of the root node, as for interpreter_evaluate().
+ */
+struct value interpreter_run_flat(struct interpreter *interp,
+				  const struct flat_ast *ast);
+
 #endif 
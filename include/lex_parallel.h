@@ -0,0 +1,44 @@
+#ifndef LEX_PARALLEL_H
+#define LEX_PARALLEL_H
+
+#include "token_stream.h"
+#include "intern.h"
+#include "thread_pool.h"
+
+/*
+ * Sources shorter than two chunks are not worth splitting; callers can
+ * compare against this before reaching for a pool.
+ */
+#ifndef LEX_PARALLEL_MIN_CHUNK
+#define LEX_PARALLEL_MIN_CHUNK	(256 * 1024)
+#endif
+
+/**
+ * lex_parallel() - Tokenise @source on a thread pool.
+ * @source: NUL-terminated source.
+ * @length: strlen(@source); at most UINT32_MAX, the largest offset a
+ *          packed token can hold.
+ * @atoms:  Intern table that receives every identifier.
+ * @pool:   Threads to lex on; NULL lexes the chunks one after another.
+ *
+ * The source is cut into chunks after newlines.  Each chunk is lexed
+ * on its own with a raw_indent lexer, which reports the width of every
+ * line instead of INDENT/DEDENT, and with a private intern table.  A
+ * sequential pass then replays the widths through the indent stack,
+ * enters the chunks' names into @atoms in source order and, where a
+ * string literal ran across a cut, re-lexes the next chunk from where
+ * the previous one really ended.  Chunks pack their tokens as they go,
+ * and the merge copies them with atoms and side-table indices
+ * renumbered.  The result is the serial lexer's token stream, atoms
+ * included.
+ *
+ * Return: Stream ending at the first TOKEN_EOF or TOKEN_ERROR, as the
+ *         serial tokeniser produces; free it with
+ *         token_stream_destroy().  NULL on allocation failure or
+ *         when @length is too long.
+ */
+struct token_stream *lex_parallel(const char *source, size_t length,
+				  struct intern_table *atoms,
+				  struct thread_pool *pool);
+
+#endif /* LEX_PARALLEL_H */
@@ -0,0 +1,107 @@
+#ifndef LEX_PIPE_H
+#define LEX_PIPE_H
+
+#include "token.h"
+#include "lexer.h"
+#include <pthread.h>
+
+/* Ring capacity in tokens; a power of two. */
+#define LEX_PIPE_SLOTS		4096
+
+/* Tokens written or read between two updates of the shared cursors. */
+#define LEX_PIPE_BATCH		256
+
+/* Cursors owned by different threads are kept this far apart. */
+#define LEX_PIPE_CACHE_LINE	64
+
+/**
+ * struct lex_pipe - A lexer running on its own thread, feeding a
+ *                   single consumer through a ring of tokens.
+ * @lexer:      Lexer the producer thread drives (not owned).
+ * @ring:       LEX_PIPE_SLOTS tokens; a slot between @head and @tail
+ *              owns its token's @owned string.
+ * @thread:     Producer thread.
+ * @lock:       Guards sleeping; never taken while tokens are flowing.
+ * @data:       Signalled when @tail moves and the consumer is asleep.
+ * @space:      Signalled when @head moves or @closed is set and the
+ *              producer is asleep.
+ * @tail:       Tokens published by the producer.
+ * @tail_local: Producer's write cursor, ahead of @tail by at most one
+ *              batch.
+ * @head_seen:  Producer's last look at @head.
+ * @producer_waiting: Set while the producer sleeps on @space.
+ * @head:       Tokens the consumer has released back to the producer.
+ * @head_local: Consumer's read cursor, ahead of @head by at most one
+ *              batch.
+ * @tail_seen:  Consumer's last look at @tail.
+ * @consumer_waiting: Set while the consumer sleeps on @data.
+ * @closed:     Set by the consumer to make the producer stop.
+ * @end:        Copy of the TOKEN_EOF or TOKEN_ERROR the stream ended
+ *              with, once the consumer has read it.
+ * @ended:      Non-zero once @end is valid.
+ *
+ * The cursors count tokens from the start and are masked to index
+ * @ring.  Each side reads the other's cursor with acquire loads and
+ * publishes its own with release stores, so tokens pass between the
+ * threads without a lock.  A side that finds the ring empty (or full)
+ * spins briefly and then sleeps on a condition variable; the other side
+ * only takes the lock when it sees the matching *_waiting flag.
+ */
+struct lex_pipe {
+	struct lexer	*lexer;
+	struct token	*ring;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 data;
+	pthread_cond_t	 space;
+
+	/* Written by the producer. */
+	unsigned	 tail __attribute__((aligned(LEX_PIPE_CACHE_LINE)));
+	unsigned	 tail_local;
+	unsigned	 head_seen;
+	int		 producer_waiting;
+
+	/* Written by the consumer. */
+	unsigned	 head __attribute__((aligned(LEX_PIPE_CACHE_LINE)));
+	unsigned	 head_local;
+	unsigned	 tail_seen;
+	int		 consumer_waiting;
+	int		 closed;
+	struct token	 end;
+	int		 ended;
+};
+
+/**
+ * lex_pipe_start() - Start lexing @lexer to the end on a new thread.
+ * @lexer: Lexer positioned at the start of its source; must outlive
+ *         the pipe and must not be used by anyone else until
+ *         lex_pipe_stop().
+ *
+ * Return: Pointer to pipe, or NULL if it cannot be allocated or the
+ *         thread cannot be started.
+ */
+struct lex_pipe *lex_pipe_start(struct lexer *lexer);
+
+/**
+ * lex_pipe_next() - Take the next token, waiting for the lexer if it
+ *                   has not produced one yet.
+ * @pipe: Pipe from lex_pipe_start(); called from one thread only.
+ *
+ * Once the stream's final TOKEN_EOF or TOKEN_ERROR has been returned,
+ * every further call returns TOKEN_EOF at the same offset.
+ *
+ * Return: The token, as lexer_next_token() produced it; the caller
+ *         owns @owned.
+ */
+struct token lex_pipe_next(struct lex_pipe *pipe);
+
+/**
+ * lex_pipe_stop() - Stop the producer, wait for it and free the pipe.
+ * @pipe: Pipe to stop.  Safe to call with NULL.
+ *
+ * May be called before the stream has been read to the end; tokens
+ * still in the ring are freed.
+ */
+void lex_pipe_stop(struct lex_pipe *pipe);
+
+#endif /* LEX_PIPE_H */
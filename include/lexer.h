@@ -2,41 +2,110 @@
 #define LEXER_H
 
 #include "token.h"
+#include "intern.h"
+#include "line_index.h"
+#include <stdio.h>
+
+/* Bytes a streaming lexer reads from its input at a time. */
+#ifndef LEXER_WINDOW
+#define LEXER_WINDOW	(1 << 20)
+#endif
 
 /**
  * struct lexer - Tokeniser state for a single source string.
- * @source:          NUL-terminated source code (not owned by lexer).
+ * @source:          NUL-terminated source code (not owned by lexer); for
+ *                   a streaming lexer, the current window.
  * @source_len:      Cached strlen(@source); avoids repeated O(n) calls.
  * @position:        Current byte offset into @source.
- * @line:            Current line number (1-based).
- * @column:          Current column number (1-based).
  * @indent_stack:    Stack of active indentation levels in spaces.
  * @indent_top:      Index of the top element in @indent_stack.
  * @indent_capacity: Allocated length of @indent_stack.
  * @at_line_start:   Non-zero when the next char begins a new line.
  * @pending_dedents: DEDENT tokens queued but not yet returned.
+ * @atoms:           Intern table identifiers are entered into (not owned).
+ * @utf8_end:        Offset of the first ill-formed UTF-8 byte, or
+ *                   @source_len when the source is valid.
+ * @raw_indent:      When set, every non-blank line start yields one
+ *                   TOKEN_INDENT whose @number is the line's width and
+ *                   no DEDENT is generated; the caller rebuilds the
+ *                   block structure (see lex_parallel()).
+ * @input:           Stream a lexer from lexer_create_stream() reads
+ *                   (not owned); NULL for a lexer over a whole string.
+ * @window:          Buffer @source points into when streaming (owned).
+ * @window_cap:      Allocated length of @window.
+ * @filled:          Bytes read into @window; those past @source_len
+ *                   belong to a line that has not been read to its end.
+ * @held:            Byte at @window[@source_len], where the window's
+ *                   NUL terminator is standing in for it.
+ * @base:            Offset in the whole input of @window[0].
+ * @input_done:      Set once @input has reached end of file.
+ * @failed:          Set after a read error or allocation failure.
+ * @lines:           Line table fed with each window (not owned).
  */
 struct lexer {
 	const char *source;
-	int source_len;
-	int position;
-	int line;
-	int column;
+	size_t source_len;
+	size_t position;
 	int *indent_stack;
 	int indent_top;
 	int indent_capacity;
 	int at_line_start;
 	int pending_dedents;
+	struct intern_table *atoms;
+	size_t utf8_end;
+	int raw_indent;
+	FILE *input;
+	char *window;
+	size_t window_cap;
+	size_t filled;
+	char held;
+	size_t base;
+	int input_done;
+	int failed;
+	struct line_index *lines;
 };
 
 /**
  * lexer_create() - Allocate and initialise a lexer for @source.
  * @source: NUL-terminated source string.  The lexer does not take
  *          ownership; caller must ensure it outlives the lexer.
+ * @atoms:  Intern table that receives every identifier; shared by the
+ *          rest of the compilation and not owned by the lexer.
+ *
+ * The source is validated as UTF-8 up front.  Non-ASCII text may
+ * appear in string literals and comments; lexing stops with an error
+ * token at the first ill-formed byte.
+ *
+ * Return: Pointer to lexer, or NULL on allocation failure.
+ */
+struct lexer *lexer_create(const char *source, struct intern_table *atoms);
+
+/**
+ * lexer_create_stream() - Allocate a lexer that reads its source from
+ *                         @input as it goes.
+ * @input: Open stream positioned at the start of the program; not
+ *         closed by the lexer.
+ * @atoms: Intern table, as for lexer_create().
+ * @lines: Index from line_index_create(NULL, 0); every byte read is
+ *         fed to it, so diagnostics can still be placed after the text
+ *         itself is gone.
+ *
+ * The source is read LEXER_WINDOW bytes at a time into a window that
+ * always ends after a complete line.  When the cursor reaches the end
+ * of the window, the lines behind it are dropped and the next ones
+ * read; a string literal still open at that point keeps its start in
+ * the window.  Memory therefore stays at about LEXER_WINDOW plus the
+ * longest line or string literal, whatever the size of the input.
+ *
+ * Token offsets still count from the start of the input, but token
+ * text cannot point into a window that moves: string literals and
+ * error tokens always come with an @owned copy, and token_text()
+ * spells keywords and operators from their type.
  *
  * Return: Pointer to lexer, or NULL on allocation failure.
  */
-struct lexer *lexer_create(const char *source);
+struct lexer *lexer_create_stream(FILE *input, struct intern_table *atoms,
+				  struct line_index *lines);
 
 /**
  * lexer_destroy() - Free a lexer and its internal buffers.
@@ -44,15 +113,51 @@ struct lexer *lexer_create(const char *source);
  */
 void lexer_destroy(struct lexer *lexer);
 
+/**
+ * lexer_reset() - Restart a lexer at a top-level line of @source.
+ * @lexer:  Lexer to restart.
+ * @source: NUL-terminated source; may differ from the one @lexer was
+ *          created with.
+ * @length: strlen(@source), which the caller already knows.
+ * @offset: Byte offset of a line start whose indentation is zero.
+ *
+ * At such a line the indent stack is known to hold only the base
+ * level, so lexing from here yields the same tokens a full pass would
+ * from this point on, minus the DEDENTs that closed earlier blocks.
+ * The caller is expected to have validated @source as UTF-8 already.
+ */
+void lexer_reset(struct lexer *lexer, const char *source, size_t length,
+		 size_t offset);
+
 /**
  * lexer_next_token() - Produce the next token from the source stream.
  * @lexer: Active lexer state.
  *
- * The returned token's @value field is heap-allocated and must be
- * freed by the caller (or via token_array_free() in main.c).
+ * The returned token views the lexer's source; only a string literal
+ * with escapes carries heap storage in @owned, which the caller must
+ * free (or release via token_array_free() in main.c).
  *
- * Return: The next token.  Returns TOKEN_EOF at end of input.
+ * Return: The next token.  Returns TOKEN_EOF at end of input, and
+ *         TOKEN_ERROR if a streaming lexer cannot read on.
  */
 struct token lexer_next_token(struct lexer *lexer);
 
+/**
+ * token_text() - Return a token's text and its length.
+ * @source: Source buffer the token was lexed from, or NULL for a
+ *          token from lexer_create_stream().
+ * @tok:    Token to inspect.
+ * @len:    Out: length of the returned text in bytes.
+ *
+ * The text is not NUL-terminated; print it with "%.*s".  INDENT,
+ * DEDENT and EOF have no source text and yield their type name.
+ * Without @source, keywords, operators and NEWLINE are spelled from
+ * their type; an identifier or number yields "" (use its @atom or
+ * @number).
+ *
+ * Return: Pointer into @source, into @tok->owned, or to a static name.
+ */
+const char *token_text(const char *source, const struct token *tok,
+		       int *len);
+
 #endif
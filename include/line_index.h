@@ -0,0 +1,83 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct line_index - Where each line of a source starts.
+ * @text:   Source the offsets refer to (not owned), or NULL for an
+ *          index fed by line_index_extend().
+ * @length: Bytes in @text, or bytes fed so far.
+ * @starts: Offset of each line's first byte, ascending; @starts[0] is
+ *          0.  NULL until the first lookup needs it.
+ * @count:  Number of entries in @starts.
+ * @cap:    Allocated length of @starts when fed incrementally.
+ *
+ * Tokens and AST nodes carry only a byte offset; line and column are
+ * worked out from this table when a diagnostic is actually printed,
+ * so neither the lexer nor the parser keeps count.
+ */
+struct line_index {
+	const char	*text;
+	size_t		 length;
+	size_t		*starts;
+	size_t		 count;
+	size_t		 cap;
+};
+
+/**
+ * line_index_create() - Make an index for @text without scanning it.
+ * @text:   Source; must outlive the index.  NULL makes an empty index
+ *          for a source that is read piece by piece and never held
+ *          whole; see line_index_extend().
+ * @length: Bytes in @text; 0 when @text is NULL.
+ *
+ * Return: Pointer to index, or NULL on allocation failure.
+ */
+struct line_index *line_index_create(const char *text, size_t length);
+
+/**
+ * line_index_extend() - Record the lines in the next piece of a source.
+ * @index: Index created with a NULL text.
+ * @piece: The @n bytes that follow the ones fed so far.
+ * @n:     Bytes at @piece.
+ *
+ * The piece itself is not kept, so a streamed source can be indexed
+ * without being held in memory; only one offset per line is.
+ *
+ * Return: 1 on success, 0 on allocation failure.
+ */
+int line_index_extend(struct line_index *index, const char *piece,
+		      size_t n);
+
+/**
+ * line_index_destroy() - Free an index.
+ * @index: Index to destroy.  Safe to call with NULL.
+ */
+void line_index_destroy(struct line_index *index);
+
+/**
+ * line_index_line() - Line holding byte @offset (1-based).
+ * @index:  Index, or NULL.
+ * @offset: Byte offset; clamped to the end of the text.
+ *
+ * The table is built with one vectorised newline scan on the first
+ * call and binary-searched after that.  If it cannot be allocated the
+ * newlines are counted directly instead.
+ *
+ * Return: The line, or 0 when @index is NULL.
+ */
+int line_index_line(struct line_index *index, size_t offset);
+
+/**
+ * line_index_column() - Column of byte @offset within its line.
+ * @index:  Index, or NULL.
+ * @offset: Byte offset; clamped to the end of the text.
+ *
+ * Return: The 1-based column in code points, or 0 when @index is NULL
+ *         or has no text to count in.
+ */
+int line_index_column(struct line_index *index, size_t offset);
+
+#endif /* LINE_INDEX_H */
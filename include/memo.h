@@ -0,0 +1,234 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "ast.h"
+#include "flat_ast.h"
+#include "symbol_table.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Functions with more parameters than this are never memoised. */
+#define MEMO_MAX_ARGS		4
+
+/* Results kept at most; must be a power of two. */
+#ifndef MEMO_SLOTS
+#define MEMO_SLOTS		(1 << 16)
+#endif
+
+/* Slots looked at from a key's hash before one is evicted. */
+#define MEMO_PROBES		4
+
+/**
+ * enum memo_state - What a purity check found for a definition.
+ */
+enum memo_state {
+	MEMO_UNCHECKED,		/* not looked at since the last scan  */
+	MEMO_CHECKING,		/* being checked; assumed pure        */
+	MEMO_PURE,		/* calls may be memoised              */
+	MEMO_IMPURE		/* or its body is not parsed yet      */
+};
+
+/**
+ * struct memo_stats - How much memoisation saved.
+ * @calls:   Calls to a pure function with numeric arguments, each
+ *           looked up in the cache.
+ * @hits:    Of those, calls answered from the cache.
+ * @stored:  Results added to the cache.
+ * @evicted: Results dropped to make room for newer ones.
+ * @flushed: Times the whole cache was dropped because a function it
+ *           depended on could have been redefined.
+ */
+struct memo_stats {
+	size_t calls;
+	size_t hits;
+	size_t stored;
+	size_t evicted;
+	size_t flushed;
+};
+
+/**
+ * struct memo_name - What a program does with one name.
+ * @defs:    Definitions of a function by this name.
+ * @nested:  Those of @defs inside a function body, which bind the name
+ *           only while that function runs.
+ * @binds:   Other bindings: assignments to it and parameters so named.
+ * @def:     The definition, as a node pointer or a flat tree index,
+ *           when @defs is 1.
+ * @checked: Memo generation @state was found in; it is stale after.
+ * @state:   enum memo_state of @def.
+ */
+struct memo_name {
+	uint32_t	 defs;
+	uint32_t	 nested;
+	uint32_t	 binds;
+	uintptr_t	 def;
+	uint32_t	 checked;
+	uint8_t		 state;
+};
+
+/**
+ * struct memo_slot - One cached result.
+ * @func:  Definition called, as in struct memo_name.
+ * @epoch: Memo epoch the result was stored in; 0 for an empty slot.
+ * @argc:  Arguments in @args.
+ * @type:  VALUE_NUMBER or VALUE_NONE.
+ * @depth: Depth of the calls the result took, the call itself being 1.
+ * @args:  Argument values.
+ * @value: Result, when @type is VALUE_NUMBER.
+ */
+struct memo_slot {
+	uintptr_t	 func;
+	uint32_t	 epoch;
+	uint8_t		 argc;
+	uint8_t		 type;
+	uint16_t	 depth;
+	double		 args[MEMO_MAX_ARGS];
+	double		 value;
+};
+
+/**
+ * struct memo - Pure functions of one run and the results of their calls.
+ * @names:         One entry per atom, indexed by atom.
+ * @name_count:    Entries in @names; atoms past the end are unused.
+ * @slots:         MEMO_SLOTS results.
+ * @generation:    Bumped by every scan, since new code may change which
+ *                 functions are pure.
+ * @epoch:         Bumped to drop every result at once.
+ * @visited:       Names whose state one purity check has set, so a
+ *                 check that fails can undo what it assumed.
+ * @visited_count: Entries in use on @visited.
+ * @visited_cap:   Allocated length of @visited.
+ * @flat:          Tree given to memo_scan_flat(), or NULL for a pointer
+ *                 tree.
+ * @stats:         Counts for the run so far.
+ */
+struct memo {
+	struct memo_name	*names;
+	uint32_t		 name_count;
+	struct memo_slot	*slots;
+	uint32_t		 generation;
+	uint32_t		 epoch;
+	uint32_t		*visited;
+	size_t			 visited_count;
+	size_t			 visited_cap;
+	const struct flat_ast	*flat;
+	struct memo_stats	 stats;
+};
+
+/**
+ * memo_create() - Allocate an empty memo.
+ *
+ * Return: Pointer to the memo, or NULL on allocation failure.
+ */
+struct memo *memo_create(void);
+
+/**
+ * memo_destroy() - Free a memo and its cached results.
+ * @memo: Memo to destroy.  Safe to call with NULL.
+ */
+void memo_destroy(struct memo *memo);
+
+/**
+ * memo_scan_ast() - Record the names a pointer tree defines and binds.
+ * @memo: Memo of the run.
+ * @node: A program, a top-level statement or a function body just
+ *        parsed; each part of a program must be scanned exactly once,
+ *        before any of it runs.
+ *
+ * A name that was defined exactly once and bound nowhere else may have
+ * been called from results in the cache; giving it a second definition
+ * or any other binding drops them all.
+ */
+void memo_scan_ast(struct memo *memo, const struct ast_node *node);
+
+/**
+ * memo_scan_flat() - Record the names a flat tree defines and binds.
+ * @memo: Memo of the run.
+ * @ast:  The whole program, scanned once before it runs.
+ */
+void memo_scan_flat(struct memo *memo, const struct flat_ast *ast);
+
+/**
+ * memo_pure_ast() - Whether calls to a definition may be memoised.
+ * @memo: Memo of the run.
+ * @def:  AST_FUNCTION_DEF about to be called.
+ *
+ * A function is pure if it is defined outside any function body, its
+ * name has no other definition or binding, it has at most MEMO_MAX_ARGS parameters, and its body, which must
+ * have been parsed, only
+ *
+ *   - reads and assigns its parameters,
+ *   - computes with literals and operators, and returns, and
+ *   - calls pure functions by their own names, with as many arguments
+ *     as they have parameters.
+ *
+ * So no print, no definitions and no use of any other name: scopes are
+ * dynamic, and assigning a name that is not a parameter could write a
+ * caller's variable.  Given numeric arguments, a pure call then always
+ * computes the same result, or reports the same runtime error.
+ * Recursion, direct or mutual, does not stop a function being pure.
+ *
+ * The answer is kept until the next scan.  A body not yet parsed makes
+ * the answer no for now.
+ *
+ * Return: 1 if pure, 0 if not.
+ */
+int memo_pure_ast(struct memo *memo, const struct ast_node *def);
+
+/**
+ * memo_pure_flat() - memo_pure_ast() for a flat tree.
+ * @memo: Memo of the run.
+ * @ast:  Flat tree scanned with memo_scan_flat().
+ * @def:  Index of the AST_FUNCTION_DEF about to be called.
+ *
+ * Return: 1 if pure, 0 if not.
+ */
+int memo_pure_flat(struct memo *memo, const struct flat_ast *ast,
+		   uint32_t def);
+
+/**
+ * memo_pure_count() - Functions that are pure now.
+ * @memo: Memo of the run.
+ *
+ * Checks every function the scans have found, as memo_pure_ast() or
+ * memo_pure_flat() would when it is called; one whose body was never
+ * parsed does not count.
+ *
+ * Return: How many are pure.
+ */
+size_t memo_pure_count(struct memo *memo);
+
+/**
+ * memo_lookup() - Find the result of an earlier call.
+ * @memo:   Memo of the run.
+ * @func:   Definition called: its node pointer or flat tree index.
+ * @args:   Argument values.
+ * @argc:   Arguments at @args, at most MEMO_MAX_ARGS.
+ * @room:   Depth of calls that may still be made; a result that took
+ *          more is a miss.
+ * @result: Receives the result on a hit.
+ *
+ * Arguments match by their bits, so 0 and -0 are different keys.
+ *
+ * Return: The depth the result took, at least 1, or 0 on a miss.
+ */
+int memo_lookup(struct memo *memo, uintptr_t func, const double *args,
+		uint32_t argc, int room, struct value *result);
+
+/**
+ * memo_store() - Remember the result of a call.
+ * @memo:   Memo of the run.
+ * @func:   As for memo_lookup().
+ * @args:   As for memo_lookup().
+ * @argc:   As for memo_lookup().
+ * @depth:  Depth of the calls it took, the call itself being 1.
+ * @result: What the call returned; only numbers and None are kept.
+ *
+ * The result goes in the first free slot of the MEMO_PROBES after the
+ * key's hash; when none is free the first is overwritten, so the cache
+ * never holds more than MEMO_SLOTS results.
+ */
+void memo_store(struct memo *memo, uintptr_t func, const double *args,
+		uint32_t argc, int depth, struct value result);
+
+#endif /* MEMO_H */
@@ -0,0 +1,68 @@
+#ifndef OPTIMISE_H
+#define OPTIMISE_H
+
+#include "ast.h"
+#include "arena.h"
+#include "intern.h"
+#include <stddef.h>
+
+/**
+ * struct optimise_stats - What optimise() changed.
+ * @nodes_before: Nodes reachable from the tree before the pass; a
+ *                shared node counts once per place it is used.
+ * @nodes_after:  The same, afterwards.
+ * @folded:       Operators replaced by the constant they compute.
+ * @propagated:   Reads of a global replaced by its constant value.
+ * @pruned:       if and while statements decided by a constant
+ *                condition, replaced by the branch taken or removed.
+ * @dropped:      Statements removed because a return comes first.
+ *
+ * optimise() adds to the counts, so one struct can total several calls.
+ */
+struct optimise_stats {
+	size_t nodes_before;
+	size_t nodes_after;
+	size_t folded;
+	size_t propagated;
+	size_t pruned;
+	size_t dropped;
+};
+
+/**
+ * optimise() - Simplify a tree without changing what it does.
+ * @node:  An AST_PROGRAM, or one top-level statement of a program that
+ *         is run statement by statement.
+ * @arena: Arena @node was built in; new constants are allocated here.
+ * @atoms: Intern table of the tree's names; only read for a program.
+ * @stats: Counts to add to, or NULL.
+ *
+ * The pass rewrites the tree in place:
+ *
+ *   - Unary and binary operators over constants are replaced by their
+ *     value.  Those that would fail at run time, such as a division by
+ *     zero or a type mismatch, are kept so the error is still raised,
+ *     from the same line.
+ *   - A global assigned exactly once, by a top-level statement, to a
+ *     number, which is never a parameter or function name, is read as
+ *     that number in every statement after the assignment.  Scopes are
+ *     dynamic, so any other write or parameter of the name could
+ *     shadow it at some call.  Strings are not propagated: each
+ *     evaluation of a literal copies it, where a read does not.
+ *   - An if or while whose condition is constant becomes the branch it
+ *     takes, or goes away.
+ *   - Statements in a block after one that always returns are removed.
+ *     Top-level ones are kept: a return there only stops blocks.
+ *
+ * Shared constants (see hashcons.h) are never modified; the operators
+ * above them are replaced instead.  Function bodies deferred by lazy
+ * parsing are left as they are, and their presence turns propagation
+ * off, since their writes cannot be seen.
+ *
+ * Return: The node to run in place of @node: @node itself, a branch of
+ *         it, or NULL for a statement that does nothing.
+ */
+struct ast_node *optimise(struct ast_node *node, struct arena *arena,
+			  const struct intern_table *atoms,
+			  struct optimise_stats *stats);
+
+#endif /* OPTIMISE_H */
@@ -2,41 +2,225 @@
 #define PARSER_H
 
 #include "token.h"
+#include "token_stream.h"
+#include "lexer.h"
+#include "lex_pipe.h"
 #include "ast.h"
+#include "arena.h"
+#include "hashcons.h"
+#include "line_index.h"
+#include "thread_pool.h"
+
+/*
+ * Tokens unpacked or lexed ahead of the cursor.  The grammar never
+ * looks further than one token past the current one (see
+ * next_is_assign() in parser.c); the rest is slack.
+ */
+#define PARSER_LOOKAHEAD	4
+
+/*
+ * Deepest nesting of parentheses and call arguments accepted within
+ * one expression; each level is a few C stack frames.
+ */
+#define PARSER_MAX_NESTING	1000
+
+/*
+ * A program is split for parallel parsing into about this many slices
+ * per thread, so that slices of uneven cost balance out, but none
+ * smaller than PARSER_SLICE_MIN_TOKENS.
+ */
+#define PARSER_SLICES_PER_THREAD	4
+#ifndef PARSER_SLICE_MIN_TOKENS
+#define PARSER_SLICE_MIN_TOKENS		(16 * 1024)
+#endif
 
 /**
  * struct parser - Recursive-descent parser state.
- * @tokens:      Token array produced by the lexer (not owned).
- * @position:    Index of the current token.
- * @token_count: Total number of tokens in @tokens.
+ * @tokens:      Packed tokens produced by the lexer (not owned).
+ * @source:      Source the tokens view into (not owned).
+ * @position:    Number of tokens consumed so far.
+ * @end:         Index in @tokens at which the parser sees TOKEN_EOF;
+ *               the end of the stream unless parsing one slice of it.
+ * @lexer:       Token source in stream mode (not owned); NULL when
+ *               parsing a materialised @tokens stream.
+ * @pipe:        Token source in pipeline mode (not owned), fed by a
+ *               lexer on another thread.
+ * @ring:        Lookahead ring, unpacked from @tokens or taken from
+ *               @lexer or @pipe on demand; unless @tokens is set it
+ *               owns the @owned strings of buffered tokens.
+ * @ring_head:   Index of the current token in @ring.
+ * @ring_fill:   Number of tokens buffered in @ring.
+ * @error:       Set once the lexer reports an invalid token or a
+ *               statement cannot be parsed; the parser then sees
+ *               only TOKEN_EOF and unwinds.
+ * @lines:       Line table for @source, built by the first diagnostic.
+ * @arena:       Arena every node is allocated from (not owned).
+ * @scratch:     Stack the children of unfinished blocks, programs and
+ *               argument lists are gathered on before being copied
+ *               into @arena at their final length.
+ * @scratch_top: Entries in use on @scratch.
+ * @scratch_cap: Allocated length of @scratch.
+ * @nesting:     Expressions being parsed inside one another, through
+ *               parentheses or call arguments.
+ * @pool:        Threads parser_parse_program() may split @tokens
+ *               across (not owned); NULL parses on the caller alone.
+ * @quiet:       Set on the parsers that work on slices: diagnostics
+ *               are not printed, only noted in @failed.
+ * @failed:      Set once a diagnostic has been raised.
+ * @lazy:        Skip function bodies, see parser_set_lazy().
+ * @consts:      Literals and constant expressions built so far, so a
+ *               constant written twice is one node (see hashcons.h).
  */
 struct parser {
-	struct token	*tokens;
+	const struct token_stream *tokens;
+	const char	*source;
 	int		 position;
-	int		 token_count;
+	int		 end;
+	struct lexer	*lexer;
+	struct lex_pipe	*pipe;
+	struct token	 ring[PARSER_LOOKAHEAD];
+	int		 ring_head;
+	int		 ring_fill;
+	int		 error;
+	struct line_index *lines;
+	struct arena	*arena;
+	struct ast_node	**scratch;
+	int		 scratch_top;
+	int		 scratch_cap;
+	int		 nesting;
+	struct thread_pool *pool;
+	int		 quiet;
+	int		 failed;
+	int		 lazy;
+	struct hashcons	 consts;
 };
 
 /**
- * parser_create() - Initialise a parser over a token array.
- * @tokens: Token array; must outlive the parser.
- * @count:  Number of tokens in @tokens.
+ * parser_create() - Initialise a parser over a packed token stream.
+ * @tokens: Token stream; must outlive the parser.
+ * @source: Source buffer the tokens were lexed from; must outlive
+ *          the parser.
+ * @arena:  Arena the tree is built in; the caller releases the tree
+ *          by destroying it.
+ *
+ * Tokens are unpacked a few at a time into the lookahead ring as the
+ * grammar reaches them; no struct token array is ever built.
  *
  * Return: Pointer to parser, or NULL on allocation failure.
  */
-struct parser *parser_create(struct token *tokens, int count);
+struct parser *parser_create(const struct token_stream *tokens,
+			     const char *source, struct arena *arena);
+
+/**
+ * parser_create_stream() - Initialise a parser that pulls tokens from
+ *                          @lexer on demand.
+ * @lexer: Active lexer; must outlive the parser.
+ * @arena: Arena the tree is built in, as for parser_create().
+ *
+ * No token array is built: tokens are lexed as the grammar asks for
+ * them and dropped once consumed, so the front end's memory is
+ * bounded by nesting depth rather than by source size.
+ *
+ * Return: Pointer to parser, or NULL on allocation failure.
+ */
+struct parser *parser_create_stream(struct lexer *lexer,
+				    struct arena *arena);
+
+/**
+ * parser_create_pipe() - Initialise a parser that takes tokens from a
+ *                        lexer running on another thread.
+ * @pipe:  Started pipe; must outlive the parser.
+ * @arena: Arena the tree is built in, as for parser_create().
+ *
+ * Like parser_create_stream(), but lexing overlaps parsing: the parser
+ * waits only when it catches up with the lexer.
+ *
+ * Return: Pointer to parser, or NULL on allocation failure.
+ */
+struct parser *parser_create_pipe(struct lex_pipe *pipe,
+				  struct arena *arena);
 
 /**
  * parser_destroy() - Free the parser struct.
- * @parser: Parser to destroy.  Does not free the token array.
+ * @parser: Parser to destroy.  Does not free the token stream.
  */
 void parser_destroy(struct parser *parser);
 
+/**
+ * parser_set_pool() - Let parser_parse_program() use @pool.
+ * @parser: Parser created with parser_create(); stream and pipe
+ *          parsers see their tokens one at a time and cannot split.
+ * @pool:   Pool to run slices on, or NULL to parse serially.  Must
+ *          outlive the parse and not be busy with another job.
+ */
+void parser_set_pool(struct parser *parser, struct thread_pool *pool);
+
+/**
+ * parser_set_lazy() - Defer parsing function bodies until needed.
+ * @parser: Parser created with parser_create(); only a token array
+ *          can be gone back to later.
+ * @lazy:   Non-zero to defer.
+ *
+ * A deferred definition is left with a NULL body and the index of the
+ * body's INDENT token in @body_start.  The body is stepped over by
+ * counting INDENT and DEDENT tokens, building nothing, so a syntax
+ * error in it is reported only once parser_parse_body() gets to it,
+ * and never for a function that is not called.  The parser, its
+ * tokens and its arena must then outlive the tree.
+ */
+void parser_set_lazy(struct parser *parser, int lazy);
+
+/**
+ * parser_parse_body() - Parse the body a lazy parse deferred.
+ * @parser: Parser that built @def, done with parser_parse_program().
+ * @def:    AST_FUNCTION_DEF with a NULL body.
+ *
+ * The body is built in the parser's arena and stored in @def.  If it
+ * cannot be parsed, the diagnostic is printed and @def gets an empty
+ * body instead, so that it is reported once rather than on every call.
+ * Definitions nested in the body are deferred in turn.
+ *
+ * Return: The body, or NULL on allocation failure.
+ */
+struct ast_node *parser_parse_body(struct parser *parser,
+				   struct ast_node *def);
+
+/**
+ * parser_current() - Return the token the parser will consume next.
+ * @parser: Initialised parser.
+ *
+ * The token is valid only until the parser advances.
+ */
+const struct token *parser_current(struct parser *parser);
+
+/**
+ * parser_parse_toplevel() - Parse one top-level statement and the
+ *                           newlines that follow it.
+ * @parser: Initialised parser, not at TOKEN_EOF.
+ *
+ * This is one step of parser_parse_program(), for callers that track
+ * where each top-level statement starts.
+ *
+ * Return: The statement, or NULL if none was produced.  Check
+ *         @parser->error to tell an error from an empty step.
+ */
+struct ast_node *parser_parse_toplevel(struct parser *parser);
+
 /**
  * parser_parse_program() - Parse all top-level statements into an AST.
  * @parser: Initialised parser.
  *
+ * With a pool set, a large token stream is cut at top-level statements
+ * (where the INDENT/DEDENT depth is zero) into slices that are parsed
+ * concurrently, each by its own parser into its own arena; the slices'
+ * statements are then spliced in source order and their arenas merged
+ * into @parser's.  The tree is the one a serial parse builds.  If any
+ * slice hits an error, the slices are thrown away and the program is
+ * parsed serially, so diagnostics come out in order as before.
+ *
  * Return: AST_PROGRAM root node, or NULL on unrecoverable error.
- *         Caller must call ast_free() on the result.
+ *         The tree, and whatever a failed parse left behind, stays
+ *         in the parser's arena.
  */
 struct ast_node *parser_parse_program(struct parser *parser);
 
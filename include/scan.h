@@ -0,0 +1,107 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * enum scan_level - Instruction-set tier used by the run scanners.
+ */
+enum scan_level {
+	SCAN_SCALAR,		/* portable byte loop            */
+	SCAN_SSE2,		/* 16 bytes per step             */
+	SCAN_AVX2		/* 32 bytes per step             */
+};
+
+/*
+ * Run scanners used by the lexer's hot loops.  Each one returns how
+ * many bytes at the start of @s (at most @n) belong to the run, so the
+ * caller can advance its position and column in one step.  None of the
+ * runs can contain a newline, which keeps line tracking trivial.
+ */
+
+/**
+ * scan_blanks() - Length of the leading run of spaces and tabs.
+ * @s: Start of the run.
+ * @n: Bytes available at @s.
+ */
+size_t scan_blanks(const char *s, size_t n);
+
+/**
+ * scan_line() - Length of the text before the next newline or NUL.
+ * @s: Start of the run.
+ * @n: Bytes available at @s.
+ */
+size_t scan_line(const char *s, size_t n);
+
+/**
+ * scan_ident() - Length of the leading run of [A-Za-z0-9_] bytes.
+ * @s: Start of the run.
+ * @n: Bytes available at @s.
+ */
+size_t scan_ident(const char *s, size_t n);
+
+/**
+ * scan_string() - Length of a string body up to the next byte that
+ *                 needs attention: @quote, backslash, newline or NUL.
+ * @s:     Start of the run.
+ * @n:     Bytes available at @s.
+ * @quote: Closing quote character of the literal.
+ */
+size_t scan_string(const char *s, size_t n, char quote);
+
+/**
+ * scan_utf8() - Length of the leading well-formed UTF-8 in @s.
+ * @s:     Bytes to validate.
+ * @n:     Number of bytes at @s.
+ * @ascii: Out: non-zero if every byte of @s is ASCII; only set when
+ *         the whole input is valid.
+ *
+ * Unlike the run scanners this is meant for a whole file at once.
+ * The AVX2 tier validates 32 bytes per step with table lookups; the
+ * others skip ASCII a word or vector at a time and check the rest
+ * sequence by sequence.
+ *
+ * Return: @n if @s is valid UTF-8, else the offset of the first byte
+ *         of the first ill-formed sequence.
+ */
+size_t scan_utf8(const char *s, size_t n, int *ascii);
+
+/**
+ * scan_newlines() - Count the newlines in @s and record the lines they
+ *                   start.
+ * @s:      Bytes to scan.
+ * @n:      Number of bytes at @s.
+ * @starts: If not NULL, receives the offset just past each newline, in
+ *          order; it must have room for the count a NULL pass returns.
+ *
+ * Like scan_utf8() this is a whole-buffer pass, used to build line
+ * tables: one call to size the table and one to fill it.
+ *
+ * Return: Number of newline bytes in @s.
+ */
+size_t scan_newlines(const char *s, size_t n, size_t *starts);
+
+/**
+ * scan_set_level() - Select the scanner tier.
+ * @level: Requested tier; clamped to what the CPU supports.
+ *
+ * The best supported tier is selected automatically on first use, from
+ * whichever thread gets there first; this exists for benchmarking and
+ * testing the fallbacks, and must not race with a scan in progress.
+ *
+ * Return: The tier actually selected.
+ */
+enum scan_level scan_set_level(enum scan_level level);
+
+/**
+ * scan_best_level() - Highest tier this CPU and build support.
+ */
+enum scan_level scan_best_level(void);
+
+/**
+ * scan_level_name() - Printable name of @level ("scalar", "sse2", ...).
+ */
+const char *scan_level_name(enum scan_level level);
+
+#endif /* SCAN_H */
@@ -0,0 +1,53 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of a digest in bytes. */
+#define SHA256_BYTES		32
+
+/**
+ * struct sha256 - State of an incremental SHA-256 computation.
+ * @state:  Hash words H0..H7.
+ * @bytes:  Message bytes absorbed so far.
+ * @block:  Bytes of the current, incomplete 64-byte block.
+ * @filled: Bytes used in @block.
+ */
+struct sha256 {
+	uint32_t	 state[8];
+	uint64_t	 bytes;
+	uint8_t		 block[64];
+	size_t		 filled;
+};
+
+/**
+ * sha256_init() - Start a new digest.
+ * @ctx: State to reset.
+ */
+void sha256_init(struct sha256 *ctx);
+
+/**
+ * sha256_update() - Absorb @len bytes of message.
+ * @ctx:  State from sha256_init().
+ * @data: Message bytes.
+ * @len:  Bytes at @data.
+ */
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+
+/**
+ * sha256_final() - Pad the message and write out its digest.
+ * @ctx: State to finish; must be re-initialised before reuse.
+ * @out: Receives the SHA256_BYTES-byte digest.
+ */
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_BYTES]);
+
+/**
+ * sha256() - Digest @len bytes at @data in one call.
+ * @data: Message bytes.
+ * @len:  Bytes at @data.
+ * @out:  Receives the SHA256_BYTES-byte digest.
+ */
+void sha256(const void *data, size_t len, uint8_t out[SHA256_BYTES]);
+
+#endif /* SHA256_H */
@@ -0,0 +1,60 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * struct source - A loaded program text.
+ * @text:   NUL-terminated source; text[length] is always '\0'.  NULL
+ *          when the program is left in @file instead.
+ * @length: Size of the text in bytes, excluding the terminator.
+ * @mapped: Non-zero when @text is a read-only file mapping rather
+ *          than a heap buffer.
+ * @file:   Stream to read the program from, when source_open_stream()
+ *          did not load it; NULL otherwise.
+ *
+ * Regular files are mapped straight from the page cache, so loading a
+ * large script costs no copy.  Pipes, terminals and stdin are read in
+ * chunks into a growable heap buffer instead.
+ */
+struct source {
+	const char	*text;
+	size_t		 length;
+	int		 mapped;
+	FILE		*file;
+};
+
+/**
+ * source_open() - Load a program from @path.
+ * @path: File to load, or "-" for standard input.
+ *
+ * A regular file is mapped read-only when the kernel's zero-filled
+ * page tail can serve as the NUL terminator, i.e. when its size is not
+ * a multiple of the page size.  Anything else goes through
+ * read_file().  A mapped file that is truncated while loaded raises
+ * SIGBUS on access, as with any mapping.
+ *
+ * Return: Loaded source, or NULL on error (message printed to stderr).
+ */
+struct source *source_open(const char *path);
+
+/**
+ * source_open_stream() - Open a program from @path for a single pass.
+ * @path: File to open, or "-" for standard input.
+ *
+ * As source_open(), but a source that cannot be mapped is not read
+ * into memory: @file is left open for lexer_create_stream(), so the
+ * whole text never has to fit in one allocation.
+ *
+ * Return: Opened source, or NULL on error (message printed to stderr).
+ */
+struct source *source_open_stream(const char *path);
+
+/**
+ * source_close() - Release a loaded source.
+ * @src: Source to release.  Safe to call with NULL.
+ */
+void source_close(struct source *src);
+
+#endif /* SOURCE_H */
@@ -2,6 +2,7 @@
 #define SYMBOL_TABLE_H
 
 #include "ast.h"
+#include <stdint.h>
 
 /**
  * enum value_type - Runtime value discriminator.
@@ -20,8 +21,9 @@ enum value_type {
  *
  * VALUE_STRING owns its string; the holder is responsible for
  * freeing it when the value is overwritten or goes out of scope.
- * VALUE_FUNCTION is a borrowed pointer into the AST; it is never
- * freed through this struct.
+ * VALUE_FUNCTION is a borrowed pointer into the AST, or the index of
+ * the definition when a flat tree is run (see interpreter_run_flat());
+ * it is never freed through this struct.
  */
 struct value {
 	enum value_type type;
@@ -29,84 +31,135 @@ struct value {
 		double number;
 		char *string;
 		struct ast_node *function; /* points into AST; not owned */
+		uint32_t node;		   /* FUNCTION_DEF in a flat tree */
 	} data;
 };
 
 /**
- * struct symbol - A name-to-value binding.
- * @name:  Heap-allocated identifier string (owned).
+ * struct symbol - The binding of one name that lookups currently see.
  * @value: The bound runtime value.
+ * @depth: Call depth of the frame that made the binding, 0 for a
+ *         global; -1 while the name is unbound.
  */
 struct symbol {
-	char		*name;
 	struct value	 value;
+	int		 depth;
 };
 
 /**
- * struct symbol_table - A single lexical scope.
- * @symbols:  Dynamic array of bindings.
- * @count:    Number of active bindings.
- * @capacity: Allocated capacity of @symbols.
- * @parent:   Enclosing scope, NULL for the global scope.
+ * struct symbol_save - A binding hidden by a call's local of the name.
+ * @name:  Atom of the name.
+ * @depth: Frame whose local hides it; restored when that frame ends.
+ * @old:   The hidden binding, possibly unbound.
+ */
+struct symbol_save {
+	uint32_t	 name;
+	int		 depth;
+	struct symbol	 old;
+};
+
+/**
+ * struct symbol_table - Every binding of one run, by name.
+ * @cells:       One binding per atom, indexed by atom.
+ * @cell_count:  Entries in @cells; atoms past the end are unbound.
+ * @saved:       Stack of bindings hidden by the active calls' locals,
+ *               innermost call last.
+ * @saved_count: Entries in use on @saved.
+ * @saved_cap:   Allocated length of @saved.
+ * @depth:       Number of active calls.
+ *
+ * Scopes are dynamic: a function sees its caller's locals, and the
+ * innermost binding of a name along the active calls wins, falling back
+ * to the globals.  Rather than walk a chain of per-call tables, each
+ * name's visible binding is kept in its cell (shallow binding).  A call
+ * that binds a local moves the binding it hides onto @saved and puts
+ * it back when the call returns, so a lookup is one array index
+ * however deep the recursion, and a call allocates nothing unless it
+ * outgrows @saved.
  */
 struct symbol_table {
-	struct symbol		*symbols;
-	int			 count;
-	int			 capacity;
-	struct symbol_table	*parent;
+	struct symbol		*cells;
+	uint32_t		 cell_count;
+	struct symbol_save	*saved;
+	size_t			 saved_count;
+	size_t			 saved_cap;
+	int			 depth;
 };
 
 /**
- * symbol_table_create() - Allocate a new symbol table scope.
- * @parent: Enclosing scope, or NULL for the global scope.
+ * symbol_table_create() - Allocate an empty table at the top level.
  *
  * Return: Pointer to the new table, or NULL on allocation failure.
  */
-struct symbol_table *symbol_table_create(struct symbol_table *parent);
+struct symbol_table *symbol_table_create(void);
 
 /**
- * symbol_table_destroy() - Free a scope and all of its bindings.
+ * symbol_table_destroy() - Free a table and all of its bindings.
  * @table: Table to destroy.  Safe to call with NULL.
  *
- * Does not walk to parent scopes.
+ * Bindings of calls still active are released too.
  */
 void symbol_table_destroy(struct symbol_table *table);
 
 /**
- * symbol_table_find() - Look up a name in this scope or any ancestor.
- * @table: Innermost scope to start the search.
- * @name:  Identifier to look up.
+ * symbol_table_find() - Look up the binding of a name.
+ * @table: Symbol table.
+ * @name:  Atom of the identifier to look up.
+ *
+ * The innermost binding along the active calls, then the global one.
+ * The pointer is invalidated by the next binding of a new name; read
+ * what is needed from it straight away.
  *
  * Return: Pointer to the symbol if found, NULL otherwise.
  */
 struct symbol *symbol_table_find(struct symbol_table *table,
-				 const char *name);
+				 uint32_t name);
+
+/**
+ * symbol_table_push() - Enter a function call.
+ * @table: Symbol table.
+ *
+ * Names bound with symbol_table_set_local() from now on are locals of
+ * the new call, until symbol_table_pop().
+ */
+void symbol_table_push(struct symbol_table *table);
+
+/**
+ * symbol_table_pop() - Leave the innermost call.
+ * @table: Symbol table.
+ *
+ * Releases the call's locals and makes the bindings they hid visible
+ * again.
+ */
+void symbol_table_pop(struct symbol_table *table);
 
 /**
- * symbol_table_set_local() - Bind a name in the current scope only.
- * @table: Target scope.
- * @name:  Identifier (copied if creating a new binding).
+ * symbol_table_set_local() - Bind a name in the innermost call only.
+ * @table: Symbol table.
+ * @name:  Atom of the identifier.
  * @value: Value to bind.
  *
- * If @name already exists in @table it is updated in place.
- * Parent scopes are never modified.
+ * If the innermost call (or, at the top level, the globals) already
+ * binds @name it is updated in place; bindings of outer calls are
+ * hidden, not modified.
  */
 void symbol_table_set_local(struct symbol_table *table,
-			     const char *name,
+			     uint32_t name,
 			     struct value value);
 
 /**
  * symbol_table_set() - Assign respecting the full scope chain.
- * @table: Innermost scope.
- * @name:  Identifier.
+ * @table: Symbol table.
+ * @name:  Atom of the identifier.
  * @value: Value to bind.
  *
- * If @name exists anywhere in the scope chain it is updated there.
- * Otherwise a new binding is created in @table.  This matches
- * Python's default assignment semantics for module-level names.
+ * If @name is bound anywhere along the active calls or in the globals,
+ * the visible binding is updated.  Otherwise a new binding is created
+ * in the innermost call.  This matches Python's default assignment
+ * semantics for module-level names.
  */
 void symbol_table_set(struct symbol_table *table,
-		      const char *name,
+		      uint32_t name,
 		      struct value value);
 
 #endif /* SYMBOL_TABLE_H */
@@ -0,0 +1,77 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+/**
+ * struct thread_pool - Fixed set of worker threads for parallel loops.
+ * @threads:    Worker handles; slot 0 stands for the calling thread.
+ * @nthreads:   Threads jobs run on, counting the caller, which also
+ *              takes work.
+ * @lock:       Guards every field below.
+ * @wake:       Signalled when a job is posted or the pool shuts down.
+ * @idle:       Signalled when the last item of a job finishes.
+ * @fn:         Current job.
+ * @arg:        Argument passed to @fn.
+ * @count:      Number of items in the current job.
+ * @next:       Next unclaimed item.
+ * @pending:    Items claimed or unclaimed that have not yet finished.
+ * @generation: Bumped for each job so workers can tell a new one apart.
+ * @stop:       Non-zero once the pool is being destroyed.
+ */
+struct thread_pool {
+	pthread_t	*threads;
+	int		 nthreads;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 wake;
+	pthread_cond_t	 idle;
+	void		(*fn)(void *arg, int index);
+	void		*arg;
+	int		 count;
+	int		 next;
+	int		 pending;
+	unsigned	 generation;
+	int		 stop;
+};
+
+/**
+ * thread_pool_cpus() - Number of online CPUs, at least 1.
+ */
+int thread_pool_cpus(void);
+
+/**
+ * thread_pool_create() - Start a pool.
+ * @nthreads: Total threads to run jobs on, counting the caller; 0 picks
+ *            thread_pool_cpus().  A pool of one starts no workers.
+ *
+ * Return: Pointer to pool, or NULL on failure.
+ */
+struct thread_pool *thread_pool_create(int nthreads);
+
+/**
+ * thread_pool_destroy() - Stop every worker and free the pool.
+ * @pool: Pool to destroy.  Safe to call with NULL.
+ */
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * thread_pool_size() - Threads a job runs on, counting the caller.
+ * @pool: Pool, or NULL for the caller alone.
+ */
+int thread_pool_size(const struct thread_pool *pool);
+
+/**
+ * thread_pool_run() - Run @fn(@arg, i) for i in [0, @count) and wait.
+ * @pool:  Pool, or NULL to run every item on the calling thread.
+ * @fn:    Job, called once per item on whichever thread claims it;
+ *         items must not depend on one another.
+ * @arg:   Passed unchanged to every call.
+ * @count: Number of items.
+ *
+ * Items are handed out one at a time, so uneven items balance out.
+ * Not reentrant: @fn must not post to the same pool.
+ */
+void thread_pool_run(struct thread_pool *pool,
+		     void (*fn)(void *arg, int index), void *arg, int count);
+
+#endif /* THREAD_POOL_H */
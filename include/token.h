@@ -1,6 +1,9 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  * enum token_type - All token types produced by the lexer
  *
@@ -53,20 +56,56 @@ enum token_type {
 	TOKEN_ERROR		/* unrecognised char    */
 };
 
+/*
+ * Punctuation spellings, as X(type, first byte) for one-byte operators
+ * and X(type, first byte, second byte) for two-byte ones.  The lexer
+ * builds its operator transition tables from these lists, so adding an
+ * operator is a one-line change here.  No two entries of
+ * TOKEN_OPERATORS_2 may share a first byte.
+ */
+#define TOKEN_OPERATORS_1(X)		\
+	X(TOKEN_PLUS,		'+')	\
+	X(TOKEN_MINUS,		'-')	\
+	X(TOKEN_MULTIPLY,	'*')	\
+	X(TOKEN_DIVIDE,		'/')	\
+	X(TOKEN_ASSIGN,		'=')	\
+	X(TOKEN_LESS,		'<')	\
+	X(TOKEN_GREATER,	'>')	\
+	X(TOKEN_LPAREN,		'(')	\
+	X(TOKEN_RPAREN,		')')	\
+	X(TOKEN_COMMA,		',')	\
+	X(TOKEN_COLON,		':')
+
+#define TOKEN_OPERATORS_2(X)			\
+	X(TOKEN_EQUAL,		'=', '=')	\
+	X(TOKEN_NOT_EQUAL,	'!', '=')	\
+	X(TOKEN_LESS_EQUAL,	'<', '=')	\
+	X(TOKEN_GREATER_EQUAL,	'>', '=')
+
 /**
  * struct token - A single lexical token
  * @type: Classification of this token
- * @value: Heap-allocated string form; caller must free()
- * @line: Source line (1 - based)
- * @column: Source column (1 - based)
+ * @offset: Byte offset of the token text in the lexer's source
+ * @length: Length of the token text in bytes; 0 for INDENT/DEDENT/EOF
+ * @owned: Decoded text of a string literal that contained escapes,
+ *         NULL otherwise; caller must free()
  * @number: Numeric value; only valid when type == TOKEN_NUMBER
+ * @atom: Interned name; only valid when type == TOKEN_IDENTIFIER
+ *
+ * Token text is a view into the source buffer, which must outlive
+ * the token.  For TOKEN_STRING the view covers the literal's body
+ * without its quotes; when the body contains escapes the decoded
+ * text lives in @owned instead and @length is its length.  Line and
+ * column are not stored; look @offset up in a struct line_index when
+ * a diagnostic needs them.
  */
 struct token {
 	enum token_type type;
-	char *value;
-	int line;
-	int column;
+	size_t offset;
+	int length;
+	char *owned;
 	double number;
+	uint32_t atom;
 };
 
 #endif 
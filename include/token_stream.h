@@ -0,0 +1,134 @@
+#ifndef TOKEN_STREAM_H
+#define TOKEN_STREAM_H
+
+#include "token.h"
+#include <stdint.h>
+
+/*
+ * Packed length of a token whose text is at least this long; the real
+ * length is in the stream's lengths table.
+ */
+#define TOKEN_LENGTH_MAX	((1u << 24) - 1)
+
+/* @value of a string literal that is a plain view of the source. */
+#define TOKEN_NO_ENTRY		UINT32_MAX
+
+/**
+ * struct packed_token - A token in 12 bytes.
+ * @type:   enum token_type.
+ * @length: Length of the token text; for a string literal with
+ *          escapes, the length of the decoded text.  TOKEN_LENGTH_MAX
+ *          if the length is in the lengths table.
+ * @offset: Byte offset of the token text in the source.  Sources past
+ *          4 GiB do not fit and are parsed straight from the lexer.
+ * @value:  Atom for TOKEN_IDENTIFIER, index into the numbers table for
+ *          TOKEN_NUMBER, index into the strings table for a
+ *          TOKEN_STRING with escapes (TOKEN_NO_ENTRY without); 0 for
+ *          every other type.
+ */
+struct packed_token {
+	uint32_t type   : 8;
+	uint32_t length : 24;
+	uint32_t offset;
+	uint32_t value;
+};
+
+/**
+ * struct token_length - Length of a token too long to pack.
+ * @offset: Byte offset of the token, as in its packed token.
+ * @length: Length of the token text.
+ */
+struct token_length {
+	uint32_t offset;
+	int	 length;
+};
+
+/**
+ * struct token_stream - A lexed source as packed tokens and side tables.
+ * @tokens:     Packed tokens in source order.
+ * @count:      Number of entries in @tokens.
+ * @capacity:   Allocated length of @tokens.
+ * @numbers:    Values of the numeric literals, in order.
+ * @nnumbers:   Number of entries in @numbers.
+ * @number_cap: Allocated length of @numbers.
+ * @strings:    Decoded text of the string literals with escapes (owned).
+ * @nstrings:   Number of entries in @strings.
+ * @string_cap: Allocated length of @strings.
+ * @lengths:    Lengths of the tokens of TOKEN_LENGTH_MAX bytes or more,
+ *              by offset in source order.
+ * @nlengths:   Number of entries in @lengths.
+ * @length_cap: Allocated length of @lengths.
+ *
+ * struct token spends a double on every token and a pointer on every
+ * token that is not a string with escapes.  Here only the few tokens
+ * that need them take a slot in a side table, so a scan over the
+ * stream touches 12 bytes a token.  The stream ends at its first
+ * TOKEN_EOF or TOKEN_ERROR, as the lexer produces them.
+ */
+struct token_stream {
+	struct packed_token	*tokens;
+	int			 count;
+	int			 capacity;
+	double			*numbers;
+	int			 nnumbers;
+	int			 number_cap;
+	char			**strings;
+	int			 nstrings;
+	int			 string_cap;
+	struct token_length	*lengths;
+	int			 nlengths;
+	int			 length_cap;
+};
+
+/**
+ * token_stream_create() - Allocate an empty stream.
+ *
+ * Return: Pointer to stream, or NULL on allocation failure.
+ */
+struct token_stream *token_stream_create(void);
+
+/**
+ * token_stream_destroy() - Free a stream and the strings it owns.
+ * @stream: Stream to destroy.  Safe to call with NULL.
+ */
+void token_stream_destroy(struct token_stream *stream);
+
+/**
+ * token_stream_reserve() - Make room without growing again.
+ * @stream:   Stream to grow.
+ * @tokens:   Tokens the stream must be able to hold.
+ * @numbers:  Entries the numbers table must be able to hold.
+ * @strings:  Entries the strings table must be able to hold.
+ * @lengths:  Entries the lengths table must be able to hold.
+ *
+ * For producers that know their totals up front and fill the arrays
+ * directly (see lex_parallel()).
+ *
+ * Return: 1 on success, 0 on allocation failure.
+ */
+int token_stream_reserve(struct token_stream *stream, int tokens,
+			 int numbers, int strings, int lengths);
+
+/**
+ * token_stream_push() - Pack @tok onto the end of @stream.
+ * @stream: Stream to append to.
+ * @tok:    Token from lexer_next_token().
+ *
+ * The stream takes @tok->owned, and frees it if the push fails.
+ *
+ * Return: 1 on success, 0 on allocation failure or when the token
+ *         starts past the 4 GiB a packed offset can reach.
+ */
+int token_stream_push(struct token_stream *stream, struct token *tok);
+
+/**
+ * token_stream_get() - Unpack token @index of @stream.
+ * @stream: Stream to read.
+ * @index:  Token index, below @stream->count.
+ * @tok:    Out: the token as the lexer produced it.  @tok->owned still
+ *          belongs to the stream and must not be freed.
+ */
+void token_stream_get(const struct token_stream *stream, int index,
+		      struct token *tok);
+
+#endif /* TOKEN_STREAM_H */
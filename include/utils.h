@@ -11,9 +11,24 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdio.h>
+
+/**
+ * read_stream() - Read @file to EOF into a heap-allocated string.
+ * @file:   Open stream; may be a pipe or terminal.
+ * @length: If non-NULL, receives the number of bytes read.
+ *
+ * Reads in chunks into a buffer that doubles as it fills, so the size
+ * need not be known up front.
+ *
+ * Return: NUL-terminated buffer on success; caller must free().
+ *         NULL on error (message printed to stderr).
+ */
+char *read_stream(FILE *file, size_t *length);
+
 /**
  * read_file() - Read a file's contents into a heap-allocated string.
- * @filename: Path to the file.
+ * @filename: Path to the file, or "-" for standard input.
  *
  * Return: NUL-terminated buffer on success; caller must free().
  *         NULL on error (message printed to stderr).
@@ -5,13 +5,31 @@
  * sees the whole program in one pass.
  *
  * Build:
- *   gcc -Wall -Wextra -std=c99 -O2 -I include/ -o build/python-compiler \
+ *   gcc -Wall -Wextra -std=c99 -O2 -pthread -I include/ \
+ *       -o build/python-compiler \
  *       src/python_compiler.c
  */
 #include "src/utils.c"
+#include "src/source.c"
+#include "src/intern.c"
+#include "src/arena.c"
 #include "src/ast.c"
+#include "src/hashcons.c"
+#include "src/optimise.c"
+#include "src/flat_ast.c"
+#include "src/sha256.c"
+#include "src/ast_cache.c"
+#include "src/bundle.c"
 #include "src/symbol_table.c"
+#include "src/memo.c"
+#include "src/scan.c"
+#include "src/line_index.c"
+#include "src/token_stream.c"
 #include "src/lexer.c"
+#include "src/thread_pool.c"
+#include "src/lex_parallel.c"
+#include "src/lex_pipe.c"
 #include "src/parser.c"
+#include "src/incremental.c"
 #include "src/interpreter.c"
 #include "src/main.c"
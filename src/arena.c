@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Alignment of arena_alloc() results. */
+#define ARENA_ALIGN	sizeof(((struct arena_chunk *)0)->data[0])
+
+/**
+ * arena_create() - Allocate an empty arena.
+ */
+struct arena *arena_create(void)
+{
+	struct arena *arena;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena) {
+		fprintf(stderr, "arena: out of memory\n");
+		return NULL;
+	}
+
+	arena->next = ARENA_CHUNK_MIN;
+	return arena;
+}
+
+/**
+ * arena_destroy() - Release an arena and everything allocated from it.
+ */
+void arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+	struct arena_chunk *next;
+
+	if (!arena)
+		return;
+
+	for (chunk = arena->head; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/*
+ * arena_new_chunk() - Start a chunk with room for at least @size bytes.
+ *
+ * An oversized request gets a chunk of its own, placed behind the
+ * current one so the space left there is not abandoned.
+ */
+static struct arena_chunk *arena_new_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t bytes = arena->next;
+
+	if (bytes < size)
+		bytes = size;
+
+	chunk = calloc(1, sizeof(*chunk) + bytes);
+	if (!chunk) {
+		fprintf(stderr, "arena: out of memory\n");
+		return NULL;
+	}
+	chunk->size = bytes;
+
+	if (bytes > arena->next && arena->head) {
+		chunk->next       = arena->head->next;
+		arena->head->next = chunk;
+		return chunk;
+	}
+
+	chunk->next = arena->head;
+	arena->head = chunk;
+	if (arena->next < ARENA_CHUNK_MAX)
+		arena->next *= 2;
+	return chunk;
+}
+
+/* arena_take() - Carve @size bytes at a multiple of @align. */
+static void *arena_take(struct arena *arena, size_t size, size_t align)
+{
+	struct arena_chunk *chunk = arena->head;
+	size_t at = 0;
+
+	if (chunk)
+		at = (chunk->used + align - 1) & ~(align - 1);
+	if (!chunk || at > chunk->size || size > chunk->size - at) {
+		chunk = arena_new_chunk(arena, size);
+		if (!chunk)
+			return NULL;
+		at = 0;
+	}
+
+	chunk->used   = at + size;
+	arena->total += size;
+	return (char *)chunk->data + at;
+}
+
+/**
+ * arena_alloc() - Take @size zeroed bytes from @arena.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	return arena_take(arena, size, ARENA_ALIGN);
+}
+
+/**
+ * arena_strndup() - Copy @n bytes of @s into @arena as a C string.
+ */
+char *arena_strndup(struct arena *arena, const char *s, size_t n)
+{
+	char *copy;
+
+	copy = arena_take(arena, n + 1, 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, s, n);
+	return copy;
+}
+
+/**
+ * arena_merge() - Move everything allocated from @src into @dst.
+ */
+void arena_merge(struct arena *dst, struct arena *src)
+{
+	struct arena_chunk *last;
+
+	if (!src)
+		return;
+
+	/* Behind @dst's head, which keeps serving new allocations. */
+	if (src->head) {
+		for (last = src->head; last->next; last = last->next)
+			;
+		if (dst->head) {
+			last->next      = dst->head->next;
+			dst->head->next = src->head;
+		} else {
+			dst->head = src->head;
+		}
+	}
+	dst->total += src->total;
+	free(src);
+}
@@ -7,19 +7,21 @@
 /**
  * ast_create_node() - Allocate and zero-initialise a new AST node.
  */
-struct ast_node *ast_create_node(enum ast_node_type type, int line_number)
+struct ast_node *ast_create_node(struct arena *arena,
+				 enum ast_node_type type, size_t offset)
 {
 	struct ast_node *node;
 
-	node = calloc(1, sizeof(*node));
+	/* Arena memory comes zeroed. */
+	node = arena_alloc(arena, sizeof(*node));
 
 	if (!node) {
 		fprintf(stderr, "ast: out of memory\n");
 		return NULL;
 	}
 
-	node->type        = type;
-	node->line_number = line_number;
+	node->type   = type;
+	node->offset = offset;
 
 	return node;
 }
@@ -27,11 +29,12 @@ struct ast_node *ast_create_node(enum ast_node_type type, int line_number)
 /**
  * ast_create_number() - Convenience constructor for a numeric literal.
  */
-struct ast_node *ast_create_number(double value, int line)
+struct ast_node *ast_create_number(struct arena *arena, double value,
+				   size_t offset)
 {
 	struct ast_node *node;
 
-	node = ast_create_node(AST_NUMBER, line);
+	node = ast_create_node(arena, AST_NUMBER, offset);
 	if (!node)
 		return NULL;
 
@@ -42,22 +45,21 @@ struct ast_node *ast_create_number(double value, int line)
 /**
  * ast_create_string() - Convenience constructor for a string literal.
  */
-struct ast_node *ast_create_string(const char *value, int line)
+struct ast_node *ast_create_string(struct arena *arena, const char *value,
+				   int length, size_t offset)
 {
 	struct ast_node *node;
 
-	if (!value)
+	if (!value || length < 0)
 		return NULL;
 
-	node = ast_create_node(AST_STRING, line);
+	node = ast_create_node(arena, AST_STRING, offset);
 	if (!node)
 		return NULL;
 
-	node->data.string.value = strdup(value);
-	if (!node->data.string.value) {
-		free(node);
+	node->data.string.value = arena_strndup(arena, value, (size_t)length);
+	if (!node->data.string.value)
 		return NULL;
-	}
 
 	return node;
 }
@@ -65,40 +67,34 @@ struct ast_node *ast_create_string(const char *value, int line)
 /**
  * ast_create_identifier() - Convenience constructor for an identifier.
  */
-struct ast_node *ast_create_identifier(const char *name, int line)
+struct ast_node *ast_create_identifier(struct arena *arena, uint32_t name,
+				       size_t offset)
 {
 	struct ast_node *node;
 
-	if (!name)
-		return NULL;
-
-	node = ast_create_node(AST_IDENTIFIER, line);
+	node = ast_create_node(arena, AST_IDENTIFIER, offset);
 	if (!node)
 		return NULL;
 
-	node->data.identifier.name = strdup(name);
-	if (!node->data.identifier.name) {
-		free(node);
-		return NULL;
-	}
-
+	node->data.identifier.name = name;
 	return node;
 }
 
 /**
  * ast_create_binary_op() - Convenience constructor for a binary expression.
  */
-struct ast_node *ast_create_binary_op(struct ast_node *left,
+struct ast_node *ast_create_binary_op(struct arena *arena,
+				      struct ast_node *left,
 				      enum token_type op,
 				      struct ast_node *right,
-				      int line)
+				      size_t offset)
 {
 	struct ast_node *node;
 
 	if (!left || !right)
 		return NULL;
 
-	node = ast_create_node(AST_BINARY_OP, line);
+	node = ast_create_node(arena, AST_BINARY_OP, offset);
 	if (!node)
 		return NULL;
 
@@ -108,103 +104,86 @@ struct ast_node *ast_create_binary_op(struct ast_node *left,
 	return node;
 }
 
-/* --- Free helpers per node type ----------------------------------------- */
-
-static void free_function_def(struct ast_node *node)
-{
-	int j;
-
-	free(node->data.function_def.name);
-	for (j = 0; j < node->data.function_def.param_count; j++)
-		free(node->data.function_def.parameters[j]);
-	free(node->data.function_def.parameters);
-	ast_free(node->data.function_def.body);
-}
-
-static void free_function_call(struct ast_node *node)
-{
-	int j;
-
-	free(node->data.function_call.function_name);
-	for (j = 0; j < node->data.function_call.arg_count; j++)
-		ast_free(node->data.function_call.arguments[j]);
-	free(node->data.function_call.arguments);
-}
-
-static void free_block(struct ast_node *node)
-{
-	int j;
-
-	for (j = 0; j < node->data.block.count; j++)
-		ast_free(node->data.block.statements[j]);
-	free(node->data.block.statements);
-}
-
-static void free_program(struct ast_node *node)
+/**
+ * ast_create_list() - Copy a list of child nodes into @arena.
+ */
+struct ast_node **ast_create_list(struct arena *arena,
+				  struct ast_node *const *nodes, int count)
 {
-	int j;
+	struct ast_node **list;
 
-	for (j = 0; j < node->data.program.count; j++)
-		ast_free(node->data.program.statements[j]);
-	free(node->data.program.statements);
+	list = arena_alloc(arena, sizeof(*list) * (size_t)count);
+	if (!list) {
+		fprintf(stderr, "ast: out of memory\n");
+		return NULL;
+	}
+	if (count)
+		memcpy(list, nodes, sizeof(*list) * (size_t)count);
+	return list;
 }
 
 /**
- * ast_free() - Recursively release a node and all of its descendants.
+ * ast_shift_offsets() - Add @delta to the offset of every node.
  */
-void ast_free(struct ast_node *node)
+void ast_shift_offsets(struct ast_node *node, ptrdiff_t delta)
 {
-	if (!node)
+	int j;
+
+	/* A shared constant may sit under several statements; its offset
+	 * is never reported, so it keeps the one it was first parsed at. */
+	if (!node || !delta || node->shared)
 		return;
 
+	node->offset += delta;
+
 	switch (node->type) {
-	case AST_STRING:
-		free(node->data.string.value);
-		break;
-	case AST_IDENTIFIER:
-		free(node->data.identifier.name);
-		break;
 	case AST_BINARY_OP:
-		ast_free(node->data.binary_op.left);
-		ast_free(node->data.binary_op.right);
+		ast_shift_offsets(node->data.binary_op.left, delta);
+		ast_shift_offsets(node->data.binary_op.right, delta);
 		break;
 	case AST_UNARY_OP:
-		ast_free(node->data.unary_op.operand);
+		ast_shift_offsets(node->data.unary_op.operand, delta);
 		break;
 	case AST_ASSIGNMENT:
-		free(node->data.assignment.variable);
-		ast_free(node->data.assignment.value);
+		ast_shift_offsets(node->data.assignment.value, delta);
 		break;
 	case AST_IF_STMT:
-		ast_free(node->data.if_stmt.condition);
-		ast_free(node->data.if_stmt.then_block);
-		ast_free(node->data.if_stmt.else_block);
+		ast_shift_offsets(node->data.if_stmt.condition, delta);
+		ast_shift_offsets(node->data.if_stmt.then_block, delta);
+		ast_shift_offsets(node->data.if_stmt.else_block, delta);
 		break;
 	case AST_WHILE_STMT:
-		ast_free(node->data.while_stmt.condition);
-		ast_free(node->data.while_stmt.body);
+		ast_shift_offsets(node->data.while_stmt.condition, delta);
+		ast_shift_offsets(node->data.while_stmt.body, delta);
 		break;
 	case AST_FUNCTION_DEF:
-		free_function_def(node);
+		ast_shift_offsets(node->data.function_def.body, delta);
 		break;
 	case AST_FUNCTION_CALL:
-		free_function_call(node);
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			ast_shift_offsets(
+				node->data.function_call.arguments[j],
+				delta);
 		break;
 	case AST_RETURN_STMT:
-		ast_free(node->data.return_stmt.value);
+		ast_shift_offsets(node->data.return_stmt.value, delta);
 		break;
 	case AST_PRINT_STMT:
-		ast_free(node->data.print_stmt.value);
+		ast_shift_offsets(node->data.print_stmt.value, delta);
 		break;
 	case AST_BLOCK:
-		free_block(node);
+		for (j = 0; j < node->data.block.count; j++)
+			ast_shift_offsets(node->data.block.statements[j],
+					delta);
 		break;
 	case AST_PROGRAM:
-		free_program(node);
+		for (j = 0; j < node->data.program.count; j++)
+			ast_shift_offsets(node->data.program.statements[j],
+					delta);
 		break;
 	case AST_NUMBER:
+	case AST_STRING:
+	case AST_IDENTIFIER:
 		break;
 	}
-
-	free(node);
 }
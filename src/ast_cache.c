@@ -0,0 +1,637 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "ast_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AST_IMAGE_MAGIC		"PYCAST\r\n"
+#define AST_IMAGE_ORDER		0x01020304u
+#define AST_IMAGE_SUFFIX	".ast"
+
+/* Sections start at multiples of this, so they can be used in place. */
+#define AST_IMAGE_ALIGN		sizeof(double)
+
+/*
+ * Sizes of the types stored in the sections, packed into one word so a
+ * build with a different size_t or node layout rejects the entry.
+ */
+#define AST_IMAGE_TYPES	((uint32_t)sizeof(struct flat_node) |		\
+			 (uint32_t)sizeof(size_t) << 8 |		\
+			 (uint32_t)sizeof(double) << 16 |		\
+			 (uint32_t)sizeof(uint32_t) << 24)
+
+/**
+ * struct ast_image_header - First bytes of a cache entry.
+ * @magic:         AST_IMAGE_MAGIC.
+ * @version:       AST_IMAGE_VERSION of the writer.
+ * @byte_order:    AST_IMAGE_ORDER as the writer stored it.
+ * @type_sizes:    AST_IMAGE_TYPES of the writer.
+ * @atom_count:    Names in the name section.
+ * @source_length: Bytes in the source the tree was built from.
+ * @size:          Bytes in the whole entry.
+ * @key:           SHA-256 of the source.
+ * @digest:        SHA-256 of every byte after the header.
+ * @node_count:    See struct flat_ast.
+ * @number_count:  See struct flat_ast.
+ * @list_count:    See struct flat_ast.
+ * @string_bytes:  See struct flat_ast.
+ * @name_bytes:    Bytes in the name section.
+ * @at_nodes:      Entry offset of each section.
+ * @at_offsets:    ...
+ * @at_numbers:    ...
+ * @at_lists:      ...
+ * @at_strings:    ...
+ * @at_names:      NUL-terminated names, in atom order.
+ *
+ * Every field is fixed-width and naturally aligned, so the header has
+ * no padding and the entry holds no pointers: it means the same
+ * wherever it is mapped.
+ */
+struct ast_image_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 byte_order;
+	uint32_t	 type_sizes;
+	uint32_t	 atom_count;
+	uint64_t	 source_length;
+	uint64_t	 size;
+	uint8_t		 key[SHA256_BYTES];
+	uint8_t		 digest[SHA256_BYTES];
+	uint32_t	 node_count;
+	uint32_t	 number_count;
+	uint32_t	 list_count;
+	uint32_t	 string_bytes;
+	uint64_t	 name_bytes;
+	uint64_t	 at_nodes;
+	uint64_t	 at_offsets;
+	uint64_t	 at_numbers;
+	uint64_t	 at_lists;
+	uint64_t	 at_strings;
+	uint64_t	 at_names;
+};
+
+/* cache_round() - Round @n up to a multiple of AST_IMAGE_ALIGN. */
+static uint64_t cache_round(uint64_t n)
+{
+	return (n + AST_IMAGE_ALIGN - 1) & ~(uint64_t)(AST_IMAGE_ALIGN - 1);
+}
+
+/* cache_join() - "@dir/@name", or NULL when out of memory. */
+static char *cache_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t nlen = strlen(name);
+	char *path;
+
+	path = malloc(dlen + nlen + 2);
+	if (!path) {
+		fprintf(stderr, "ast_cache: out of memory\n");
+		return NULL;
+	}
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	memcpy(path + dlen + 1, name, nlen + 1);
+	return path;
+}
+
+/* cache_path() - Path of the entry for @key, ending in @suffix. */
+static char *cache_path(const char *dir, const uint8_t key[SHA256_BYTES],
+			const char *suffix)
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[2 * SHA256_BYTES + 32];
+	int j;
+
+	for (j = 0; j < SHA256_BYTES; j++) {
+		name[2 * j]     = hex[key[j] >> 4];
+		name[2 * j + 1] = hex[key[j] & 15];
+	}
+	snprintf(name + 2 * SHA256_BYTES, sizeof(name) - 2 * SHA256_BYTES,
+		 "%s", suffix);
+	return cache_join(dir, name);
+}
+
+/* --- Loading ------------------------------------------------------------- */
+
+/* cache_section() - Whether @count items of @size fit at @at. */
+static int cache_section(const struct ast_image_header *h, uint64_t at,
+			 uint64_t count, uint64_t size)
+{
+	return at % AST_IMAGE_ALIGN == 0 && at >= sizeof(*h) &&
+	       at <= h->size && count <= (h->size - at) / size;
+}
+
+/* cache_child() - Whether @child is absent or a node after @at. */
+static int cache_child(const struct flat_ast *ast, uint32_t at,
+		       uint32_t child)
+{
+	return child == FLAT_NONE || (child > at && child < ast->node_count);
+}
+
+/* cache_span() - Whether a node's b/c span lies inside @ast->lists. */
+static int cache_span(const struct flat_ast *ast, const struct flat_node *n)
+{
+	return n->c <= ast->list_count && n->b <= ast->list_count - n->c;
+}
+
+/*
+ * cache_check_nodes() - Check that every index in @ast stays in bounds.
+ *
+ * Children always come after their parent in pre-order, so requiring
+ * that also rules out cycles.  One pass over the nodes, which costs a
+ * small fraction of parsing them.
+ */
+static int cache_check_nodes(const struct flat_ast *ast, uint32_t atoms)
+{
+	const struct flat_node *n;
+	uint32_t at;
+	uint32_t j;
+
+	if (!ast->node_count || ast->nodes[0].kind != AST_PROGRAM)
+		return 0;
+
+	for (at = 0; at < ast->node_count; at++) {
+		n = &ast->nodes[at];
+		switch (n->kind) {
+		case AST_NUMBER:
+			if (n->a >= ast->number_count)
+				return 0;
+			break;
+		case AST_STRING:
+			if (n->a >= ast->string_bytes)
+				return 0;
+			break;
+		case AST_IDENTIFIER:
+			if (n->a >= atoms)
+				return 0;
+			break;
+		case AST_BINARY_OP:
+		case AST_WHILE_STMT:
+		case AST_IF_STMT:
+			if (!cache_child(ast, at, n->a) ||
+			    !cache_child(ast, at, n->b) ||
+			    !cache_child(ast, at, n->c))
+				return 0;
+			break;
+		case AST_UNARY_OP:
+		case AST_RETURN_STMT:
+		case AST_PRINT_STMT:
+			if (!cache_child(ast, at, n->a))
+				return 0;
+			break;
+		case AST_ASSIGNMENT:
+			if (n->a >= atoms || !cache_child(ast, at, n->b))
+				return 0;
+			break;
+		case AST_FUNCTION_DEF:
+			if (n->a >= atoms || at + 1 >= ast->node_count ||
+			    !cache_span(ast, n))
+				return 0;
+			for (j = 0; j < n->c; j++)
+				if (ast->lists[n->b + j] >= atoms)
+					return 0;
+			break;
+		case AST_FUNCTION_CALL:
+		case AST_BLOCK:
+		case AST_PROGRAM:
+			if ((n->kind == AST_FUNCTION_CALL && n->a >= atoms) ||
+			    !cache_span(ast, n))
+				return 0;
+			for (j = 0; j < n->c; j++)
+				if (!cache_child(ast, at, ast->lists[n->b + j]))
+					return 0;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * ast_image_open() - Use an image that is already in memory.
+ */
+int ast_image_open(struct flat_ast *ast, const void *data, size_t size,
+		   const uint8_t key[SHA256_BYTES], size_t length,
+		   struct intern_table *atoms)
+{
+	const struct ast_image_header *h = data;
+	const char *base = data;
+	const char *names;
+	const char *end;
+	uint8_t digest[SHA256_BYTES];
+	size_t len;
+	uint32_t j;
+
+	if (size < sizeof(*h) || (uintptr_t)data % AST_IMAGE_ALIGN)
+		return 0;
+
+	/* Stale: another version, another build, or another source. */
+	if (memcmp(h->magic, AST_IMAGE_MAGIC, sizeof(h->magic)) ||
+	    h->version != AST_IMAGE_VERSION ||
+	    h->byte_order != AST_IMAGE_ORDER ||
+	    h->type_sizes != AST_IMAGE_TYPES || h->size != size ||
+	    (key && (h->source_length != length ||
+		     memcmp(h->key, key, SHA256_BYTES))))
+		return 0;
+
+	if (!cache_section(h, h->at_nodes, h->node_count,
+			   sizeof(*ast->nodes)) ||
+	    !cache_section(h, h->at_offsets, h->node_count,
+			   sizeof(*ast->offsets)) ||
+	    !cache_section(h, h->at_numbers, h->number_count,
+			   sizeof(*ast->numbers)) ||
+	    !cache_section(h, h->at_lists, h->list_count,
+			   sizeof(*ast->lists)) ||
+	    !cache_section(h, h->at_strings, h->string_bytes, 1) ||
+	    !cache_section(h, h->at_names, h->name_bytes, 1))
+		return 0;
+
+	/* The checks below cannot tell a flipped operator or literal. */
+	sha256(base + sizeof(*h), size - sizeof(*h), digest);
+	if (memcmp(digest, h->digest, SHA256_BYTES))
+		return 0;
+
+	ast->nodes        = (struct flat_node *)(base + h->at_nodes);
+	ast->offsets      = (size_t *)(base + h->at_offsets);
+	ast->numbers      = (double *)(base + h->at_numbers);
+	ast->lists        = (uint32_t *)(base + h->at_lists);
+	ast->strings      = (char *)(base + h->at_strings);
+	ast->node_count   = h->node_count;
+	ast->number_count = h->number_count;
+	ast->list_count   = h->list_count;
+	ast->string_bytes = h->string_bytes;
+	ast->bytes        = size;
+
+	if (ast->string_bytes && ast->strings[ast->string_bytes - 1])
+		return 0;
+	if (!cache_check_nodes(ast, h->atom_count))
+		return 0;
+
+	/* Interned in order, distinct names get back their old atoms. */
+	names = base + h->at_names;
+	end   = names + h->name_bytes;
+	for (j = 0; j < h->atom_count; j++) {
+		len = strnlen(names, (size_t)(end - names));
+		if (len == (size_t)(end - names) ||
+		    intern(atoms, names, len) != j)
+			return 0;
+		names += len + 1;
+	}
+	return 1;
+}
+
+/**
+ * ast_cache_load() - Look up the tree compiled from a source.
+ */
+struct ast_image *ast_cache_load(const char *dir,
+				 const uint8_t key[SHA256_BYTES],
+				 size_t length, struct intern_table *atoms)
+{
+	struct ast_image *image = NULL;
+	struct stat st;
+	char *path;
+	void *map;
+	int fd;
+
+	path = cache_path(dir, key, AST_IMAGE_SUFFIX);
+	if (!path)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size < (off_t)sizeof(struct ast_image_header))
+		goto done;
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto done;
+
+	image = calloc(1, sizeof(*image));
+	if (!image) {
+		munmap(map, (size_t)st.st_size);
+		goto done;
+	}
+	image->map  = map;
+	image->size = (size_t)st.st_size;
+
+	if (!ast_image_open(&image->ast, map, image->size, key, length,
+			    atoms)) {
+		ast_cache_release(image);
+		image = NULL;
+		goto done;
+	}
+
+	/* Mark the entry used; eviction goes by modification time. */
+	futimens(fd, NULL);
+done:
+	close(fd);
+	return image;
+}
+
+/**
+ * ast_cache_release() - Unmap an image from ast_cache_load().
+ */
+void ast_cache_release(struct ast_image *image)
+{
+	if (!image)
+		return;
+	munmap(image->map, image->size);
+	free(image);
+}
+
+/* --- Storing ------------------------------------------------------------- */
+
+/*
+ * cache_put() - Pad with zeros up to @at, then put @n bytes: written to
+ *               @file, or absorbed into @hash when @file is NULL.
+ */
+static int cache_put(FILE *file, struct sha256 *hash, uint64_t *pos,
+		     uint64_t at, const void *data, size_t n)
+{
+	static const char zeros[AST_IMAGE_ALIGN];
+
+	if (!file) {
+		if (at > *pos)
+			sha256_update(hash, zeros, at - *pos);
+		if (n)
+			sha256_update(hash, data, n);
+	} else {
+		if (at > *pos &&
+		    fwrite(zeros, 1, at - *pos, file) != at - *pos)
+			return 0;
+		if (n && fwrite(data, 1, n, file) != n)
+			return 0;
+	}
+	*pos = at + n;
+	return 1;
+}
+
+/**
+ * struct cache_entry - One file found in the cache directory.
+ * @path: Full path.
+ * @used: Last modification, i.e. last write or hit.
+ * @size: Bytes in the file.
+ */
+struct cache_entry {
+	char		*path;
+	struct timespec	 used;
+	uint64_t	 size;
+};
+
+/* cache_older() - qsort() order: least recently used first. */
+static int cache_older(const void *a, const void *b)
+{
+	const struct cache_entry *x = a;
+	const struct cache_entry *y = b;
+
+	if (x->used.tv_sec != y->used.tv_sec)
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+	if (x->used.tv_nsec != y->used.tv_nsec)
+		return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * cache_evict() - Delete the least recently used entries in @dir until
+ *                 the rest total at most @limit bytes.
+ */
+static void cache_evict(const char *dir, uint64_t limit)
+{
+	struct cache_entry *list = NULL;
+	struct cache_entry *grown;
+	struct dirent *de;
+	struct stat st;
+	uint64_t total = 0;
+	size_t count = 0;
+	size_t cap = 0;
+	size_t len;
+	size_t j;
+	char *path;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((de = readdir(d))) {
+		len = strlen(de->d_name);
+		if (len <= strlen(AST_IMAGE_SUFFIX) ||
+		    strcmp(de->d_name + len - strlen(AST_IMAGE_SUFFIX),
+			   AST_IMAGE_SUFFIX))
+			continue;
+
+		path = cache_join(dir, de->d_name);
+		if (!path)
+			break;
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		if (count == cap) {
+			cap   = cap ? cap * 2 : 64;
+			grown = realloc(list, cap * sizeof(*list));
+			if (!grown) {
+				fprintf(stderr, "ast_cache: out of memory\n");
+				free(path);
+				break;
+			}
+			list = grown;
+		}
+		list[count].path = path;
+		list[count].used = st.st_mtim;
+		list[count].size = (uint64_t)st.st_size;
+		total += list[count].size;
+		count++;
+	}
+	closedir(d);
+
+	qsort(list, count, sizeof(*list), cache_older);
+	for (j = 0; j < count; j++) {
+		if (total > limit && !unlink(list[j].path))
+			total -= list[j].size;
+		free(list[j].path);
+	}
+	free(list);
+}
+
+/*
+ * image_layout() - Fill in the header of the image of @ast: counts and
+ *                  the offset of every section, the last one ending at
+ *                  @h->size.
+ */
+static void image_layout(struct ast_image_header *h,
+			 const uint8_t key[SHA256_BYTES], size_t length,
+			 const struct flat_ast *ast,
+			 const struct intern_table *atoms)
+{
+	uint32_t j;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, AST_IMAGE_MAGIC, sizeof(h->magic));
+	h->version       = AST_IMAGE_VERSION;
+	h->byte_order    = AST_IMAGE_ORDER;
+	h->type_sizes    = AST_IMAGE_TYPES;
+	h->atom_count    = atoms->count;
+	h->source_length = length;
+	memcpy(h->key, key, SHA256_BYTES);
+	h->node_count    = ast->node_count;
+	h->number_count  = ast->number_count;
+	h->list_count    = ast->list_count;
+	h->string_bytes  = ast->string_bytes;
+	for (j = 0; j < atoms->count; j++)
+		h->name_bytes += strlen(intern_name(atoms, j)) + 1;
+
+	h->at_nodes   = cache_round(sizeof(*h));
+	h->at_offsets = cache_round(h->at_nodes + (uint64_t)h->node_count *
+				    sizeof(*ast->nodes));
+	h->at_numbers = cache_round(h->at_offsets +
+				    (uint64_t)h->node_count *
+				    sizeof(*ast->offsets));
+	h->at_lists   = cache_round(h->at_numbers +
+				    (uint64_t)h->number_count *
+				    sizeof(*ast->numbers));
+	h->at_strings = cache_round(h->at_lists + (uint64_t)h->list_count *
+				    sizeof(*ast->lists));
+	h->at_names   = cache_round(h->at_strings + h->string_bytes);
+	h->size       = h->at_names + h->name_bytes;
+}
+
+/**
+ * ast_image_size() - Bytes ast_image_write() would write.
+ */
+uint64_t ast_image_size(const struct flat_ast *ast,
+			const struct intern_table *atoms)
+{
+	static const uint8_t none[SHA256_BYTES];
+	struct ast_image_header h;
+
+	image_layout(&h, none, 0, ast, atoms);
+	return h.size;
+}
+
+/*
+ * image_body() - Put every section of the image after header @h, as
+ *                cache_put() does.
+ */
+static int image_body(FILE *file, struct sha256 *hash,
+		      const struct ast_image_header *h,
+		      const struct flat_ast *ast,
+		      const struct intern_table *atoms)
+{
+	uint64_t pos = sizeof(*h);
+	const char *name;
+	uint32_t j;
+
+	if (!cache_put(file, hash, &pos, h->at_nodes, ast->nodes,
+		       h->node_count * sizeof(*ast->nodes)) ||
+	    !cache_put(file, hash, &pos, h->at_offsets, ast->offsets,
+		       h->node_count * sizeof(*ast->offsets)) ||
+	    !cache_put(file, hash, &pos, h->at_numbers, ast->numbers,
+		       h->number_count * sizeof(*ast->numbers)) ||
+	    !cache_put(file, hash, &pos, h->at_lists, ast->lists,
+		       h->list_count * sizeof(*ast->lists)) ||
+	    !cache_put(file, hash, &pos, h->at_strings, ast->strings,
+		       h->string_bytes) ||
+	    !cache_put(file, hash, &pos, h->at_names, NULL, 0))
+		return 0;
+	for (j = 0; j < atoms->count; j++) {
+		name = intern_name(atoms, j);
+		if (!cache_put(file, hash, &pos, pos, name, strlen(name) + 1))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * ast_image_write() - Write the image of a tree to a stream.
+ */
+int ast_image_write(FILE *file, const uint8_t key[SHA256_BYTES],
+		    size_t length, const struct flat_ast *ast,
+		    const struct intern_table *atoms)
+{
+	struct ast_image_header h;
+	struct sha256 hash;
+
+	image_layout(&h, key, length, ast, atoms);
+
+	/* The header goes first, so digest the body before writing it. */
+	sha256_init(&hash);
+	image_body(NULL, &hash, &h, ast, atoms);
+	sha256_final(&hash, h.digest);
+
+	if (fwrite(&h, 1, sizeof(h), file) != sizeof(h))
+		return 0;
+	return image_body(file, NULL, &h, ast, atoms);
+}
+
+/**
+ * ast_cache_store() - Save a tree under the key of its source.
+ */
+int ast_cache_store(const char *dir, const uint8_t key[SHA256_BYTES],
+		    size_t length, const struct flat_ast *ast,
+		    const struct intern_table *atoms)
+{
+	char suffix[32];
+	char *final = NULL;
+	char *tmp = NULL;
+	FILE *file = NULL;
+	int ok = 0;
+
+	/* An entry bigger than the whole cache would evict itself. */
+	if (ast_image_size(ast, atoms) > AST_CACHE_MAX_BYTES)
+		return 0;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		goto err;
+
+	snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+	tmp   = cache_path(dir, key, suffix);
+	final = cache_path(dir, key, AST_IMAGE_SUFFIX);
+	if (!tmp || !final)
+		goto done;
+
+	file = fopen(tmp, "wb");
+	if (!file)
+		goto err;
+
+	if (!ast_image_write(file, key, length, ast, atoms))
+		goto err;
+
+	if (fclose(file)) {
+		file = NULL;
+		goto err;
+	}
+	file = NULL;
+
+	if (rename(tmp, final) < 0)
+		goto err;
+	ok = 1;
+
+	cache_evict(dir, AST_CACHE_MAX_BYTES);
+	goto done;
+
+err:
+	fprintf(stderr, "ast_cache: cannot write to '%s'\n", dir);
+	if (file)
+		fclose(file);
+	if (tmp)
+		remove(tmp);
+done:
+	free(tmp);
+	free(final);
+	return ok;
+}
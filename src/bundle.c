@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "bundle.h"
+#include "ast_cache.h"
+#include "sha256.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define BUNDLE_MAGIC		"PYBUNDL\n"
+
+/**
+ * struct bundle_trailer - Last bytes of a bundled executable.
+ * @payload:       File offset of the payload; a multiple of
+ *                 BUNDLE_ALIGN.
+ * @image_size:    Bytes of tree image at the start of the payload.
+ * @source_at:     Payload offset of the source text.
+ * @source_length: Bytes of source, which are followed by a NUL.
+ * @magic:         BUNDLE_MAGIC, last so a truncated file never has it.
+ */
+struct bundle_trailer {
+	uint64_t	 payload;
+	uint64_t	 image_size;
+	uint64_t	 source_at;
+	uint64_t	 source_length;
+	char		 magic[8];
+};
+
+/*
+ * bundle_trailer() - Read the trailer of the file open on @fd into @t,
+ *                    and its size into @size.  Returns 1 for a sound
+ *                    trailer, 0 for none and -1 for a damaged one.
+ */
+static int bundle_trailer(int fd, struct bundle_trailer *t, uint64_t *size)
+{
+	struct stat st;
+	uint64_t end;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	*size = (uint64_t)st.st_size;
+	if (*size < sizeof(*t) ||
+	    pread(fd, t, sizeof(*t), (off_t)(*size - sizeof(*t))) !=
+	    (ssize_t)sizeof(*t) ||
+	    memcmp(t->magic, BUNDLE_MAGIC, sizeof(t->magic)))
+		return 0;
+
+	end = *size - sizeof(*t);
+	if (t->payload % BUNDLE_ALIGN || t->payload > end ||
+	    t->source_at < t->image_size ||
+	    t->source_at > end - t->payload ||
+	    t->source_length >= end - t->payload - t->source_at ||
+	    t->payload + t->source_at + t->source_length + 1 != end)
+		return -1;
+	return 1;
+}
+
+/**
+ * bundle_open() - Find the program embedded in an executable.
+ */
+int bundle_open(const char *exe, struct intern_table *atoms,
+		struct bundle **bundle)
+{
+	struct bundle_trailer t;
+	struct bundle *b = NULL;
+	uint64_t size;
+	void *map;
+	int rc;
+	int fd;
+
+	fd = open(exe, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	rc = bundle_trailer(fd, &t, &size);
+	if (rc <= 0)
+		goto done;
+
+	rc  = -1;
+	map = mmap(NULL, (size_t)(size - sizeof(t) - t.payload), PROT_READ,
+		   MAP_PRIVATE, fd, (off_t)t.payload);
+	if (map == MAP_FAILED)
+		goto done;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		munmap(map, (size_t)(size - sizeof(t) - t.payload));
+		goto done;
+	}
+	b->map    = map;
+	b->size   = (size_t)(size - sizeof(t) - t.payload);
+	b->source = (const char *)map + t.source_at;
+	b->length = (size_t)t.source_length;
+
+	if (!ast_image_open(&b->ast, map, (size_t)t.image_size, NULL, 0,
+			    atoms))
+		goto done;
+
+	*bundle = b;
+	b  = NULL;
+	rc = 1;
+done:
+	if (rc < 0)
+		fprintf(stderr, "bundle: '%s' holds a damaged program\n",
+			exe);
+	bundle_close(b);
+	close(fd);
+	return rc;
+}
+
+/**
+ * bundle_close() - Unmap a bundle from bundle_open().
+ */
+void bundle_close(struct bundle *bundle)
+{
+	if (!bundle)
+		return;
+	munmap(bundle->map, bundle->size);
+	free(bundle);
+}
+
+/* bundle_copy() - Append the first @n bytes of @in to @out. */
+static int bundle_copy(FILE *out, FILE *in, uint64_t n)
+{
+	char buf[65536];
+	size_t chunk;
+
+	for (; n; n -= chunk) {
+		chunk = n < sizeof(buf) ? (size_t)n : sizeof(buf);
+		if (fread(buf, 1, chunk, in) != chunk ||
+		    fwrite(buf, 1, chunk, out) != chunk)
+			return 0;
+	}
+	return 1;
+}
+
+/* bundle_pad() - Append @n zero bytes to @out. */
+static int bundle_pad(FILE *out, uint64_t n)
+{
+	static const char zeros[4096];
+	size_t chunk;
+
+	for (; n; n -= chunk) {
+		chunk = n < sizeof(zeros) ? (size_t)n : sizeof(zeros);
+		if (fwrite(zeros, 1, chunk, out) != chunk)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * bundle_write() - Write a standalone executable that runs a program.
+ */
+int bundle_write(const char *out, const char *exe, const char *source,
+		 size_t length, const struct flat_ast *ast,
+		 const struct intern_table *atoms)
+{
+	struct bundle_trailer t;
+	uint8_t key[SHA256_BYTES];
+	FILE *file = NULL;
+	FILE *in;
+	long stub;
+	size_t len;
+	char *tmp;
+	int ok = 0;
+
+	in = fopen(exe, "rb");
+	if (!in) {
+		fprintf(stderr, "bundle: cannot read '%s'\n", exe);
+		return 0;
+	}
+
+	if (fseek(in, 0, SEEK_END) < 0 || (stub = ftell(in)) < 0 ||
+	    fseek(in, 0, SEEK_SET) < 0) {
+		fprintf(stderr, "bundle: cannot read '%s'\n", exe);
+		fclose(in);
+		return 0;
+	}
+
+	len = strlen(out);
+	tmp = malloc(len + 32);
+	if (!tmp) {
+		fprintf(stderr, "bundle: out of memory\n");
+		fclose(in);
+		return 0;
+	}
+	snprintf(tmp, len + 32, "%s.%ld.tmp", out, (long)getpid());
+
+	memset(&t, 0, sizeof(t));
+	memcpy(t.magic, BUNDLE_MAGIC, sizeof(t.magic));
+	t.payload       = ((uint64_t)stub + BUNDLE_ALIGN - 1) /
+			  BUNDLE_ALIGN * BUNDLE_ALIGN;
+	t.image_size    = ast_image_size(ast, atoms);
+	t.source_at     = t.image_size;
+	t.source_length = length;
+	sha256(source, length, key);
+
+	file = fopen(tmp, "wb");
+	if (!file)
+		goto err;
+
+	if (!bundle_copy(file, in, (uint64_t)stub) ||
+	    !bundle_pad(file, t.payload - (uint64_t)stub) ||
+	    !ast_image_write(file, key, length, ast, atoms) ||
+	    fwrite(source, 1, length, file) != length ||
+	    fputc('\0', file) == EOF ||
+	    fwrite(&t, sizeof(t), 1, file) != 1 ||
+	    fflush(file) || fchmod(fileno(file), 0755) < 0)
+		goto err;
+
+	if (fclose(file)) {
+		file = NULL;
+		goto err;
+	}
+	file = NULL;
+
+	if (rename(tmp, out) < 0)
+		goto err;
+	ok = 1;
+	goto done;
+
+err:
+	fprintf(stderr, "bundle: cannot write '%s'\n", out);
+	if (file)
+		fclose(file);
+	remove(tmp);
+done:
+	free(tmp);
+	fclose(in);
+	return ok;
+}
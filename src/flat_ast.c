@@ -0,0 +1,264 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "flat_ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Pools are placed at multiples of this inside the allocation. */
+#define FLAT_ALIGN	sizeof(double)
+
+/**
+ * struct flat_build - Sizes, then write cursors, of a flattening.
+ * @nodes:   Nodes counted / emitted so far.
+ * @numbers: Entries of the number pool.
+ * @lists:   Entries of the span pool.
+ * @strings: Bytes of the string pool.
+ * @ast:     Tree being written; NULL while counting.
+ */
+struct flat_build {
+	size_t			 nodes;
+	size_t			 numbers;
+	size_t			 lists;
+	size_t			 strings;
+	struct flat_ast		*ast;
+};
+
+/* flat_count() - Add the space @node's sub-tree needs to @b. */
+static void flat_count(struct flat_build *b, const struct ast_node *node)
+{
+	int j;
+
+	if (!node)
+		return;
+
+	b->nodes++;
+	switch (node->type) {
+	case AST_NUMBER:
+		b->numbers++;
+		break;
+	case AST_STRING:
+		b->strings += strlen(node->data.string.value) + 1;
+		break;
+	case AST_BINARY_OP:
+		flat_count(b, node->data.binary_op.left);
+		flat_count(b, node->data.binary_op.right);
+		break;
+	case AST_UNARY_OP:
+		flat_count(b, node->data.unary_op.operand);
+		break;
+	case AST_ASSIGNMENT:
+		flat_count(b, node->data.assignment.value);
+		break;
+	case AST_IF_STMT:
+		flat_count(b, node->data.if_stmt.condition);
+		flat_count(b, node->data.if_stmt.then_block);
+		flat_count(b, node->data.if_stmt.else_block);
+		break;
+	case AST_WHILE_STMT:
+		flat_count(b, node->data.while_stmt.condition);
+		flat_count(b, node->data.while_stmt.body);
+		break;
+	case AST_FUNCTION_DEF:
+		b->lists += node->data.function_def.param_count;
+		flat_count(b, node->data.function_def.body);
+		break;
+	case AST_FUNCTION_CALL:
+		b->lists += node->data.function_call.arg_count;
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			flat_count(b, node->data.function_call.arguments[j]);
+		break;
+	case AST_RETURN_STMT:
+		flat_count(b, node->data.return_stmt.value);
+		break;
+	case AST_PRINT_STMT:
+		flat_count(b, node->data.print_stmt.value);
+		break;
+	case AST_BLOCK:
+	case AST_PROGRAM:	/* same layout as a block */
+		b->lists += node->data.block.count;
+		for (j = 0; j < node->data.block.count; j++)
+			flat_count(b, node->data.block.statements[j]);
+		break;
+	case AST_IDENTIFIER:
+		break;
+	}
+}
+
+/* flat_span() - Reserve @count entries of the span pool. */
+static uint32_t flat_span(struct flat_build *b, int count)
+{
+	uint32_t start = (uint32_t)b->lists;
+
+	b->lists += count;
+	return start;
+}
+
+/*
+ * flat_emit() - Write @node's sub-tree in pre-order and return the
+ *               index of its root, or FLAT_NONE for a NULL @node.
+ */
+static uint32_t flat_emit(struct flat_build *b, const struct ast_node *node)
+{
+	struct flat_ast *ast = b->ast;
+	struct flat_node *f;
+	uint32_t at;
+	size_t len;
+	int j;
+
+	if (!node)
+		return FLAT_NONE;
+
+	at = (uint32_t)b->nodes++;
+	f  = &ast->nodes[at];
+	f->kind = (uint8_t)node->type;
+	f->a    = FLAT_NONE;
+	f->b    = FLAT_NONE;
+	f->c    = FLAT_NONE;
+	ast->offsets[at] = node->offset;
+
+	switch (node->type) {
+	case AST_NUMBER:
+		f->a = (uint32_t)b->numbers++;
+		ast->numbers[f->a] = node->data.number.value;
+		break;
+	case AST_STRING:
+		len  = strlen(node->data.string.value) + 1;
+		f->a = (uint32_t)b->strings;
+		memcpy(ast->strings + b->strings, node->data.string.value, len);
+		b->strings += len;
+		break;
+	case AST_IDENTIFIER:
+		f->a = node->data.identifier.name;
+		break;
+	case AST_BINARY_OP:
+		f->op = (uint8_t)node->data.binary_op.op;
+		f->a  = flat_emit(b, node->data.binary_op.left);
+		f->b  = flat_emit(b, node->data.binary_op.right);
+		break;
+	case AST_UNARY_OP:
+		f->op = (uint8_t)node->data.unary_op.op;
+		f->a  = flat_emit(b, node->data.unary_op.operand);
+		break;
+	case AST_ASSIGNMENT:
+		f->a = node->data.assignment.variable;
+		f->b = flat_emit(b, node->data.assignment.value);
+		break;
+	case AST_IF_STMT:
+		f->a = flat_emit(b, node->data.if_stmt.condition);
+		f->b = flat_emit(b, node->data.if_stmt.then_block);
+		f->c = flat_emit(b, node->data.if_stmt.else_block);
+		break;
+	case AST_WHILE_STMT:
+		f->a = flat_emit(b, node->data.while_stmt.condition);
+		f->b = flat_emit(b, node->data.while_stmt.body);
+		break;
+	case AST_FUNCTION_DEF:
+		f->a = node->data.function_def.name;
+		f->c = (uint32_t)node->data.function_def.param_count;
+		f->b = flat_span(b, node->data.function_def.param_count);
+		if (f->c)
+			memcpy(ast->lists + f->b,
+			       node->data.function_def.parameters,
+			       f->c * sizeof(*ast->lists));
+		/* The body must directly follow: it has no operand. */
+		flat_emit(b, node->data.function_def.body);
+		break;
+	case AST_FUNCTION_CALL:
+		f->a = node->data.function_call.function_name;
+		f->c = (uint32_t)node->data.function_call.arg_count;
+		f->b = flat_span(b, node->data.function_call.arg_count);
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			ast->lists[f->b + j] = flat_emit(
+				b, node->data.function_call.arguments[j]);
+		break;
+	case AST_RETURN_STMT:
+		f->a = flat_emit(b, node->data.return_stmt.value);
+		break;
+	case AST_PRINT_STMT:
+		f->a = flat_emit(b, node->data.print_stmt.value);
+		break;
+	case AST_BLOCK:
+	case AST_PROGRAM:	/* same layout as a block */
+		f->c = (uint32_t)node->data.block.count;
+		f->b = flat_span(b, node->data.block.count);
+		for (j = 0; j < node->data.block.count; j++)
+			ast->lists[f->b + j] = flat_emit(
+				b, node->data.block.statements[j]);
+		break;
+	}
+	return at;
+}
+
+/* flat_round() - Round @n up to a multiple of FLAT_ALIGN. */
+static size_t flat_round(size_t n)
+{
+	return (n + FLAT_ALIGN - 1) & ~(FLAT_ALIGN - 1);
+}
+
+/**
+ * flat_ast_build() - Flatten the tree under @root.
+ */
+struct flat_ast *flat_ast_build(const struct ast_node *root)
+{
+	struct flat_build b = { 0 };
+	struct flat_ast *ast;
+	size_t at_nodes;
+	size_t at_offsets;
+	size_t at_numbers;
+	size_t at_lists;
+	size_t at_strings;
+	size_t bytes;
+	char *mem;
+
+	if (!root)
+		return NULL;
+
+	flat_count(&b, root);
+
+	/* FLAT_NONE must stay free to mean "no child". */
+	if (b.nodes >= FLAT_NONE || b.lists >= FLAT_NONE ||
+	    b.numbers >= FLAT_NONE || b.strings >= FLAT_NONE) {
+		fprintf(stderr, "flat_ast: tree too large\n");
+		return NULL;
+	}
+
+	/* One block: header, then each pool at an aligned position. */
+	at_nodes   = flat_round(sizeof(*ast));
+	at_offsets = flat_round(at_nodes + b.nodes * sizeof(*ast->nodes));
+	at_numbers = flat_round(at_offsets + b.nodes * sizeof(*ast->offsets));
+	at_lists   = flat_round(at_numbers + b.numbers * sizeof(*ast->numbers));
+	at_strings = flat_round(at_lists + b.lists * sizeof(*ast->lists));
+	bytes      = at_strings + b.strings;
+
+	mem = calloc(1, bytes);
+	if (!mem) {
+		fprintf(stderr, "flat_ast: out of memory\n");
+		return NULL;
+	}
+
+	ast = (struct flat_ast *)mem;
+	ast->nodes        = (struct flat_node *)(mem + at_nodes);
+	ast->offsets      = (size_t *)(mem + at_offsets);
+	ast->numbers      = (double *)(mem + at_numbers);
+	ast->lists        = (uint32_t *)(mem + at_lists);
+	ast->strings      = mem + at_strings;
+	ast->node_count   = (uint32_t)b.nodes;
+	ast->number_count = (uint32_t)b.numbers;
+	ast->list_count   = (uint32_t)b.lists;
+	ast->string_bytes = (uint32_t)b.strings;
+	ast->bytes        = bytes;
+
+	memset(&b, 0, sizeof(b));
+	b.ast = ast;
+	flat_emit(&b, root);
+	return ast;
+}
+
+/**
+ * flat_ast_destroy() - Free a flat tree.
+ */
+void flat_ast_destroy(struct flat_ast *ast)
+{
+	free(ast);
+}
@@ -0,0 +1,372 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "hashcons.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Slots allocated for the first constant; the table doubles from here. */
+#define HASHCONS_MIN_SLOTS	64
+
+/* hashcons_mix() - Finish a 64-bit key into a well-spread hash. */
+static uint32_t hashcons_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
+/* hashcons_bytes() - Hash @len bytes of string, eight at a time. */
+static uint64_t hashcons_bytes(const char *s, size_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+	uint64_t w;
+
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&w, s, 8);
+		h  = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, s, len);
+	return (h ^ w) * 0xFF51AFD7ED558CCDull;
+}
+
+/* hashcons_hash() - Hash of the constant @key stands for. */
+static uint32_t hashcons_hash(const struct ast_node *key, size_t length)
+{
+	uint64_t h = 0;
+
+	switch (key->type) {
+	case AST_NUMBER:
+		memcpy(&h, &key->data.number.value, sizeof(h));
+		break;
+	case AST_STRING:
+		h = hashcons_bytes(key->data.string.value, length);
+		break;
+	case AST_UNARY_OP:
+		h = (uintptr_t)key->data.unary_op.operand * 31 +
+		    key->data.unary_op.op;
+		break;
+	case AST_BINARY_OP:
+		h = ((uintptr_t)key->data.binary_op.left * 31 +
+		     (uintptr_t)key->data.binary_op.right) * 31 +
+		    key->data.binary_op.op;
+		break;
+	default:
+		break;
+	}
+	return hashcons_mix(h ^ ((uint64_t)key->type << 59));
+}
+
+/*
+ * hashcons_same() - Whether @node is the constant @key stands for.
+ *                   A key string is @length bytes and not terminated.
+ */
+static int hashcons_same(const struct ast_node *node,
+			 const struct ast_node *key, size_t length)
+{
+	if (node->type != key->type)
+		return 0;
+
+	switch (key->type) {
+	case AST_NUMBER:
+		return !memcmp(&node->data.number.value,
+			       &key->data.number.value,
+			       sizeof(key->data.number.value));
+	case AST_STRING:
+		return !strncmp(node->data.string.value,
+				key->data.string.value, length) &&
+		       node->data.string.value[length] == '\0';
+	case AST_UNARY_OP:
+		return node->data.unary_op.op == key->data.unary_op.op &&
+		       node->data.unary_op.operand ==
+		       key->data.unary_op.operand;
+	case AST_BINARY_OP:
+		return node->data.binary_op.op == key->data.binary_op.op &&
+		       node->data.binary_op.left ==
+		       key->data.binary_op.left &&
+		       node->data.binary_op.right ==
+		       key->data.binary_op.right;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * hashcons_reset() - Forget every constant, keeping the slots.
+ */
+void hashcons_reset(struct hashcons *hc)
+{
+	if (hc->slots)
+		memset(hc->slots, 0, sizeof(*hc->slots) * (hc->mask + 1));
+	hc->count = 0;
+	hc->arena = NULL;
+}
+
+/**
+ * hashcons_release() - Free the table's slots; the nodes stay.
+ */
+void hashcons_release(struct hashcons *hc)
+{
+	free(hc->slots);
+	memset(hc, 0, sizeof(*hc));
+}
+
+/* hashcons_bind() - Start over if the tree moved to another arena. */
+static void hashcons_bind(struct hashcons *hc, struct arena *arena)
+{
+	if (hc->arena == arena)
+		return;
+	hashcons_reset(hc);
+	hc->arena = arena;
+}
+
+/* hashcons_find() - The shared node equal to @key, or NULL. */
+static struct ast_node *hashcons_find(const struct hashcons *hc,
+				      const struct ast_node *key,
+				      size_t length, uint32_t hash)
+{
+	const struct hashcons_slot *slot;
+	uint32_t j;
+
+	if (!hc->slots)
+		return NULL;
+
+	for (j = hash & hc->mask; ; j = (j + 1) & hc->mask) {
+		slot = &hc->slots[j];
+		if (!slot->node)
+			return NULL;
+		if (slot->hash == hash &&
+		    hashcons_same(slot->node, key, length))
+			return slot->node;
+	}
+}
+
+/* hashcons_grow() - Double the slots, or allocate the first ones. */
+static int hashcons_grow(struct hashcons *hc)
+{
+	struct hashcons_slot *slots;
+	uint32_t size = hc->slots ? (hc->mask + 1) * 2 : HASHCONS_MIN_SLOTS;
+	uint32_t j;
+	uint32_t k;
+
+	slots = calloc(size, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "hashcons: out of memory\n");
+		return 0;
+	}
+
+	for (j = 0; hc->slots && j <= hc->mask; j++) {
+		if (!hc->slots[j].node)
+			continue;
+		for (k = hc->slots[j].hash & (size - 1); slots[k].node;
+		     k = (k + 1) & (size - 1))
+			;
+		slots[k] = hc->slots[j];
+	}
+
+	free(hc->slots);
+	hc->slots = slots;
+	hc->mask  = size - 1;
+	return 1;
+}
+
+/*
+ * hashcons_add() - Remember @node as the constant of its value.  A full
+ *                  table that cannot grow only loses sharing, so @node
+ *                  is returned either way.
+ */
+static struct ast_node *hashcons_add(struct hashcons *hc,
+				     struct ast_node *node, uint32_t hash)
+{
+	uint32_t j;
+
+	if (!hc->slots || (hc->count + 1) * 2 > hc->mask + 1)
+		if (!hashcons_grow(hc))
+			return node;
+
+	for (j = hash & hc->mask; hc->slots[j].node; j = (j + 1) & hc->mask)
+		;
+	hc->slots[j].node = node;
+	hc->slots[j].hash = hash;
+	hc->count++;
+	return node;
+}
+
+/**
+ * hashcons_number() - Return the number literal @value in @arena.
+ */
+struct ast_node *hashcons_number(struct hashcons *hc, struct arena *arena,
+				 double value, size_t offset)
+{
+	struct ast_node key;
+	struct ast_node *node;
+	uint32_t hash;
+
+	hashcons_bind(hc, arena);
+	memset(&key, 0, sizeof(key));
+	key.type              = AST_NUMBER;
+	key.data.number.value = value;
+	hash = hashcons_hash(&key, 0);
+	node = hashcons_find(hc, &key, 0, hash);
+	if (node)
+		return node;
+
+	node = ast_create_number(arena, value, offset);
+	if (!node)
+		return NULL;
+	node->shared = AST_SHARED_NUMBER;
+	return hashcons_add(hc, node, hash);
+}
+
+/**
+ * hashcons_string() - Return the string literal @value in @arena.
+ */
+struct ast_node *hashcons_string(struct hashcons *hc, struct arena *arena,
+				 const char *value, int length,
+				 size_t offset)
+{
+	struct ast_node key;
+	struct ast_node *node;
+	uint32_t hash;
+	size_t len;
+
+	if (!value || length < 0)
+		return NULL;
+
+	/* Strings run as C strings: an embedded NUL ends the value. */
+	len = strnlen(value, (size_t)length);
+
+	hashcons_bind(hc, arena);
+	memset(&key, 0, sizeof(key));
+	key.type              = AST_STRING;
+	key.data.string.value = (char *)value;
+	hash = hashcons_hash(&key, len);
+	node = hashcons_find(hc, &key, len, hash);
+	if (node)
+		return node;
+
+	node = ast_create_string(arena, value, (int)len, offset);
+	if (!node)
+		return NULL;
+	node->shared = AST_SHARED_STRING;
+	return hashcons_add(hc, node, hash);
+}
+
+/**
+ * hashcons_unary() - Build, or find, a unary expression.
+ */
+struct ast_node *hashcons_unary(struct hashcons *hc, struct arena *arena,
+				enum token_type op, struct ast_node *operand,
+				size_t offset)
+{
+	struct ast_node key;
+	struct ast_node *node = NULL;
+	uint32_t hash = 0;
+	int shared;
+
+	if (!operand)
+		return NULL;
+
+	shared = operand->shared == AST_SHARED_NUMBER &&
+		 (op == TOKEN_PLUS || op == TOKEN_MINUS);
+	if (shared) {
+		hashcons_bind(hc, arena);
+		memset(&key, 0, sizeof(key));
+		key.type                  = AST_UNARY_OP;
+		key.data.unary_op.op      = op;
+		key.data.unary_op.operand = operand;
+		hash = hashcons_hash(&key, 0);
+		node = hashcons_find(hc, &key, 0, hash);
+		if (node)
+			return node;
+	}
+
+	node = ast_create_node(arena, AST_UNARY_OP, offset);
+	if (!node)
+		return NULL;
+	node->data.unary_op.op      = op;
+	node->data.unary_op.operand = operand;
+	if (!shared)
+		return node;
+	node->shared = AST_SHARED_NUMBER;
+	return hashcons_add(hc, node, hash);
+}
+
+/*
+ * hashcons_kind() - What @left @op @right evaluates to if it is a
+ *                   constant that cannot fail, else AST_UNSHARED.
+ */
+static enum ast_shared hashcons_kind(const struct ast_node *left,
+				     enum token_type op,
+				     const struct ast_node *right)
+{
+	if (left->shared == AST_SHARED_STRING &&
+	    right->shared == AST_SHARED_STRING)
+		return op == TOKEN_PLUS ? AST_SHARED_STRING : AST_UNSHARED;
+
+	if (left->shared != AST_SHARED_NUMBER ||
+	    right->shared != AST_SHARED_NUMBER)
+		return AST_UNSHARED;
+
+	switch (op) {
+	case TOKEN_DIVIDE:
+		if (right->type != AST_NUMBER ||
+		    right->data.number.value == 0.0)
+			return AST_UNSHARED;
+		return AST_SHARED_NUMBER;
+	case TOKEN_PLUS:
+	case TOKEN_MINUS:
+	case TOKEN_MULTIPLY:
+	case TOKEN_EQUAL:
+	case TOKEN_NOT_EQUAL:
+	case TOKEN_LESS:
+	case TOKEN_GREATER:
+	case TOKEN_LESS_EQUAL:
+	case TOKEN_GREATER_EQUAL:
+		return AST_SHARED_NUMBER;
+	default:
+		return AST_UNSHARED;
+	}
+}
+
+/**
+ * hashcons_binary() - Build, or find, a binary expression.
+ */
+struct ast_node *hashcons_binary(struct hashcons *hc, struct arena *arena,
+				 struct ast_node *left, enum token_type op,
+				 struct ast_node *right, size_t offset)
+{
+	struct ast_node key;
+	struct ast_node *node;
+	enum ast_shared kind;
+	uint32_t hash;
+
+	if (!left || !right)
+		return NULL;
+
+	kind = hashcons_kind(left, op, right);
+	if (kind == AST_UNSHARED)
+		return ast_create_binary_op(arena, left, op, right, offset);
+
+	hashcons_bind(hc, arena);
+	memset(&key, 0, sizeof(key));
+	key.type                 = AST_BINARY_OP;
+	key.data.binary_op.left  = left;
+	key.data.binary_op.op    = op;
+	key.data.binary_op.right = right;
+	hash = hashcons_hash(&key, 0);
+	node = hashcons_find(hc, &key, 0, hash);
+	if (node)
+		return node;
+
+	node = ast_create_binary_op(arena, left, op, right, offset);
+	if (!node)
+		return NULL;
+	node->shared = (uint8_t)kind;
+	return hashcons_add(hc, node, hash);
+}
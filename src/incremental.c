@@ -0,0 +1,468 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "incremental.h"
+#include "parser.h"
+#include "scan.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STMT_INIT_CAP	64
+
+/* Longest source a session holds: offsets and @capacity are ints. */
+#define INCR_LENGTH_MAX	(INT_MAX - 1)
+
+/* --- Statement table ----------------------------------------------------- */
+
+/* incr_arena_create() - Start the arena for one update's trees. */
+static struct incr_arena *incr_arena_create(void)
+{
+	struct incr_arena *mem;
+
+	mem = calloc(1, sizeof(*mem));
+	if (!mem)
+		return NULL;
+	mem->arena = arena_create();
+	if (!mem->arena) {
+		free(mem);
+		return NULL;
+	}
+	return mem;
+}
+
+/* incr_arena_put() - Release @mem once no statement uses it. */
+static void incr_arena_put(struct incr_arena *mem)
+{
+	if (!mem || mem->live)
+		return;
+	arena_destroy(mem->arena);
+	free(mem);
+}
+
+/* free_stmts() - Drop the trees of stmts[from, to). */
+static void free_stmts(struct incr_stmt *stmts, int from, int to)
+{
+	int j;
+
+	for (j = from; j < to; j++) {
+		stmts[j].mem->live--;
+		incr_arena_put(stmts[j].mem);
+	}
+}
+
+/* reserve_stmts() - Make room for @need entries in @s->stmts. */
+static int reserve_stmts(struct incremental *s, int need)
+{
+	struct incr_stmt *grown;
+	int cap = s->stmt_capacity ? s->stmt_capacity : STMT_INIT_CAP;
+
+	if (need <= s->stmt_capacity)
+		return 1;
+	while (cap < need)
+		cap *= 2;
+
+	grown = realloc(s->stmts, sizeof(*grown) * cap);
+	if (!grown)
+		return 0;
+	s->stmts         = grown;
+	s->stmt_capacity = cap;
+	return 1;
+}
+
+/* append_entry() - Push @e onto a growable entry list. */
+static int append_entry(struct incr_stmt **list, int *count, int *cap,
+			struct incr_stmt e)
+{
+	struct incr_stmt *grown;
+	int new_cap;
+
+	if (*count >= *cap) {
+		new_cap = *cap ? *cap * 2 : STMT_INIT_CAP;
+		grown   = realloc(*list, sizeof(*grown) * new_cap);
+		if (!grown)
+			return 0;
+		*list = grown;
+		*cap  = new_cap;
+	}
+
+	(*list)[(*count)++] = e;
+	return 1;
+}
+
+/* last_at_or_before() - Index of the last statement at or before @offset. */
+static int last_at_or_before(const struct incremental *s, int offset)
+{
+	int lo = 0;
+	int hi = s->count;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->stmts[mid].offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* find_resumable() - Index of the resumable statement at @offset, or -1. */
+static int find_resumable(const struct incremental *s, int from, int offset)
+{
+	int k = last_at_or_before(s, offset);
+
+	if (k < from || s->stmts[k].offset != offset ||
+	    !s->stmts[k].resumable)
+		return -1;
+	return k;
+}
+
+/*
+ * opens_line() - True if @tok is the first thing on its line, so a
+ *                fresh lexer started at the line would see the same
+ *                tokens from here on.
+ */
+static int opens_line(const struct incremental *s, const struct token *tok)
+{
+	if (tok->type == TOKEN_INDENT || tok->type == TOKEN_DEDENT ||
+	    tok->type == TOKEN_NEWLINE || tok->type == TOKEN_EOF)
+		return 0;
+	return tok->offset == 0 || s->text[tok->offset - 1] == '\n';
+}
+
+/* --- Re-parsing ---------------------------------------------------------- */
+
+/* invalidate() - Drop every tree after a failed update. */
+static void invalidate(struct incremental *s)
+{
+	free_stmts(s->stmts, 0, s->count);
+	s->count = 0;
+	s->valid = 0;
+}
+
+/*
+ * splice() - Replace stmts[first, reuse) with @fresh and shift the
+ *            kept tail by @delta bytes.
+ */
+static int splice(struct incremental *s, int first, int reuse,
+		  struct incr_stmt *fresh, int nfresh, int delta)
+{
+	int tail = s->count - reuse;
+	int j;
+
+	if (!reserve_stmts(s, first + nfresh + tail))
+		return 0;
+
+	free_stmts(s->stmts, first, reuse);
+	memmove(s->stmts + first + nfresh, s->stmts + reuse,
+		sizeof(*s->stmts) * tail);
+	if (nfresh)
+		memcpy(s->stmts + first, fresh, sizeof(*fresh) * nfresh);
+
+	for (j = first + nfresh; j < first + nfresh + tail; j++)
+		s->stmts[j].offset += delta;
+
+	s->count = first + nfresh + tail;
+	return 1;
+}
+
+/*
+ * reparse() - Lex and parse from statement @j (or the top of the file
+ *             when @j is -1) until a statement at or past @edit_end
+ *             matches an old one @delta bytes earlier.
+ */
+static int reparse(struct incremental *s, int j, int edit_end, int delta)
+{
+	struct incr_stmt *fresh = NULL;
+	struct incr_arena *mem;
+	const struct token *tok;
+	struct parser *p = NULL;
+	struct incr_stmt e;
+	int first  = j < 0 ? 0 : j;
+	int offset = j < 0 ? 0 : s->stmts[j].offset;
+	int reuse  = s->count;
+	int nfresh = 0;
+	int cap    = 0;
+	int k;
+
+	mem = incr_arena_create();
+	if (!mem) {
+		fprintf(stderr, "incremental: out of memory\n");
+		goto err;
+	}
+
+	lexer_reset(s->lexer, s->text, s->length, offset);
+	p = parser_create_stream(s->lexer, mem->arena);
+	if (!p)
+		goto err;
+
+	for (;;) {
+		tok = parser_current(p);
+		if (tok->type == TOKEN_EOF)
+			break;
+
+		e.offset     = tok->offset;
+		e.ast_offset = tok->offset;
+		e.resumable  = opens_line(s, tok);
+
+		/* Past the edit: stop once we are back in step. */
+		if (e.resumable && e.offset >= edit_end) {
+			k = find_resumable(s, first, e.offset - delta);
+			if (k >= 0) {
+				reuse = k;
+				break;
+			}
+		}
+
+		e.node = parser_parse_toplevel(p);
+		e.mem  = mem;
+		if (p->error)
+			goto err;
+		if (!e.node)
+			continue;
+
+		if (!append_entry(&fresh, &nfresh, &cap, e)) {
+			fprintf(stderr, "incremental: out of memory\n");
+			goto err;
+		}
+		mem->live++;
+	}
+
+	if (p->error)
+		goto err;
+
+	s->stats.relexed  = s->lexer->position - offset;
+	s->stats.reparsed = nfresh;
+	s->stats.reused   = first + (s->count - reuse);
+
+	if (!splice(s, first, reuse, fresh, nfresh, delta)) {
+		fprintf(stderr, "incremental: out of memory\n");
+		goto err;
+	}
+
+	parser_destroy(p);
+	free(fresh);
+	incr_arena_put(mem);
+	s->valid = 1;
+	return 0;
+
+err:
+	parser_destroy(p);
+	free_stmts(fresh, 0, nfresh);
+	if (!nfresh)
+		incr_arena_put(mem);
+	free(fresh);
+	invalidate(s);
+	return -1;
+}
+
+/*
+ * resume_index() - Pick the statement to restart from for an edit at
+ *                  @start, or -1 to start from the top of the file.
+ *
+ * The statement holding @start is re-parsed, and so is the one before
+ * it when the edit touches the first line: that line's first token is
+ * what tells the previous statement where it ends (an indent extends
+ * its block, an 'else' joins its 'if').
+ */
+static int resume_index(const struct incremental *s, int start)
+{
+	const char *nl;
+	int k;
+
+	if (!s->valid)
+		return -1;
+
+	k = last_at_or_before(s, start);
+	if (k >= 0) {
+		nl = memchr(s->text + s->stmts[k].offset, '\n',
+			    s->length - s->stmts[k].offset);
+		if (!nl || start <= nl - s->text)
+			k--;
+	}
+
+	while (k >= 0 && !s->stmts[k].resumable)
+		k--;
+	return k;
+}
+
+/* replace_text() - Splice @len bytes of @text over [@start, @end). */
+static int replace_text(struct incremental *s, int start, int end,
+			const char *text, int len)
+{
+	int new_len = s->length - (end - start) + len;
+	int cap = s->capacity;
+	char *grown;
+
+	if (new_len + 1 > cap) {
+		while (new_len + 1 > cap)
+			cap = cap > INT_MAX / 2 ? INT_MAX : cap * 2;
+		grown = realloc(s->text, cap);
+		if (!grown)
+			return 0;
+		s->text     = grown;
+		s->capacity = cap;
+	}
+
+	memmove(s->text + start + len, s->text + end,
+		s->length - end + 1);
+	if (len)
+		memcpy(s->text + start, text, len);
+	s->length = new_len;
+	return 1;
+}
+
+/*
+ * valid_utf8() - Check [@from, @to) widened to whole UTF-8 sequences.
+ *
+ * After an edit only the sequences crossing the splice can have been
+ * broken, so a session that was valid before re-checks just those.
+ */
+static int valid_utf8(const struct incremental *s, int from, int to)
+{
+	int ascii;
+
+	while (from > 0 && ((unsigned char)s->text[from] & 0xC0) == 0x80)
+		from--;
+	while (to < s->length && ((unsigned char)s->text[to] & 0xC0) == 0x80)
+		to++;
+	if (scan_utf8(s->text + from, to - from, &ascii) == (size_t)(to - from))
+		return 1;
+
+	fprintf(stderr, "incremental: source is not valid UTF-8\n");
+	return 0;
+}
+
+/* --- Public API ---------------------------------------------------------- */
+
+/**
+ * incremental_create() - Start an edit session and parse @source.
+ */
+struct incremental *incremental_create(const char *source)
+{
+	struct incremental *s;
+	size_t len;
+
+	if (!source)
+		return NULL;
+
+	len = strlen(source);
+	if (len > INCR_LENGTH_MAX) {
+		fprintf(stderr, "incremental: source too large\n");
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		goto err;
+
+	s->length   = (int)len;
+	s->capacity = (int)len + 1;
+	s->text     = malloc(s->capacity);
+	s->atoms    = intern_create();
+	s->program.type = AST_PROGRAM;
+	if (!s->text || !s->atoms)
+		goto err_session;
+	memcpy(s->text, source, len + 1);
+
+	s->lexer = lexer_create(s->text, s->atoms);
+	if (!s->lexer)
+		goto err_session;
+
+	if (valid_utf8(s, 0, s->length))
+		reparse(s, -1, 0, 0);
+	return s;
+
+err_session:
+	incremental_destroy(s);
+err:
+	fprintf(stderr, "incremental: out of memory\n");
+	return NULL;
+}
+
+/**
+ * incremental_destroy() - Free a session and every tree it owns.
+ */
+void incremental_destroy(struct incremental *s)
+{
+	if (!s)
+		return;
+
+	free_stmts(s->stmts, 0, s->count);
+	free(s->stmts);
+	free(s->program.data.program.statements);
+	lexer_destroy(s->lexer);
+	intern_destroy(s->atoms);
+	free(s->text);
+	free(s);
+}
+
+/**
+ * incremental_edit() - Replace a byte range and bring the AST up to date.
+ */
+int incremental_edit(struct incremental *s, int start, int end,
+		     const char *text, int len)
+{
+	int j;
+
+	if (!s || start < 0 || end < start || end > s->length ||
+	    len < 0 || (len && !text))
+		return -1;
+	if (len > INCR_LENGTH_MAX - (s->length - (end - start))) {
+		fprintf(stderr, "incremental: source too large\n");
+		return -1;
+	}
+
+	j = resume_index(s, start);
+
+	if (!replace_text(s, start, end, text, len)) {
+		fprintf(stderr, "incremental: out of memory\n");
+		invalidate(s);
+		return -1;
+	}
+
+	if (s->valid ? !valid_utf8(s, start, start + len) :
+		       !valid_utf8(s, 0, s->length)) {
+		invalidate(s);
+		return -1;
+	}
+
+	return reparse(s, j, start + len, len - (end - start));
+}
+
+/**
+ * incremental_program() - Return the up-to-date program tree.
+ */
+struct ast_node *incremental_program(struct incremental *s)
+{
+	struct ast_node **list;
+	struct incr_stmt *e;
+	int j;
+
+	if (!s || !s->valid)
+		return NULL;
+
+	if (s->count > s->program_cap) {
+		list = realloc(s->program.data.program.statements,
+			       sizeof(*list) * s->count);
+		if (!list) {
+			fprintf(stderr, "incremental: out of memory\n");
+			return NULL;
+		}
+		s->program.data.program.statements = list;
+		s->program_cap                     = s->count;
+	}
+
+	for (j = 0; j < s->count; j++) {
+		e = &s->stmts[j];
+		if (e->ast_offset != e->offset) {
+			ast_shift_offsets(e->node, e->offset - e->ast_offset);
+			e->ast_offset = e->offset;
+		}
+		s->program.data.program.statements[j] = e->node;
+	}
+
+	s->program.data.program.count = s->count;
+	return &s->program;
+}
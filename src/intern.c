@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_INIT_SLOTS	256
+#define INTERN_INIT_NAMES	128
+#define INTERN_INIT_CHARS	4096
+
+/*
+ * hash_name() - Word-at-a-time multiplicative hash.
+ *
+ * Identifiers are short, so this mixes eight bytes per step and folds
+ * the tail in one go rather than looping per byte like FNV would.
+ */
+static uint32_t hash_name(const char *s, size_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+	uint64_t w;
+
+	while (len >= 8) {
+		memcpy(&w, s, 8);
+		h  = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+		s   += 8;
+		len -= 8;
+	}
+
+	w = 0;
+	memcpy(&w, s, len);
+	h  = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 29;
+	return (uint32_t)h;
+}
+
+/**
+ * intern_create() - Allocate an empty intern table.
+ */
+struct intern_table *intern_create(void)
+{
+	struct intern_table *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		goto err;
+
+	t->slots   = calloc(INTERN_INIT_SLOTS, sizeof(*t->slots));
+	t->entries = malloc(sizeof(*t->entries) * INTERN_INIT_NAMES);
+	t->chars   = malloc(INTERN_INIT_CHARS);
+	if (!t->slots || !t->entries || !t->chars) {
+		intern_destroy(t);
+		goto err;
+	}
+
+	t->slot_mask = INTERN_INIT_SLOTS - 1;
+	t->capacity  = INTERN_INIT_NAMES;
+	t->chars_cap = INTERN_INIT_CHARS;
+	return t;
+
+err:
+	fprintf(stderr, "intern: out of memory\n");
+	return NULL;
+}
+
+/**
+ * intern_destroy() - Free a table and every name in it.
+ */
+void intern_destroy(struct intern_table *t)
+{
+	if (!t)
+		return;
+	free(t->slots);
+	free(t->entries);
+	free(t->chars);
+	free(t);
+}
+
+/* grow_slots() - Double the slot array and re-seat every atom. */
+static int grow_slots(struct intern_table *t)
+{
+	uint32_t new_mask = t->slot_mask * 2 + 1;
+	uint32_t *slots;
+	uint32_t atom;
+	uint32_t i;
+
+	slots = calloc((size_t)new_mask + 1, sizeof(*slots));
+	if (!slots)
+		return 0;
+
+	for (atom = 0; atom < t->count; atom++) {
+		i = t->entries[atom].hash & new_mask;
+		while (slots[i])
+			i = (i + 1) & new_mask;
+		slots[i] = atom + 1;
+	}
+
+	free(t->slots);
+	t->slots     = slots;
+	t->slot_mask = new_mask;
+	return 1;
+}
+
+/* add_name() - Append a new name; returns its atom or ATOM_INVALID. */
+static uint32_t add_name(struct intern_table *t, const char *name,
+			 size_t len, uint32_t hash)
+{
+	struct intern_entry *entries;
+	char *chars;
+	size_t cap;
+
+	if (t->count >= t->capacity) {
+		entries = realloc(t->entries,
+				  sizeof(*entries) * t->capacity * 2);
+		if (!entries)
+			return ATOM_INVALID;
+		t->entries   = entries;
+		t->capacity *= 2;
+	}
+
+	if (t->chars_len + len + 1 > t->chars_cap) {
+		cap = t->chars_cap * 2;
+		while (t->chars_len + len + 1 > cap)
+			cap *= 2;
+		chars = realloc(t->chars, cap);
+		if (!chars)
+			return ATOM_INVALID;
+		t->chars     = chars;
+		t->chars_cap = cap;
+	}
+
+	memcpy(t->chars + t->chars_len, name, len);
+	t->chars[t->chars_len + len] = '\0';
+
+	t->entries[t->count].offset = (uint32_t)t->chars_len;
+	t->entries[t->count].length = (uint32_t)len;
+	t->entries[t->count].hash   = hash;
+	t->chars_len += len + 1;
+	return t->count++;
+}
+
+/**
+ * intern() - Return the atom for a name, adding it on first sight.
+ */
+uint32_t intern(struct intern_table *t, const char *name, size_t len)
+{
+	const struct intern_entry *e;
+	uint32_t hash;
+	uint32_t atom;
+	uint32_t i;
+
+	if (!t || !name)
+		return ATOM_INVALID;
+
+	hash = hash_name(name, len);
+	i    = hash & t->slot_mask;
+
+	while (t->slots[i]) {
+		e = &t->entries[t->slots[i] - 1];
+		if (e->hash == hash && e->length == len &&
+		    !memcmp(t->chars + e->offset, name, len))
+			return t->slots[i] - 1;
+		i = (i + 1) & t->slot_mask;
+	}
+
+	/* Keep the load factor at or below one half. */
+	if ((t->count + 1) * 2 > t->slot_mask + 1) {
+		if (!grow_slots(t))
+			goto oom;
+		i = hash & t->slot_mask;
+		while (t->slots[i])
+			i = (i + 1) & t->slot_mask;
+	}
+
+	atom = add_name(t, name, len, hash);
+	if (atom == ATOM_INVALID)
+		goto oom;
+	t->slots[i] = atom + 1;
+	return atom;
+
+oom:
+	fprintf(stderr, "intern: out of memory\n");
+	return ATOM_INVALID;
+}
+
+/**
+ * intern_name() - Return the NUL-terminated text of an atom.
+ */
+const char *intern_name(const struct intern_table *t, uint32_t atom)
+{
+	if (!t || atom >= t->count)
+		return "?";
+	return t->chars + t->entries[atom].offset;
+}
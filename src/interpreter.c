@@ -38,16 +38,27 @@ static struct value val_string(const char *s)
 	return v;
 }
 
+/*
+ * node_line() - Source line of @node for a runtime error.  Nodes carry
+ *               only an offset; the table behind it is built on demand.
+ */
+static int node_line(struct interpreter *interp, const struct ast_node *node)
+{
+	return line_index_line(interp->lines, node->offset);
+}
+
 /* --- Arithmetic ---------------------------------------------------------- */
 
 /*
  * number_op() - Apply a binary operator to two doubles.
  *
  * Extracted so eval_binary_op stays flat — no nesting inside a switch
- * inside an if inside a function.
+ * inside an if inside a function.  Takes the operator and offset, not
+ * a node, so the flat walker can share it.
  */
-static struct value number_op(enum token_type op,
-			      double l, double r, int line)
+static struct value number_op(struct interpreter *interp,
+			      enum token_type op, size_t offset,
+			      double l, double r)
 {
 	switch (op) {
 	case TOKEN_PLUS: return val_number(l + r);
@@ -55,9 +66,11 @@ static struct value number_op(enum token_type op,
 	case TOKEN_MULTIPLY: return val_number(l * r);
 	case TOKEN_DIVIDE:
 		if (r == 0.0) {
+			interp->errors++;
 			fprintf(stderr,
 				"runtime error: division by zero "
-				"at line %d\n", line);
+				"at line %d\n",
+				line_index_line(interp->lines, offset));
 			return val_none();
 		}
 		return val_number(l / r);
@@ -68,9 +81,10 @@ static struct value number_op(enum token_type op,
 	case TOKEN_LESS_EQUAL: return val_number(l <= r);
 	case TOKEN_GREATER_EQUAL: return val_number(l >= r);
 	default:
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: unknown operator "
-			"at line %d\n", line);
+			"at line %d\n", line_index_line(interp->lines, offset));
 		return val_none();
 	}
 }
@@ -101,10 +115,9 @@ static struct value eval_binary_op(struct interpreter *interp,
 	right = interpreter_evaluate(interp, node->data.binary_op.right);
 
 	if (left.type == VALUE_NUMBER && right.type == VALUE_NUMBER)
-		return number_op(node->data.binary_op.op,
-				 left.data.number,
-				 right.data.number,
-				 node->line_number);
+		return number_op(interp, node->data.binary_op.op,
+				 node->offset, left.data.number,
+				 right.data.number);
 
 	if (left.type  == VALUE_STRING  &&
 	    right.type == VALUE_STRING  &&
@@ -112,8 +125,9 @@ static struct value eval_binary_op(struct interpreter *interp,
 		return string_concat(left.data.string,
 				     right.data.string);
 
+	interp->errors++;
 	fprintf(stderr, "runtime error: type mismatch at line %d\n",
-		node->line_number);
+		node_line(interp, node));
 	return val_none();
 }
 
@@ -126,9 +140,10 @@ static struct value eval_unary_op(struct interpreter *interp,
 				       node->data.unary_op.operand);
 
 	if (operand.type != VALUE_NUMBER) {
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: unary op on non-number "
-			"at line %d\n", node->line_number);
+			"at line %d\n", node_line(interp, node));
 		return val_none();
 	}
 
@@ -136,9 +151,10 @@ static struct value eval_unary_op(struct interpreter *interp,
 	case TOKEN_MINUS:	return val_number(-operand.data.number);
 	case TOKEN_PLUS:	return val_number(+operand.data.number);
 	default:
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: unknown unary op "
-			"at line %d\n", node->line_number);
+			"at line %d\n", node_line(interp, node));
 		return val_none();
 	}
 }
@@ -146,20 +162,17 @@ static struct value eval_unary_op(struct interpreter *interp,
 /* --- Function calls ------------------------------------------------------ */
 
 /*
- * bind_args() - Evaluate call arguments in caller scope then bind
- *               them into func_scope.
+ * eval_args() - Evaluate call arguments in caller scope into @values.
+ *               Returns how many there are, at most MAX_ARGS.
  *
- * Must happen before the scope switch so argument expressions resolve
- * against the caller's names, not the empty function scope.
+ * Must happen before bind_args() so argument expressions resolve
+ * against the caller's names, not the new parameters.
  */
-static void bind_args(struct interpreter *interp,
-		      struct ast_node *call,
-		      struct ast_node *def,
-		      struct symbol_table *func_scope)
+static int eval_args(struct interpreter *interp,
+		     struct ast_node *call,
+		     struct value *values)
 {
-	struct value arg_values[MAX_ARGS];
 	int nargs;
-	int nparams;
 	int j;
 
 	nargs = call->data.function_call.arg_count;
@@ -167,16 +180,64 @@ static void bind_args(struct interpreter *interp,
 		nargs = MAX_ARGS;
 
 	for (j = 0; j < nargs; j++)
-		arg_values[j] = interpreter_evaluate(
+		values[j] = interpreter_evaluate(
 			interp,
 			call->data.function_call.arguments[j]);
+	return nargs;
+}
+
+/* bind_args() - Enter a call and bind its arguments as its locals. */
+static void bind_args(struct interpreter *interp,
+		      const uint32_t *params, int nparams,
+		      const struct value *values, int nargs)
+{
+	int j;
 
-	nparams = def->data.function_def.param_count;
+	symbol_table_push(interp->symbols);
 	for (j = 0; j < nparams && j < nargs; j++)
-		symbol_table_set_local(
-			func_scope,
-			def->data.function_def.parameters[j],
-			arg_values[j]);
+		symbol_table_set_local(interp->symbols, params[j],
+				       values[j]);
+}
+
+/*
+ * call_key() - Copy the arguments of a call into @key, if they can be a
+ *              memo key: a number for each of the @nparams parameters.
+ */
+static int call_key(const struct value *values, int nargs, int nparams,
+		    double *key)
+{
+	int j;
+
+	if (nargs != nparams || nargs > MEMO_MAX_ARGS)
+		return 0;
+	for (j = 0; j < nargs; j++) {
+		if (values[j].type != VALUE_NUMBER)
+			return 0;
+		key[j] = values[j].data.number;
+	}
+	return 1;
+}
+
+/*
+ * call_cached() - Answer a call from interp->memo, if it holds a result
+ *                 the call could have computed from here.
+ *
+ * A result is only used if repeating the calls it took would stay
+ * within MAX_CALL_DEPTH, so a program that runs out of depth without
+ * the memo still does with it, at the same call.
+ */
+static int call_cached(struct interpreter *interp, uintptr_t func,
+		       const double *key, int nargs, struct value *result)
+{
+	int depth;
+
+	depth = memo_lookup(interp->memo, func, key, (uint32_t)nargs,
+			    MAX_CALL_DEPTH - interp->call_depth, result);
+	if (!depth)
+		return 0;
+	if (interp->call_peak < interp->call_depth + depth)
+		interp->call_peak = interp->call_depth + depth;
+	return 1;
 }
 
 static struct value eval_function_call(struct interpreter *interp,
@@ -184,56 +245,83 @@ static struct value eval_function_call(struct interpreter *interp,
 {
 	struct symbol *func_sym;
 	struct ast_node	*func_def;
-	struct symbol_table *func_scope;
-	struct symbol_table *saved_scope;
+	struct value values[MAX_ARGS];
+	double key[MEMO_MAX_ARGS];
 	int saved_returned;
 	struct value saved_return;
 	struct value result;
-	const char *fname;
+	uint32_t fname;
+	size_t errors = 0;
+	int peak = 0;
+	int memoised;
+	int depth;
+	int nparams;
+	int nargs;
 
 	fname    = node->data.function_call.function_name;
-	func_sym = symbol_table_find(interp->current_scope, fname);
+	func_sym = symbol_table_find(interp->symbols, fname);
 
 	if (!func_sym || func_sym->value.type != VALUE_FUNCTION) {
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: undefined function '%s' "
-			"at line %d\n", fname, node->line_number);
+			"at line %d\n", intern_name(interp->atoms, fname),
+			node_line(interp, node));
 		return val_none();
 	}
 
 	if (interp->call_depth >= MAX_CALL_DEPTH) {
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: max recursion depth (%d) "
 			"exceeded at line %d\n",
-			MAX_CALL_DEPTH, node->line_number);
+			MAX_CALL_DEPTH, node_line(interp, node));
 		return val_none();
 	}
 
-	func_def   = func_sym->value.data.function;
-	func_scope = symbol_table_create(interp->current_scope);
-	if (!func_scope)
-		return val_none();
+	func_def = func_sym->value.data.function;
+	if (!func_def->data.function_def.body && interp->parser) {
+		parser_parse_body(interp->parser, func_def);
+		if (interp->memo && func_def->data.function_def.body)
+			memo_scan_ast(interp->memo,
+				      func_def->data.function_def.body);
+	}
 
-	bind_args(interp, node, func_def, func_scope);
+	nargs    = eval_args(interp, node, values);
+	nparams  = func_def->data.function_def.param_count;
+	memoised = interp->memo && call_key(values, nargs, nparams, key) &&
+		   memo_pure_ast(interp->memo, func_def);
+	if (memoised && call_cached(interp, (uintptr_t)func_def, key, nargs,
+				    &result))
+		return result;
+
+	errors = interp->errors;
+	peak   = interp->call_peak;
+	bind_args(interp, func_def->data.function_def.parameters, nparams,
+		  values, nargs);
 
-	saved_scope     = interp->current_scope;
 	saved_returned  = interp->has_returned;
 	saved_return    = interp->return_value;
 
-	interp->current_scope = func_scope;
 	interp->has_returned  = 0;
 	interp->return_value  = val_none();
 	interp->call_depth++;
+	interp->call_peak = interp->call_depth;
 
 	interpreter_evaluate(interp, func_def->data.function_def.body);
 	result = interp->return_value;
 
 	interp->call_depth--;
-	interp->current_scope = saved_scope;
 	interp->has_returned  = saved_returned;
 	interp->return_value  = saved_return;
 
-	symbol_table_destroy(func_scope);
+	symbol_table_pop(interp->symbols);
+	depth = interp->call_peak - interp->call_depth;
+	if (interp->call_peak < peak)
+		interp->call_peak = peak;
+	if (memoised && interp->errors == errors)
+		memo_store(interp->memo, (uintptr_t)func_def, key,
+			   (uint32_t)nargs, depth, result);
 	return result;
 }
 
@@ -260,12 +348,275 @@ static void print_value(struct value v)
 	}
 }
 
+/* --- Flat trees ---------------------------------------------------------- */
+
+/*
+ * The functions below mirror the pointer walk above node for node, so
+ * that both layouts print the same output and the same errors.
+ */
+
+static struct value flat_eval(struct interpreter *interp, uint32_t at);
+
+/* flat_line() - Source line of node @at for a runtime error. */
+static int flat_line(struct interpreter *interp, uint32_t at)
+{
+	return line_index_line(interp->lines, interp->flat->offsets[at]);
+}
+
+static struct value flat_binary_op(struct interpreter *interp, uint32_t at)
+{
+	const struct flat_node *node = &interp->flat->nodes[at];
+	struct value left;
+	struct value right;
+
+	left  = flat_eval(interp, node->a);
+	right = flat_eval(interp, node->b);
+
+	if (left.type == VALUE_NUMBER && right.type == VALUE_NUMBER)
+		return number_op(interp, (enum token_type)node->op,
+				 interp->flat->offsets[at], left.data.number,
+				 right.data.number);
+
+	if (left.type  == VALUE_STRING  &&
+	    right.type == VALUE_STRING  &&
+	    node->op == TOKEN_PLUS)
+		return string_concat(left.data.string,
+				     right.data.string);
+
+	interp->errors++;
+	fprintf(stderr, "runtime error: type mismatch at line %d\n",
+		flat_line(interp, at));
+	return val_none();
+}
+
+static struct value flat_unary_op(struct interpreter *interp, uint32_t at)
+{
+	const struct flat_node *node = &interp->flat->nodes[at];
+	struct value operand;
+
+	operand = flat_eval(interp, node->a);
+
+	if (operand.type != VALUE_NUMBER) {
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: unary op on non-number "
+			"at line %d\n", flat_line(interp, at));
+		return val_none();
+	}
+
+	switch (node->op) {
+	case TOKEN_MINUS:	return val_number(-operand.data.number);
+	case TOKEN_PLUS:	return val_number(+operand.data.number);
+	default:
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: unknown unary op "
+			"at line %d\n", flat_line(interp, at));
+		return val_none();
+	}
+}
+
+/* flat_eval_args() - eval_args() for flat trees. */
+static int flat_eval_args(struct interpreter *interp,
+			  const struct flat_node *call,
+			  struct value *values)
+{
+	const uint32_t *lists = interp->flat->lists;
+	uint32_t nargs;
+	uint32_t j;
+
+	nargs = call->c;
+	if (nargs > MAX_ARGS)
+		nargs = MAX_ARGS;
+
+	for (j = 0; j < nargs; j++)
+		values[j] = flat_eval(interp, lists[call->b + j]);
+	return (int)nargs;
+}
+
+static struct value flat_function_call(struct interpreter *interp,
+				       uint32_t at)
+{
+	const struct flat_node *node = &interp->flat->nodes[at];
+	const struct flat_node *fdef;
+	struct symbol *func_sym;
+	struct value values[MAX_ARGS];
+	double key[MEMO_MAX_ARGS];
+	int saved_returned;
+	struct value saved_return;
+	struct value result;
+	uint32_t def;
+	size_t errors = 0;
+	int peak = 0;
+	int memoised;
+	int depth;
+	int nargs;
+
+	func_sym = symbol_table_find(interp->symbols, node->a);
+
+	if (!func_sym || func_sym->value.type != VALUE_FUNCTION) {
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: undefined function '%s' "
+			"at line %d\n", intern_name(interp->atoms, node->a),
+			flat_line(interp, at));
+		return val_none();
+	}
+
+	if (interp->call_depth >= MAX_CALL_DEPTH) {
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: max recursion depth (%d) "
+			"exceeded at line %d\n",
+			MAX_CALL_DEPTH, flat_line(interp, at));
+		return val_none();
+	}
+
+	def      = func_sym->value.data.node;
+	fdef     = &interp->flat->nodes[def];
+	nargs    = flat_eval_args(interp, node, values);
+	memoised = interp->memo && call_key(values, nargs, (int)fdef->c, key) &&
+		   memo_pure_flat(interp->memo, interp->flat, def);
+	if (memoised && call_cached(interp, def, key, nargs, &result))
+		return result;
+
+	errors = interp->errors;
+	peak   = interp->call_peak;
+	bind_args(interp, interp->flat->lists + fdef->b, (int)fdef->c,
+		  values, nargs);
+
+	saved_returned  = interp->has_returned;
+	saved_return    = interp->return_value;
+
+	interp->has_returned  = 0;
+	interp->return_value  = val_none();
+	interp->call_depth++;
+	interp->call_peak = interp->call_depth;
+
+	/* A definition's body is the node right after it. */
+	flat_eval(interp, def + 1);
+	result = interp->return_value;
+
+	interp->call_depth--;
+	interp->has_returned  = saved_returned;
+	interp->return_value  = saved_return;
+
+	symbol_table_pop(interp->symbols);
+	depth = interp->call_peak - interp->call_depth;
+	if (interp->call_peak < peak)
+		interp->call_peak = peak;
+	if (memoised && interp->errors == errors)
+		memo_store(interp->memo, def, key, (uint32_t)nargs, depth,
+			   result);
+	return result;
+}
+
+/* flat_eval() - interpreter_evaluate() for node @at of interp->flat. */
+static struct value flat_eval(struct interpreter *interp, uint32_t at)
+{
+	const struct flat_ast *ast = interp->flat;
+	const struct flat_node *node;
+	struct value result = val_none();
+	struct symbol *sym;
+	struct value cond;
+	struct value value;
+	struct value fv;
+	uint32_t j;
+
+	if (at == FLAT_NONE)
+		return result;
+
+	node = &ast->nodes[at];
+	switch (node->kind) {
+	case AST_NUMBER:
+		return val_number(ast->numbers[node->a]);
+
+	case AST_STRING:
+		return val_string(ast->strings + node->a);
+
+	case AST_IDENTIFIER:
+		sym = symbol_table_find(interp->symbols, node->a);
+		if (sym)
+			return sym->value;
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: undefined variable '%s' "
+			"at line %d\n",
+			intern_name(interp->atoms, node->a),
+			flat_line(interp, at));
+		return val_none();
+
+	case AST_BINARY_OP:
+		return flat_binary_op(interp, at);
+
+	case AST_UNARY_OP:
+		return flat_unary_op(interp, at);
+
+	case AST_ASSIGNMENT:
+		value = flat_eval(interp, node->b);
+		symbol_table_set(interp->symbols, node->a, value);
+		return value;
+
+	case AST_IF_STMT:
+		cond = flat_eval(interp, node->a);
+		if (cond.type == VALUE_NUMBER && cond.data.number != 0.0)
+			return flat_eval(interp, node->b);
+		return flat_eval(interp, node->c);
+
+	case AST_WHILE_STMT:
+		for (;;) {
+			cond = flat_eval(interp, node->a);
+			if (cond.type != VALUE_NUMBER ||
+			    cond.data.number == 0.0 || interp->has_returned)
+				break;
+			flat_eval(interp, node->b);
+		}
+		return val_none();
+
+	case AST_FUNCTION_DEF:
+		fv.type      = VALUE_FUNCTION;
+		fv.data.node = at;
+		symbol_table_set(interp->symbols, node->a, fv);
+		return val_none();
+
+	case AST_FUNCTION_CALL:
+		return flat_function_call(interp, at);
+
+	case AST_RETURN_STMT:
+		interp->return_value = flat_eval(interp, node->a);
+		interp->has_returned = 1;
+		return interp->return_value;
+
+	case AST_PRINT_STMT:
+		print_value(flat_eval(interp, node->a));
+		return val_none();
+
+	case AST_BLOCK:
+		for (j = 0; j < node->c && !interp->has_returned; j++)
+			result = flat_eval(interp, ast->lists[node->b + j]);
+		return result;
+
+	case AST_PROGRAM:
+		for (j = 0; j < node->c; j++)
+			result = flat_eval(interp, ast->lists[node->b + j]);
+		return result;
+
+	default:
+		interp->errors++;
+		fprintf(stderr,
+			"runtime error: unknown node type %d "
+			"at line %d\n", node->kind, flat_line(interp, at));
+		return val_none();
+	}
+}
+
 /* --- Public API ---------------------------------------------------------- */
 
 /**
  * interpreter_create() - Allocate and initialise a new interpreter.
  */
-struct interpreter *interpreter_create(void)
+struct interpreter *interpreter_create(const struct intern_table *atoms,
+				       struct line_index *lines)
 {
 	struct interpreter *interp;
 
@@ -275,16 +626,17 @@ struct interpreter *interpreter_create(void)
 		return NULL;
 	}
 
-	interp->global_scope  = symbol_table_create(NULL);
-	if (!interp->global_scope) {
+	interp->symbols = symbol_table_create();
+	if (!interp->symbols) {
 		free(interp);
 		return NULL;
 	}
 
-	interp->current_scope = interp->global_scope;
 	interp->has_returned  = 0;
 	interp->return_value  = val_none();
 	interp->call_depth    = 0;
+	interp->atoms         = atoms;
+	interp->lines         = lines;
 	return interp;
 }
 
@@ -295,10 +647,27 @@ void interpreter_destroy(struct interpreter *interp)
 {
 	if (!interp)
 		return;
-	symbol_table_destroy(interp->global_scope);
+	symbol_table_destroy(interp->symbols);
 	free(interp);
 }
 
+/**
+ * interpreter_set_parser() - Name the parser of a lazily parsed tree.
+ */
+void interpreter_set_parser(struct interpreter *interp,
+			    struct parser *parser)
+{
+	interp->parser = parser;
+}
+
+/**
+ * interpreter_set_memo() - Memoise calls to pure functions.
+ */
+void interpreter_set_memo(struct interpreter *interp, struct memo *memo)
+{
+	interp->memo = memo;
+}
+
 /**
  * interpreter_evaluate() - Recursively evaluate an AST node.
  */
@@ -324,15 +693,17 @@ struct value interpreter_evaluate(struct interpreter *interp,
 		return val_string(node->data.string.value);
 
 	case AST_IDENTIFIER:
-		sym = symbol_table_find(interp->current_scope,
+		sym = symbol_table_find(interp->symbols,
 					node->data.identifier.name);
 		if (sym)
 			return sym->value;
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: undefined variable '%s' "
 			"at line %d\n",
-			node->data.identifier.name,
-			node->line_number);
+			intern_name(interp->atoms,
+				    node->data.identifier.name),
+			node_line(interp, node));
 		return val_none();
 
 	case AST_BINARY_OP:
@@ -344,7 +715,7 @@ struct value interpreter_evaluate(struct interpreter *interp,
 	case AST_ASSIGNMENT:
 		value = interpreter_evaluate(
 			interp, node->data.assignment.value);
-		symbol_table_set(interp->current_scope,
+		symbol_table_set(interp->symbols,
 				 node->data.assignment.variable,
 				 value);
 		return value;
@@ -382,7 +753,7 @@ struct value interpreter_evaluate(struct interpreter *interp,
 	case AST_FUNCTION_DEF:
 		fv.type          = VALUE_FUNCTION;
 		fv.data.function = node;
-		symbol_table_set(interp->current_scope,
+		symbol_table_set(interp->symbols,
 				 node->data.function_def.name, fv);
 		return val_none();
 
@@ -422,10 +793,24 @@ struct value interpreter_evaluate(struct interpreter *interp,
 		return result;
 
 	default:
+		interp->errors++;
 		fprintf(stderr,
 			"runtime error: unknown node type %d "
 			"at line %d\n",
-			node->type, node->line_number);
+			node->type, node_line(interp, node));
 		return val_none();
 	}
 }
+
+/**
+ * interpreter_run_flat() - Run a program flattened by flat_ast_build().
+ */
+struct value interpreter_run_flat(struct interpreter *interp,
+				  const struct flat_ast *ast)
+{
+	if (!interp || !ast || !ast->node_count)
+		return val_none();
+
+	interp->flat = ast;
+	return flat_eval(interp, 0);
+}
@@ -0,0 +1,506 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "lex_parallel.h"
+#include "lexer.h"
+#include "scan.h"
+#include "token_stream.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Chunks per thread, so one slow chunk does not hold the others up. */
+#define CHUNKS_PER_THREAD	4
+#define CHUNK_INIT_WIDTHS	256
+#define LEVELS_INIT_CAP		32
+
+/**
+ * struct line_width - Indentation reported at one line start.
+ * @index:  Chunk token the INDENT/DEDENTs are inserted before.
+ * @width:  Indentation in spaces; 0 for the end of input.
+ * @offset: Offset of the line's first token.
+ * @emit:   Set by the stitch: 1 for an INDENT, -n for n DEDENTs.
+ */
+struct line_width {
+	int index;
+	int width;
+	size_t offset;
+	int emit;
+};
+
+/**
+ * struct chunk - One slice of the source and what lexing it produced.
+ * @start:    First byte; always just after a newline, or 0.
+ * @end:      One past the last byte.
+ * @utf8_end: First ill-formed byte in the slice, or @end.
+ * @lex:      raw_indent lexer, kept so the stitch can extend the chunk.
+ * @atoms:    Names in the order this chunk first saw them.
+ * @atom_map: Global atom for each of @atoms.
+ * @tokens:   Tokens without INDENT/DEDENT; atoms still local.
+ * @widths:   Line starts, in token order.
+ * @out:      Index of the chunk's first token in the merged stream.
+ * @number_base: Index of its first number in the merged side table.
+ * @string_base: Index of its first string in the merged side table.
+ * @length_base: Index of its first long length in the merged side table.
+ * @done:     Non-zero once TOKEN_EOF or TOKEN_ERROR was produced.
+ * @failed:   Non-zero after an allocation failure.
+ * @used:     Non-zero if the merged stream takes its tokens from here.
+ */
+struct chunk {
+	size_t			 start;
+	size_t			 end;
+	size_t			 utf8_end;
+	struct lexer		*lex;
+	struct intern_table	*atoms;
+	uint32_t		*atom_map;
+	struct token_stream	*tokens;
+	struct line_width	*widths;
+	int			 nwidths;
+	int			 width_cap;
+	int			 out;
+	int			 number_base;
+	int			 string_base;
+	int			 length_base;
+	int			 done;
+	int			 failed;
+	int			 used;
+};
+
+/**
+ * struct lex_job - Shared state of one lex_parallel() call.
+ * @source:   Whole source.
+ * @length:   strlen(@source).
+ * @chunks:   Slices in source order.
+ * @nchunks:  Length of @chunks.
+ * @utf8_end: First ill-formed byte of the whole source, or @length.
+ * @used:     Chunks the merged stream is built from, in order.
+ * @nused:    Length of @used.
+ * @levels:   The indent stack, replayed across chunks.
+ * @top:      Index of the innermost level in @levels.
+ * @level_cap: Allocated length of @levels.
+ * @out:      Merged token stream.
+ * @total:    Tokens in @out.
+ * @nnumbers: Entries in @out's numbers table.
+ * @nstrings: Entries in @out's strings table.
+ * @nlengths: Entries in @out's lengths table.
+ */
+struct lex_job {
+	const char	 *source;
+	size_t		  length;
+	struct chunk	 *chunks;
+	int		  nchunks;
+	size_t		  utf8_end;
+	struct chunk	**used;
+	int		  nused;
+	int		 *levels;
+	int		  top;
+	int		  level_cap;
+	struct token_stream *out;
+	int		  total;
+	int		  nnumbers;
+	int		  nstrings;
+	int		  nlengths;
+};
+
+/* --- Splitting ----------------------------------------------------------- */
+
+/*
+ * split_chunks() - Cut the source into up to @want slices, each ending
+ *                  just after a newline (the last one at the end).
+ */
+static int split_chunks(struct lex_job *job, int want)
+{
+	const char *nl;
+	size_t target;
+	size_t start = 0;
+	size_t cut;
+	int j;
+
+	job->chunks = calloc(want, sizeof(*job->chunks));
+	job->used   = calloc(want, sizeof(*job->used));
+	if (!job->chunks || !job->used)
+		return 0;
+
+	for (j = 1; j < want; j++) {
+		target = (size_t)((unsigned long long)job->length * j / want);
+		if (target < start)
+			continue;
+		nl = memchr(job->source + target, '\n', job->length - target);
+		if (!nl)
+			break;
+		cut = (size_t)(nl - job->source) + 1;
+		if (cut >= job->length)
+			break;
+		job->chunks[job->nchunks].start = start;
+		job->chunks[job->nchunks].end   = cut;
+		job->nchunks++;
+		start = cut;
+	}
+
+	job->chunks[job->nchunks].start = start;
+	job->chunks[job->nchunks].end   = job->length;
+	job->nchunks++;
+	return 1;
+}
+
+/* scan_chunk() - Pool job: validate a slice. */
+static void scan_chunk(void *arg, int index)
+{
+	struct lex_job *job = arg;
+	struct chunk *c = &job->chunks[index];
+	const char *s = job->source + c->start;
+	size_t n = c->end - c->start;
+	int ascii;
+
+	c->utf8_end = c->start + scan_utf8(s, n, &ascii);
+}
+
+/* settle_chunks() - Reduce the slices' UTF-8 verdicts to one. */
+static void settle_chunks(struct lex_job *job)
+{
+	struct chunk *c;
+	int j;
+
+	job->utf8_end = job->length;
+	for (j = 0; j < job->nchunks; j++) {
+		c = &job->chunks[j];
+		if (c->utf8_end < c->end && job->utf8_end == job->length)
+			job->utf8_end = c->utf8_end;
+	}
+}
+
+/* --- Lexing one chunk ---------------------------------------------------- */
+
+/* chunk_push_width() - Record the width of a line starting at @tok. */
+static int chunk_push_width(struct chunk *c, const struct token *tok,
+			    int width)
+{
+	struct line_width *grown;
+	struct line_width *w;
+	int cap;
+
+	if (c->nwidths >= c->width_cap) {
+		cap   = c->width_cap ? c->width_cap * 2 : CHUNK_INIT_WIDTHS;
+		grown = realloc(c->widths, sizeof(*grown) * cap);
+		if (!grown)
+			return 0;
+		c->widths    = grown;
+		c->width_cap = cap;
+	}
+
+	w = &c->widths[c->nwidths++];
+	w->index  = c->tokens->count;
+	w->width  = width;
+	w->offset = tok->offset;
+	w->emit   = 0;
+	return 1;
+}
+
+/*
+ * chunk_lex_to() - Lex @c until its cursor reaches @stop between two
+ *                  tokens, or to the end of input when @last is set.
+ */
+static int chunk_lex_to(struct chunk *c, size_t stop, int last)
+{
+	struct token tok;
+
+	while (!c->done && (last || c->lex->position < stop)) {
+		tok = lexer_next_token(c->lex);
+
+		if (tok.type == TOKEN_INDENT) {
+			if (!chunk_push_width(c, &tok, (int)tok.number))
+				goto oom;
+			continue;
+		}
+
+		/* Every open block closes at the end of input. */
+		if (tok.type == TOKEN_EOF && !chunk_push_width(c, &tok, 0))
+			goto oom;
+		if (!token_stream_push(c->tokens, &tok))
+			goto oom;
+		c->done = tok.type == TOKEN_EOF || tok.type == TOKEN_ERROR;
+	}
+	return 1;
+
+oom:
+	c->failed = 1;
+	return 0;
+}
+
+/*
+ * lex_chunk() - Pool job: lex a slice as if it started the file, with
+ *               the UTF-8 verdict of the real one.
+ */
+static void lex_chunk(void *arg, int index)
+{
+	struct lex_job *job = arg;
+	struct chunk *c = &job->chunks[index];
+
+	c->atoms = intern_create();
+	if (!c->atoms)
+		goto oom;
+	c->lex = lexer_create("", c->atoms);
+	if (!c->lex)
+		goto oom;
+	c->tokens = token_stream_create();
+	if (!c->tokens)
+		goto oom;
+
+	lexer_reset(c->lex, job->source, job->length, c->start);
+	c->lex->utf8_end   = job->utf8_end;
+	c->lex->raw_indent = 1;
+
+	chunk_lex_to(c, c->end, index == job->nchunks - 1);
+	return;
+
+oom:
+	c->failed = 1;
+}
+
+/* --- Stitching ----------------------------------------------------------- */
+
+/* map_atoms() - Enter a chunk's names into @atoms in first-seen order. */
+static int map_atoms(struct chunk *c, struct intern_table *atoms)
+{
+	const struct intern_entry *e;
+	uint32_t a;
+
+	if (!c->atoms->count)
+		return 1;
+
+	c->atom_map = malloc(sizeof(*c->atom_map) * c->atoms->count);
+	if (!c->atom_map)
+		return 0;
+
+	for (a = 0; a < c->atoms->count; a++) {
+		e = &c->atoms->entries[a];
+		c->atom_map[a] = intern(atoms, c->atoms->chars + e->offset,
+					e->length);
+		if (c->atom_map[a] == ATOM_INVALID)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * replay_widths() - Run a chunk's line widths through the indent stack
+ *                   the way handle_line_start() does, and return how
+ *                   many INDENT/DEDENT tokens that adds (or -1).
+ */
+static int replay_widths(struct lex_job *job, struct chunk *c)
+{
+	struct line_width *w;
+	int *grown;
+	int added = 0;
+	int j;
+
+	for (j = 0; j < c->nwidths; j++) {
+		w = &c->widths[j];
+
+		if (w->width > job->levels[job->top]) {
+			if (job->top + 1 >= job->level_cap) {
+				grown = realloc(job->levels, sizeof(*grown) *
+						job->level_cap * 2);
+				if (!grown)
+					return -1;
+				job->levels     = grown;
+				job->level_cap *= 2;
+			}
+			job->levels[++job->top] = w->width;
+			w->emit = 1;
+			added++;
+			continue;
+		}
+
+		while (job->top > 0 && job->levels[job->top] > w->width) {
+			job->top--;
+			w->emit--;
+		}
+		added -= w->emit;
+	}
+	return added;
+}
+
+/*
+ * stitch() - Walk the chunks in order, extending any chunk whose last
+ *            token ran past the next one's start, and lay out the
+ *            merged array.  Sequential, but touches only line starts
+ *            and distinct names.
+ */
+static int stitch(struct lex_job *job, struct intern_table *atoms)
+{
+	struct chunk *c;
+	int added;
+	int next;
+	int k;
+
+	job->levels = malloc(sizeof(*job->levels) * LEVELS_INIT_CAP);
+	if (!job->levels)
+		return 0;
+	job->levels[0] = 0;
+	job->level_cap = LEVELS_INIT_CAP;
+
+	for (k = 0; k < job->nchunks; k = next) {
+		c    = &job->chunks[k];
+		next = k + 1;
+
+		/* A string literal can swallow a cut; lex on from there. */
+		while (!c->failed && !c->done && next < job->nchunks &&
+		       c->lex->position != job->chunks[next].start) {
+			chunk_lex_to(c, job->chunks[next].end,
+				     next == job->nchunks - 1);
+			next++;
+		}
+		if (c->failed || !map_atoms(c, atoms))
+			return 0;
+
+		added = replay_widths(job, c);
+		if (added < 0)
+			return 0;
+
+		c->used        = 1;
+		c->out         = job->total;
+		c->number_base = job->nnumbers;
+		c->string_base = job->nstrings;
+		c->length_base = job->nlengths;
+		job->total    += c->tokens->count + added;
+		job->nnumbers += c->tokens->nnumbers;
+		job->nstrings += c->tokens->nstrings;
+		job->nlengths += c->tokens->nlengths;
+		job->used[job->nused++] = c;
+		if (c->done)
+			break;
+	}
+	return 1;
+}
+
+/* emit_chunk() - Pool job: copy one chunk into the merged stream. */
+static void emit_chunk(void *arg, int index)
+{
+	struct lex_job *job = arg;
+	struct chunk *c = job->used[index];
+	const struct token_stream *in = c->tokens;
+	struct packed_token *out = job->out->tokens + c->out;
+	struct line_width *w = c->widths;
+	struct line_width *w_end = c->widths + c->nwidths;
+	struct packed_token t;
+	int n;
+	int j;
+
+	if (in->nnumbers)
+		memcpy(job->out->numbers + c->number_base, in->numbers,
+		       sizeof(*in->numbers) * in->nnumbers);
+	if (in->nstrings)
+		memcpy(job->out->strings + c->string_base, in->strings,
+		       sizeof(*in->strings) * in->nstrings);
+	if (in->nlengths)
+		memcpy(job->out->lengths + c->length_base, in->lengths,
+		       sizeof(*in->lengths) * in->nlengths);
+
+	memset(&t, 0, sizeof(t));
+	for (j = 0; j <= in->count; j++) {
+		for (; w < w_end && w->index == j; w++) {
+			t.type   = w->emit > 0 ? TOKEN_INDENT : TOKEN_DEDENT;
+			t.offset = (uint32_t)w->offset;
+			for (n = w->emit > 0 ? w->emit : -w->emit; n > 0; n--)
+				*out++ = t;
+		}
+		if (j == in->count)
+			break;
+
+		/* Side-table indices and atoms become the merged ones. */
+		*out = in->tokens[j];
+		switch (out->type) {
+		case TOKEN_IDENTIFIER:
+			out->value = c->atom_map[out->value];
+			break;
+		case TOKEN_NUMBER:
+			out->value += (uint32_t)c->number_base;
+			break;
+		case TOKEN_STRING:
+			if (out->value != TOKEN_NO_ENTRY)
+				out->value += (uint32_t)c->string_base;
+			break;
+		default:
+			break;
+		}
+		out++;
+	}
+}
+
+/* free_job() - Free the chunks; @moved chunks' strings live on in @out. */
+static void free_job(struct lex_job *job, int moved)
+{
+	struct chunk *c;
+	int j;
+
+	for (j = 0; job->chunks && j < job->nchunks; j++) {
+		c = &job->chunks[j];
+		if (moved && c->used)
+			c->tokens->nstrings = 0;
+		lexer_destroy(c->lex);
+		intern_destroy(c->atoms);
+		token_stream_destroy(c->tokens);
+		free(c->atom_map);
+		free(c->widths);
+	}
+	free(job->chunks);
+	free(job->used);
+	free(job->levels);
+}
+
+/* --- Public API ---------------------------------------------------------- */
+
+/**
+ * lex_parallel() - Tokenise @source on a thread pool.
+ */
+struct token_stream *lex_parallel(const char *source, size_t length,
+				  struct intern_table *atoms,
+				  struct thread_pool *pool)
+{
+	struct lex_job job;
+	struct token_stream *tokens = NULL;
+	int want;
+
+	if (!source || !atoms || length > UINT32_MAX)
+		return NULL;
+
+	memset(&job, 0, sizeof(job));
+	job.source = source;
+	job.length = length;
+
+	want = thread_pool_size(pool) * CHUNKS_PER_THREAD;
+	if ((size_t)want > length / LEX_PARALLEL_MIN_CHUNK)
+		want = (int)(length / LEX_PARALLEL_MIN_CHUNK);
+	if (want < 1)
+		want = 1;
+
+	if (!split_chunks(&job, want))
+		goto err;
+	thread_pool_run(pool, scan_chunk, &job, job.nchunks);
+	settle_chunks(&job);
+	thread_pool_run(pool, lex_chunk, &job, job.nchunks);
+
+	if (!stitch(&job, atoms))
+		goto err;
+	tokens = token_stream_create();
+	if (!tokens || !token_stream_reserve(tokens, job.total,
+					     job.nnumbers, job.nstrings,
+					     job.nlengths))
+		goto err;
+	job.out = tokens;
+	thread_pool_run(pool, emit_chunk, &job, job.nused);
+
+	tokens->count    = job.total;
+	tokens->nnumbers = job.nnumbers;
+	tokens->nstrings = job.nstrings;
+	tokens->nlengths = job.nlengths;
+	free_job(&job, 1);
+	return tokens;
+
+err:
+	fprintf(stderr, "lex_parallel: out of memory\n");
+	token_stream_destroy(tokens);
+	free_job(&job, 0);
+	return NULL;
+}
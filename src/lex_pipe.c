@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "lex_pipe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LEX_PIPE_MASK	(LEX_PIPE_SLOTS - 1)
+
+/* Looks at the other side's cursor before going to sleep. */
+#define LEX_PIPE_SPIN	64
+
+/* --- Producer ------------------------------------------------------------ */
+
+/* pipe_publish_tail() - Hand the tokens written so far to the consumer. */
+static void pipe_publish_tail(struct lex_pipe *pipe)
+{
+	__atomic_store_n(&pipe->tail, pipe->tail_local, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pipe->consumer_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pipe->lock);
+		pthread_cond_signal(&pipe->data);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+/* pipe_has_space() - Non-zero if the ring has a free slot. */
+static int pipe_has_space(struct lex_pipe *pipe, int order)
+{
+	pipe->head_seen = __atomic_load_n(&pipe->head, order);
+	return pipe->tail_local - pipe->head_seen < LEX_PIPE_SLOTS;
+}
+
+/*
+ * pipe_wait_space() - Wait until the consumer frees a slot.  Returns 0
+ *                     if it closed the pipe instead.
+ */
+static int pipe_wait_space(struct lex_pipe *pipe)
+{
+	int spin;
+
+	/* The consumer may be waiting on tokens we have not published. */
+	pipe_publish_tail(pipe);
+
+	for (spin = 0; spin < LEX_PIPE_SPIN; spin++)
+		if (pipe_has_space(pipe, __ATOMIC_ACQUIRE))
+			return 1;
+
+	pthread_mutex_lock(&pipe->lock);
+	__atomic_store_n(&pipe->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&pipe->closed, __ATOMIC_SEQ_CST) &&
+	       !pipe_has_space(pipe, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pipe->space, &pipe->lock);
+	__atomic_store_n(&pipe->producer_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pipe->lock);
+
+	return !__atomic_load_n(&pipe->closed, __ATOMIC_ACQUIRE);
+}
+
+/* pipe_produce() - Thread body: lex to the end of input into the ring. */
+static void *pipe_produce(void *data)
+{
+	struct lex_pipe *pipe = data;
+	struct token tok;
+
+	do {
+		tok = lexer_next_token(pipe->lexer);
+
+		if (pipe->tail_local - pipe->head_seen >= LEX_PIPE_SLOTS &&
+		    !pipe_wait_space(pipe)) {
+			free(tok.owned);
+			break;
+		}
+		pipe->ring[pipe->tail_local++ & LEX_PIPE_MASK] = tok;
+
+		if (pipe->tail_local - pipe->tail >= LEX_PIPE_BATCH) {
+			pipe_publish_tail(pipe);
+			if (__atomic_load_n(&pipe->closed, __ATOMIC_RELAXED))
+				break;
+		}
+	} while (tok.type != TOKEN_EOF && tok.type != TOKEN_ERROR);
+
+	pipe_publish_tail(pipe);
+	return NULL;
+}
+
+/* --- Consumer ------------------------------------------------------------ */
+
+/* pipe_publish_head() - Give the slots read so far back to the producer. */
+static void pipe_publish_head(struct lex_pipe *pipe)
+{
+	__atomic_store_n(&pipe->head, pipe->head_local, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pipe->producer_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pipe->lock);
+		pthread_cond_signal(&pipe->space);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+/* pipe_has_data() - Non-zero if the ring holds an unread token. */
+static int pipe_has_data(struct lex_pipe *pipe, int order)
+{
+	pipe->tail_seen = __atomic_load_n(&pipe->tail, order);
+	return pipe->tail_seen != pipe->head_local;
+}
+
+/* pipe_wait_data() - Wait until the producer publishes a token. */
+static void pipe_wait_data(struct lex_pipe *pipe)
+{
+	int spin;
+
+	/* The producer may be waiting on slots we have not released. */
+	pipe_publish_head(pipe);
+
+	for (spin = 0; spin < LEX_PIPE_SPIN; spin++)
+		if (pipe_has_data(pipe, __ATOMIC_ACQUIRE))
+			return;
+
+	pthread_mutex_lock(&pipe->lock);
+	__atomic_store_n(&pipe->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	while (!pipe_has_data(pipe, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pipe->data, &pipe->lock);
+	__atomic_store_n(&pipe->consumer_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * lex_pipe_next() - Take the next token from the ring.
+ */
+struct token lex_pipe_next(struct lex_pipe *pipe)
+{
+	struct token tok;
+
+	if (pipe->ended)
+		return pipe->end;
+
+	if (pipe->head_local == pipe->tail_seen)
+		pipe_wait_data(pipe);
+
+	tok = pipe->ring[pipe->head_local++ & LEX_PIPE_MASK];
+	if (pipe->head_local - pipe->head >= LEX_PIPE_BATCH)
+		pipe_publish_head(pipe);
+
+	if (tok.type == TOKEN_EOF || tok.type == TOKEN_ERROR) {
+		pipe->end        = tok;
+		pipe->end.type   = TOKEN_EOF;
+		pipe->end.length = 0;
+		pipe->end.owned  = NULL;
+		pipe->ended      = 1;
+	}
+	return tok;
+}
+
+/* --- Lifetime ------------------------------------------------------------ */
+
+/**
+ * lex_pipe_start() - Start lexing @lexer on a new thread.
+ */
+struct lex_pipe *lex_pipe_start(struct lexer *lexer)
+{
+	struct lex_pipe *pipe;
+	void *mem;
+
+	if (!lexer)
+		return NULL;
+
+	/* The cursor blocks are cache-line aligned within the struct. */
+	if (posix_memalign(&mem, LEX_PIPE_CACHE_LINE, sizeof(*pipe)))
+		goto err;
+	pipe = mem;
+	memset(pipe, 0, sizeof(*pipe));
+
+	pipe->ring = malloc(sizeof(*pipe->ring) * LEX_PIPE_SLOTS);
+	if (!pipe->ring)
+		goto err_pipe;
+
+	pipe->lexer = lexer;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->data, NULL);
+	pthread_cond_init(&pipe->space, NULL);
+
+	if (pthread_create(&pipe->thread, NULL, pipe_produce, pipe)) {
+		fprintf(stderr, "lex_pipe: cannot start thread\n");
+		pthread_cond_destroy(&pipe->space);
+		pthread_cond_destroy(&pipe->data);
+		pthread_mutex_destroy(&pipe->lock);
+		free(pipe->ring);
+		free(pipe);
+		return NULL;
+	}
+	return pipe;
+
+err_pipe:
+	free(pipe);
+err:
+	fprintf(stderr, "lex_pipe: out of memory\n");
+	return NULL;
+}
+
+/**
+ * lex_pipe_stop() - Stop the producer, wait for it and free the pipe.
+ */
+void lex_pipe_stop(struct lex_pipe *pipe)
+{
+	unsigned j;
+
+	if (!pipe)
+		return;
+
+	__atomic_store_n(&pipe->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pipe->lock);
+	pthread_cond_signal(&pipe->space);
+	pthread_mutex_unlock(&pipe->lock);
+	pthread_join(pipe->thread, NULL);
+
+	for (j = pipe->head_local; j != pipe->tail_local; j++)
+		free(pipe->ring[j & LEX_PIPE_MASK].owned);
+
+	pthread_cond_destroy(&pipe->space);
+	pthread_cond_destroy(&pipe->data);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe->ring);
+	free(pipe);
+}
@@ -1,24 +1,23 @@
 /* SPDX-License-Identifier: MIT */
 #include "utils.h"
 #include "lexer.h"
+#include "scan.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 #define INDENT_INIT_CAP	32
-#define STRING_BUF_CAP 1024
-#define IDENT_BUF_CAP 256
 #define NUM_BUF_CAP 64
 
 /**
  * lexer_create() - Allocate and initialise a lexer.
  */
-struct lexer *lexer_create(const char *source)
+struct lexer *lexer_create(const char *source, struct intern_table *atoms)
 {
 	struct lexer *lex;
+	int ascii;
 
-	if (!source)
+	if (!source || !atoms)
 		return NULL;
 
 	lex = calloc(1, sizeof(*lex));
@@ -30,15 +29,15 @@ struct lexer *lexer_create(const char *source)
 		goto err_stack;
 
 	lex->source = source;
-	lex->source_len = (int)strlen(source);
+	lex->source_len = strlen(source);
+	lex->utf8_end = scan_utf8(source, lex->source_len, &ascii);
 	lex->position = 0;
-	lex->line = 1;
-	lex->column = 1;
 	lex->indent_stack[0] = 0;
 	lex->indent_top = 0;
 	lex->indent_capacity = INDENT_INIT_CAP;
 	lex->at_line_start = 1;
 	lex->pending_dedents = 0;
+	lex->atoms = atoms;
 	return lex;
 
 err_stack:
@@ -48,6 +47,35 @@ err_lex:
 	return NULL;
 }
 
+/**
+ * lexer_create_stream() - Allocate a lexer that reads @input as it goes.
+ */
+struct lexer *lexer_create_stream(FILE *input, struct intern_table *atoms,
+				  struct line_index *lines)
+{
+	struct lexer *lex;
+
+	if (!input || !lines)
+		return NULL;
+
+	lex = lexer_create("", atoms);
+	if (!lex)
+		return NULL;
+
+	lex->window = malloc(LEXER_WINDOW + 1);
+	if (!lex->window) {
+		fprintf(stderr, "lexer: out of memory\n");
+		lexer_destroy(lex);
+		return NULL;
+	}
+	lex->window[0]  = '\0';
+	lex->source     = lex->window;
+	lex->window_cap = LEXER_WINDOW + 1;
+	lex->input      = input;
+	lex->lines      = lines;
+	return lex;
+}
+
 /**
  * lexer_destroy() - Free a lexer and its internal buffers.
  */
@@ -55,10 +83,30 @@ void lexer_destroy(struct lexer *lex)
 {
 	if (!lex)
 		return;
+	free(lex->window);
 	free(lex->indent_stack);
 	free(lex);
 }
 
+/**
+ * lexer_reset() - Restart a lexer at a top-level line of @source.
+ */
+void lexer_reset(struct lexer *lex, const char *source, size_t length,
+		 size_t offset)
+{
+	if (!lex || !source)
+		return;
+
+	lex->source          = source;
+	lex->source_len      = length;
+	lex->utf8_end        = length;
+	lex->position        = offset;
+	lex->indent_stack[0] = 0;
+	lex->indent_top      = 0;
+	lex->at_line_start   = 1;
+	lex->pending_dedents = 0;
+}
+
 /* --- Internal helpers ---------------------------------------------------- */
 
 static char lex_peek(const struct lexer *lex)
@@ -76,132 +124,411 @@ static char lex_advance(struct lexer *lex)
 		return '\0';
 
 	c = lex->source[lex->position++];
-	if (c == '\n') {
-		lex->line++;
-		lex->column      = 1;
+	if (c == '\n')
 		lex->at_line_start = 1;
-	} else {
-		lex->column++;
+	return c;
+}
+
+/*
+ * lex_skip() - Consume @n bytes in one step.
+ *
+ * Only for runs found by the scan_*() helpers, which never include a
+ * newline, so at_line_start cannot change.
+ */
+static void lex_skip(struct lexer *lex, size_t n)
+{
+	lex->position += n;
+}
+
+/* lex_rest() - Bytes left between the cursor and the end of source. */
+static size_t lex_rest(const struct lexer *lex)
+{
+	return lex->source_len - lex->position;
+}
+
+/* --- Streaming window ---------------------------------------------------- */
+
+/*
+ * lex_read() - Append up to LEXER_WINDOW more bytes of input to the
+ *              window.  Returns 0 on a read error or allocation failure.
+ */
+static int lex_read(struct lexer *lex)
+{
+	size_t cap = lex->window_cap;
+	size_t got;
+	char *grown;
+
+	while (cap < lex->filled + LEXER_WINDOW + 1)
+		cap *= 2;
+	if (cap != lex->window_cap) {
+		grown = realloc(lex->window, cap);
+		if (!grown) {
+			fprintf(stderr, "lexer: out of memory\n");
+			return 0;
+		}
+		lex->window     = grown;
+		lex->source     = grown;
+		lex->window_cap = cap;
 	}
 
-	return c;
+	got = fread(lex->window + lex->filled, 1, LEXER_WINDOW, lex->input);
+	lex->filled += got;
+	if (got < LEXER_WINDOW) {
+		if (ferror(lex->input)) {
+			fprintf(stderr, "lexer: read failed\n");
+			return 0;
+		}
+		lex->input_done = 1;
+	}
+	return 1;
+}
+
+/*
+ * lex_refill() - Drop the window before @keep and read on to the end of
+ *                a line.
+ *
+ * Everything past the old end of the window is new: it is validated as
+ * UTF-8 and fed to the line table here, once.  Only a window that ends
+ * after a newline (or at end of input) is handed to the lexer, so no
+ * token but a string literal can run off its end.  Returns 1 if the
+ * window grew, 0 at end of input, after ill-formed UTF-8 (which the
+ * lexer is about to report) or on failure, which sets @failed.
+ */
+static int lex_refill(struct lexer *lex, size_t keep)
+{
+	size_t fresh;
+	size_t cut;
+	size_t j;
+	int ascii;
+
+	if (!lex->input || lex->input_done || lex->failed ||
+	    lex->utf8_end < lex->source_len)
+		return 0;
+
+	lex->window[lex->source_len] = lex->held;
+	memmove(lex->window, lex->window + keep, lex->filled - keep);
+	lex->filled     -= keep;
+	lex->source_len -= keep;
+	lex->position   -= keep;
+	lex->utf8_end   -= keep;
+	lex->base       += keep;
+	fresh = lex->source_len;
+
+	/* Bytes past the old window hold no newline; look beyond them. */
+	j = lex->filled;
+	for (;;) {
+		if (!lex_read(lex))
+			goto fail;
+		if (lex->input_done) {
+			cut = lex->filled;
+			break;
+		}
+		for (cut = lex->filled; cut > j; cut--)
+			if (lex->window[cut - 1] == '\n')
+				break;
+		if (cut > j)
+			break;
+		j = lex->filled;
+	}
+
+	lex->held        = lex->window[cut];
+	lex->window[cut] = '\0';
+	lex->source_len  = cut;
+	lex->utf8_end    = fresh + scan_utf8(lex->window + fresh,
+					     cut - fresh, &ascii);
+	if (!line_index_extend(lex->lines, lex->window + fresh, cut - fresh))
+		goto fail;
+	return cut > fresh;
+
+fail:
+	lex->window[lex->source_len] = '\0';
+	lex->failed = 1;
+	return 0;
 }
 
 static void lex_skip_ws(struct lexer *lex)
 {
-	while (lex_peek(lex) == ' ' || lex_peek(lex) == '\t')
-		lex_advance(lex);
+	lex_skip(lex, scan_blanks(lex->source + lex->position,
+				  lex_rest(lex)));
 }
 
 static void lex_skip_comment(struct lexer *lex)
 {
-	while (lex_peek(lex) != '\n' && lex_peek(lex) != '\0')
-		lex_advance(lex);
+	lex_skip(lex, scan_line(lex->source + lex->position,
+				lex_rest(lex)));
 }
 
-static struct token make_tok(enum token_type type, const char *value,
-			     int line, int col)
+/*
+ * make_tok() - Build a token viewing @length bytes of source at @offset.
+ *
+ * No allocation happens here; the text stays in the source buffer.
+ */
+static struct token make_tok(enum token_type type, size_t offset,
+			     int length)
 {
 	struct token t;
 
 	t.type = type;
-	t.value = strdup(value);
-	t.line = line;
-	t.column = col;
+	t.offset = offset;
+	t.length = length;
+	t.owned = NULL;
 	t.number = 0.0;
+	t.atom = ATOM_INVALID;
 	return t;
 }
 
-static enum token_type classify_keyword(const char *s)
+/* --- Byte classes and operator tables ---------------------------------- */
+
+/*
+ * enum byte_class - What a byte can start, which is all the dispatch in
+ * lexer_next_token() needs to know.  Bytes outside ASCII are CC_PUNCT
+ * and, matching no operator, lex as TOKEN_ERROR.
+ */
+enum byte_class {
+	CC_PUNCT,		/* operator, delimiter or invalid */
+	CC_NUL,			/* end of input                   */
+	CC_NEWLINE,
+	CC_BLANK,		/* space or tab                   */
+	CC_HASH,		/* comment                        */
+	CC_DIGIT,
+	CC_IDENT,		/* letter or underscore           */
+	CC_QUOTE
+};
+
+#define CLASS_OF(c)						\
+	((c) == '\0' ? CC_NUL :					\
+	 (c) == '\n' ? CC_NEWLINE :				\
+	 (c) == ' ' || (c) == '\t' ? CC_BLANK :			\
+	 (c) == '#' ? CC_HASH :					\
+	 (c) >= '0' && (c) <= '9' ? CC_DIGIT :			\
+	 ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+	 (c) == '_' ? CC_IDENT :					\
+	 (c) == '"' || (c) == '\'' ? CC_QUOTE : CC_PUNCT)
+
+#define CLASS_4(n)	CLASS_OF(n), CLASS_OF((n) + 1),		\
+			CLASS_OF((n) + 2), CLASS_OF((n) + 3)
+#define CLASS_16(n)	CLASS_4(n), CLASS_4((n) + 4),			\
+			CLASS_4((n) + 8), CLASS_4((n) + 12)
+#define CLASS_64(n)	CLASS_16(n), CLASS_16((n) + 16),		\
+			CLASS_16((n) + 32), CLASS_16((n) + 48)
+
+static const unsigned char byte_class[256] = {
+	CLASS_64(0), CLASS_64(64), CLASS_64(128), CLASS_64(192)
+};
+
+#define CLASS(c)	((enum byte_class)byte_class[(unsigned char)(c)])
+
+/*
+ * Operator transitions, generated from the lists in token.h.  Types are
+ * stored plus one so that 0 means "no transition".  From the start state
+ * a byte either moves to its two-byte state, if the next byte is the
+ * expected second byte, or accepts as its one-byte operator.
+ */
+static const unsigned char op_single[256] = {
+#define X(type, c)		[(unsigned char)(c)] = (type) + 1,
+	TOKEN_OPERATORS_1(X)
+#undef X
+};
+
+static const struct {
+	char		second;
+	unsigned char	type;
+} op_double[256] = {
+#define X(type, c, d)		[(unsigned char)(c)] = { (d), (type) + 1 },
+	TOKEN_OPERATORS_2(X)
+#undef X
+};
+
+/*
+ * Keywords sit in a perfect hash keyed on (length + first byte) & 7,
+ * which happens to give all six a distinct slot.  One table probe and
+ * one memcmp classify any identifier.
+ */
+#define KEYWORD_SLOT(s, len)	(((len) + (unsigned char)(s)[0]) & 7)
+
+static const struct {
+	const char	*name;
+	int		 len;
+	enum token_type	 type;
+} keywords[8] = {
+	[0] = { "return", 6, TOKEN_RETURN },
+	[1] = { "else",   4, TOKEN_ELSE   },
+	[3] = { "if",     2, TOKEN_IF     },
+	[4] = { "while",  5, TOKEN_WHILE  },
+	[5] = { "print",  5, TOKEN_PRINT  },
+	[7] = { "def",    3, TOKEN_DEF    },
+};
+
+static enum token_type classify_keyword(const char *s, int len)
 {
-	if (!strcmp(s, "if"))     return TOKEN_IF;
-	if (!strcmp(s, "else"))   return TOKEN_ELSE;
-	if (!strcmp(s, "while"))  return TOKEN_WHILE;
-	if (!strcmp(s, "def"))    return TOKEN_DEF;
-	if (!strcmp(s, "return")) return TOKEN_RETURN;
-	if (!strcmp(s, "print"))  return TOKEN_PRINT;
+	int slot = KEYWORD_SLOT(s, len);
+
+	if (keywords[slot].len == len && !memcmp(s, keywords[slot].name, len))
+		return keywords[slot].type;
 
 	return TOKEN_IDENTIFIER;
 }
 
+/*
+ * Powers of ten that are exact in a double.  A literal with at most
+ * NUM_EXACT_DIGITS digits has an exact mantissa, so dividing it by one
+ * of these is correctly rounded and matches what atof() returns.
+ */
+#define NUM_EXACT_DIGITS	15
+
+static const double exact_pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
 static struct token read_number(struct lexer *lex)
 {
+	const char *s = lex->source + lex->position;
 	char buf[NUM_BUF_CAP];
+	uint64_t mantissa = 0;
+	int max = NUM_BUF_CAP - 1;
+	size_t start = lex->position;
+	int dot = -1;
 	int j = 0;
-	int has_dot = 0;
-	int line = lex->line;
-	int col = lex->column;
 	struct token t;
 
-	while (j < NUM_BUF_CAP - 1 &&
-	       (isdigit(lex_peek(lex)) ||
-		(lex_peek(lex) == '.' && !has_dot))) {
-		if (lex_peek(lex) == '.')
-			has_dot = 1;
-		buf[j++] = lex_advance(lex);
+	if ((size_t)max > lex_rest(lex))
+		max = (int)lex_rest(lex);
+
+	for (; j < max; j++) {
+		if (CLASS(s[j]) == CC_DIGIT) {
+			mantissa = mantissa * 10 + (uint64_t)(s[j] - '0');
+			continue;
+		}
+		if (s[j] != '.' || dot >= 0)
+			break;
+		dot = j;
 	}
-	buf[j] = '\0';
 
-	t = make_tok(TOKEN_NUMBER, buf, line, col);
-	t.number = atof(buf);
+	t = make_tok(TOKEN_NUMBER, start, j);
+	lex_skip(lex, j);
 
+	if (j - (dot >= 0) <= NUM_EXACT_DIGITS) {
+		t.number = (double)mantissa;
+		if (dot >= 0)
+			t.number /= exact_pow10[j - dot - 1];
+		return t;
+	}
+
+	memcpy(buf, s, j);
+	buf[j] = '\0';
+	t.number = atof(buf);
 	return t;
 }
 
 static struct token read_identifier(struct lexer *lex)
 {
-	char buf[IDENT_BUF_CAP];
-	int  j    = 0;
-	int  line = lex->line;
-	int  col  = lex->column;
-
-	while (j < IDENT_BUF_CAP - 1 &&
-	       (isalnum(lex_peek(lex)) || lex_peek(lex) == '_'))
-		buf[j++] = lex_advance(lex);
-	buf[j] = '\0';
+	size_t start = lex->position;
+	int len;
+	struct token t;
 
-	return make_tok(classify_keyword(buf), buf, line, col);
+	lex_skip(lex, scan_ident(lex->source + start, lex_rest(lex)));
+
+	len = (int)(lex->position - start);
+	t   = make_tok(classify_keyword(lex->source + start, len),
+		       start, len);
+	if (t.type != TOKEN_IDENTIFIER)
+		return t;
+
+	t.atom = intern(lex->atoms, lex->source + start, (size_t)len);
+	if (t.atom == ATOM_INVALID)
+		t.type = TOKEN_ERROR;
+	return t;
 }
 
-static struct token read_string(struct lexer *lex)
+/*
+ * unescape() - Decode the escapes in a string literal body.
+ *
+ * Only called for bodies that actually contain a backslash, so plain
+ * literals never allocate.  Return: heap copy, or NULL on OOM.
+ */
+static char *unescape(const char *body, int len, int *out_len)
 {
-	char buf[STRING_BUF_CAP];
-	int  j  = 0;
-	int  line = lex->line;
-	int  col = lex->column;
-	char quote = lex_advance(lex);
-	char esc;
+	char *buf;
+	int i;
+	int j = 0;
+
+	buf = malloc(len + 1);
+	if (!buf)
+		return NULL;
 
-	while (lex_peek(lex) != quote &&
-	       lex_peek(lex) != '\0'  &&
-	       j < STRING_BUF_CAP - 1) {
-		if (lex_peek(lex) != '\\') {
-			buf[j++] = lex_advance(lex);
+	for (i = 0; i < len; i++) {
+		if (body[i] != '\\') {
+			buf[j++] = body[i];
 			continue;
 		}
-		lex_advance(lex);
-		esc = lex_advance(lex);
-		switch (esc) {
+		if (++i >= len)
+			break;
+		switch (body[i]) {
 		case 'n':  buf[j++] = '\n'; break;
 		case 't':  buf[j++] = '\t'; break;
 		case 'r':  buf[j++] = '\r'; break;
-		case '\\': buf[j++] = '\\'; break;
-		case '"':  buf[j++] = '"';  break;
-		case '\'': buf[j++] = '\''; break;
-		default:   buf[j++] = esc;  break;
+		default:   buf[j++] = body[i]; break;
 		}
 	}
 
+	buf[j] = '\0';
+	*out_len = j;
+	return buf;
+}
+
+static struct token read_string(struct lexer *lex)
+{
+	char quote = lex_advance(lex);
+	size_t start = lex->position;
+	int has_escape = 0;
+	struct token t;
+	char c;
+
+	for (;;) {
+		lex_skip(lex, scan_string(lex->source + lex->position,
+					  lex_rest(lex), quote));
+		c = lex_peek(lex);
+		if (c == quote)
+			break;
+		if (c == '\0') {
+			/* The literal runs on into the next window. */
+			if (lex->position < lex->source_len ||
+			    !lex_refill(lex, start))
+				break;
+			start = 0;
+			continue;
+		}
+		if (c == '\\') {
+			has_escape = 1;
+			lex_advance(lex);
+			if (lex_peek(lex) == '\0')
+				break;
+		}
+		lex_advance(lex);	/* newline or escaped byte */
+	}
+
+	t = make_tok(TOKEN_STRING, start, (int)(lex->position - start));
+
 	if (lex_peek(lex) == quote)
 		lex_advance(lex);
 
-	buf[j] = '\0';
-	return make_tok(TOKEN_STRING, buf, line, col);
+	/* A streamed window moves on, so the text is always copied. */
+	if (!has_escape && !lex->input)
+		return t;
+
+	t.owned = unescape(lex->source + start, t.length, &t.length);
+	if (!t.owned) {
+		fprintf(stderr, "lexer: out of memory\n");
+		t.type = TOKEN_ERROR;
+		t.length = 0;
+	}
+	return t;
 }
 
 /* --- Indentation handling ------------------------------------------------ */
 
-static int is_blank_line(const struct lexer *lex, int tmp_pos)
+static int is_blank_line(const struct lexer *lex, size_t tmp_pos)
 {
 	char c;
 
@@ -211,10 +538,10 @@ static int is_blank_line(const struct lexer *lex, int tmp_pos)
 	return (c == '\n' || c == '#' || c == '\0');
 }
 
-static int count_indent(const struct lexer *lex, int *out_pos)
+static int count_indent(const struct lexer *lex, size_t *out_pos)
 {
 	int spaces = 0;
-	int tmp_pos = lex->position;
+	size_t tmp_pos = lex->position;
 
 	while (tmp_pos < lex->source_len &&
 	       (lex->source[tmp_pos] == ' ' ||
@@ -255,12 +582,13 @@ static int push_indent(struct lexer *lex, int spaces)
  *
  * Sets *emitted to 1 and returns the token if the indentation level
  * changed.  Sets *emitted to 0 and returns a dummy token otherwise.
- * Multiple DEDENT levels are queued in lex->pending_dedents.
+ * Multiple DEDENT levels are queued in lex->pending_dedents.  With
+ * lex->raw_indent set, the line's width is handed back instead.
  */
 static struct token handle_line_start(struct lexer *lex, int *emitted)
 {
-	struct token dummy = make_tok(TOKEN_EOF, "EOF", lex->line, 1);
-	int tmp_pos;
+	struct token dummy = make_tok(TOKEN_EOF, lex->position, 0);
+	size_t tmp_pos;
 	int spaces;
 	int current;
 	int dedents;
@@ -274,6 +602,15 @@ static struct token handle_line_start(struct lexer *lex, int *emitted)
 		return dummy;
 	}
 
+	if (lex->raw_indent) {
+		lex_skip_ws(lex);
+		lex->at_line_start = 0;
+		*emitted = 1;
+		dummy = make_tok(TOKEN_INDENT, lex->position, 0);
+		dummy.number = spaces;
+		return dummy;
+	}
+
 	current = lex->indent_stack[lex->indent_top];
 
 	if (spaces == current) {
@@ -288,7 +625,7 @@ static struct token handle_line_start(struct lexer *lex, int *emitted)
 		if (!push_indent(lex, spaces))
 			return dummy;
 		*emitted = 1;
-		return make_tok(TOKEN_INDENT, "INDENT", lex->line, 1);
+		return make_tok(TOKEN_INDENT, lex->position, 0);
 	}
 
 	/* Dedent: pop levels and queue extras. */
@@ -303,60 +640,62 @@ static struct token handle_line_start(struct lexer *lex, int *emitted)
 
 	lex->pending_dedents = dedents - 1;
 	*emitted = 1;
-	return make_tok(TOKEN_DEDENT, "DEDENT", lex->line, 1);
+	return make_tok(TOKEN_DEDENT, lex->position, 0);
 }
 
-/* --- Two-character operator dispatch ------------------------------------ */
+/* --- Operators ---------------------------------------------------------- */
 
-static struct token try_two_char(struct lexer *lex, char first,
-				 int line, int col)
+/*
+ * read_operator() - Run the operator tables from the byte at the cursor.
+ *
+ * Neither byte can be a newline, so the cursor moves with lex_skip().
+ * A non-ASCII character matches nothing; its error token covers the
+ * whole character rather than its lead byte.
+ */
+static struct token read_operator(struct lexer *lex)
 {
-	char next = lex_peek(lex);
-
-	if (next != '=')
-		return make_tok(TOKEN_ERROR, "?", line, col);
+	size_t start = lex->position;
+	unsigned char c = (unsigned char)lex->source[start];
+	int len = 1;
+
+	if (c >= 0x80) {
+		while (start + len < lex->utf8_end && len < 4 &&
+		       ((unsigned char)lex->source[start + len] & 0xC0) == 0x80)
+			len++;
+		lex_skip(lex, len);
+		return make_tok(TOKEN_ERROR, start, len);
+	}
 
-	switch (first) {
-	case '=':
-		lex_advance(lex);
-		return make_tok(TOKEN_EQUAL, "==", line, col);
-	case '!':
-		lex_advance(lex);
-		return make_tok(TOKEN_NOT_EQUAL, "!=", line, col);
-	case '<':
-		lex_advance(lex);
-		return make_tok(TOKEN_LESS_EQUAL, "<=", line, col);
-	case '>':
-		lex_advance(lex);
-		return make_tok(TOKEN_GREATER_EQUAL, ">=", line, col);
-	default:
-		return make_tok(TOKEN_ERROR, "?", line, col);
+	if (op_double[c].type && lex_rest(lex) > 1 &&
+	    lex->source[start + 1] == op_double[c].second) {
+		lex_skip(lex, 2);
+		return make_tok(op_double[c].type - 1, start, 2);
 	}
+
+	lex_skip(lex, 1);
+	if (op_single[c])
+		return make_tok(op_single[c] - 1, start, 1);
+	return make_tok(TOKEN_ERROR, start, 1);
 }
 
 /* --- Public API ---------------------------------------------------------- */
 
-/**
- * lexer_next_token() - Return the next token from the source stream.
- */
-struct token lexer_next_token(struct lexer *lex)
+static struct token next_token(struct lexer *lex)
 {
 	struct token tok;
 	int emitted;
-	int line;
-	int col;
+	size_t start;
 	char c;
-	char buf[2];
-
-	if (!lex)
-		return make_tok(TOKEN_ERROR, "?", 0, 0);
 
 	/* Drain queued DEDENT tokens first. */
 	if (lex->pending_dedents > 0) {
 		lex->pending_dedents--;
-		return make_tok(TOKEN_DEDENT, "DEDENT", lex->line, 1);
+		return make_tok(TOKEN_DEDENT, lex->position, 0);
 	}
 
+	if (lex->position >= lex->source_len)
+		lex_refill(lex, lex->position);
+
 	if (lex->at_line_start) {
 		tok = handle_line_start(lex, &emitted);
 		if (emitted)
@@ -370,60 +709,131 @@ struct token lexer_next_token(struct lexer *lex)
 		lex_skip_ws(lex);
 	}
 
-	line = lex->line;
-	col  = lex->column;
-	c    = lex_peek(lex);
+	start = lex->position;
+	c     = lex_peek(lex);
 
-	if (c == '\0') {
+	switch (CLASS(c)) {
+	case CC_NUL:
 		if (lex->indent_top > 0) {
 			lex->indent_top--;
-			return make_tok(TOKEN_DEDENT, "DEDENT", line, col);
+			return make_tok(TOKEN_DEDENT, start, 0);
 		}
-		return make_tok(TOKEN_EOF, "EOF", line, col);
+		return make_tok(TOKEN_EOF, start, 0);
+	case CC_NEWLINE:
+		lex_advance(lex);
+		return make_tok(TOKEN_NEWLINE, start, 1);
+	case CC_DIGIT:
+		return read_number(lex);
+	case CC_IDENT:
+		return read_identifier(lex);
+	case CC_QUOTE:
+		return read_string(lex);
+	default:
+		return read_operator(lex);
 	}
+}
 
-	if (c == '\n') {
-		lex_advance(lex);
-		return make_tok(TOKEN_NEWLINE, "\n", line, col);
+/*
+ * stream_token() - Finish a token from a streaming lexer: give an error
+ *                  token a copy of its text and make the offset count
+ *                  from the start of the input.
+ */
+static struct token stream_token(struct lexer *lex, struct token tok)
+{
+	if (lex->failed && tok.type != TOKEN_ERROR) {
+		free(tok.owned);
+		tok = make_tok(TOKEN_ERROR, lex->position, 0);
 	}
 
-	if (isdigit(c))
-		return read_number(lex);
+	if (tok.type == TOKEN_ERROR && !tok.owned && tok.length > 0) {
+		tok.owned = malloc((size_t)tok.length);
+		if (tok.owned)
+			memcpy(tok.owned, lex->source + tok.offset,
+			       (size_t)tok.length);
+		else
+			tok.length = 0;
+	}
 
-	if (isalpha(c) || c == '_')
-		return read_identifier(lex);
+	tok.offset += lex->base;
+	return tok;
+}
 
-	if (c == '"' || c == '\'')
-		return read_string(lex);
+/**
+ * lexer_next_token() - Return the next token from the source stream.
+ *
+ * A token that would run over ill-formed UTF-8 is replaced by an error
+ * at the offending byte.
+ */
+struct token lexer_next_token(struct lexer *lex)
+{
+	struct token tok;
 
-	lex_advance(lex);
+	if (!lex)
+		return make_tok(TOKEN_ERROR, 0, 0);
 
-	/* Try two-character operators first. */
-	if (c == '=' || c == '!' || c == '<' || c == '>') {
-		tok = try_two_char(lex, c, line, col);
-		if (tok.type != TOKEN_ERROR)
-			return tok;
-		free(tok.value);
+	tok = next_token(lex);
+	if (lex->position > lex->utf8_end) {
+		/* Report the first ill-formed byte itself. */
+		free(tok.owned);
+		tok = make_tok(TOKEN_ERROR, lex->utf8_end, 1);
 	}
 
-	/* Single-character operators. */
-	switch (c) {
-	case '+': return make_tok(TOKEN_PLUS,     "+", line, col);
-	case '-': return make_tok(TOKEN_MINUS,    "-", line, col);
-	case '*': return make_tok(TOKEN_MULTIPLY, "*", line, col);
-	case '/': return make_tok(TOKEN_DIVIDE,   "/", line, col);
-	case '(': return make_tok(TOKEN_LPAREN,   "(", line, col);
-	case ')': return make_tok(TOKEN_RPAREN,   ")", line, col);
-	case ',': return make_tok(TOKEN_COMMA,    ",", line, col);
-	case ':': return make_tok(TOKEN_COLON,    ":", line, col);
-	case '=': return make_tok(TOKEN_ASSIGN,   "=", line, col);
-	case '<': return make_tok(TOKEN_LESS,     "<", line, col);
-	case '>': return make_tok(TOKEN_GREATER,  ">", line, col);
-	default:
-		break;
+	if (lex->input)
+		tok = stream_token(lex, tok);
+	return tok;
+}
+
+/*
+ * Spellings for token_text() when there is no source to point into.
+ * Operators come from the same lists as the transition tables.
+ */
+static const char op_text[TOKEN_ERROR + 1][3] = {
+#define X(type, c)		[type] = { (c) },
+	TOKEN_OPERATORS_1(X)
+#undef X
+#define X(type, c, d)		[type] = { (c), (d) },
+	TOKEN_OPERATORS_2(X)
+#undef X
+};
+
+/* spell() - Text of a token that is fixed by its type, or "". */
+static const char *spell(enum token_type type, int *len)
+{
+	int j;
+
+	if (type == TOKEN_NEWLINE) {
+		*len = 1;
+		return "\n";
 	}
+	for (j = 0; j < 8; j++)
+		if (keywords[j].name && keywords[j].type == type) {
+			*len = keywords[j].len;
+			return keywords[j].name;
+		}
+	*len = (int)strlen(op_text[type]);
+	return op_text[type];
+}
 
-	buf[0] = c;
-	buf[1] = '\0';
-	return make_tok(TOKEN_ERROR, buf, line, col);
+/**
+ * token_text() - Return a token's text and its length.
+ */
+const char *token_text(const char *source, const struct token *tok,
+		       int *len)
+{
+	*len = tok->length;
+
+	if (tok->owned)
+		return tok->owned;
+
+	if (tok->length > 0 && source)
+		return source + tok->offset;
+	if (tok->length > 0)
+		return spell(tok->type, len);
+
+	switch (tok->type) {
+	case TOKEN_INDENT:	*len = 6; return "INDENT";
+	case TOKEN_DEDENT:	*len = 6; return "DEDENT";
+	case TOKEN_EOF:		*len = 3; return "EOF";
+	default:		return "";
+	}
 }
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "line_index.h"
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * line_index_create() - Make an index for @text without scanning it.
+ */
+struct line_index *line_index_create(const char *text, size_t length)
+{
+	struct line_index *index;
+
+	index = calloc(1, sizeof(*index));
+	if (!index) {
+		fprintf(stderr, "line_index: out of memory\n");
+		return NULL;
+	}
+
+	index->text   = text;
+	index->length = length;
+	return index;
+}
+
+/**
+ * line_index_destroy() - Free an index.
+ */
+void line_index_destroy(struct line_index *index)
+{
+	if (!index)
+		return;
+	free(index->starts);
+	free(index);
+}
+
+/**
+ * line_index_extend() - Record the lines in the next piece of a source.
+ */
+int line_index_extend(struct line_index *index, const char *piece,
+		      size_t n)
+{
+	size_t lines = scan_newlines(piece, n, NULL);
+	size_t need = index->count + lines + !index->count;
+	size_t cap = index->cap ? index->cap : 1;
+	size_t *grown;
+	size_t j;
+
+	if (need > index->cap) {
+		while (cap < need)
+			cap *= 2;
+		grown = realloc(index->starts, sizeof(*grown) * cap);
+		if (!grown) {
+			fprintf(stderr, "line_index: out of memory\n");
+			return 0;
+		}
+		index->starts = grown;
+		index->cap    = cap;
+	}
+	if (!index->count)
+		index->starts[index->count++] = 0;
+
+	scan_newlines(piece, n, index->starts + index->count);
+	for (j = 0; j < lines; j++)
+		index->starts[index->count + j] += index->length;
+	index->count  += lines;
+	index->length += n;
+	return 1;
+}
+
+/* build() - Fill in @index->starts; returns 0 if it cannot be allocated. */
+static int build(struct line_index *index)
+{
+	size_t lines;
+
+	if (index->starts)
+		return 1;
+	if (!index->text)
+		return 0;
+
+	lines = scan_newlines(index->text, index->length, NULL) + 1;
+	index->starts = malloc(sizeof(*index->starts) * lines);
+	if (!index->starts)
+		return 0;
+
+	index->starts[0] = 0;
+	scan_newlines(index->text, index->length, index->starts + 1);
+	index->count = lines;
+	return 1;
+}
+
+/* line_start() - Offset of the start of the line holding @offset. */
+static size_t line_start(struct line_index *index, size_t offset,
+			 size_t *line)
+{
+	size_t lo = 0;
+	size_t hi;
+	size_t mid;
+
+	if (!build(index)) {
+		*line = 0;
+		if (!index->text)
+			return 0;
+		*line = scan_newlines(index->text, offset, NULL);
+		while (offset > 0 && index->text[offset - 1] != '\n')
+			offset--;
+		return offset;
+	}
+
+	/* Last start at or before @offset. */
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->starts[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*line = lo - 1;
+	return index->starts[lo - 1];
+}
+
+/**
+ * line_index_line() - Line holding byte @offset (1-based).
+ */
+int line_index_line(struct line_index *index, size_t offset)
+{
+	size_t line;
+
+	if (!index)
+		return 0;
+	if (offset > index->length)
+		offset = index->length;
+
+	line_start(index, offset, &line);
+	return (int)line + 1;
+}
+
+/**
+ * line_index_column() - Column of byte @offset within its line.
+ */
+int line_index_column(struct line_index *index, size_t offset)
+{
+	size_t line;
+	size_t j;
+	int column = 1;
+
+	if (!index || !index->text)
+		return 0;
+	if (offset > index->length)
+		offset = index->length;
+
+	/* Count code points: skip UTF-8 continuation bytes. */
+	for (j = line_start(index, offset, &line); j < offset; j++)
+		column += ((unsigned char)index->text[j] & 0xC0) != 0x80;
+	return column;
+}
@@ -1,149 +1,1360 @@
 #include "utils.h"
 #include "token.h"
+#include "token_stream.h"
 #include "lexer.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "intern.h"
+#include "source.h"
+#include "incremental.h"
+#include "scan.h"
+#include "lex_parallel.h"
+#include "lex_pipe.h"
+#include "thread_pool.h"
+#include "line_index.h"
+#include "arena.h"
+#include "flat_ast.h"
+#include "ast_cache.h"
+#include "bundle.h"
+#include "memo.h"
+#include "optimise.h"
+#include "sha256.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define TOKEN_INIT_CAP	1024
+/* Each benchmark configuration repeats until it has run this long. */
+#define BENCH_MIN_SECONDS	0.5
 
-/* --- Token array --------------------------------------------------------- */
+/* Upper bound for --jobs. */
+#define JOBS_MAX		256
 
-static void token_array_free(struct token *tokens, int count)
+/*
+ * Largest source parsed from a token array.  A token takes at least a
+ * byte, bar a DEDENT, which closes an INDENT that took one, so this
+ * many bytes lex to no more than INT_MAX tokens.
+ */
+#define ARRAY_SOURCE_MAX	((size_t)INT_MAX / 2)
+
+/* --interleave passes output on at least this often. */
+#define FLUSH_SECONDS		0.01
+
+/* --- Token stream -------------------------------------------------------- */
+
+static struct token_stream *tokenise(const char *source,
+				     struct intern_table *atoms)
 {
-	int j;
+	struct lexer *lex;
+	struct token_stream *tokens;
+	struct token tok;
 
-	if (!tokens)
-		return;
-	for (j = 0; j < count; j++)
-		free(tokens[j].value);
-	free(tokens);
+	if (!source)
+		return NULL;
+
+	lex = lexer_create(source, atoms);
+	if (!lex)
+		return NULL;
+
+	tokens = token_stream_create();
+	if (!tokens) {
+		lexer_destroy(lex);
+		return NULL;
+	}
+
+	do {
+		tok = lexer_next_token(lex);
+		if (!token_stream_push(tokens, &tok)) {
+			token_stream_destroy(tokens);
+			lexer_destroy(lex);
+			return NULL;
+		}
+	} while (tok.type != TOKEN_EOF && tok.type != TOKEN_ERROR);
+
+	lexer_destroy(lex);
+	return tokens;
 }
 
-/* grow_tokens() - Double token array capacity. Returns new pointer or NULL. */
-static struct token *grow_tokens(struct token *tokens, int *capacity)
+/* --- Compilation pipeline ----------------------------------------------- */
+
+static double now_seconds(void)
 {
-	struct token	*grown;
-	int		 new_cap = (*capacity) * 2;
+	struct timespec ts;
 
-	grown = realloc(tokens, sizeof(struct token) * new_cap);
-	if (!grown)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * struct run_options - Switches selected on the command line.
+ * @stream:    Parse straight from the lexer instead of materialising
+ *             the whole token array first.
+ * @pipeline:  As @stream, but with the lexer on a thread of its own.
+ * @flat:      Flatten the tree (see flat_ast.h) and run that instead.
+ * @lazy:      Parse function bodies on first call, not up front.
+ * @interleave: Run each top-level statement as soon as it is parsed.
+ * @bench_lex: Measure lexer throughput instead of running the file.
+ * @bench_edit: Time an incremental edit against a full re-parse.
+ * @bench_walk: Compare the pointer and flat tree layouts.
+ * @jobs:      Threads to lex large files on; 0 means one per CPU.
+ * @cache:     Directory of compiled trees (see ast_cache.h), or NULL.
+ * @optimise:  Optimisation level: 0 runs the tree as parsed, 1 runs
+ *             it through optimise() first.
+ * @opt_stats: Report what optimise() changed on stderr.
+ * @memo:      Cache the results of calls to pure functions (see memo.h).
+ * @memo_stats: Report how often the cache answered a call on stderr.
+ * @bundle:    Write a standalone executable here instead of running
+ *             the program (see bundle.h), or NULL.
+ * @self:      Path of the running executable, copied into bundles.
+ */
+struct run_options {
+	int stream;
+	int pipeline;
+	int flat;
+	int lazy;
+	int interleave;
+	int bench_lex;
+	int bench_edit;
+	int bench_walk;
+	int jobs;
+	const char *cache;
+	int optimise;
+	int opt_stats;
+	int memo;
+	int memo_stats;
+	const char *bundle;
+	const char *self;
+};
+
+/*
+ * front_end_pool() - Threads to lex and parse @source on, or NULL when
+ *                    one thread will do: @jobs is 1 or @source is too
+ *                    small to split.
+ */
+static struct thread_pool *front_end_pool(const char *source, int jobs)
+{
+	if (jobs == 0)
+		jobs = thread_pool_cpus();
+	if (jobs == 1 || strlen(source) < 2 * LEX_PARALLEL_MIN_CHUNK)
 		return NULL;
-	*capacity = new_cap;
-	return grown;
+	return thread_pool_create(jobs);
+}
+
+/*
+ * parse_array() - Tokenise all of @source, then parse the stream; both
+ *                 on @jobs threads when @source is large enough.
+ *
+ * The token stream is handed back through @tokens so the caller can
+ * free it alongside the AST.  @lines places a lexer error.  With
+ * @lazy, function bodies are deferred and the parser is handed back
+ * through it to parse them later.
+ */
+static struct ast_node *parse_array(const char *source,
+				    struct intern_table *atoms,
+				    struct line_index *lines, int jobs,
+				    struct arena *arena,
+				    struct token_stream **tokens,
+				    struct parser **lazy)
+{
+	struct thread_pool *pool;
+	struct parser *parser;
+	struct ast_node	*ast = NULL;
+	struct token last;
+	const char *text;
+	int len;
+
+	/* One pool serves both stages. */
+	pool = front_end_pool(source, jobs);
+	if (pool)
+		*tokens = lex_parallel(source, strlen(source), atoms, pool);
+	else
+		*tokens = tokenise(source, atoms);
+	if (!*tokens)
+		goto out;
+
+	/* The stream stops at the first error, so only its end can be one. */
+	token_stream_get(*tokens, (*tokens)->count - 1, &last);
+	if (last.type == TOKEN_ERROR) {
+		text = token_text(source, &last, &len);
+		fprintf(stderr,
+			"lexer error: invalid token '%.*s' "
+			"at line %d\n",
+			len, text, line_index_line(lines, last.offset));
+		goto out;
+	}
+
+	parser = parser_create(*tokens, source, arena);
+	if (!parser)
+		goto out;
+
+	parser_set_pool(parser, pool);
+	parser_set_lazy(parser, lazy != NULL);
+	ast = parser_parse_program(parser);
+	if (ast && lazy) {
+		/* Deferred bodies are parsed serially; the pool goes. */
+		parser_set_pool(parser, NULL);
+		*lazy = parser;
+	} else {
+		parser_destroy(parser);
+	}
+
+	if (!ast)
+		fprintf(stderr, "parse error: could not build AST\n");
+out:
+	thread_pool_destroy(pool);
+	return ast;
 }
 
-static struct token *tokenise(const char *source, int *count)
+/*
+ * parse_stream() - Lex and parse in lock-step without a token array.
+ *
+ * A source left open as a stream is lexed a window at a time, feeding
+ * @lines as it goes.
+ */
+static struct ast_node *parse_stream(const struct source *src,
+				     struct intern_table *atoms,
+				     struct line_index *lines,
+				     struct arena *arena)
 {
 	struct lexer *lex;
-	struct token *tokens;
-	struct token *grown;
-	int capacity = TOKEN_INIT_CAP;
-	struct token tok;
+	struct parser *parser;
+	struct ast_node	*ast;
+	int lex_error;
 
-	if (!source || !count)
+	if (src->file)
+		lex = lexer_create_stream(src->file, atoms, lines);
+	else
+		lex = lexer_create(src->text, atoms);
+	if (!lex)
 		return NULL;
 
-	lex = lexer_create(source);
+	parser = parser_create_stream(lex, arena);
+	if (!parser) {
+		lexer_destroy(lex);
+		return NULL;
+	}
+
+	ast = parser_parse_program(parser);
+	lex_error = parser->error;
+	parser_destroy(parser);
+	lexer_destroy(lex);
+
+	if (!ast && !lex_error)
+		fprintf(stderr, "parse error: could not build AST\n");
+	return ast;
+}
+
+/*
+ * parse_pipeline() - Lex on a second thread while this one parses.
+ *
+ * Falls back to parse_stream() if the thread cannot be started.
+ */
+static struct ast_node *parse_pipeline(const struct source *src,
+				       struct intern_table *atoms,
+				       struct line_index *lines,
+				       struct arena *arena)
+{
+	struct lexer *lex;
+	struct lex_pipe *pipe;
+	struct parser *parser;
+	struct ast_node	*ast;
+	int lex_error;
+
+	lex = lexer_create(src->text, atoms);
 	if (!lex)
 		return NULL;
 
-	tokens = malloc(sizeof(struct token) * capacity);
-	if (!tokens) {
+	pipe = lex_pipe_start(lex);
+	if (!pipe) {
+		lexer_destroy(lex);
+		return parse_stream(src, atoms, lines, arena);
+	}
+
+	parser = parser_create_pipe(pipe, arena);
+	if (!parser) {
+		lex_pipe_stop(pipe);
 		lexer_destroy(lex);
 		return NULL;
 	}
 
-	*count = 0;
+	ast = parser_parse_program(parser);
+	lex_error = parser->error;
+	parser_destroy(parser);
+	lex_pipe_stop(pipe);
+	lexer_destroy(lex);
+
+	if (!ast && !lex_error)
+		fprintf(stderr, "parse error: could not build AST\n");
+	return ast;
+}
 
-	for (;;) {
-		tok = lexer_next_token(lex);
+/*
+ * parse_source() - Build the tree for @src the way @opts asks.
+ *
+ * A token array counts its tokens in an int, so a source past
+ * ARRAY_SOURCE_MAX is parsed straight from the lexer whatever @opts
+ * asks for.  A token
+ * array is handed back through @tokens.  Only a token array can be
+ * parsed lazily: if @lazy is set and a parser comes back through it,
+ * function bodies were deferred to it.
+ */
+static struct ast_node *parse_source(const struct source *src,
+				     const struct run_options *opts,
+				     struct intern_table *atoms,
+				     struct line_index *lines,
+				     struct arena *arena,
+				     struct token_stream **tokens,
+				     struct parser **lazy)
+{
+	if (src->file)
+		return parse_stream(src, atoms, lines, arena);
+	if (opts->pipeline)
+		return parse_pipeline(src, atoms, lines, arena);
+	if (opts->stream || src->length > ARRAY_SOURCE_MAX)
+		return parse_stream(src, atoms, lines, arena);
+	return parse_array(src->text, atoms, lines, opts->jobs, arena,
+			   tokens, lazy);
+}
 
-		if (*count >= capacity) {
-			grown = grow_tokens(tokens, &capacity);
-			if (!grown) {
-				token_array_free(tokens, *count);
-				lexer_destroy(lex);
-				return NULL;
-			}
-			tokens = grown;
-		}
+/* report_optimise() - Print what optimise() changed, for --opt-stats. */
+static void report_optimise(const struct optimise_stats *stats)
+{
+	fprintf(stderr,
+		"optimise: %zu nodes -> %zu: %zu folded, %zu propagated, "
+		"%zu pruned, %zu dropped\n", stats->nodes_before,
+		stats->nodes_after, stats->folded, stats->propagated,
+		stats->pruned, stats->dropped);
+}
+
+/* report_memo() - Print how well --memo did, for --memo-stats. */
+static void report_memo(struct memo *memo)
+{
+	const struct memo_stats *stats = &memo->stats;
+
+	fprintf(stderr,
+		"memo: %zu pure functions, %zu calls, %zu hits (%.1f%%), "
+		"%zu stored, %zu evicted, %zu flushed\n",
+		memo_pure_count(memo), stats->calls, stats->hits,
+		stats->calls ? 100.0 * stats->hits / stats->calls : 0.0,
+		stats->stored, stats->evicted, stats->flushed);
+}
+
+/*
+ * binds_function() - Whether running top-level @stmt may bind a name to
+ *                    a function defined inside it.
+ *
+ * A definition in the body of a top-level if or while binds a global
+ * like one at the top level; one in a function body binds only when
+ * the function runs, and the enclosing definition keeps it alive.
+ */
+static int binds_function(const struct ast_node *stmt)
+{
+	int j;
+
+	if (!stmt)
+		return 0;
+
+	switch (stmt->type) {
+	case AST_FUNCTION_DEF:
+		return 1;
+	case AST_IF_STMT:
+		return binds_function(stmt->data.if_stmt.then_block) ||
+		       binds_function(stmt->data.if_stmt.else_block);
+	case AST_WHILE_STMT:
+		return binds_function(stmt->data.while_stmt.body);
+	case AST_BLOCK:
+		for (j = 0; j < stmt->data.block.count; j++)
+			if (binds_function(stmt->data.block.statements[j]))
+				return 1;
+		return 0;
+	default:
+		return 0;
+	}
+}
 
-		tokens[(*count)++] = tok;
+/*
+ * run_interleaved() - Run each top-level statement of @src as soon as
+ *                     it is parsed.
+ *
+ * Tokens are pulled from the lexer, or from a lexer thread with
+ * --pipeline, so no token array is built.  Each statement is built in
+ * an arena of its own that is released once the statement has run,
+ * unless it defined a function: then the arena joins @keep for the
+ * rest of the run.  Memory is bounded by the largest statement plus
+ * the function definitions rather than by the program.  Output is
+ * flushed between statements every FLUSH_SECONDS, so it reaches a
+ * pipe while the rest of the program is still being parsed.
+ *
+ * A syntax error that stops the parser stops the run, but unlike a
+ * whole-program parse, the statements before it have already run.
+ */
+static int run_interleaved(const struct source *src,
+			   const struct run_options *opts,
+			   struct intern_table *atoms,
+			   struct line_index *lines)
+{
+	struct interpreter *interp = NULL;
+	struct parser *parser = NULL;
+	struct lex_pipe *pipe = NULL;
+	struct memo *memo = NULL;
+	struct arena *scratch = NULL;
+	struct arena *keep;
+	struct ast_node	*stmt;
+	struct lexer *lex;
+	struct optimise_stats stats = { 0 };
+	double flushed;
+	double now;
+	int rc = 1;
+
+	if (src->file)
+		lex = lexer_create_stream(src->file, atoms, lines);
+	else
+		lex = lexer_create(src->text, atoms);
+	if (!lex)
+		return 1;
 
-		if (tok.type == TOKEN_EOF || tok.type == TOKEN_ERROR)
+	keep = arena_create();
+	if (!keep)
+		goto done;
+
+	if (opts->pipeline && !src->file)
+		pipe = lex_pipe_start(lex);
+	if (pipe)
+		parser = parser_create_pipe(pipe, keep);
+	else
+		parser = parser_create_stream(lex, keep);
+	interp = interpreter_create(atoms, lines);
+	if (!parser || !interp)
+		goto done;
+	if (opts->memo) {
+		memo = memo_create();
+		if (!memo)
+			goto done;
+		interpreter_set_memo(interp, memo);
+	}
+
+	flushed = now_seconds();
+	for (;;) {
+		if (!scratch) {
+			scratch = arena_create();
+			if (!scratch)
+				goto done;
+		}
+		if (parser_current(parser)->type == TOKEN_EOF)
 			break;
+
+		/* A definition outlives its statement; build it in place. */
+		if (parser_current(parser)->type == TOKEN_DEF)
+			parser->arena = keep;
+		else
+			parser->arena = scratch;
+
+		stmt = parser_parse_toplevel(parser);
+		if (parser->error)
+			goto done;
+		if (stmt && opts->optimise)
+			stmt = optimise(stmt, parser->arena, atoms, &stats);
+		if (!stmt)
+			continue;
+
+		if (memo)
+			memo_scan_ast(memo, stmt);
+		interpreter_evaluate(interp, stmt);
+		now = now_seconds();
+		if (now - flushed >= FLUSH_SECONDS) {
+			fflush(stdout);
+			flushed = now;
+		}
+
+		if (parser->arena == keep)
+			continue;
+		/* The next scratch arena may reuse this one's address. */
+		hashcons_reset(&parser->consts);
+		if (binds_function(stmt))
+			arena_merge(keep, scratch);
+		else
+			arena_destroy(scratch);
+		scratch = NULL;
 	}
+	rc = 0;
 
+done:
+	if (opts->opt_stats)
+		report_optimise(&stats);
+	if (memo && opts->memo_stats)
+		report_memo(memo);
+	interpreter_destroy(interp);
+	memo_destroy(memo);
+	parser_destroy(parser);
+	if (pipe)
+		lex_pipe_stop(pipe);
 	lexer_destroy(lex);
-	return tokens;
+	arena_destroy(scratch);
+	arena_destroy(keep);
+	return rc;
 }
 
-/* --- Compilation pipeline ----------------------------------------------- */
-
-static int compile_and_run(const char *source)
+/*
+ * compile_and_run() - Parse and run one program.
+ *
+ * With a cache, a source seen before is not lexed or parsed at all:
+ * its flat tree is mapped from the cache and run as it lies.  On a
+ * miss the tree is flattened and stored for next time.  A streamed
+ * source is never held whole, so it cannot be hashed and skips the
+ * cache.  A tree to be flattened is parsed in full, even with --lazy.
+ * With -O1 the tree goes through optimise() before it is flattened,
+ * stored or run.  With --bundle the flat tree is written out with a
+ * copy of the interpreter instead of being run.
+ */
+static int compile_and_run(const struct source *src,
+			   const struct run_options *opts)
 {
-	int token_count = 0;
-	struct token *tokens;
-	struct parser *parser;
-	struct ast_node	*ast;
+	struct token_stream *tokens = NULL;
+	struct intern_table *atoms;
+	struct ast_node	*ast = NULL;
+	struct flat_ast *flat = NULL;
+	struct ast_image *image = NULL;
 	struct interpreter *interp;
-	int j;
-	int rc = 0;
+	struct line_index *lines;
+	struct arena *arena = NULL;
+	struct parser *bodies = NULL;
+	struct memo *memo = NULL;
+	struct optimise_stats stats = { 0 };
+	struct sha256 hash;
+	uint8_t key[SHA256_BYTES];
+	int cache = opts->cache && src->text;
+	int lazy;
+	int rc = 1;
 
-	if (!source)
+	if (!src->text && !src->file)
 		return 1;
 
-	tokens = tokenise(source, &token_count);
-	if (!tokens)
+	/* One table per compilation; the AST holds atoms, not strings. */
+	atoms = intern_create();
+	if (!atoms)
 		return 1;
 
-	for (j = 0; j < token_count; j++) {
-		if (tokens[j].type != TOKEN_ERROR)
-			continue;
-		fprintf(stderr,
-			"lexer error: invalid token '%s' "
-			"at line %d\n",
-			tokens[j].value, tokens[j].line);
-		token_array_free(tokens, token_count);
+	/* Not scanned until a diagnostic asks for a line number. */
+	lines = line_index_create(src->text, src->length);
+	if (!lines)
+		goto done;
+
+	if (opts->interleave && !opts->bundle) {
+		rc = run_interleaved(src, opts, atoms, lines);
+		goto done;
+	}
+
+	if (cache) {
+		/* Optimised trees are kept apart from the plain ones. */
+		sha256_init(&hash);
+		sha256_update(&hash, src->text, src->length);
+		if (opts->optimise)
+			sha256_update(&hash, "-O1", 3);
+		sha256_final(&hash, key);
+		image = ast_cache_load(opts->cache, key, src->length, atoms);
+		if (image)
+			goto run;
+	}
+
+	/* The whole tree, released in one go at the end. */
+	arena = arena_create();
+	if (!arena)
+		goto done;
+
+	lazy = opts->lazy && !opts->flat && !cache && !opts->bundle;
+	ast  = parse_source(src, opts, atoms, lines, arena, &tokens,
+			    lazy ? &bodies : NULL);
+	if (!ast)
+		goto done;
+
+	if (opts->optimise) {
+		ast = optimise(ast, arena, atoms, &stats);
+		if (opts->opt_stats)
+			report_optimise(&stats);
+	}
+
+	if (opts->flat || cache || opts->bundle) {
+		/* The copy needs nothing from the arena, so drop it now. */
+		flat = flat_ast_build(ast);
+		arena_destroy(arena);
+		arena = NULL;
+		if (!flat)
+			goto done;
+	}
+
+	if (cache)
+		ast_cache_store(opts->cache, key, src->length, flat, atoms);
+
+	if (opts->bundle) {
+		if (bundle_write(opts->bundle, opts->self, src->text,
+				 src->length, flat, atoms))
+			rc = 0;
+		goto done;
+	}
+
+run:
+	interp = interpreter_create(atoms, lines);
+	if (!interp)
+		goto done;
+
+	interpreter_set_parser(interp, bodies);
+	if (opts->memo) {
+		memo = memo_create();
+		if (!memo) {
+			interpreter_destroy(interp);
+			goto done;
+		}
+		if (image)
+			memo_scan_flat(memo, &image->ast);
+		else if (flat)
+			memo_scan_flat(memo, flat);
+		else
+			memo_scan_ast(memo, ast);
+		interpreter_set_memo(interp, memo);
+	}
+
+	if (image)
+		interpreter_run_flat(interp, &image->ast);
+	else if (flat)
+		interpreter_run_flat(interp, flat);
+	else
+		interpreter_evaluate(interp, ast);
+	interpreter_destroy(interp);
+	if (memo && opts->memo_stats)
+		report_memo(memo);
+	rc = 0;
+
+done:
+	memo_destroy(memo);
+	ast_cache_release(image);
+	flat_ast_destroy(flat);
+	parser_destroy(bodies);
+	arena_destroy(arena);
+	token_stream_destroy(tokens);
+	line_index_destroy(lines);
+	intern_destroy(atoms);
+	return rc;
+}
+
+/*
+ * run_bundle() - Run the program embedded in @self, if there is one.
+ *                Returns -1 when there is none, else the exit status.
+ *
+ * Only the embedded source's line table is ever built from it, and
+ * only if a diagnostic needs a line.
+ */
+static int run_bundle(const char *self)
+{
+	struct interpreter *interp = NULL;
+	struct line_index *lines = NULL;
+	struct intern_table *atoms;
+	struct bundle *bundle = NULL;
+	int rc;
+
+	atoms = intern_create();
+	if (!atoms)
 		return 1;
+
+	rc = bundle_open(self, atoms, &bundle);
+	if (rc <= 0) {
+		intern_destroy(atoms);
+		return rc ? 1 : -1;
 	}
 
-	parser = parser_create(tokens, token_count);
-	if (!parser) {
-		token_array_free(tokens, token_count);
+	rc = 1;
+	lines = line_index_create(bundle->source, bundle->length);
+	if (lines)
+		interp = interpreter_create(atoms, lines);
+	if (interp) {
+		interpreter_run_flat(interp, &bundle->ast);
+		rc = 0;
+	}
+
+	interpreter_destroy(interp);
+	line_index_destroy(lines);
+	bundle_close(bundle);
+	intern_destroy(atoms);
+	return rc;
+}
+
+/* --- Benchmarks ---------------------------------------------------------- */
+
+/* lex_all() - Lex @source to EOF once, discarding the tokens. */
+static int lex_all(const char *source)
+{
+	struct intern_table *atoms;
+	struct lexer *lex;
+	struct token tok;
+
+	atoms = intern_create();
+	if (!atoms)
+		return 0;
+
+	lex = lexer_create(source, atoms);
+	if (!lex) {
+		intern_destroy(atoms);
+		return 0;
+	}
+
+	do {
+		tok = lexer_next_token(lex);
+		free(tok.owned);
+	} while (tok.type != TOKEN_EOF && tok.type != TOKEN_ERROR);
+
+	lexer_destroy(lex);
+	intern_destroy(atoms);
+	return 1;
+}
+
+/*
+ * bench_tokens() - Report the throughput of building the whole token
+ *                  stream on @threads threads.
+ */
+static int bench_tokens(const char *source, int threads)
+{
+	struct intern_table *atoms;
+	struct thread_pool *pool;
+	struct token_stream *tokens;
+	int len = (int)strlen(source);
+	double start;
+	double elapsed;
+	int reps = 0;
+
+	pool = thread_pool_create(threads);
+	if (!pool)
 		return 1;
+
+	start = now_seconds();
+	do {
+		atoms  = intern_create();
+		tokens = atoms ? lex_parallel(source, len, atoms, pool) : NULL;
+		intern_destroy(atoms);
+		if (!tokens) {
+			thread_pool_destroy(pool);
+			return 1;
+		}
+		token_stream_destroy(tokens);
+		reps++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < BENCH_MIN_SECONDS);
+
+	thread_pool_destroy(pool);
+	printf("  %-8d %9.1f MB/s\n", threads, len * reps / elapsed / 1e6);
+	return 0;
+}
+
+/*
+ * bench_lex() - Report lexer throughput in MB/s for every scanner tier
+ *               this CPU supports, slowest first, then for the token
+ *               array on one thread and on @jobs.
+ */
+static int bench_lex(const char *source, int jobs)
+{
+	double size = (double)strlen(source);
+	double start;
+	double elapsed;
+	int best = scan_best_level();
+	int level;
+	int reps;
+
+	printf("lexer throughput (%.1f MB source)\n", size / 1e6);
+	for (level = SCAN_SCALAR; level <= best; level++) {
+		level = scan_set_level(level);
+		reps  = 0;
+		start = now_seconds();
+		do {
+			if (!lex_all(source))
+				return 1;
+			reps++;
+			elapsed = now_seconds() - start;
+		} while (elapsed < BENCH_MIN_SECONDS);
+		printf("  %-8s %9.1f MB/s\n", scan_level_name(level),
+		       size * reps / elapsed / 1e6);
 	}
 
-	ast = parser_parse_program(parser);
-	parser_destroy(parser);
+	scan_set_level(best);
 
-	if (!ast) {
-		fprintf(stderr, "parse error: could not build AST\n");
-		token_array_free(tokens, token_count);
+	if (!jobs)
+		jobs = thread_pool_cpus();
+	printf("token array by thread count\n");
+	if (bench_tokens(source, 1))
+		return 1;
+	return jobs > 1 ? bench_tokens(source, jobs) : 0;
+}
+
+/*
+ * bench_edit() - Compare parsing the whole file with updating it after
+ *                a blank line is inserted and removed mid-file.
+ */
+static int bench_edit(const char *source)
+{
+	struct incremental *session;
+	struct incremental *full;
+	struct incr_stats stats;
+	double start;
+	double whole;
+	double edit;
+	int mid;
+	int reps;
+
+	session = incremental_create(source);
+	if (!session)
+		return 1;
+	if (!session->valid || !session->count) {
+		fprintf(stderr,
+			"error: --bench-edit needs a file that parses\n");
+		incremental_destroy(session);
 		return 1;
 	}
 
-	interp = interpreter_create();
-	if (!interp) {
-		rc = 1;
-		goto done;
+	reps  = 0;
+	start = now_seconds();
+	do {
+		full = incremental_create(source);
+		if (!full)
+			goto err;
+		incremental_destroy(full);
+		reps++;
+		whole = now_seconds() - start;
+	} while (whole < BENCH_MIN_SECONDS);
+	whole /= reps;
+
+	mid   = session->stmts[session->count / 2].offset;
+	reps  = 0;
+	start = now_seconds();
+	do {
+		if (incremental_edit(session, mid, mid, "\n", 1) < 0)
+			goto err;
+		stats = session->stats;
+		if (incremental_edit(session, mid, mid + 1, "", 0) < 0)
+			goto err;
+		reps += 2;
+		edit  = now_seconds() - start;
+	} while (edit < BENCH_MIN_SECONDS);
+	edit /= reps;
+
+	printf("edit-to-ready (%d statements, %.1f MB source)\n",
+	       session->count, session->length / 1e6);
+	printf("  full parse  %10.3f ms\n", whole * 1e3);
+	printf("  edit        %10.3f ms  (%d bytes re-lexed, "
+	       "%d statements re-parsed, %d reused)\n",
+	       edit * 1e3, stats.relexed, stats.reparsed, stats.reused);
+
+	incremental_destroy(session);
+	return 0;
+
+err:
+	incremental_destroy(session);
+	return 1;
+}
+
+/* walk_tree() - Visit every node under @node; returns how many. */
+static size_t walk_tree(const struct ast_node *node)
+{
+	size_t n = 1;
+	int j;
+
+	if (!node)
+		return 0;
+
+	switch (node->type) {
+	case AST_BINARY_OP:
+		n += walk_tree(node->data.binary_op.left);
+		n += walk_tree(node->data.binary_op.right);
+		break;
+	case AST_UNARY_OP:
+		n += walk_tree(node->data.unary_op.operand);
+		break;
+	case AST_ASSIGNMENT:
+		n += walk_tree(node->data.assignment.value);
+		break;
+	case AST_IF_STMT:
+		n += walk_tree(node->data.if_stmt.condition);
+		n += walk_tree(node->data.if_stmt.then_block);
+		n += walk_tree(node->data.if_stmt.else_block);
+		break;
+	case AST_WHILE_STMT:
+		n += walk_tree(node->data.while_stmt.condition);
+		n += walk_tree(node->data.while_stmt.body);
+		break;
+	case AST_FUNCTION_DEF:
+		n += walk_tree(node->data.function_def.body);
+		break;
+	case AST_FUNCTION_CALL:
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			n += walk_tree(node->data.function_call.arguments[j]);
+		break;
+	case AST_RETURN_STMT:
+		n += walk_tree(node->data.return_stmt.value);
+		break;
+	case AST_PRINT_STMT:
+		n += walk_tree(node->data.print_stmt.value);
+		break;
+	case AST_BLOCK:
+	case AST_PROGRAM:
+		for (j = 0; j < node->data.block.count; j++)
+			n += walk_tree(node->data.block.statements[j]);
+		break;
+	default:
+		break;
 	}
+	return n;
+}
+
+/* walk_flat() - walk_tree() over a flat tree, following child indices. */
+static size_t walk_flat(const struct flat_ast *ast, uint32_t at)
+{
+	const struct flat_node *node;
+	size_t n = 1;
+	uint32_t j;
+
+	if (at == FLAT_NONE)
+		return 0;
+
+	node = &ast->nodes[at];
+	switch (node->kind) {
+	case AST_BINARY_OP:
+	case AST_WHILE_STMT:
+		n += walk_flat(ast, node->a);
+		n += walk_flat(ast, node->b);
+		break;
+	case AST_ASSIGNMENT:
+		n += walk_flat(ast, node->b);
+		break;
+	case AST_UNARY_OP:
+	case AST_RETURN_STMT:
+	case AST_PRINT_STMT:
+		n += walk_flat(ast, node->a);
+		break;
+	case AST_IF_STMT:
+		n += walk_flat(ast, node->a);
+		n += walk_flat(ast, node->b);
+		n += walk_flat(ast, node->c);
+		break;
+	case AST_FUNCTION_DEF:
+		n += walk_flat(ast, at + 1);
+		break;
+	case AST_FUNCTION_CALL:
+	case AST_BLOCK:
+	case AST_PROGRAM:
+		for (j = 0; j < node->c; j++)
+			n += walk_flat(ast, ast->lists[node->b + j]);
+		break;
+	default:
+		break;
+	}
+	return n;
+}
+
+/*
+ * run_quietly() - Run one layout of the program with stdout sent to
+ *                 /dev/null; returns the seconds it took.
+ */
+static double run_quietly(struct ast_node *ast, const struct flat_ast *flat,
+			  struct intern_table *atoms, struct line_index *lines)
+{
+	struct interpreter *interp;
+	double start;
+	int saved;
+	int null;
+
+	interp = interpreter_create(atoms, lines);
+	if (!interp)
+		return -1.0;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	null  = open("/dev/null", O_WRONLY);
+	if (saved >= 0 && null >= 0)
+		dup2(null, STDOUT_FILENO);
+
+	start = now_seconds();
+	if (flat)
+		interpreter_run_flat(interp, flat);
+	else
+		interpreter_evaluate(interp, ast);
+	start = now_seconds() - start;
+
+	fflush(stdout);
+	if (saved >= 0 && null >= 0)
+		dup2(saved, STDOUT_FILENO);
+	if (saved >= 0)
+		close(saved);
+	if (null >= 0)
+		close(null);
 
-	interpreter_evaluate(interp, ast);
 	interpreter_destroy(interp);
+	return start;
+}
+
+/*
+ * bench_walk() - Compare the arena tree with its flattened copy: bytes
+ *                per node and in all, a walk over every node, and a run
+ *                of the program with its output discarded.
+ */
+static int bench_walk(const struct source *src, int jobs)
+{
+	struct token_stream *tokens = NULL;
+	struct intern_table *atoms;
+	struct line_index *lines = NULL;
+	struct arena *arena = NULL;
+	struct flat_ast *flat = NULL;
+	struct ast_node *ast;
+	double walk[2];
+	double run[2];
+	double start;
+	size_t seen = 0;
+	int reps;
+	int rc = 1;
+	int k;
+
+	atoms = intern_create();
+	if (!atoms)
+		return 1;
+	lines = line_index_create(src->text, src->length);
+	arena = arena_create();
+	if (!lines || !arena)
+		goto done;
+
+	ast = parse_array(src->text, atoms, lines, jobs, arena, &tokens, NULL);
+	if (!ast)
+		goto done;
+	flat = flat_ast_build(ast);
+	if (!flat)
+		goto done;
+
+	for (k = 0; k < 2; k++) {
+		reps  = 0;
+		start = now_seconds();
+		do {
+			seen += k ? walk_flat(flat, 0) : walk_tree(ast);
+			reps++;
+			walk[k] = now_seconds() - start;
+		} while (walk[k] < BENCH_MIN_SECONDS);
+		walk[k] /= reps;
+
+		reps   = 0;
+		run[k] = 0.0;
+		do {
+			start = run_quietly(ast, k ? flat : NULL, atoms, lines);
+			if (start < 0.0)
+				goto done;
+			run[k] += start;
+			reps++;
+		} while (run[k] < BENCH_MIN_SECONDS);
+		run[k] /= reps;
+	}
+
+	printf("tree layout (%u nodes, %zu visited)\n",
+	       flat->node_count, seen);
+	printf("  pointer  %2zu B/node       %8.1f MB  walk %8.3f ms  "
+	       "run %8.3f ms\n", sizeof(struct ast_node),
+	       arena->total / 1e6, walk[0] * 1e3, run[0] * 1e3);
+	printf("  flat     %2zu+%zu B/node     %8.1f MB  walk %8.3f ms  "
+	       "run %8.3f ms\n", sizeof(struct flat_node),
+	       sizeof(*flat->offsets), flat->bytes / 1e6, walk[1] * 1e3,
+	       run[1] * 1e3);
+	rc = 0;
 
 done:
-	ast_free(ast);
-	token_array_free(tokens, token_count);
+	flat_ast_destroy(flat);
+	arena_destroy(arena);
+	token_stream_destroy(tokens);
+	line_index_destroy(lines);
+	intern_destroy(atoms);
 	return rc;
 }
 
 /* --- Built-in tests ------------------------------------------------------ */
 
-static void run_tests(void)
+/* Inputs below this are lexed on one thread whatever --jobs says. */
+#define TEST_PARALLEL_BYTES	(2 * LEX_PARALLEL_MIN_CHUNK + 1)
+
+/**
+ * struct capture - Standard output redirected into a temporary file.
+ * @file:  Where output goes while the capture lasts.
+ * @saved: The real standard output.
+ */
+struct capture {
+	FILE	*file;
+	int	 saved;
+};
+
+/* capture_start() - Send standard output to a fresh temporary file. */
+static int capture_start(struct capture *c)
+{
+	fflush(stdout);
+	c->file  = tmpfile();
+	c->saved = c->file ? dup(STDOUT_FILENO) : -1;
+	if (c->saved < 0 || dup2(fileno(c->file), STDOUT_FILENO) < 0) {
+		if (c->saved >= 0)
+			close(c->saved);
+		if (c->file)
+			fclose(c->file);
+		fprintf(stderr, "error: cannot capture output\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * capture_end() - Restore standard output and return what was written
+ *                 meanwhile, NUL-terminated (caller frees), or NULL.
+ */
+static char *capture_end(struct capture *c)
+{
+	char *out = NULL;
+	long len;
+
+	fflush(stdout);
+	dup2(c->saved, STDOUT_FILENO);
+	close(c->saved);
+
+	len = ftell(c->file);
+	if (len >= 0 && !fseek(c->file, 0, SEEK_SET))
+		out = malloc((size_t)len + 1);
+	if (out && fread(out, 1, (size_t)len, c->file) == (size_t)len) {
+		out[len] = '\0';
+	} else {
+		free(out);
+		out = NULL;
+	}
+	fclose(c->file);
+	return out;
+}
+
+/* run_captured() - Output of compile_and_run(), or NULL on failure. */
+static char *run_captured(const struct source *src,
+			  const struct run_options *opts)
+{
+	struct capture c;
+
+	if (!capture_start(&c))
+		return NULL;
+	compile_and_run(src, opts);
+	return capture_end(&c);
+}
+
+/*
+ * run_piped() - Output of @source read through a stream, as a pipe
+ *               is with --stream.
+ */
+static char *run_piped(const char *source, const struct run_options *opts)
+{
+	struct source src = { 0 };
+	char *out;
+
+	src.file = fmemopen((void *)source, strlen(source), "r");
+	if (!src.file)
+		return NULL;
+	out = run_captured(&src, opts);
+	fclose(src.file);
+	return out;
+}
+
+/*
+ * run_edited() - Output of the tree an incremental session holds after
+ *                a blank line is inserted and removed mid-file.
+ */
+static char *run_edited(const char *source)
+{
+	struct incremental *session;
+	struct interpreter *interp = NULL;
+	struct line_index *lines = NULL;
+	struct ast_node *program;
+	struct capture c;
+	char *out = NULL;
+	int mid;
+
+	session = incremental_create(source);
+	if (!session || !session->valid || !session->count)
+		goto done;
+
+	mid = session->stmts[session->count / 2].offset;
+	if (incremental_edit(session, mid, mid, "\n", 1) < 0 ||
+	    incremental_edit(session, mid, mid + 1, "", 0) < 0)
+		goto done;
+	program = incremental_program(session);
+	lines   = line_index_create(session->text, session->length);
+	interp  = lines ? interpreter_create(session->atoms, lines) : NULL;
+	if (!program || !interp || !capture_start(&c))
+		goto done;
+	interpreter_evaluate(interp, program);
+	out = capture_end(&c);
+
+done:
+	interpreter_destroy(interp);
+	line_index_destroy(lines);
+	incremental_destroy(session);
+	return out;
+}
+
+/* run_bundled() - Output of a bundle of @source written to @path. */
+static char *run_bundled(const struct source *src,
+			 const struct run_options *opts, const char *path)
+{
+	struct run_options bundle = *opts;
+	struct capture c;
+	char *out;
+
+	bundle.bundle = path;
+	if (compile_and_run(src, &bundle) || !capture_start(&c))
+		return NULL;
+	if (system(path) < 0)
+		fprintf(stderr, "error: cannot run '%s'\n", path);
+	out = capture_end(&c);
+	unlink(path);
+	return out;
+}
+
+/* remove_dir() - Delete @dir and the files in it. */
+static void remove_dir(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+/*
+ * check_modes() - Run @source every other way and compare the output
+ *                 with that of a plain run; returns the mismatches,
+ *                 each reported under @label.
+ *
+ * @scratch is a private directory for the cache and the bundle.  The
+ * cache is run twice so the second run loads the entry the first one
+ * stored.
+ */
+static int check_modes(const char *label, const char *source,
+		       const struct run_options *opts, const char *scratch)
+{
+	static const struct {
+		const char *name;
+		struct run_options opts;
+	} modes[] = {
+		{ "--stream",		{ .stream = 1, .jobs = 1 } },
+		{ "--pipeline",		{ .pipeline = 1, .jobs = 1 } },
+		{ "--interleave",	{ .interleave = 1, .jobs = 1 } },
+		{ "--jobs 4",		{ .jobs = 4 } },
+		{ "--flat",		{ .flat = 1, .jobs = 1 } },
+		{ "--lazy",		{ .lazy = 1, .jobs = 1 } },
+		{ "-O1",		{ .optimise = 1, .jobs = 1 } },
+		{ "--memo",		{ .memo = 1, .jobs = 1 } },
+	};
+	int nmodes = (int)(sizeof(modes) / sizeof(modes[0]));
+	struct run_options plain = { 0 };
+	struct run_options mode;
+	struct source src = { 0 };
+	char cache[PATH_MAX];
+	char bundle[PATH_MAX];
+	const char *name;
+	char *expect;
+	char *out;
+	int failed = 0;
+	int j;
+
+	plain.jobs = 1;
+	plain.self = opts->self;
+	src.text   = source;
+	src.length = strlen(source);
+	snprintf(cache, sizeof(cache), "%s/cache", scratch);
+	snprintf(bundle, sizeof(bundle), "%s/bundle", scratch);
+
+	expect = run_captured(&src, &plain);
+	if (!expect)
+		return 1;
+
+	for (j = 0; j < nmodes + 5; j++) {
+		mode      = j < nmodes ? modes[j].opts : plain;
+		mode.self = opts->self;
+		switch (j - nmodes) {
+		case 0:
+			name = "piped --stream";
+			mode.stream = 1;
+			out  = run_piped(source, &mode);
+			break;
+		case 1:
+			name = "incremental edit";
+			out  = run_edited(source);
+			break;
+		case 2:
+		case 3:
+			name = j - nmodes == 2 ? "--cache (store)" :
+						 "--cache (load)";
+			mode.cache = cache;
+			out  = run_captured(&src, &mode);
+			break;
+		case 4:
+			name = "--bundle";
+			out  = run_bundled(&src, &mode, bundle);
+			break;
+		default:
+			name = modes[j].name;
+			out  = run_captured(&src, &mode);
+			break;
+		}
+
+		if (!out || strcmp(out, expect)) {
+			printf("mismatch: %s: %s\n", label, name);
+			failed++;
+		}
+		free(out);
+	}
+	remove_dir(cache);
+
+	free(expect);
+	return failed;
+}
+
+/*
+ * test_parallel_source() - A program long enough to be lexed and parsed
+ *                          on several threads (caller frees).
+ */
+static char *test_parallel_source(void)
+{
+	static const char piece[] =
+		"def square(x):\n"
+		"    return x * x\n"
+		"\n"
+		"if square(3) > 5:\n"
+		"    print(square(3) + 1)\n"
+		"else:\n"
+		"    print(0)\n";
+	size_t n = sizeof(piece) - 1;
+	size_t reps = TEST_PARALLEL_BYTES / n + 1;
+	char *source;
+	size_t j;
+
+	source = malloc(reps * n + 1);
+	if (!source)
+		return NULL;
+	for (j = 0; j < reps; j++)
+		memcpy(source + j * n, piece, n);
+	source[reps * n] = '\0';
+	return source;
+}
+
+/*
+ * run_tests() - Run each built-in program, then check that every front
+ *               end, tree layout and optimisation prints what a plain
+ *               run does.  Returns the number of mismatches.
+ */
+static int run_tests(const struct run_options *opts)
 {
 	static const struct {
 		const char *name;
@@ -200,48 +1411,287 @@ static void run_tests(void)
 			"b = \" world\"\n"
 			"print(a + b)\n"
 		},
+		{
+			"nested definition",
+			"def f(n):\n"
+			"    return g(n) + 1\n"
+			"\n"
+			"def h():\n"
+			"    def g(n):\n"
+			"        return n * 2\n"
+			"    return f(3)\n"
+			"\n"
+			"print(h())\n"
+			"print(f(3))\n"
+		},
+		{
+			"constant folding",
+			"x = 2 * 3 + 4\n"
+			"if 1 < 0:\n"
+			"    print(\"dead\")\n"
+			"while 0:\n"
+			"    x = 0\n"
+			"print(x - 10 / 4)\n"
+			"print(-x * (1 + 1))\n"
+		},
+		{
+			"memoised recursion",
+			"def fib(n):\n"
+			"    if n < 2:\n"
+			"        return n\n"
+			"    return fib(n - 1) + fib(n - 2)\n"
+			"\n"
+			"def twice(n):\n"
+			"    return fib(n) + fib(n)\n"
+			"\n"
+			"print(twice(15))\n"
+			"fib = 3\n"
+			"print(fib)\n"
+		},
 	};
 
 	int ntests = (int)(sizeof(tests) / sizeof(tests[0]));
+	struct source src = { 0 };
+	char scratch[] = "/tmp/python-compiler.XXXXXX";
+	char *large;
+	int failed = 0;
 	int j;
 
 	printf("Running %d built-in tests\n\n", ntests);
 	for (j = 0; j < ntests; j++) {
 		printf("--- Test %d: %s ---\n", j + 1, tests[j].name);
-		compile_and_run(tests[j].source);
+		src.text   = tests[j].source;
+		src.length = strlen(tests[j].source);
+		compile_and_run(&src, opts);
 		printf("\n");
 	}
+
+	if (!mkdtemp(scratch)) {
+		fprintf(stderr, "error: cannot create '%s'\n", scratch);
+		return 1;
+	}
+
+	printf("--- Every mode against a plain run ---\n");
+	for (j = 0; j < ntests; j++)
+		failed += check_modes(tests[j].name, tests[j].source, opts,
+				      scratch);
+	large = test_parallel_source();
+	failed += large ? check_modes("large program", large, opts,
+				      scratch) : 1;
+	free(large);
+	remove_dir(scratch);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
 }
 
 /* --- Entry point --------------------------------------------------------- */
 
+static void usage(FILE *out, const char *prog)
+{
+	fprintf(out,
+		"Usage: %s [options] [file.py | -]\n"
+		"\n"
+		"Options:\n"
+		"  --stream     parse while lexing, without a token array;\n"
+		"               pipes are read a window at a time\n"
+		"  --pipeline   as --stream, lexing on a second thread\n"
+		"  --flat       run a flattened, index-linked copy of the tree\n"
+		"  --lazy       parse each function body on its first call\n"
+		"  -O0, -O1     run the tree as parsed (default), or fold\n"
+		"               constants and drop dead code first\n"
+		"  --opt-stats  report what -O1 changed on stderr\n"
+		"  --memo       cache the results of calls to pure\n"
+		"               functions\n"
+		"  --memo-stats as --memo, and report the cache's hit rate\n"
+		"               on stderr\n"
+		"  --interleave run each top-level statement as soon as it\n"
+		"               is parsed\n"
+		"  --bench-lex  report lexer throughput for the file\n"
+		"  --bench-edit time an incremental edit against a full parse\n"
+		"  --bench-walk compare tree size and walk time of both tree\n"
+		"               layouts\n"
+		"  --jobs N     lex large files on N threads (default: one\n"
+		"               per CPU)\n"
+		"  --cache DIR  keep compiled trees in DIR and reuse them\n"
+		"               while the source is unchanged (default:\n"
+		"               $" AST_CACHE_ENV ", if set)\n"
+		"  --bundle OUT write OUT, a copy of this interpreter that\n"
+		"               runs the file's program without parsing it\n"
+		"  -h, --help   show this help\n"
+		"\n"
+		"With no file, runs the built-in tests; '-' reads the\n"
+		"program from standard input.\n", prog);
+}
+
+/* self_path() - Where this executable can be opened from. */
+static const char *self_path(const char *argv0)
+{
+	/* Linux names the running binary; elsewhere, trust argv[0]. */
+	if (!access(BUNDLE_SELF, R_OK))
+		return BUNDLE_SELF;
+	return argv0;
+}
+
+/* parse_jobs() - Read a --jobs count. */
+static int parse_jobs(const char *arg, int *jobs)
+{
+	char *end;
+	long n = strtol(arg, &end, 10);
+
+	if (end == arg || *end || n < 1 || n > JOBS_MAX)
+		return 0;
+	*jobs = (int)n;
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
-	char	*source;
+	struct run_options opts = { 0 };
+	const char *path = NULL;
+	struct source *source;
 	int	 rc;
+	int	 j;
 
-	if (argc == 1) {
-		run_tests();
-		return 0;
+	/* A bundled program runs at once, whatever the arguments. */
+	opts.self = self_path(argv[0]);
+	rc = run_bundle(opts.self);
+	if (rc >= 0)
+		return rc;
+
+	for (j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "--help") || !strcmp(argv[j], "-h")) {
+			usage(stdout, argv[0]);
+			return 0;
+		}
+		if (!strcmp(argv[j], "--stream")) {
+			opts.stream = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--pipeline")) {
+			opts.pipeline = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--flat")) {
+			opts.flat = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--lazy")) {
+			opts.lazy = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "-O0") || !strcmp(argv[j], "-O1")) {
+			opts.optimise = argv[j][2] - '0';
+			continue;
+		}
+		if (!strcmp(argv[j], "--opt-stats")) {
+			opts.opt_stats = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--memo")) {
+			opts.memo = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--memo-stats")) {
+			opts.memo       = 1;
+			opts.memo_stats = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--interleave")) {
+			opts.interleave = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--bench-lex")) {
+			opts.bench_lex = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--bench-edit")) {
+			opts.bench_edit = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--bench-walk")) {
+			opts.bench_walk = 1;
+			continue;
+		}
+		if (!strcmp(argv[j], "--jobs")) {
+			if (j + 1 >= argc || !parse_jobs(argv[j + 1],
+							 &opts.jobs)) {
+				fprintf(stderr, "error: --jobs needs a count "
+					"from 1 to %d\n", JOBS_MAX);
+				return 1;
+			}
+			j++;
+			continue;
+		}
+		if (!strcmp(argv[j], "--cache")) {
+			if (j + 1 >= argc || !argv[j + 1][0]) {
+				fprintf(stderr,
+					"error: --cache needs a directory\n");
+				return 1;
+			}
+			opts.cache = argv[++j];
+			continue;
+		}
+		if (!strcmp(argv[j], "--bundle")) {
+			if (j + 1 >= argc || !argv[j + 1][0]) {
+				fprintf(stderr, "error: --bundle needs an "
+					"output path\n");
+				return 1;
+			}
+			opts.bundle = argv[++j];
+			continue;
+		}
+		if ((argv[j][0] == '-' && argv[j][1] != '\0') || path) {
+			fprintf(stderr, "error: unexpected argument '%s'\n",
+				argv[j]);
+			usage(stderr, argv[0]);
+			return 1;
+		}
+		path = argv[j];
 	}
 
-	if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
-		printf("Usage: %s [file.py]\n", argv[0]);
-		return 0;
+	if (!opts.cache) {
+		opts.cache = getenv(AST_CACHE_ENV);
+		if (opts.cache && !opts.cache[0])
+			opts.cache = NULL;
 	}
 
-	if (argc != 2) {
-		fprintf(stderr,
-			"error: expected one argument\n"
-			"Usage: %s [file.py]\n", argv[0]);
+	if (!path && (opts.bench_lex || opts.bench_edit || opts.bench_walk)) {
+		fprintf(stderr, "error: --bench-%s needs a file\n",
+			opts.bench_lex ? "lex" : opts.bench_edit ? "edit" :
+			"walk");
+		return 1;
+	}
+
+	if (!path && opts.bundle) {
+		fprintf(stderr, "error: --bundle needs a file\n");
 		return 1;
 	}
 
-	source = read_file(argv[1]);
+	if (!path)
+		return run_tests(&opts) ? 1 : 0;
+
+	/*
+	 * Plain --stream and --interleave need only one pass, so pipes
+	 * need not be held.
+	 */
+	if ((opts.interleave || (opts.stream && !opts.pipeline)) &&
+	    !opts.bench_lex && !opts.bench_edit && !opts.bench_walk &&
+	    !opts.bundle)
+		source = source_open_stream(path);
+	else
+		source = source_open(path);
 	if (!source)
 		return 1;
 
-	rc = compile_and_run(source);
-	free(source);
+	if (opts.bench_lex)
+		rc = bench_lex(source->text, opts.jobs);
+	else if (opts.bench_edit)
+		rc = bench_edit(source->text);
+	else if (opts.bench_walk)
+		rc = bench_walk(source, opts.jobs);
+	else
+		rc = compile_and_run(source, &opts);
+	source_close(source);
 	return rc;
 }
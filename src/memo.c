@@ -0,0 +1,632 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "memo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMO_NAMES_MIN	64
+
+/**
+ * memo_create() - Allocate an empty memo.
+ */
+struct memo *memo_create(void)
+{
+	struct memo *memo;
+
+	memo = calloc(1, sizeof(*memo));
+	if (!memo)
+		goto oom;
+
+	/* Zeroed slots are empty: a live one never has epoch 0. */
+	memo->slots = calloc(MEMO_SLOTS, sizeof(*memo->slots));
+	if (!memo->slots) {
+		free(memo);
+		goto oom;
+	}
+	memo->generation = 1;
+	memo->epoch      = 1;
+	return memo;
+
+oom:
+	fprintf(stderr, "memo: out of memory\n");
+	return NULL;
+}
+
+/**
+ * memo_destroy() - Free a memo and its cached results.
+ */
+void memo_destroy(struct memo *memo)
+{
+	if (!memo)
+		return;
+	free(memo->names);
+	free(memo->slots);
+	free(memo->visited);
+	free(memo);
+}
+
+/* --- Scanning ------------------------------------------------------------ */
+
+/* memo_name() - Entry of @atom, grown on demand; NULL when out of memory. */
+static struct memo_name *memo_name(struct memo *memo, uint32_t atom)
+{
+	struct memo_name *names;
+	uint32_t cap = memo->name_count ? memo->name_count : MEMO_NAMES_MIN;
+
+	if (atom < memo->name_count)
+		return &memo->names[atom];
+
+	while (cap <= atom)
+		cap *= 2;
+	names = realloc(memo->names, sizeof(*names) * cap);
+	if (!names) {
+		fprintf(stderr, "memo: out of memory\n");
+		return NULL;
+	}
+	memset(names + memo->name_count, 0,
+	       sizeof(*names) * (cap - memo->name_count));
+	memo->names      = names;
+	memo->name_count = cap;
+	return &memo->names[atom];
+}
+
+/*
+ * memo_callable() - Whether @name always means its one definition.
+ *
+ * Names are scoped dynamically, so one defined inside a function body
+ * is undefined, or something else, outside the calls that define it.
+ */
+static int memo_callable(const struct memo_name *name)
+{
+	return name && name->defs == 1 && !name->nested && !name->binds;
+}
+
+/*
+ * memo_note() - Count a definition (@def not 0) or other binding of
+ *               @atom; @nested if it is inside a function body.
+ *
+ * Results in the cache may have called the name's one definition, and
+ * this one could replace it, so they are all dropped.
+ */
+static void memo_note(struct memo *memo, uint32_t atom, uintptr_t def,
+		      int nested)
+{
+	struct memo_name *name = memo_name(memo, atom);
+
+	if (!name)
+		return;
+	if (memo_callable(name)) {
+		memo->epoch++;
+		memo->stats.flushed++;
+	}
+
+	if (def) {
+		name->defs++;
+		name->nested += nested != 0;
+		name->def = def;
+	} else {
+		name->binds++;
+	}
+}
+
+/*
+ * memo_scan_node() - memo_scan_ast() without the new generation;
+ *                    @nested inside a function body.
+ */
+static void memo_scan_node(struct memo *memo, const struct ast_node *node,
+			   int nested)
+{
+	int j;
+
+	if (!node)
+		return;
+
+	switch (node->type) {
+	case AST_BINARY_OP:
+		memo_scan_node(memo, node->data.binary_op.left, nested);
+		memo_scan_node(memo, node->data.binary_op.right, nested);
+		break;
+	case AST_UNARY_OP:
+		memo_scan_node(memo, node->data.unary_op.operand, nested);
+		break;
+	case AST_ASSIGNMENT:
+		memo_note(memo, node->data.assignment.variable, 0, 0);
+		memo_scan_node(memo, node->data.assignment.value, nested);
+		break;
+	case AST_IF_STMT:
+		memo_scan_node(memo, node->data.if_stmt.condition, nested);
+		memo_scan_node(memo, node->data.if_stmt.then_block, nested);
+		memo_scan_node(memo, node->data.if_stmt.else_block, nested);
+		break;
+	case AST_WHILE_STMT:
+		memo_scan_node(memo, node->data.while_stmt.condition, nested);
+		memo_scan_node(memo, node->data.while_stmt.body, nested);
+		break;
+	case AST_FUNCTION_DEF:
+		memo_note(memo, node->data.function_def.name,
+			  (uintptr_t)node, nested);
+		for (j = 0; j < node->data.function_def.param_count; j++)
+			memo_note(memo, node->data.function_def.parameters[j],
+				  0, 0);
+		memo_scan_node(memo, node->data.function_def.body, 1);
+		break;
+	case AST_FUNCTION_CALL:
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			memo_scan_node(memo,
+				       node->data.function_call.arguments[j],
+				       nested);
+		break;
+	case AST_RETURN_STMT:
+		memo_scan_node(memo, node->data.return_stmt.value, nested);
+		break;
+	case AST_PRINT_STMT:
+		memo_scan_node(memo, node->data.print_stmt.value, nested);
+		break;
+	case AST_BLOCK:
+		for (j = 0; j < node->data.block.count; j++)
+			memo_scan_node(memo, node->data.block.statements[j],
+				       nested);
+		break;
+	case AST_PROGRAM:
+		for (j = 0; j < node->data.program.count; j++)
+			memo_scan_node(memo,
+				       node->data.program.statements[j], nested);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * memo_scan_ast() - Record the names a pointer tree defines and binds.
+ */
+void memo_scan_ast(struct memo *memo, const struct ast_node *node)
+{
+	/* Of the nodes handed in, only a function body is a block. */
+	memo_scan_node(memo, node, node && node->type == AST_BLOCK);
+	memo->generation++;
+}
+
+/* memo_scan_flat_node() - memo_scan_node() for node @at of a flat tree. */
+static void memo_scan_flat_node(struct memo *memo, const struct flat_ast *ast,
+				uint32_t at, int nested)
+{
+	const struct flat_node *node;
+	uint32_t j;
+
+	if (at == FLAT_NONE)
+		return;
+
+	node = &ast->nodes[at];
+	switch (node->kind) {
+	case AST_ASSIGNMENT:
+		memo_note(memo, node->a, 0, 0);
+		memo_scan_flat_node(memo, ast, node->b, nested);
+		break;
+	case AST_FUNCTION_DEF:
+		/* Index 0 is the program, so no definition is 0. */
+		memo_note(memo, node->a, at, nested);
+		for (j = 0; j < node->c; j++)
+			memo_note(memo, ast->lists[node->b + j], 0, 0);
+		memo_scan_flat_node(memo, ast, at + 1, 1);
+		break;
+	case AST_BINARY_OP:
+	case AST_WHILE_STMT:
+	case AST_IF_STMT:
+		memo_scan_flat_node(memo, ast, node->a, nested);
+		memo_scan_flat_node(memo, ast, node->b, nested);
+		memo_scan_flat_node(memo, ast, node->c, nested);
+		break;
+	case AST_UNARY_OP:
+	case AST_RETURN_STMT:
+	case AST_PRINT_STMT:
+		memo_scan_flat_node(memo, ast, node->a, nested);
+		break;
+	case AST_FUNCTION_CALL:
+	case AST_BLOCK:
+	case AST_PROGRAM:
+		for (j = 0; j < node->c; j++)
+			memo_scan_flat_node(memo, ast, ast->lists[node->b + j],
+					    nested);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * memo_scan_flat() - Record the names a flat tree defines and binds.
+ */
+void memo_scan_flat(struct memo *memo, const struct flat_ast *ast)
+{
+	memo->flat = ast;
+	if (ast->node_count)
+		memo_scan_flat_node(memo, ast, 0, 0);
+	memo->generation++;
+}
+
+/* --- Purity -------------------------------------------------------------- */
+
+/*
+ * memo_visit() - Start checking the definition of @atom, or find out
+ *                what an earlier check said.  Returns the name to check
+ *                with its state set to MEMO_CHECKING, or NULL with the
+ *                answer in @pure.
+ */
+static struct memo_name *memo_visit(struct memo *memo, uint32_t atom,
+				    uintptr_t def, int *pure)
+{
+	struct memo_name *name = NULL;
+	uint32_t *visited;
+	size_t cap;
+
+	if (atom < memo->name_count)
+		name = &memo->names[atom];
+	*pure = 0;
+	if (!memo_callable(name) || name->def != def)
+		return NULL;
+	if (name->checked == memo->generation) {
+		*pure = name->state != MEMO_IMPURE;
+		return NULL;
+	}
+
+	if (memo->visited_count == memo->visited_cap) {
+		cap     = memo->visited_cap ? memo->visited_cap * 2 :
+					      MEMO_NAMES_MIN;
+		visited = realloc(memo->visited, sizeof(*visited) * cap);
+		if (!visited) {
+			fprintf(stderr, "memo: out of memory\n");
+			return NULL;
+		}
+		memo->visited     = visited;
+		memo->visited_cap = cap;
+	}
+	memo->visited[memo->visited_count++] = atom;
+
+	name->checked = memo->generation;
+	name->state   = MEMO_CHECKING;
+	return name;
+}
+
+/*
+ * memo_settle() - End the check that began at the outermost visit.
+ *
+ * Callers being checked are assumed pure, which is what lets recursion
+ * through them pass.  If the outermost one turns out impure, some of
+ * the others were only found pure by assuming so; they are checked
+ * afresh next time.  A failure always reaches the outermost check,
+ * since it makes every caller on the way up impure too.
+ */
+static int memo_settle(struct memo *memo, int pure)
+{
+	struct memo_name *name;
+	size_t j;
+
+	for (j = 0; !pure && j < memo->visited_count; j++) {
+		name = &memo->names[memo->visited[j]];
+		if (name->state == MEMO_PURE)
+			name->checked = memo->generation - 1;
+	}
+	memo->visited_count = 0;
+	return pure;
+}
+
+/* memo_param() - Whether @atom is one of @count @params. */
+static int memo_param(const uint32_t *params, uint32_t count, uint32_t atom)
+{
+	uint32_t j;
+
+	for (j = 0; j < count; j++)
+		if (params[j] == atom)
+			return 1;
+	return 0;
+}
+
+static int memo_def_ast(struct memo *memo, const struct ast_node *def);
+
+/* memo_body_ast() - Whether @node only does what a pure @def may. */
+static int memo_body_ast(struct memo *memo, const struct ast_node *def,
+			 const struct ast_node *node)
+{
+	const uint32_t *params = def->data.function_def.parameters;
+	uint32_t count = (uint32_t)def->data.function_def.param_count;
+	const struct memo_name *callee;
+	const struct ast_node *target;
+	int j;
+
+	if (!node)
+		return 1;
+
+	switch (node->type) {
+	case AST_NUMBER:
+	case AST_STRING:
+		return 1;
+	case AST_IDENTIFIER:
+		return memo_param(params, count, node->data.identifier.name);
+	case AST_BINARY_OP:
+		return memo_body_ast(memo, def, node->data.binary_op.left) &&
+		       memo_body_ast(memo, def, node->data.binary_op.right);
+	case AST_UNARY_OP:
+		return memo_body_ast(memo, def, node->data.unary_op.operand);
+	case AST_ASSIGNMENT:
+		return memo_param(params, count,
+				  node->data.assignment.variable) &&
+		       memo_body_ast(memo, def, node->data.assignment.value);
+	case AST_IF_STMT:
+		return memo_body_ast(memo, def,
+				     node->data.if_stmt.condition) &&
+		       memo_body_ast(memo, def,
+				     node->data.if_stmt.then_block) &&
+		       memo_body_ast(memo, def,
+				     node->data.if_stmt.else_block);
+	case AST_WHILE_STMT:
+		return memo_body_ast(memo, def,
+				     node->data.while_stmt.condition) &&
+		       memo_body_ast(memo, def, node->data.while_stmt.body);
+	case AST_RETURN_STMT:
+		return memo_body_ast(memo, def, node->data.return_stmt.value);
+	case AST_BLOCK:
+		for (j = 0; j < node->data.block.count; j++)
+			if (!memo_body_ast(memo, def,
+					   node->data.block.statements[j]))
+				return 0;
+		return 1;
+	case AST_FUNCTION_CALL:
+		callee = NULL;
+		if (node->data.function_call.function_name < memo->name_count)
+			callee = &memo->names[
+				node->data.function_call.function_name];
+		if (!memo_callable(callee))
+			return 0;
+		target = (const struct ast_node *)callee->def;
+		if (target->data.function_def.param_count !=
+		    node->data.function_call.arg_count ||
+		    !memo_def_ast(memo, target))
+			return 0;
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			if (!memo_body_ast(memo, def,
+				node->data.function_call.arguments[j]))
+				return 0;
+		return 1;
+	default:
+		/* Prints, definitions. */
+		return 0;
+	}
+}
+
+/* memo_def_ast() - Whether @def is pure, checking it if need be. */
+static int memo_def_ast(struct memo *memo, const struct ast_node *def)
+{
+	struct memo_name *name;
+	int pure;
+
+	name = memo_visit(memo, def->data.function_def.name,
+			  (uintptr_t)def, &pure);
+	if (!name)
+		return pure;
+
+	pure = def->data.function_def.body &&
+	       def->data.function_def.param_count <= MEMO_MAX_ARGS &&
+	       memo_body_ast(memo, def, def->data.function_def.body);
+	name->state = pure ? MEMO_PURE : MEMO_IMPURE;
+	return pure;
+}
+
+/**
+ * memo_pure_ast() - Whether calls to a definition may be memoised.
+ */
+int memo_pure_ast(struct memo *memo, const struct ast_node *def)
+{
+	return memo_settle(memo, memo_def_ast(memo, def));
+}
+
+static int memo_def_flat(struct memo *memo, const struct flat_ast *ast,
+			 uint32_t def);
+
+/* memo_body_flat() - memo_body_ast() for node @at of a flat tree. */
+static int memo_body_flat(struct memo *memo, const struct flat_ast *ast,
+			  uint32_t def, uint32_t at)
+{
+	const struct flat_node *fn = &ast->nodes[def];
+	const uint32_t *params = ast->lists + fn->b;
+	const struct memo_name *callee;
+	const struct flat_node *node;
+	uint32_t j;
+
+	if (at == FLAT_NONE)
+		return 1;
+
+	node = &ast->nodes[at];
+	switch (node->kind) {
+	case AST_NUMBER:
+	case AST_STRING:
+		return 1;
+	case AST_IDENTIFIER:
+		return memo_param(params, fn->c, node->a);
+	case AST_UNARY_OP:
+	case AST_RETURN_STMT:
+		return memo_body_flat(memo, ast, def, node->a);
+	case AST_ASSIGNMENT:
+		return memo_param(params, fn->c, node->a) &&
+		       memo_body_flat(memo, ast, def, node->b);
+	case AST_BINARY_OP:
+	case AST_WHILE_STMT:
+	case AST_IF_STMT:
+		return memo_body_flat(memo, ast, def, node->a) &&
+		       memo_body_flat(memo, ast, def, node->b) &&
+		       memo_body_flat(memo, ast, def, node->c);
+	case AST_BLOCK:
+		for (j = 0; j < node->c; j++)
+			if (!memo_body_flat(memo, ast, def,
+					    ast->lists[node->b + j]))
+				return 0;
+		return 1;
+	case AST_FUNCTION_CALL:
+		callee = NULL;
+		if (node->a < memo->name_count)
+			callee = &memo->names[node->a];
+		if (!memo_callable(callee) ||
+		    ast->nodes[callee->def].c != node->c ||
+		    !memo_def_flat(memo, ast, (uint32_t)callee->def))
+			return 0;
+		for (j = 0; j < node->c; j++)
+			if (!memo_body_flat(memo, ast, def,
+					    ast->lists[node->b + j]))
+				return 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* memo_def_flat() - memo_def_ast() for a flat tree. */
+static int memo_def_flat(struct memo *memo, const struct flat_ast *ast,
+			 uint32_t def)
+{
+	struct memo_name *name;
+	int pure;
+
+	name = memo_visit(memo, ast->nodes[def].a, def, &pure);
+	if (!name)
+		return pure;
+
+	/* A definition's body is the node right after it. */
+	pure = ast->nodes[def].c <= MEMO_MAX_ARGS &&
+	       memo_body_flat(memo, ast, def, def + 1);
+	name->state = pure ? MEMO_PURE : MEMO_IMPURE;
+	return pure;
+}
+
+/**
+ * memo_pure_flat() - memo_pure_ast() for a flat tree.
+ */
+int memo_pure_flat(struct memo *memo, const struct flat_ast *ast,
+		   uint32_t def)
+{
+	return memo_settle(memo, memo_def_flat(memo, ast, def));
+}
+
+/**
+ * memo_pure_count() - Functions that are pure now.
+ */
+size_t memo_pure_count(struct memo *memo)
+{
+	const struct memo_name *name;
+	size_t n = 0;
+	uint32_t j;
+
+	for (j = 0; j < memo->name_count; j++) {
+		name = &memo->names[j];
+		if (!memo_callable(name))
+			continue;
+		if (memo->flat)
+			n += memo_pure_flat(memo, memo->flat,
+					    (uint32_t)name->def);
+		else
+			n += memo_pure_ast(memo,
+					   (const struct ast_node *)name->def);
+	}
+	return n;
+}
+
+/* --- Results ------------------------------------------------------------- */
+
+/* memo_mix() - Spread every bit of @h over the whole word. */
+static uint64_t memo_mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9u;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebu;
+	h ^= h >> 31;
+	return h;
+}
+
+/*
+ * memo_hash() - Mix a definition and its arguments into one word.
+ *
+ * Small integers differ only in the top bits of their doubles, so each
+ * step must carry those down to the bits that pick a slot.
+ */
+static uint64_t memo_hash(uintptr_t func, const double *args, uint32_t argc)
+{
+	uint64_t h = memo_mix((uint64_t)func ^ (uint64_t)argc << 56);
+	uint64_t bits;
+	uint32_t j;
+
+	for (j = 0; j < argc; j++) {
+		memcpy(&bits, &args[j], sizeof(bits));
+		h = memo_mix(h ^ bits);
+	}
+	return h;
+}
+
+/* memo_match() - Whether @slot holds the result for this key. */
+static int memo_match(const struct memo *memo, const struct memo_slot *slot,
+		      uintptr_t func, const double *args, uint32_t argc)
+{
+	return slot->epoch == memo->epoch && slot->func == func &&
+	       slot->argc == argc &&
+	       !memcmp(slot->args, args, sizeof(*args) * argc);
+}
+
+/**
+ * memo_lookup() - Find the result of an earlier call.
+ */
+int memo_lookup(struct memo *memo, uintptr_t func, const double *args,
+		uint32_t argc, int room, struct value *result)
+{
+	const struct memo_slot *slot;
+	uint64_t h = memo_hash(func, args, argc);
+	uint32_t j;
+
+	memo->stats.calls++;
+	for (j = 0; j < MEMO_PROBES; j++) {
+		slot = &memo->slots[(h + j) & (MEMO_SLOTS - 1)];
+		if (!memo_match(memo, slot, func, args, argc))
+			continue;
+		if (slot->depth > room)
+			return 0;
+		result->type        = (enum value_type)slot->type;
+		result->data.number = slot->value;
+		memo->stats.hits++;
+		return slot->depth;
+	}
+	return 0;
+}
+
+/**
+ * memo_store() - Remember the result of a call.
+ */
+void memo_store(struct memo *memo, uintptr_t func, const double *args,
+		uint32_t argc, int depth, struct value result)
+{
+	struct memo_slot *slot = NULL;
+	uint64_t h = memo_hash(func, args, argc);
+	uint32_t j;
+
+	if ((result.type != VALUE_NUMBER && result.type != VALUE_NONE) ||
+	    depth < 1 || depth > UINT16_MAX)
+		return;
+
+	for (j = 0; j < MEMO_PROBES; j++) {
+		slot = &memo->slots[(h + j) & (MEMO_SLOTS - 1)];
+		if (slot->epoch != memo->epoch ||
+		    memo_match(memo, slot, func, args, argc))
+			break;
+	}
+	if (j == MEMO_PROBES) {
+		slot = &memo->slots[h & (MEMO_SLOTS - 1)];
+		memo->stats.evicted++;
+	}
+
+	slot->func  = func;
+	slot->epoch = memo->epoch;
+	slot->argc  = (uint8_t)argc;
+	slot->type  = (uint8_t)result.type;
+	slot->depth = (uint16_t)depth;
+	slot->value = result.type == VALUE_NUMBER ? result.data.number : 0.0;
+	memcpy(slot->args, args, sizeof(*args) * argc);
+	memo->stats.stored++;
+}
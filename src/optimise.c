@@ -0,0 +1,472 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "optimise.h"
+#include "hashcons.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Writes counted per name; more than one is as good as many. */
+#define OPT_MANY		2
+
+/**
+ * struct opt_name - What the pass knows about one atom.
+ * @value:  The number the name holds, when @known.
+ * @writes: Assignments, definitions and parameters of the name, up to
+ *          OPT_MANY.
+ * @known:  Set once the single assignment of the name has been passed.
+ */
+struct opt_name {
+	double	 value;
+	uint8_t	 writes;
+	uint8_t	 known;
+};
+
+/**
+ * struct optimiser - State of one optimise() call.
+ * @arena:    Arena new constants go in.
+ * @consts:   Constants made so far, so each value is made once.
+ * @names:    Per-atom facts, or NULL when nothing is propagated.
+ * @count:    Entries in @names.
+ * @deferred: Set if a function body has not been parsed yet.
+ * @stats:    Counts being gathered.
+ */
+struct optimiser {
+	struct arena		*arena;
+	struct hashcons		 consts;
+	struct opt_name		*names;
+	uint32_t		 count;
+	int			 deferred;
+	struct optimise_stats	 stats;
+};
+
+/* opt_write() - Note one more write of @name. */
+static void opt_write(struct optimiser *o, uint32_t name, int writes)
+{
+	if (!o->names || name >= o->count)
+		return;
+	if (o->names[name].writes + writes > OPT_MANY)
+		o->names[name].writes = OPT_MANY;
+	else
+		o->names[name].writes += (uint8_t)writes;
+}
+
+/*
+ * opt_scan() - Count the nodes under @node and, with @o->names, the
+ *              writes of every name.
+ */
+static size_t opt_scan(struct optimiser *o, const struct ast_node *node)
+{
+	size_t n = 1;
+	int j;
+
+	if (!node)
+		return 0;
+
+	switch (node->type) {
+	case AST_BINARY_OP:
+		n += opt_scan(o, node->data.binary_op.left);
+		n += opt_scan(o, node->data.binary_op.right);
+		break;
+	case AST_UNARY_OP:
+		n += opt_scan(o, node->data.unary_op.operand);
+		break;
+	case AST_ASSIGNMENT:
+		opt_write(o, node->data.assignment.variable, 1);
+		n += opt_scan(o, node->data.assignment.value);
+		break;
+	case AST_IF_STMT:
+		n += opt_scan(o, node->data.if_stmt.condition);
+		n += opt_scan(o, node->data.if_stmt.then_block);
+		n += opt_scan(o, node->data.if_stmt.else_block);
+		break;
+	case AST_WHILE_STMT:
+		n += opt_scan(o, node->data.while_stmt.condition);
+		n += opt_scan(o, node->data.while_stmt.body);
+		break;
+	case AST_FUNCTION_DEF:
+		opt_write(o, node->data.function_def.name, OPT_MANY);
+		for (j = 0; j < node->data.function_def.param_count; j++)
+			opt_write(o, node->data.function_def.parameters[j],
+				  OPT_MANY);
+		if (!node->data.function_def.body)
+			o->deferred = 1;
+		n += opt_scan(o, node->data.function_def.body);
+		break;
+	case AST_FUNCTION_CALL:
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			n += opt_scan(o,
+				      node->data.function_call.arguments[j]);
+		break;
+	case AST_RETURN_STMT:
+		n += opt_scan(o, node->data.return_stmt.value);
+		break;
+	case AST_PRINT_STMT:
+		n += opt_scan(o, node->data.print_stmt.value);
+		break;
+	case AST_BLOCK:
+		for (j = 0; j < node->data.block.count; j++)
+			n += opt_scan(o, node->data.block.statements[j]);
+		break;
+	case AST_PROGRAM:
+		for (j = 0; j < node->data.program.count; j++)
+			n += opt_scan(o, node->data.program.statements[j]);
+		break;
+	default:
+		break;
+	}
+	return n;
+}
+
+/* --- Expressions --------------------------------------------------------- */
+
+/*
+ * opt_number_op() - Compute @l @op @r as the interpreter's number_op()
+ *                   would.  Returns 0 for anything that would raise an
+ *                   error instead.
+ */
+static int opt_number_op(enum token_type op, double l, double r,
+			 double *out)
+{
+	switch (op) {
+	case TOKEN_PLUS:		*out = l + r;	return 1;
+	case TOKEN_MINUS:		*out = l - r;	return 1;
+	case TOKEN_MULTIPLY:		*out = l * r;	return 1;
+	case TOKEN_DIVIDE:
+		if (r == 0.0)
+			return 0;
+		*out = l / r;
+		return 1;
+	case TOKEN_EQUAL:		*out = l == r;	return 1;
+	case TOKEN_NOT_EQUAL:		*out = l != r;	return 1;
+	case TOKEN_LESS:		*out = l <  r;	return 1;
+	case TOKEN_GREATER:		*out = l >  r;	return 1;
+	case TOKEN_LESS_EQUAL:		*out = l <= r;	return 1;
+	case TOKEN_GREATER_EQUAL:	*out = l >= r;	return 1;
+	default:			return 0;
+	}
+}
+
+/* opt_concat() - The string literal @l followed by @r, or NULL. */
+static struct ast_node *opt_concat(struct optimiser *o,
+				   const struct ast_node *l,
+				   const struct ast_node *r, size_t offset)
+{
+	struct ast_node *node;
+	size_t llen = strlen(l->data.string.value);
+	size_t rlen = strlen(r->data.string.value);
+	char *text;
+
+	if (llen + rlen > INT32_MAX)
+		return NULL;
+	text = malloc(llen + rlen + 1);
+	if (!text) {
+		fprintf(stderr, "optimise: out of memory\n");
+		return NULL;
+	}
+	memcpy(text, l->data.string.value, llen);
+	memcpy(text + llen, r->data.string.value, rlen + 1);
+
+	node = hashcons_string(&o->consts, o->arena, text,
+			       (int)(llen + rlen), offset);
+	free(text);
+	return node;
+}
+
+/*
+ * opt_fold_binary() - @node's value as a literal, or NULL if it is not
+ *                     constant or would fail at run time.
+ */
+static struct ast_node *opt_fold_binary(struct optimiser *o,
+					const struct ast_node *node,
+					const struct ast_node *l,
+					const struct ast_node *r)
+{
+	enum token_type op = node->data.binary_op.op;
+	double value;
+
+	if (!l || !r)
+		return NULL;
+	if (l->type == AST_NUMBER && r->type == AST_NUMBER) {
+		if (!opt_number_op(op, l->data.number.value,
+				   r->data.number.value, &value))
+			return NULL;
+		return hashcons_number(&o->consts, o->arena, value,
+				       node->offset);
+	}
+	if (l->type == AST_STRING && r->type == AST_STRING &&
+	    op == TOKEN_PLUS)
+		return opt_concat(o, l, r, node->offset);
+	return NULL;
+}
+
+/*
+ * opt_expr() - Simplify the expression @node.  Returns what to use in
+ *              its place, which is @node unless it folded.
+ */
+static struct ast_node *opt_expr(struct optimiser *o, struct ast_node *node)
+{
+	struct ast_node *folded = NULL;
+	struct ast_node *a;
+	struct ast_node *b;
+	const struct opt_name *name;
+	int j;
+
+	if (!node)
+		return NULL;
+
+	switch (node->type) {
+	case AST_IDENTIFIER:
+		if (!o->names || node->data.identifier.name >= o->count)
+			return node;
+		name = &o->names[node->data.identifier.name];
+		if (!name->known)
+			return node;
+		folded = hashcons_number(&o->consts, o->arena, name->value,
+					 node->offset);
+		if (!folded)
+			return node;
+		o->stats.propagated++;
+		return folded;
+
+	case AST_BINARY_OP:
+		a = opt_expr(o, node->data.binary_op.left);
+		b = opt_expr(o, node->data.binary_op.right);
+		folded = opt_fold_binary(o, node, a, b);
+		if (folded) {
+			o->stats.folded++;
+			return folded;
+		}
+		if (!node->shared) {
+			node->data.binary_op.left  = a;
+			node->data.binary_op.right = b;
+		}
+		return node;
+
+	case AST_UNARY_OP:
+		a = opt_expr(o, node->data.unary_op.operand);
+		if (a && a->type == AST_NUMBER) {
+			if (node->data.unary_op.op == TOKEN_MINUS)
+				folded = hashcons_number(&o->consts, o->arena,
+							 -a->data.number.value,
+							 node->offset);
+			else if (node->data.unary_op.op == TOKEN_PLUS)
+				folded = a;
+		}
+		if (folded) {
+			o->stats.folded++;
+			return folded;
+		}
+		if (!node->shared)
+			node->data.unary_op.operand = a;
+		return node;
+
+	case AST_FUNCTION_CALL:
+		for (j = 0; j < node->data.function_call.arg_count; j++)
+			node->data.function_call.arguments[j] = opt_expr(o,
+				node->data.function_call.arguments[j]);
+		return node;
+
+	default:
+		return node;
+	}
+}
+
+/* --- Statements ---------------------------------------------------------- */
+
+/*
+ * opt_returns() - Whether running @node always ends in a return: it is
+ *                 one, or a block holding one, or an if whose branches
+ *                 both always return.
+ */
+static int opt_returns(const struct ast_node *node)
+{
+	int j;
+
+	if (!node)
+		return 0;
+
+	switch (node->type) {
+	case AST_RETURN_STMT:
+		return 1;
+	case AST_BLOCK:
+		for (j = 0; j < node->data.block.count; j++)
+			if (opt_returns(node->data.block.statements[j]))
+				return 1;
+		return 0;
+	case AST_IF_STMT:
+		return opt_returns(node->data.if_stmt.then_block) &&
+		       opt_returns(node->data.if_stmt.else_block);
+	default:
+		return 0;
+	}
+}
+
+/* opt_truth() - Whether the literal @cond counts as true, as in an if. */
+static int opt_truth(const struct ast_node *cond)
+{
+	return cond->type == AST_NUMBER && cond->data.number.value != 0.0;
+}
+
+/* opt_literal() - Whether @node is a number or string literal. */
+static int opt_literal(const struct ast_node *node)
+{
+	return node->type == AST_NUMBER || node->type == AST_STRING;
+}
+
+static struct ast_node *opt_stmt(struct optimiser *o, struct ast_node *node);
+
+/*
+ * opt_list() - Simplify the statements of a block or program in place,
+ *              closing the gaps left by removed ones.  In a block,
+ *              everything after a statement that always returns goes.
+ */
+static void opt_list(struct optimiser *o, struct ast_node **stmts,
+		     int *count, int block)
+{
+	struct ast_node *stmt;
+	struct opt_name *name;
+	int kept = 0;
+	int j;
+
+	for (j = 0; j < *count; j++) {
+		stmt = opt_stmt(o, stmts[j]);
+		if (!stmt)
+			continue;
+		stmts[kept++] = stmt;
+
+		if (block && opt_returns(stmt)) {
+			o->stats.dropped += (size_t)(*count - j - 1);
+			break;
+		}
+
+		/* Later statements run after this one; see optimise(). */
+		if (block || !o->names || o->deferred ||
+		    stmt->type != AST_ASSIGNMENT ||
+		    stmt->data.assignment.variable >= o->count ||
+		    stmt->data.assignment.value->type != AST_NUMBER)
+			continue;
+		name = &o->names[stmt->data.assignment.variable];
+		if (name->writes == 1) {
+			name->known = 1;
+			name->value =
+				stmt->data.assignment.value->data.number.value;
+		}
+	}
+	*count = kept;
+}
+
+/*
+ * opt_stmt() - Simplify the statement @node.  Returns what to run in
+ *              its place, or NULL if nothing needs to run.
+ */
+static struct ast_node *opt_stmt(struct optimiser *o, struct ast_node *node)
+{
+	struct ast_node *cond;
+
+	if (!node)
+		return NULL;
+
+	switch (node->type) {
+	case AST_ASSIGNMENT:
+		node->data.assignment.value =
+			opt_expr(o, node->data.assignment.value);
+		return node;
+
+	case AST_IF_STMT:
+		cond = opt_expr(o, node->data.if_stmt.condition);
+		if (opt_literal(cond)) {
+			o->stats.pruned++;
+			return opt_stmt(o, opt_truth(cond) ?
+					node->data.if_stmt.then_block :
+					node->data.if_stmt.else_block);
+		}
+		node->data.if_stmt.condition  = cond;
+		node->data.if_stmt.then_block =
+			opt_stmt(o, node->data.if_stmt.then_block);
+		node->data.if_stmt.else_block =
+			opt_stmt(o, node->data.if_stmt.else_block);
+		return node;
+
+	case AST_WHILE_STMT:
+		cond = opt_expr(o, node->data.while_stmt.condition);
+		if (opt_literal(cond) && !opt_truth(cond)) {
+			o->stats.pruned++;
+			return NULL;
+		}
+		node->data.while_stmt.condition = cond;
+		node->data.while_stmt.body =
+			opt_stmt(o, node->data.while_stmt.body);
+		return node;
+
+	case AST_FUNCTION_DEF:
+		node->data.function_def.body =
+			opt_stmt(o, node->data.function_def.body);
+		return node;
+
+	case AST_RETURN_STMT:
+		node->data.return_stmt.value =
+			opt_expr(o, node->data.return_stmt.value);
+		return node;
+
+	case AST_PRINT_STMT:
+		node->data.print_stmt.value =
+			opt_expr(o, node->data.print_stmt.value);
+		return node;
+
+	case AST_BLOCK:
+		opt_list(o, node->data.block.statements,
+			 &node->data.block.count, 1);
+		return node;
+
+	case AST_PROGRAM:
+		opt_list(o, node->data.program.statements,
+			 &node->data.program.count, 0);
+		return node;
+
+	default:
+		return opt_expr(o, node);
+	}
+}
+
+/**
+ * optimise() - Simplify a tree without changing what it does.
+ */
+struct ast_node *optimise(struct ast_node *node, struct arena *arena,
+			  const struct intern_table *atoms,
+			  struct optimise_stats *stats)
+{
+	struct optimiser o;
+
+	if (!node || !arena)
+		return node;
+
+	memset(&o, 0, sizeof(o));
+	o.arena = arena;
+
+	/* Without it only propagation is lost, so carry on. */
+	if (node->type == AST_PROGRAM && atoms && atoms->count) {
+		o.names = calloc(atoms->count, sizeof(*o.names));
+		if (o.names)
+			o.count = atoms->count;
+		else
+			fprintf(stderr, "optimise: out of memory\n");
+	}
+
+	o.stats.nodes_before = opt_scan(&o, node);
+	node = opt_stmt(&o, node);
+	free(o.names);
+	o.names = NULL;
+	o.stats.nodes_after = opt_scan(&o, node);
+
+	if (stats) {
+		stats->nodes_before += o.stats.nodes_before;
+		stats->nodes_after  += o.stats.nodes_after;
+		stats->folded       += o.stats.folded;
+		stats->propagated   += o.stats.propagated;
+		stats->pruned       += o.stats.pruned;
+		stats->dropped      += o.stats.dropped;
+	}
+	hashcons_release(&o.consts);
+	return node;
+}
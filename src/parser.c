@@ -1,13 +1,13 @@
 #include "utils.h"
 #include "parser.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define MAX_PARAMS	64
 #define MAX_ARGS	64
-#define BLOCK_INIT_CAP	16
-#define PROG_INIT_CAP	64
+#define SCRATCH_INIT_CAP 256
 
 /* Forward declarations — grammar is mutually recursive. */
 static struct ast_node *parse_expression(struct parser *p);
@@ -16,14 +16,69 @@ static struct ast_node *parse_block(struct parser *p);
 
 /* --- Parser utilities ---------------------------------------------------- */
 
+/* Stands in past the end or after an error; it has no position. */
+static const struct token eof_tok = {
+	TOKEN_EOF, SIZE_MAX, 0, NULL, 0.0, ATOM_INVALID
+};
+
+/**
+ * parser_create() - Initialise a parser over a packed token stream.
+ */
+struct parser *parser_create(const struct token_stream *tokens,
+			     const char *source, struct arena *arena)
+{
+	struct parser *p;
+
+	if (!tokens || tokens->count <= 0 || !source || !arena)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		fprintf(stderr, "parser: out of memory\n");
+		return NULL;
+	}
+
+	p->tokens   = tokens;
+	p->source   = source;
+	p->arena    = arena;
+	p->position = 0;
+	p->end      = tokens->count;
+	return p;
+}
+
+/**
+ * parser_create_stream() - Initialise a parser that pulls from a lexer.
+ */
+struct parser *parser_create_stream(struct lexer *lexer,
+				    struct arena *arena)
+{
+	struct parser *p;
+
+	if (!lexer || !arena)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		fprintf(stderr, "parser: out of memory\n");
+		return NULL;
+	}
+
+	/* A streaming lexer's window moves; its tokens carry their text. */
+	p->lexer  = lexer;
+	p->source = lexer->input ? NULL : lexer->source;
+	p->arena  = arena;
+	return p;
+}
+
 /**
- * parser_create() - Initialise a parser over a token array.
+ * parser_create_pipe() - Initialise a parser that reads a lex_pipe.
  */
-struct parser *parser_create(struct token *tokens, int count)
+struct parser *parser_create_pipe(struct lex_pipe *pipe,
+				  struct arena *arena)
 {
 	struct parser *p;
 
-	if (!tokens || count <= 0)
+	if (!pipe || !arena)
 		return NULL;
 
 	p = calloc(1, sizeof(*p));
@@ -32,38 +87,155 @@ struct parser *parser_create(struct token *tokens, int count)
 		return NULL;
 	}
 
-	p->tokens      = tokens;
-	p->position    = 0;
-	p->token_count = count;
+	p->pipe   = pipe;
+	p->source = pipe->lexer->source;
+	p->arena  = arena;
 	return p;
 }
 
 /**
- * parser_destroy() - Free the parser struct (not the token array).
+ * parser_destroy() - Free the parser struct (not the token stream).
  */
 void parser_destroy(struct parser *p)
 {
+	int j;
+
+	if (!p)
+		return;
+	for (j = 0; !p->tokens && j < p->ring_fill; j++)
+		free(p->ring[(p->ring_head + j) % PARSER_LOOKAHEAD].owned);
+	line_index_destroy(p->lines);
+	hashcons_release(&p->consts);
+	free(p->scratch);
 	free(p);
 }
 
-static struct token *cur(const struct parser *p)
+/*
+ * error_line() - Line of @offset for a diagnostic.  Tokens carry only
+ *                offsets, so the line table is built on the first error.
+ *                SIZE_MAX has no position and reports line 0.  A
+ *                streaming lexer keeps its own table.
+ */
+static int error_line(struct parser *p, size_t offset)
+{
+	if (offset == SIZE_MAX)
+		return 0;
+	if (p->lexer && p->lexer->lines)
+		return line_index_line(p->lexer->lines, offset);
+	if (!p->lines)
+		p->lines = line_index_create(p->source, strlen(p->source));
+	return line_index_line(p->lines, offset);
+}
+
+/*
+ * syntax_error() - Report "parse error: <message> at line N" for the
+ *                  construct at @offset.  A quiet parser only notes
+ *                  that it failed; see parse_slices().  Nor does one
+ *                  that has already given up, whose cursor sits on a
+ *                  stand-in EOF.
+ */
+static void syntax_error(struct parser *p, size_t offset,
+			 const char *fmt, ...)
 {
-	static struct token eof_tok = {
-		TOKEN_EOF, "EOF", 0, 0, 0.0
-	};
+	va_list ap;
+
+	p->failed = 1;
+	if (p->quiet || p->error)
+		return;
 
-	if (!p || p->position >= p->token_count)
+	fputs("parse error: ", stderr);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, " at line %d\n", error_line(p, offset));
+}
+
+/*
+ * pull() - Lex, receive or unpack one more token into the lookahead ring.
+ *
+ * A lexer error is reported here, where the array path would have
+ * reported it before parsing; the parser then sees EOF and unwinds.
+ */
+static void pull(struct parser *p)
+{
+	struct token *slot;
+	const char *str;
+	int index = p->position + p->ring_fill;
+	int len;
+
+	slot = &p->ring[(p->ring_head + p->ring_fill) % PARSER_LOOKAHEAD];
+	p->ring_fill++;
+
+	if (p->lexer)
+		*slot = lexer_next_token(p->lexer);
+	else if (p->pipe)
+		*slot = lex_pipe_next(p->pipe);
+	else if (index < p->end)
+		token_stream_get(p->tokens, index, slot);
+	else
+		*slot = eof_tok;
+
+	if (slot->type != TOKEN_ERROR)
+		return;
+
+	if (!p->quiet) {
+		str = token_text(p->source, slot, &len);
+		fprintf(stderr,
+			"lexer error: invalid token '%.*s' at line %d\n",
+			len, str, error_line(p, slot->offset));
+	}
+	slot->type = TOKEN_EOF;
+	p->error   = 1;
+	p->failed  = 1;
+}
+
+/*
+ * peek() - Return the token @ahead places past the current one.
+ *
+ * The pointer stays valid only until the next advance(); callers copy
+ * out what they need before moving on.
+ */
+static const struct token *peek(struct parser *p, int ahead)
+{
+	if (!p || p->error)
 		return &eof_tok;
-	return &p->tokens[p->position];
+
+	while (p->ring_fill <= ahead)
+		pull(p);
+	return &p->ring[(p->ring_head + ahead) % PARSER_LOOKAHEAD];
+}
+
+static const struct token *cur(struct parser *p)
+{
+	return peek(p, 0);
+}
+
+/* text() - View of a token's text; see token_text(). */
+static const char *text(const struct parser *p, const struct token *tok,
+			int *len)
+{
+	return token_text(p->source, tok, len);
 }
 
 static void advance(struct parser *p)
 {
-	if (p && p->position < p->token_count)
-		p->position++;
+	if (!p)
+		return;
+
+	/* Past the end of the stream there is nothing left to consume. */
+	if (p->tokens && p->position >= p->end)
+		return;
+
+	if (!p->ring_fill)
+		pull(p);
+	p->position++;
+	if (!p->tokens)
+		free(p->ring[p->ring_head].owned);
+	p->ring_head = (p->ring_head + 1) % PARSER_LOOKAHEAD;
+	p->ring_fill--;
 }
 
-static int match(const struct parser *p, enum token_type type)
+static int match(struct parser *p, enum token_type type)
 {
 	return cur(p)->type == type;
 }
@@ -82,45 +254,71 @@ static void skip_newlines(struct parser *p)
 		advance(p);
 }
 
-/* --- Statement list helpers --------------------------------------------- */
-
 /*
- * append_stmt() - Append a statement to a growing list.
+ * stalled() - Flag a statement that consumed no tokens.
  *
- * Doubles capacity via realloc when the list is full.
- * Returns 0 on allocation failure.
+ * parse_statement() returns NULL without advancing on a token that no
+ * rule accepts (parse_primary() has already reported it); the
+ * statement loops would otherwise spin on it forever.
  */
-static int append_stmt(struct ast_node ***stmts, int *count,
-		       int *capacity, struct ast_node *stmt)
+static int stalled(struct parser *p, int before)
 {
-	struct ast_node **new_list;
-	int new_cap;
+	if (p->position != before)
+		return 0;
+	p->error = 1;
+	return 1;
+}
 
-	if (*count < *capacity) {
-		(*stmts)[(*count)++] = stmt;
-		return 1;
-	}
+/* --- Child list helpers ------------------------------------------------- */
 
-	new_cap  = (*capacity) * 2;
-	new_list = realloc(*stmts, sizeof(struct ast_node *) * new_cap);
-	if (!new_list) {
-		fprintf(stderr, "parser: out of memory\n");
-		return 0;
+/*
+ * scratch_push() - Push a finished child onto the scratch stack.
+ *
+ * Blocks, the program and argument lists gather their children here
+ * and copy them into the arena once complete, so the arena only ever
+ * holds arrays at their final length.  A list opened inside another
+ * stacks above it and is popped before the outer one goes on.
+ * Returns 0 on allocation failure.
+ */
+static int scratch_push(struct parser *p, struct ast_node *node)
+{
+	struct ast_node **grown;
+	int cap;
+
+	if (p->scratch_top == p->scratch_cap) {
+		cap   = p->scratch_cap ? p->scratch_cap * 2 : SCRATCH_INIT_CAP;
+		grown = realloc(p->scratch, sizeof(*grown) * cap);
+		if (!grown) {
+			fprintf(stderr, "parser: out of memory\n");
+			return 0;
+		}
+		p->scratch     = grown;
+		p->scratch_cap = cap;
 	}
 
-	*stmts    = new_list;
-	*capacity = new_cap;
-	(*stmts)[(*count)++] = stmt;
+	p->scratch[p->scratch_top++] = node;
 	return 1;
 }
 
+/*
+ * scratch_pop() - Copy the children pushed since @base into the arena
+ *                 and drop them from the stack.  Returns NULL on
+ *                 allocation failure.
+ */
+static struct ast_node **scratch_pop(struct parser *p, int base, int *count)
+{
+	*count         = p->scratch_top - base;
+	p->scratch_top = base;
+	return ast_create_list(p->arena, p->scratch + base, *count);
+}
+
 /* --- Expression parsing -------------------------------------------------- */
 
 static struct ast_node *parse_call_args(struct parser *p,
-					struct ast_node *call,
-					const struct token *tok)
+					struct ast_node *call)
 {
 	struct ast_node *arg;
+	int base = p->scratch_top;
 
 	advance(p); /* consume '(' */
 
@@ -130,66 +328,65 @@ static struct ast_node *parse_call_args(struct parser *p,
 	}
 
 	do {
-		if (call->data.function_call.arg_count >= MAX_ARGS) {
-			fprintf(stderr,
-				"parse error: too many args "
-				"at line %d\n", tok->line);
-			ast_free(call);
-			return NULL;
+		if (p->scratch_top - base >= MAX_ARGS) {
+			syntax_error(p, call->offset, "too many args");
+			goto err;
 		}
 		arg = parse_expression(p);
-		if (!arg) {
-			ast_free(call);
-			return NULL;
-		}
-		call->data.function_call.arguments[
-			call->data.function_call.arg_count++] = arg;
+		if (!arg || !scratch_push(p, arg))
+			goto err;
 	} while (consume(p, TOKEN_COMMA));
 
 	consume(p, TOKEN_RPAREN);
+	call->data.function_call.arguments =
+		scratch_pop(p, base, &call->data.function_call.arg_count);
+	if (!call->data.function_call.arguments)
+		return NULL;
 	return call;
+
+err:
+	p->scratch_top = base;
+	return NULL;
 }
 
 static struct ast_node *parse_identifier_or_call(struct parser *p)
 {
-	struct token *tok = cur(p);
+	size_t offset = cur(p)->offset;
+	uint32_t name = cur(p)->atom;
 	struct ast_node *call;
 
 	advance(p);
 
 	if (!match(p, TOKEN_LPAREN))
-		return ast_create_identifier(tok->value, tok->line);
+		return ast_create_identifier(p->arena, name, offset);
 
-	call = ast_create_node(AST_FUNCTION_CALL, tok->line);
+	call = ast_create_node(p->arena, AST_FUNCTION_CALL, offset);
 	if (!call)
 		return NULL;
 
-	call->data.function_call.function_name = strdup(tok->value);
-	call->data.function_call.arguments =
-		malloc(sizeof(struct ast_node *) * MAX_ARGS);
-	call->data.function_call.arg_count = 0;
-
-	if (!call->data.function_call.function_name ||
-	    !call->data.function_call.arguments) {
-		ast_free(call);
-		return NULL;
-	}
-
-	return parse_call_args(p, call, tok);
+	call->data.function_call.function_name = name;
+	return parse_call_args(p, call);
 }
 
 static struct ast_node *parse_primary(struct parser *p)
 {
-	struct token *tok = cur(p);
+	const struct token *tok = cur(p);
 	struct ast_node *expr;
+	const char *str;
+	int len;
 
 	switch (tok->type) {
 	case TOKEN_NUMBER:
+		expr = hashcons_number(&p->consts, p->arena, tok->number,
+				       tok->offset);
 		advance(p);
-		return ast_create_number(tok->number, tok->line);
+		return expr;
 	case TOKEN_STRING:
+		str  = text(p, tok, &len);
+		expr = hashcons_string(&p->consts, p->arena, str, len,
+				       tok->offset);
 		advance(p);
-		return ast_create_string(tok->value, tok->line);
+		return expr;
 	case TOKEN_IDENTIFIER:
 		return parse_identifier_or_call(p);
 	case TOKEN_LPAREN:
@@ -198,157 +395,168 @@ static struct ast_node *parse_primary(struct parser *p)
 		consume(p, TOKEN_RPAREN);
 		return expr;
 	default:
-		fprintf(stderr,
-			"parse error: unexpected token '%s' "
-			"at line %d\n",
-			tok->value, tok->line);
+		if (p->error)
+			return NULL;
+		str = text(p, tok, &len);
+		syntax_error(p, tok->offset, "unexpected token '%.*s'",
+			     len, str);
 		return NULL;
 	}
 }
 
-static struct ast_node *parse_unary(struct parser *p)
+/*
+ * Binding power of each binary operator, higher binding tighter; 0 for
+ * tokens that do not continue an expression.  All of them are left
+ * associative.  Adding an operator is a line here plus its case in the
+ * interpreter.
+ */
+static const unsigned char binary_prec[] = {
+	[TOKEN_EQUAL]		= 1,
+	[TOKEN_NOT_EQUAL]	= 1,
+	[TOKEN_LESS]		= 1,
+	[TOKEN_GREATER]		= 1,
+	[TOKEN_LESS_EQUAL]	= 1,
+	[TOKEN_GREATER_EQUAL]	= 1,
+	[TOKEN_PLUS]		= 2,
+	[TOKEN_MINUS]		= 2,
+	[TOKEN_MULTIPLY]	= 3,
+	[TOKEN_DIVIDE]		= 3,
+};
+
+/* Highest value in binary_prec[]. */
+#define PREC_MAX	3
+
+/* Prefix operators; they bind tighter than any binary operator. */
+static const unsigned char is_prefix[] = {
+	[TOKEN_PLUS]		= 1,
+	[TOKEN_MINUS]		= 1,
+};
+
+/* prec_of() - Binding power of @type as a binary operator. */
+static int prec_of(enum token_type type)
 {
-	struct token *op;
-	struct ast_node *node;
-	struct ast_node *operand;
-
-	if (!match(p, TOKEN_MINUS) && !match(p, TOKEN_PLUS))
-		return parse_primary(p);
-
-	op = cur(p);
-	advance(p);
-
-	operand = parse_unary(p);
-	if (!operand)
-		return NULL;
-
-	node = ast_create_node(AST_UNARY_OP, op->line);
-	if (!node) {
-		ast_free(operand);
-		return NULL;
-	}
-
-	node->data.unary_op.op      = op->type;
-	node->data.unary_op.operand = operand;
-	return node;
+	if ((size_t)type >= sizeof(binary_prec))
+		return 0;
+	return binary_prec[type];
 }
 
-static struct ast_node *parse_term(struct parser *p)
+/*
+ * parse_operand() - Parse any prefix operators and the primary they
+ *                   apply to.  A run of prefixes is chained in a loop,
+ *                   so "- - - x" does not recurse per operator.  The
+ *                   innermost one is only built once its operand is
+ *                   known, so that "-1" can be a shared constant.
+ */
+static struct ast_node *parse_operand(struct parser *p)
 {
-	struct ast_node *left;
-	struct ast_node *right;
+	struct ast_node *root = NULL;
+	struct ast_node *last = NULL;
 	struct ast_node *node;
-	struct token *op;
-
-	left = parse_unary(p);
-	if (!left)
-		return NULL;
-
-	while (match(p, TOKEN_MULTIPLY) || match(p, TOKEN_DIVIDE)) {
-		op    = cur(p);
-		advance(p);
-		right = parse_unary(p);
-		if (!right) {
-			ast_free(left);
-			return NULL;
+	enum token_type type;
+	enum token_type op = TOKEN_EOF;
+	size_t offset = 0;
+	int pending = 0;
+
+	for (;;) {
+		type = cur(p)->type;
+		if ((size_t)type >= sizeof(is_prefix) || !is_prefix[type])
+			break;
+
+		if (pending) {
+			node = ast_create_node(p->arena, AST_UNARY_OP, offset);
+			if (!node)
+				return NULL;
+			node->data.unary_op.op = op;
+			if (last)
+				last->data.unary_op.operand = node;
+			else
+				root = node;
+			last = node;
 		}
-		node = ast_create_binary_op(left, op->type, right,
-					    op->line);
-		if (!node) {
-			ast_free(left);
-			ast_free(right);
-			return NULL;
-		}
-		left = node;
+		op      = type;
+		offset  = cur(p)->offset;
+		pending = 1;
+		advance(p);
 	}
 
-	return left;
+	node = parse_primary(p);
+	if (!node || !pending)
+		return node;
+	node = hashcons_unary(&p->consts, p->arena, op, node, offset);
+	if (!node || !last)
+		return node;
+	last->data.unary_op.operand = node;
+	return root;
 }
 
-static struct ast_node *parse_arithmetic(struct parser *p)
+/*
+ * parse_expression() - Parse a binary expression by precedence.
+ *
+ * Operators wait on a stack until one that binds no tighter arrives;
+ * then the waiting ones are folded into nodes.  The stack only ever
+ * holds operators of strictly increasing binding power, so it has at
+ * most PREC_MAX entries however long the chain is, and the only
+ * recursion left is into parentheses and call arguments.
+ */
+static struct ast_node *parse_expression(struct parser *p)
 {
-	struct ast_node *left;
-	struct ast_node *right;
+	struct ast_node *operands[PREC_MAX + 1];
+	enum token_type  ops[PREC_MAX];
+	size_t		 offsets[PREC_MAX];
 	struct ast_node *node;
-	struct token *op;
+	int top = 0;
+	int prec;
 
-	left = parse_term(p);
-	if (!left)
+	/* Give up on the whole parse rather than report every level. */
+	if (p->nesting >= PARSER_MAX_NESTING) {
+		syntax_error(p, cur(p)->offset, "expression nested too deeply");
+		p->error = 1;
 		return NULL;
-
-	while (match(p, TOKEN_PLUS) || match(p, TOKEN_MINUS)) {
-		op    = cur(p);
-		advance(p);
-		right = parse_term(p);
-		if (!right) {
-			ast_free(left);
-			return NULL;
-		}
-		node = ast_create_binary_op(left, op->type, right,
-					    op->line);
-		if (!node) {
-			ast_free(left);
-			ast_free(right);
-			return NULL;
-		}
-		left = node;
 	}
 
-	return left;
-}
-
-static int is_comparison_op(enum token_type t)
-{
-	return (t == TOKEN_EQUAL        ||
-		t == TOKEN_NOT_EQUAL    ||
-		t == TOKEN_LESS         ||
-		t == TOKEN_GREATER      ||
-		t == TOKEN_LESS_EQUAL   ||
-		t == TOKEN_GREATER_EQUAL);
-}
-
-static struct ast_node *parse_comparison(struct parser *p)
-{
-	struct ast_node *left;
-	struct ast_node *right;
-	struct ast_node *node;
-	struct token    *op;
+	p->nesting++;
+	operands[0] = parse_operand(p);
+	if (!operands[0])
+		goto err;
 
-	left = parse_arithmetic(p);
-	if (!left)
-		return NULL;
+	for (;;) {
+		prec = prec_of(cur(p)->type);
+
+		while (top > 0 && prec_of(ops[top - 1]) >= prec) {
+			top--;
+			node = hashcons_binary(&p->consts, p->arena,
+					       operands[top], ops[top],
+					       operands[top + 1],
+					       offsets[top]);
+			if (!node)
+				goto err;
+			operands[top] = node;
+		}
+		if (!prec)
+			break;
 
-	while (is_comparison_op(cur(p)->type)) {
-		op    = cur(p);
+		ops[top]     = cur(p)->type;
+		offsets[top] = cur(p)->offset;
 		advance(p);
-		right = parse_arithmetic(p);
-		if (!right) {
-			ast_free(left);
-			return NULL;
-		}
-		node = ast_create_binary_op(left, op->type, right,
-					    op->line);
-		if (!node) {
-			ast_free(left);
-			ast_free(right);
-			return NULL;
-		}
-		left = node;
+		top++;
+		operands[top] = parse_operand(p);
+		if (!operands[top])
+			goto err;
 	}
 
-	return left;
-}
+	p->nesting--;
+	return operands[0];
 
-static struct ast_node *parse_expression(struct parser *p)
-{
-	return parse_comparison(p);
+err:
+	p->nesting--;
+	return NULL;
 }
 
 /* --- Statement parsing --------------------------------------------------- */
 
 static struct ast_node *parse_if_stmt(struct parser *p)
 {
-	struct token *tok = cur(p);
+	size_t offset = cur(p)->offset;
 	struct ast_node *condition;
 	struct ast_node *then_block;
 	struct ast_node *else_block = NULL;
@@ -361,59 +569,42 @@ static struct ast_node *parse_if_stmt(struct parser *p)
 		return NULL;
 
 	if (!consume(p, TOKEN_COLON)) {
-		fprintf(stderr,
-			"parse error: expected ':' after if "
-			"at line %d\n", tok->line);
-		ast_free(condition);
+		syntax_error(p, offset, "expected ':' after if");
 		return NULL;
 	}
 
 	skip_newlines(p);
 	then_block = parse_block(p);
-	if (!then_block) {
-		ast_free(condition);
+	if (!then_block)
 		return NULL;
-	}
 
 	skip_newlines(p);
 	if (match(p, TOKEN_ELSE)) {
 		advance(p);
 		if (!consume(p, TOKEN_COLON)) {
-			fprintf(stderr,
-				"parse error: expected ':' after else "
-				"at line %d\n", cur(p)->line);
-			ast_free(condition);
-			ast_free(then_block);
+			syntax_error(p, cur(p)->offset,
+				     "expected ':' after else");
 			return NULL;
 		}
 		skip_newlines(p);
 		else_block = parse_block(p);
-		if (!else_block) {
-			ast_free(condition);
-			ast_free(then_block);
+		if (!else_block)
 			return NULL;
-		}
 	}
 
-	node = ast_create_node(AST_IF_STMT, tok->line);
+	node = ast_create_node(p->arena, AST_IF_STMT, offset);
 	if (!node)
-		goto err;
+		return NULL;
 
 	node->data.if_stmt.condition  = condition;
 	node->data.if_stmt.then_block = then_block;
 	node->data.if_stmt.else_block = else_block;
 	return node;
-
-err:
-	ast_free(condition);
-	ast_free(then_block);
-	ast_free(else_block);
-	return NULL;
 }
 
 static struct ast_node *parse_while_stmt(struct parser *p)
 {
-	struct token *tok = cur(p);
+	size_t offset = cur(p)->offset;
 	struct ast_node *condition;
 	struct ast_node *body;
 	struct ast_node *node;
@@ -425,139 +616,149 @@ static struct ast_node *parse_while_stmt(struct parser *p)
 		return NULL;
 
 	if (!consume(p, TOKEN_COLON)) {
-		fprintf(stderr,
-			"parse error: expected ':' after while "
-			"at line %d\n", tok->line);
-		ast_free(condition);
+		syntax_error(p, offset, "expected ':' after while");
 		return NULL;
 	}
 
 	skip_newlines(p);
 	body = parse_block(p);
-	if (!body) {
-		ast_free(condition);
+	if (!body)
 		return NULL;
-	}
 
-	node = ast_create_node(AST_WHILE_STMT, tok->line);
+	node = ast_create_node(p->arena, AST_WHILE_STMT, offset);
 	if (!node)
-		goto err;
+		return NULL;
 
 	node->data.while_stmt.condition = condition;
 	node->data.while_stmt.body      = body;
 	return node;
-
-err:
-	ast_free(condition);
-	ast_free(body);
-	return NULL;
 }
 
-static int parse_param_list(struct parser *p, struct ast_node *node)
+/*
+ * parse_param_list() - Read parameter names into @params, at most
+ *                      MAX_PARAMS of them.  Returns 0 on error.
+ */
+static int parse_param_list(struct parser *p, uint32_t *params, int *count)
 {
-	struct token *param_tok;
-	int j;
-
 	if (match(p, TOKEN_RPAREN))
 		return 1;
 
 	do {
 		if (!match(p, TOKEN_IDENTIFIER)) {
-			fprintf(stderr,
-				"parse error: expected param name "
-				"at line %d\n", cur(p)->line);
+			syntax_error(p, cur(p)->offset,
+				     "expected param name");
 			return 0;
 		}
-		if (node->data.function_def.param_count >= MAX_PARAMS) {
-			fprintf(stderr,
-				"parse error: too many params "
-				"at line %d\n", cur(p)->line);
+		if (*count >= MAX_PARAMS) {
+			syntax_error(p, cur(p)->offset, "too many params");
 			return 0;
 		}
-		param_tok = cur(p);
+		params[(*count)++] = cur(p)->atom;
 		advance(p);
-		j = node->data.function_def.param_count;
-		node->data.function_def.parameters[j] =
-			strdup(param_tok->value);
-		if (!node->data.function_def.parameters[j])
-			return 0;
-		node->data.function_def.param_count++;
 	} while (consume(p, TOKEN_COMMA));
 
 	return 1;
 }
 
+/*
+ * skip_block() - Step over the indented block at the cursor, up to and
+ *                including its closing DEDENT, without parsing it.
+ *
+ * Only packed token types are read, so this costs a fraction of
+ * parsing the block.  An unclosed block runs to the end of the stream.
+ */
+static void skip_block(struct parser *p)
+{
+	const struct packed_token *tok = p->tokens->tokens;
+	int depth = 0;
+	int j;
+
+	for (j = p->position; j < p->end; j++) {
+		if (tok[j].type == TOKEN_INDENT) {
+			depth++;
+		} else if (tok[j].type == TOKEN_DEDENT && !--depth) {
+			j++;
+			break;
+		}
+	}
+
+	/* Tokens buffered ahead are not owned in array mode. */
+	p->position  = j;
+	p->ring_fill = 0;
+}
+
 static struct ast_node *parse_function_def(struct parser *p)
 {
-	struct token	*def_tok = cur(p);
-	struct token	*name_tok;
+	size_t		 def_offset = cur(p)->offset;
+	size_t		 name_offset;
+	uint32_t	 name;
+	uint32_t	 params[MAX_PARAMS];
+	int		 nparams = 0;
+	int		 body_start;
 	struct ast_node *node;
 	struct ast_node *body;
 
 	advance(p); /* consume 'def' */
 
 	if (!match(p, TOKEN_IDENTIFIER)) {
-		fprintf(stderr,
-			"parse error: expected function name "
-			"at line %d\n", def_tok->line);
+		syntax_error(p, def_offset, "expected function name");
 		return NULL;
 	}
 
-	name_tok = cur(p);
+	name_offset = cur(p)->offset;
+	name      = cur(p)->atom;
 	advance(p);
 
 	if (!consume(p, TOKEN_LPAREN)) {
-		fprintf(stderr,
-			"parse error: expected '(' "
-			"at line %d\n", name_tok->line);
+		syntax_error(p, name_offset, "expected '('");
 		return NULL;
 	}
 
-	node = ast_create_node(AST_FUNCTION_DEF, def_tok->line);
-	if (!node)
+	if (!parse_param_list(p, params, &nparams))
 		return NULL;
 
-	node->data.function_def.name =
-		strdup(name_tok->value);
-	node->data.function_def.parameters =
-		malloc(sizeof(char *) * MAX_PARAMS);
-	node->data.function_def.param_count = 0;
-
-	if (!node->data.function_def.name ||
-	    !node->data.function_def.parameters)
-		goto err;
-
-	if (!parse_param_list(p, node))
-		goto err;
-
 	if (!consume(p, TOKEN_RPAREN) || !consume(p, TOKEN_COLON)) {
-		fprintf(stderr,
-			"parse error: expected ')' and ':' "
-			"at line %d\n", name_tok->line);
-		goto err;
+		syntax_error(p, name_offset, "expected ')' and ':'");
+		return NULL;
 	}
 
 	skip_newlines(p);
-	body = parse_block(p);
-	if (!body)
-		goto err;
+	body_start = p->position;
+	if (p->lazy && match(p, TOKEN_INDENT)) {
+		skip_block(p);
+		body = NULL;
+	} else {
+		body = parse_block(p);
+		if (!body)
+			return NULL;
+	}
 
-	node->data.function_def.body = body;
-	return node;
+	node = ast_create_node(p->arena, AST_FUNCTION_DEF, def_offset);
+	if (!node)
+		return NULL;
 
-err:
-	ast_free(node);
-	return NULL;
+	node->data.function_def.parameters =
+		arena_alloc(p->arena, sizeof(*params) * nparams);
+	if (!node->data.function_def.parameters)
+		return NULL;
+	memcpy(node->data.function_def.parameters, params,
+	       sizeof(*params) * nparams);
+
+	node->data.function_def.name        = name;
+	node->data.function_def.param_count = nparams;
+	node->data.function_def.body        = body;
+	node->data.function_def.body_start  = body_start;
+	return node;
 }
 
 static struct ast_node *parse_return_stmt(struct parser *p)
 {
-	struct token	*tok = cur(p);
+	size_t		 offset = cur(p)->offset;
 	struct ast_node *node;
 
 	advance(p); /* consume 'return' */
 
-	node = ast_create_node(AST_RETURN_STMT, tok->line);
+	node = ast_create_node(p->arena, AST_RETURN_STMT, offset);
 	if (!node)
 		return NULL;
 
@@ -569,26 +770,22 @@ static struct ast_node *parse_return_stmt(struct parser *p)
 	}
 
 	node->data.return_stmt.value = parse_expression(p);
-	if (!node->data.return_stmt.value) {
-		ast_free(node);
+	if (!node->data.return_stmt.value)
 		return NULL;
-	}
 
 	return node;
 }
 
 static struct ast_node *parse_print_stmt(struct parser *p)
 {
-	struct token *tok = cur(p);
+	size_t offset = cur(p)->offset;
 	struct ast_node *node;
 	struct ast_node *value;
 
 	advance(p); /* consume 'print' */
 
 	if (!consume(p, TOKEN_LPAREN)) {
-		fprintf(stderr,
-			"parse error: expected '(' after print "
-			"at line %d\n", tok->line);
+		syntax_error(p, offset, "expected '(' after print");
 		return NULL;
 	}
 
@@ -597,18 +794,13 @@ static struct ast_node *parse_print_stmt(struct parser *p)
 		return NULL;
 
 	if (!consume(p, TOKEN_RPAREN)) {
-		fprintf(stderr,
-			"parse error: expected ')' closing print "
-			"at line %d\n", tok->line);
-		ast_free(value);
+		syntax_error(p, offset, "expected ')' closing print");
 		return NULL;
 	}
 
-	node = ast_create_node(AST_PRINT_STMT, tok->line);
-	if (!node) {
-		ast_free(value);
+	node = ast_create_node(p->arena, AST_PRINT_STMT, offset);
+	if (!node)
 		return NULL;
-	}
 
 	node->data.print_stmt.value = value;
 	return node;
@@ -616,7 +808,8 @@ static struct ast_node *parse_print_stmt(struct parser *p)
 
 static struct ast_node *parse_assignment(struct parser *p)
 {
-	struct token *id_tok = cur(p);
+	size_t offset = cur(p)->offset;
+	uint32_t name = cur(p)->atom;
 	struct ast_node *node;
 	struct ast_node *value;
 
@@ -627,27 +820,18 @@ static struct ast_node *parse_assignment(struct parser *p)
 	if (!value)
 		return NULL;
 
-	node = ast_create_node(AST_ASSIGNMENT, id_tok->line);
-	if (!node) {
-		ast_free(value);
-		return NULL;
-	}
-
-	node->data.assignment.variable = strdup(id_tok->value);
-	if (!node->data.assignment.variable) {
-		ast_free(node);
-		ast_free(value);
+	node = ast_create_node(p->arena, AST_ASSIGNMENT, offset);
+	if (!node)
 		return NULL;
-	}
 
-	node->data.assignment.value = value;
+	node->data.assignment.variable = name;
+	node->data.assignment.value    = value;
 	return node;
 }
 
-static int next_is_assign(const struct parser *p)
+static int next_is_assign(struct parser *p)
 {
-	return (p->position + 1 < p->token_count &&
-		p->tokens[p->position + 1].type == TOKEN_ASSIGN);
+	return peek(p, 1)->type == TOKEN_ASSIGN;
 }
 
 static struct ast_node *parse_statement(struct parser *p)
@@ -678,40 +862,293 @@ static struct ast_node *parse_block(struct parser *p)
 {
 	struct ast_node	 *block;
 	struct ast_node	 *stmt;
+	int base = p->scratch_top;
+	int before;
 
-	block = ast_create_node(AST_BLOCK, cur(p)->line);
+	block = ast_create_node(p->arena, AST_BLOCK, cur(p)->offset);
 	if (!block)
 		return NULL;
 
+	if (consume(p, TOKEN_INDENT)) {
+		while (!match(p, TOKEN_DEDENT) && !match(p, TOKEN_EOF)) {
+			before = p->position;
+			stmt   = parse_statement(p);
+			skip_newlines(p);
+			if (!stmt && stalled(p, before))
+				break;
+			/* A failed statement may have left children behind. */
+			p->scratch_top = base + block->data.block.count;
+			if (!stmt)
+				continue;
+			if (!scratch_push(p, stmt))
+				goto err;
+			block->data.block.count++;
+		}
+		consume(p, TOKEN_DEDENT);
+	}
+
 	block->data.block.statements =
-		malloc(sizeof(struct ast_node *) * BLOCK_INIT_CAP);
-	block->data.block.count    = 0;
-	block->data.block.capacity = BLOCK_INIT_CAP;
+		scratch_pop(p, base, &block->data.block.count);
+	if (!block->data.block.statements)
+		return NULL;
+	return block;
 
-	if (!block->data.block.statements) {
-		ast_free(block);
+err:
+	p->scratch_top = base;
+	return NULL;
+}
+
+/**
+ * parser_set_lazy() - Defer parsing function bodies until needed.
+ */
+void parser_set_lazy(struct parser *p, int lazy)
+{
+	if (p && p->tokens)
+		p->lazy = lazy;
+}
+
+/**
+ * parser_parse_body() - Parse the body a lazy parse deferred.
+ */
+struct ast_node *parser_parse_body(struct parser *p, struct ast_node *def)
+{
+	struct ast_node *body;
+
+	if (!p || !p->tokens || def->data.function_def.body)
+		return def->data.function_def.body;
+
+	/* The block ends itself at its DEDENT; no slice bound needed. */
+	p->position  = def->data.function_def.body_start;
+	p->end       = p->tokens->count;
+	p->ring_fill = 0;
+	p->error     = 0;
+	p->nesting   = 0;
+
+	body = parse_block(p);
+	if (p->error || !body)
+		body = ast_create_node(p->arena, AST_BLOCK, def->offset);
+	def->data.function_def.body = body;
+	return body;
+}
+
+/**
+ * parser_current() - Return the token the parser will consume next.
+ */
+const struct token *parser_current(struct parser *p)
+{
+	return cur(p);
+}
+
+/**
+ * parser_parse_toplevel() - Parse one top-level statement.
+ */
+struct ast_node *parser_parse_toplevel(struct parser *p)
+{
+	struct ast_node *stmt;
+	int before;
+
+	if (!p || p->error)
 		return NULL;
-	}
 
-	if (!consume(p, TOKEN_INDENT))
-		return block;
+	before = p->position;
+	stmt   = parse_statement(p);
+	if (!stmt)
+		stalled(p, before);
+	if (p->error)
+		return NULL;
+	skip_newlines(p);
+	return stmt;
+}
 
-	while (!match(p, TOKEN_DEDENT) && !match(p, TOKEN_EOF)) {
-		stmt = parse_statement(p);
-		skip_newlines(p);
-		if (!stmt)
+/* --- Parallel program parse --------------------------------------------- */
+
+/**
+ * struct parse_slice - A run of top-level statements parsed on its own.
+ * @start:  Index of its first token.
+ * @end:    Index of the first token of the next slice.
+ * @arena:  Arena the slice's statements are built in.
+ * @stmts:  The statements, in source order, in @arena.
+ * @count:  Entries in @stmts.
+ * @failed: Non-zero unless every statement parsed without a diagnostic.
+ */
+struct parse_slice {
+	int			 start;
+	int			 end;
+	struct arena		*arena;
+	struct ast_node		**stmts;
+	int			 count;
+	int			 failed;
+};
+
+/**
+ * struct parse_job - Shared argument of parse_slice_job().
+ * @parent: Parser whose tokens are being split.
+ * @slices: One entry per work item.
+ */
+struct parse_job {
+	const struct parser	*parent;
+	struct parse_slice	*slices;
+};
+
+/*
+ * split_toplevel() - Cut @p's tokens into at most @n slices of about
+ *                    equal length, each starting at a top-level
+ *                    statement; returns how many it made.
+ *
+ * A statement starts at depth zero right after a NEWLINE or the DEDENT
+ * that closes a block.  An else carries on the if before it and never
+ * starts one.
+ */
+static int split_toplevel(const struct parser *p, struct parse_slice *slices,
+			  int n)
+{
+	const struct packed_token *tok = p->tokens->tokens;
+	int count = p->tokens->count;
+	int depth = 0;
+	int made = 1;
+	int prev;
+	int j;
+
+	slices[0].start = 0;
+	for (j = 1; j < count && made < n; j++) {
+		prev = tok[j - 1].type;
+		if (prev == TOKEN_INDENT)
+			depth++;
+		else if (prev == TOKEN_DEDENT)
+			depth--;
+
+		if (depth || (prev != TOKEN_NEWLINE && prev != TOKEN_DEDENT))
+			continue;
+		switch (tok[j].type) {
+		case TOKEN_NEWLINE:
+		case TOKEN_DEDENT:
+		case TOKEN_ELSE:
+		case TOKEN_EOF:
 			continue;
-		if (!append_stmt(&block->data.block.statements,
-				 &block->data.block.count,
-				 &block->data.block.capacity,
-				 stmt)) {
-			ast_free(block);
-			return NULL;
 		}
+		if ((size_t)j < (size_t)count * made / n)
+			continue;
+
+		slices[made - 1].end = j;
+		slices[made].start   = j;
+		made++;
 	}
+	slices[made - 1].end = count;
+	return made;
+}
 
-	consume(p, TOKEN_DEDENT);
-	return block;
+/* parse_slice_job() - Thread pool job: parse slice @index quietly. */
+static void parse_slice_job(void *arg, int index)
+{
+	struct parse_job *job = arg;
+	struct parse_slice *slice = &job->slices[index];
+	struct ast_node *stmt;
+	struct parser *p;
+
+	slice->failed = 1;
+	slice->arena  = arena_create();
+	if (!slice->arena)
+		return;
+
+	p = parser_create(job->parent->tokens, job->parent->source,
+			  slice->arena);
+	if (!p)
+		return;
+	p->position = slice->start;
+	p->end      = slice->end;
+	p->quiet    = 1;
+	p->lazy     = job->parent->lazy;
+
+	while (!match(p, TOKEN_EOF)) {
+		stmt = parser_parse_toplevel(p);
+		if (p->failed || p->error)
+			goto out;
+		/* Only trailing newlines may come back empty. */
+		if (!stmt) {
+			if (!match(p, TOKEN_EOF))
+				goto out;
+			break;
+		}
+		if (!scratch_push(p, stmt))
+			goto out;
+	}
+
+	slice->stmts  = scratch_pop(p, 0, &slice->count);
+	slice->failed = !slice->stmts;
+out:
+	parser_destroy(p);
+}
+
+/*
+ * parse_slices() - Parse the whole stream as slices on p->pool into
+ *                  @prog.  Returns 0, leaving @prog empty, if the
+ *                  stream is too short to split or a slice failed.
+ */
+static int parse_slices(struct parser *p, struct ast_node *prog)
+{
+	struct parse_slice *slices;
+	struct parse_job job;
+	struct ast_node **stmts = NULL;
+	int total = 0;
+	int ok = 1;
+	int n;
+	int j;
+
+	n = thread_pool_size(p->pool) * PARSER_SLICES_PER_THREAD;
+	if (n > p->tokens->count / PARSER_SLICE_MIN_TOKENS)
+		n = p->tokens->count / PARSER_SLICE_MIN_TOKENS;
+	if (thread_pool_size(p->pool) < 2 || n < 2)
+		return 0;
+
+	slices = calloc(n, sizeof(*slices));
+	if (!slices)
+		return 0;
+
+	n = split_toplevel(p, slices, n);
+	if (n < 2) {
+		free(slices);
+		return 0;
+	}
+
+	job.parent = p;
+	job.slices = slices;
+	thread_pool_run(p->pool, parse_slice_job, &job, n);
+
+	for (j = 0; j < n; j++) {
+		ok    &= !slices[j].failed;
+		total += slices[j].count;
+	}
+	if (ok)
+		stmts = arena_alloc(p->arena, sizeof(*stmts) * (size_t)total);
+	if (stmts) {
+		total = 0;
+		for (j = 0; j < n; j++) {
+			memcpy(stmts + total, slices[j].stmts,
+			       sizeof(*stmts) * (size_t)slices[j].count);
+			total += slices[j].count;
+		}
+		prog->data.program.statements = stmts;
+		prog->data.program.count      = total;
+		p->position                   = p->end;
+	}
+
+	for (j = 0; j < n; j++) {
+		if (stmts)
+			arena_merge(p->arena, slices[j].arena);
+		else
+			arena_destroy(slices[j].arena);
+	}
+	free(slices);
+	return stmts != NULL;
+}
+
+/**
+ * parser_set_pool() - Let parser_parse_program() use @pool.
+ */
+void parser_set_pool(struct parser *p, struct thread_pool *pool)
+{
+	if (p && p->tokens)
+		p->pool = pool;
 }
 
 /**
@@ -721,37 +1158,38 @@ struct ast_node *parser_parse_program(struct parser *p)
 {
 	struct ast_node	 *prog;
 	struct ast_node	 *stmt;
+	int base;
 
 	if (!p)
 		return NULL;
 
-	prog = ast_create_node(AST_PROGRAM, 1);
+	prog = ast_create_node(p->arena, AST_PROGRAM, 0);
 	if (!prog)
 		return NULL;
 
-	prog->data.program.statements =
-		malloc(sizeof(struct ast_node *) * PROG_INIT_CAP);
-	prog->data.program.count    = 0;
-	prog->data.program.capacity = PROG_INIT_CAP;
-
-	if (!prog->data.program.statements) {
-		ast_free(prog);
-		return NULL;
-	}
+	if (p->pool && parse_slices(p, prog))
+		return prog;
 
+	base = p->scratch_top;
 	while (!match(p, TOKEN_EOF)) {
-		stmt = parse_statement(p);
-		skip_newlines(p);
+		stmt = parser_parse_toplevel(p);
+		p->scratch_top = base + prog->data.program.count;
+		if (p->error)
+			goto err;
 		if (!stmt)
 			continue;
-		if (!append_stmt(&prog->data.program.statements,
-				 &prog->data.program.count,
-				 &prog->data.program.capacity,
-				 stmt)) {
-			ast_free(prog);
-			return NULL;
-		}
+		if (!scratch_push(p, stmt))
+			goto err;
+		prog->data.program.count++;
 	}
 
+	prog->data.program.statements =
+		scratch_pop(p, base, &prog->data.program.count);
+	if (!prog->data.program.statements)
+		return NULL;
 	return prog;
+
+err:
+	p->scratch_top = base;
+	return NULL;
 }
@@ -0,0 +1,766 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "scan.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * x86 builds get SSE2 (always present on x86-64) and, when the CPU
+ * reports it at runtime, AVX2.  Everything else uses the byte loops.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_HAVE_AVX2	1
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__)
+#define SCAN_HAVE_SSE2	1
+#include <emmintrin.h>
+#endif
+
+/**
+ * struct scan_ops - One implementation tier of the run scanners.
+ */
+struct scan_ops {
+	enum scan_level level;
+	size_t (*blanks)(const char *s, size_t n);
+	size_t (*line)(const char *s, size_t n);
+	size_t (*ident)(const char *s, size_t n);
+	size_t (*string)(const char *s, size_t n, char quote);
+	size_t (*utf8)(const char *s, size_t n, int *ascii);
+	size_t (*newlines)(const char *s, size_t n, size_t *starts);
+};
+
+/* --- Scalar fallback ----------------------------------------------------- */
+
+static int is_ident_byte(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_';
+}
+
+static size_t blanks_scalar(const char *s, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && (s[i] == ' ' || s[i] == '\t'))
+		i++;
+	return i;
+}
+
+static size_t line_scalar(const char *s, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && s[i] != '\n' && s[i] != '\0')
+		i++;
+	return i;
+}
+
+static size_t ident_scalar(const char *s, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n && is_ident_byte(s[i]))
+		i++;
+	return i;
+}
+
+static size_t string_scalar(const char *s, size_t n, char quote)
+{
+	size_t i = 0;
+
+	while (i < n && s[i] != quote && s[i] != '\\' &&
+	       s[i] != '\n' && s[i] != '\0')
+		i++;
+	return i;
+}
+
+/*
+ * utf8_seq() - Length of the well-formed UTF-8 sequence at @s, or 0.
+ *
+ * Rejects overlong forms, surrogates and code points past U+10FFFF,
+ * per RFC 3629.
+ */
+static size_t utf8_seq(const unsigned char *s, size_t n)
+{
+	unsigned c = s[0];
+
+	if (c < 0x80)
+		return 1;
+	if (c < 0xC2 || c > 0xF4)
+		return 0;
+
+	if (c < 0xE0)
+		return n >= 2 && (s[1] & 0xC0) == 0x80 ? 2 : 0;
+
+	if (c < 0xF0) {
+		if (n < 3 || (s[1] & 0xC0) != 0x80 ||
+		    (s[2] & 0xC0) != 0x80)
+			return 0;
+		if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] >= 0xA0))
+			return 0;
+		return 3;
+	}
+
+	if (n < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 ||
+	    (s[3] & 0xC0) != 0x80)
+		return 0;
+	if ((c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] >= 0x90))
+		return 0;
+	return 4;
+}
+
+/*
+ * utf8_scalar() - Validate eight ASCII bytes at a time while they last,
+ *                 and one sequence at a time otherwise.
+ */
+static size_t utf8_scalar(const char *s, size_t n, int *ascii)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	uint64_t w;
+	size_t len;
+	size_t i = 0;
+
+	*ascii = 1;
+	while (i < n) {
+		if (i + 8 <= n) {
+			memcpy(&w, u + i, 8);
+			if (!(w & 0x8080808080808080ull)) {
+				i += 8;
+				continue;
+			}
+		}
+		len = utf8_seq(u + i, n - i);
+		if (!len)
+			return i;
+		if (len > 1)
+			*ascii = 0;
+		i += len;
+	}
+	return n;
+}
+
+/*
+ * newlines_from() - Count the newlines in s[@i, @n), storing the offset
+ *                   after each at @starts[@k...] when @starts is set.
+ *                   Returns the running count.
+ */
+static size_t newlines_from(const char *s, size_t i, size_t n,
+			    size_t *starts, size_t k)
+{
+	for (; i < n; i++) {
+		if (s[i] != '\n')
+			continue;
+		if (starts)
+			starts[k] = i + 1;
+		k++;
+	}
+	return k;
+}
+
+static size_t newlines_scalar(const char *s, size_t n, size_t *starts)
+{
+	return newlines_from(s, 0, n, starts, 0);
+}
+
+/*
+ * newlines_mask() - Account for the newlines flagged in @mask, a bit
+ *                   per byte from offset @base.  Returns the new count.
+ */
+static size_t newlines_mask(uint32_t mask, size_t base, size_t *starts,
+			    size_t k)
+{
+	if (!starts)
+		return k + __builtin_popcount(mask);
+	while (mask) {
+		starts[k++] = base + __builtin_ctz(mask) + 1;
+		mask &= mask - 1;
+	}
+	return k;
+}
+
+static const struct scan_ops scalar_ops = {
+	SCAN_SCALAR,
+	blanks_scalar, line_scalar, ident_scalar, string_scalar,
+	utf8_scalar, newlines_scalar
+};
+
+/* --- SSE2: 16 bytes per step --------------------------------------------- */
+
+#ifdef SCAN_HAVE_SSE2
+
+/*
+ * Each helper builds a per-byte match mask; the scanners then find the
+ * first byte that ends the run with a count-trailing-zeros.  Signed
+ * byte compares are fine here: bytes >= 0x80 compare as negative and
+ * so never fall inside an ASCII range.
+ */
+static __m128i ident_mask_sse2(__m128i v)
+{
+	__m128i low   = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_and_si128(
+		_mm_cmpgt_epi8(low, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(low, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(
+		_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+
+	return _mm_or_si128(_mm_or_si128(alpha, digit), under);
+}
+
+static size_t blanks_sse2(const char *s, size_t n)
+{
+	const __m128i sp  = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	__m128i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+						      _mm_cmpeq_epi8(v, tab)));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + blanks_scalar(s + i, n - i);
+}
+
+static size_t line_sse2(const char *s, size_t n)
+{
+	const __m128i nl  = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl),
+						      _mm_cmpeq_epi8(v, nul)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + line_scalar(s + i, n - i);
+}
+
+static size_t ident_sse2(const char *s, size_t n)
+{
+	__m128i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = _mm_movemask_epi8(ident_mask_sse2(v));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + ident_scalar(s + i, n - i);
+}
+
+static size_t string_sse2(const char *s, size_t n, char quote)
+{
+	const __m128i q   = _mm_set1_epi8(quote);
+	const __m128i bs  = _mm_set1_epi8('\\');
+	const __m128i nl  = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v;
+	__m128i hit;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(s + i));
+		hit  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, q),
+						 _mm_cmpeq_epi8(v, bs)),
+				    _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+						 _mm_cmpeq_epi8(v, nul)));
+		mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + string_scalar(s + i, n - i, quote);
+}
+
+/*
+ * utf8_sse2() - Skip ASCII 16 bytes at a time.  SSE2 has no byte
+ * shuffle for the table lookups the AVX2 validator uses, so anything
+ * else is checked one sequence at a time.
+ */
+static size_t utf8_sse2(const char *s, size_t n, int *ascii)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	__m128i v;
+	size_t len;
+	size_t i = 0;
+
+	*ascii = 1;
+	while (i < n) {
+		if (i + 16 <= n) {
+			v = _mm_loadu_si128((const __m128i *)(s + i));
+			if (!_mm_movemask_epi8(v)) {
+				i += 16;
+				continue;
+			}
+		}
+		len = utf8_seq(u + i, n - i);
+		if (!len)
+			return i;
+		if (len > 1)
+			*ascii = 0;
+		i += len;
+	}
+	return n;
+}
+
+static size_t newlines_sse2(const char *s, size_t n, size_t *starts)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i v;
+	size_t k = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		k = newlines_mask(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)),
+				  i, starts, k);
+	}
+	return newlines_from(s, i, n, starts, k);
+}
+
+static const struct scan_ops sse2_ops = {
+	SCAN_SSE2,
+	blanks_sse2, line_sse2, ident_sse2, string_sse2,
+	utf8_sse2, newlines_sse2
+};
+
+#endif /* SCAN_HAVE_SSE2 */
+
+/* --- AVX2: 32 bytes per step --------------------------------------------- */
+
+#ifdef SCAN_HAVE_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i ident_mask_avx2(__m256i v)
+{
+	__m256i low   = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i alpha = _mm256_and_si256(
+		_mm256_cmpgt_epi8(low, _mm256_set1_epi8('a' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), low));
+	__m256i digit = _mm256_and_si256(
+		_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	__m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+
+	return _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+}
+
+AVX2 static size_t blanks_avx2(const char *s, size_t n)
+{
+	const __m256i sp  = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	__m256i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(s + i));
+		mask = (unsigned)_mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+					_mm256_cmpeq_epi8(v, tab)));
+		if (mask != 0xFFFFFFFFu)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + blanks_scalar(s + i, n - i);
+}
+
+AVX2 static size_t line_avx2(const char *s, size_t n)
+{
+	const __m256i nl  = _mm256_set1_epi8('\n');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(s + i));
+		mask = (unsigned)_mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+					_mm256_cmpeq_epi8(v, nul)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + line_scalar(s + i, n - i);
+}
+
+AVX2 static size_t ident_avx2(const char *s, size_t n)
+{
+	__m256i v;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(s + i));
+		mask = (unsigned)_mm256_movemask_epi8(ident_mask_avx2(v));
+		if (mask != 0xFFFFFFFFu)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + ident_scalar(s + i, n - i);
+}
+
+AVX2 static size_t string_avx2(const char *s, size_t n, char quote)
+{
+	const __m256i q   = _mm256_set1_epi8(quote);
+	const __m256i bs  = _mm256_set1_epi8('\\');
+	const __m256i nl  = _mm256_set1_epi8('\n');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v;
+	__m256i hit;
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(s + i));
+		hit  = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, q),
+					_mm256_cmpeq_epi8(v, bs)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+					_mm256_cmpeq_epi8(v, nul)));
+		mask = (unsigned)_mm256_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + string_scalar(s + i, n - i, quote);
+}
+
+/*
+ * UTF-8 validation by table lookup (Keiser and Lemire, "Validating
+ * UTF-8 In Less Than One Instruction Per Byte", 2021).  Each byte is
+ * classified by the high nibble of the byte before it, the low nibble
+ * of the byte before it and its own high nibble; every error pattern
+ * sets a bit in all three lookups, so their AND is non-zero exactly
+ * where a two-byte rule is broken.  Third and fourth bytes of longer
+ * sequences are checked separately against the leads two and three
+ * bytes back.
+ */
+#define U8_TOO_SHORT	(1 << 0)	/* lead not followed by a continuation */
+#define U8_TOO_LONG	(1 << 1)	/* ASCII followed by a continuation */
+#define U8_OVERLONG_3	(1 << 2)
+#define U8_TOO_LARGE	(1 << 3)
+#define U8_SURROGATE	(1 << 4)
+#define U8_OVERLONG_2	(1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4	(1 << 6)
+#define U8_TWO_CONTS	(1 << 7)	/* continuation after a continuation */
+#define U8_CARRY	(U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)	\
+	_mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+			 a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+AVX2 static __m256i high_nibble_avx2(__m256i v)
+{
+	return _mm256_and_si256(_mm256_srli_epi16(v, 4),
+				_mm256_set1_epi8(0x0F));
+}
+
+/* prev_avx2() - @v shifted right by @k bytes, filled from @prev. */
+#define prev_avx2(v, prev, k)						\
+	_mm256_alignr_epi8((v), _mm256_permute2x128_si256((prev), (v), 0x21), \
+			   16 - (k))
+
+AVX2 static __m256i utf8_errors_avx2(__m256i v, __m256i prev)
+{
+	const __m256i byte_1_high_tbl = U8_TABLE(
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		U8_TOO_SHORT,
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 |
+		U8_OVERLONG_4);
+	const __m256i byte_1_low_tbl = U8_TABLE(
+		U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+		U8_CARRY | U8_OVERLONG_2,
+		U8_CARRY,
+		U8_CARRY,
+		U8_CARRY | U8_TOO_LARGE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+	const __m256i byte_2_high_tbl = U8_TABLE(
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+		U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 |
+		U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+		U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE |
+		U8_TOO_LARGE,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+	__m256i prev1 = prev_avx2(v, prev, 1);
+	__m256i prev2 = prev_avx2(v, prev, 2);
+	__m256i prev3 = prev_avx2(v, prev, 3);
+	__m256i special;
+	__m256i must23;
+
+	special = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high_tbl,
+					    high_nibble_avx2(prev1)),
+			_mm256_shuffle_epi8(byte_1_low_tbl,
+					    _mm256_and_si256(prev1,
+						_mm256_set1_epi8(0x0F)))),
+		_mm256_shuffle_epi8(byte_2_high_tbl, high_nibble_avx2(v)));
+
+	/* 0x80 where a third or fourth byte is owed to an earlier lead. */
+	must23 = _mm256_and_si256(
+		_mm256_or_si256(
+			_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+			_mm256_subs_epu8(prev3,
+					 _mm256_set1_epi8((char)(0xF0 - 0x80)))),
+		_mm256_set1_epi8((char)0x80));
+
+	return _mm256_xor_si256(must23, special);
+}
+
+/*
+ * utf8_avx2() - Validate 32 bytes per step, skipping the lookups for
+ * all-ASCII blocks.  On failure the scalar validator is rerun to find
+ * where the error is; that only happens for invalid input.
+ */
+AVX2 static size_t utf8_avx2(const char *s, size_t n, int *ascii)
+{
+	/* Bytes a block may end on without owing continuations. */
+	const __m256i max_tail = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+	__m256i error      = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	__m256i prev       = _mm256_setzero_si256();
+	__m256i high       = _mm256_setzero_si256();
+	__m256i v;
+	char tail[32];
+	size_t i = 0;
+
+	for (;;) {
+		if (i + 32 <= n) {
+			v = _mm256_loadu_si256((const __m256i *)(s + i));
+		} else if (i < n) {
+			/* Zero padding is ASCII, so a cut-off tail errors. */
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, s + i, n - i);
+			v = _mm256_loadu_si256((const __m256i *)tail);
+		} else {
+			break;
+		}
+
+		if (!_mm256_movemask_epi8(v)) {
+			error = _mm256_or_si256(error, incomplete);
+			incomplete = _mm256_setzero_si256();
+		} else {
+			high  = _mm256_or_si256(high, v);
+			error = _mm256_or_si256(error,
+						utf8_errors_avx2(v, prev));
+			incomplete = _mm256_subs_epu8(v, max_tail);
+		}
+		prev = v;
+		i   += 32;
+	}
+
+	error = _mm256_or_si256(error, incomplete);
+	if (!_mm256_testz_si256(error, error))
+		return utf8_scalar(s, n, ascii);
+
+	*ascii = !_mm256_movemask_epi8(high);
+	return n;
+}
+
+AVX2 static size_t newlines_avx2(const char *s, size_t n, size_t *starts)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	__m256i v;
+	size_t k = 0;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		k = newlines_mask((uint32_t)_mm256_movemask_epi8(
+					  _mm256_cmpeq_epi8(v, nl)),
+				  i, starts, k);
+	}
+	return newlines_from(s, i, n, starts, k);
+}
+
+static const struct scan_ops avx2_ops = {
+	SCAN_AVX2,
+	blanks_avx2, line_avx2, ident_avx2, string_avx2,
+	utf8_avx2, newlines_avx2
+};
+
+#endif /* SCAN_HAVE_AVX2 */
+
+/* --- Dispatch ------------------------------------------------------------ */
+
+static const struct scan_ops *active_ops;
+
+/* The lexer's workers may be the first to scan, so pick a tier once. */
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+/**
+ * scan_best_level() - Highest tier this CPU and build support.
+ */
+enum scan_level scan_best_level(void)
+{
+#ifdef SCAN_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SCAN_AVX2;
+#endif
+#ifdef SCAN_HAVE_SSE2
+	return SCAN_SSE2;
+#else
+	return SCAN_SCALAR;
+#endif
+}
+
+/**
+ * scan_set_level() - Select the scanner tier.
+ */
+/* select_level() - Point active_ops at @level, clamped to the best. */
+static void select_level(enum scan_level level)
+{
+	enum scan_level best = scan_best_level();
+
+	if (level > best)
+		level = best;
+
+	switch (level) {
+#ifdef SCAN_HAVE_AVX2
+	case SCAN_AVX2:
+		active_ops = &avx2_ops;
+		break;
+#endif
+#ifdef SCAN_HAVE_SSE2
+	case SCAN_SSE2:
+		active_ops = &sse2_ops;
+		break;
+#endif
+	default:
+		active_ops = &scalar_ops;
+		break;
+	}
+}
+
+static void init_ops(void)
+{
+	select_level(scan_best_level());
+}
+
+/**
+ * scan_set_level() - Select the scanner tier.
+ */
+enum scan_level scan_set_level(enum scan_level level)
+{
+	/* Let a later first use not undo the choice. */
+	pthread_once(&ops_once, init_ops);
+	select_level(level);
+	return active_ops->level;
+}
+
+/**
+ * scan_level_name() - Printable name of @level.
+ */
+const char *scan_level_name(enum scan_level level)
+{
+	switch (level) {
+	case SCAN_AVX2:	return "avx2";
+	case SCAN_SSE2:	return "sse2";
+	default:	return "scalar";
+	}
+}
+
+static const struct scan_ops *ops(void)
+{
+	pthread_once(&ops_once, init_ops);
+	return active_ops;
+}
+
+/*
+ * The public entry points check the first byte inline: most runs in
+ * real code are empty or a single space, and those never need the
+ * indirect call.
+ */
+
+/**
+ * scan_blanks() - Length of the leading run of spaces and tabs.
+ */
+size_t scan_blanks(const char *s, size_t n)
+{
+	if (!n || (s[0] != ' ' && s[0] != '\t'))
+		return 0;
+	return ops()->blanks(s, n);
+}
+
+/**
+ * scan_line() - Length of the text before the next newline or NUL.
+ */
+size_t scan_line(const char *s, size_t n)
+{
+	if (!n || s[0] == '\n' || s[0] == '\0')
+		return 0;
+	return ops()->line(s, n);
+}
+
+/**
+ * scan_ident() - Length of the leading run of identifier bytes.
+ */
+size_t scan_ident(const char *s, size_t n)
+{
+	if (!n || !is_ident_byte(s[0]))
+		return 0;
+	return ops()->ident(s, n);
+}
+
+/**
+ * scan_string() - Length of a string body up to the next special byte.
+ */
+size_t scan_string(const char *s, size_t n, char quote)
+{
+	return ops()->string(s, n, quote);
+}
+
+/**
+ * scan_utf8() - Length of the leading well-formed UTF-8 in @s.
+ */
+size_t scan_utf8(const char *s, size_t n, int *ascii)
+{
+	return ops()->utf8(s, n, ascii);
+}
+
+/**
+ * scan_newlines() - Count the newlines in @s and record the lines they
+ *                   start.
+ */
+size_t scan_newlines(const char *s, size_t n, size_t *starts)
+{
+	return ops()->newlines(s, n, starts);
+}
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "sha256.h"
+#include <string.h>
+
+/* Round constants: the first 32 bits of the cube roots of the primes. */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/* sha256_block() - Fold one 64-byte block into @state. */
+static void sha256_block(uint32_t state[8], const uint8_t *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	int j;
+
+	for (j = 0; j < 16; j++, p += 4)
+		w[j] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		       (uint32_t)p[2] << 8 | p[3];
+	for (; j < 64; j++) {
+		t1 = ROR32(w[j - 2], 17) ^ ROR32(w[j - 2], 19) ^
+		     (w[j - 2] >> 10);
+		t2 = ROR32(w[j - 15], 7) ^ ROR32(w[j - 15], 18) ^
+		     (w[j - 15] >> 3);
+		w[j] = t1 + w[j - 7] + t2 + w[j - 16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (j = 0; j < 64; j++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[j] + w[j];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * sha256_init() - Start a new digest.
+ */
+void sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->bytes  = 0;
+	ctx->filled = 0;
+}
+
+/**
+ * sha256_update() - Absorb @len bytes of message.
+ */
+void sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	ctx->bytes += len;
+
+	if (ctx->filled) {
+		n = 64 - ctx->filled;
+		if (n > len)
+			n = len;
+		memcpy(ctx->block + ctx->filled, p, n);
+		ctx->filled += n;
+		p   += n;
+		len -= n;
+		if (ctx->filled < 64)
+			return;
+		sha256_block(ctx->state, ctx->block);
+		ctx->filled = 0;
+	}
+
+	/* Whole blocks straight from the caller's buffer. */
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(ctx->state, p);
+
+	memcpy(ctx->block, p, len);
+	ctx->filled = len;
+}
+
+/**
+ * sha256_final() - Pad the message and write out its digest.
+ */
+void sha256_final(struct sha256 *ctx, uint8_t out[SHA256_BYTES])
+{
+	uint64_t bits = ctx->bytes * 8;
+	int j;
+
+	/* A 1 bit, zeros up to 56 mod 64, then the big-endian bit count. */
+	ctx->block[ctx->filled++] = 0x80;
+	if (ctx->filled > 56) {
+		memset(ctx->block + ctx->filled, 0, 64 - ctx->filled);
+		sha256_block(ctx->state, ctx->block);
+		ctx->filled = 0;
+	}
+	memset(ctx->block + ctx->filled, 0, 56 - ctx->filled);
+	for (j = 0; j < 8; j++)
+		ctx->block[56 + j] = (uint8_t)(bits >> (56 - 8 * j));
+	sha256_block(ctx->state, ctx->block);
+
+	for (j = 0; j < 8; j++) {
+		out[4 * j]     = (uint8_t)(ctx->state[j] >> 24);
+		out[4 * j + 1] = (uint8_t)(ctx->state[j] >> 16);
+		out[4 * j + 2] = (uint8_t)(ctx->state[j] >> 8);
+		out[4 * j + 3] = (uint8_t)ctx->state[j];
+	}
+}
+
+/**
+ * sha256() - Digest @len bytes at @data in one call.
+ */
+void sha256(const void *data, size_t len, uint8_t out[SHA256_BYTES])
+{
+	struct sha256 ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, out);
+}
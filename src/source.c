@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "source.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * map_file() - Map @fd read-only if it is a regular file whose last
+ *              page has room for the NUL terminator.
+ *
+ * Returns NULL when the file should be read instead; that is not an
+ * error, so nothing is printed.
+ */
+static char *map_file(int fd, size_t *length)
+{
+	struct stat st;
+	long page;
+	void *map;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	page = sysconf(_SC_PAGESIZE);
+	if (page <= 0 || st.st_size <= 0 ||
+	    (uintmax_t)st.st_size >= SIZE_MAX ||
+	    st.st_size % page == 0)
+		return NULL;
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	/* The lexer makes a single forward pass. */
+	posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	*length = (size_t)st.st_size;
+	return map;
+}
+
+/*
+ * open_source() - Load a program from @path, or with @stream set leave
+ *                 any source that cannot be mapped in src->file.
+ */
+static struct source *open_source(const char *path, int stream)
+{
+	struct source *src;
+	FILE *file;
+	char *text;
+	int fd;
+
+	if (!path) {
+		fprintf(stderr, "error: null filename\n");
+		return NULL;
+	}
+
+	src = calloc(1, sizeof(*src));
+	if (!src) {
+		fprintf(stderr, "error: out of memory\n");
+		return NULL;
+	}
+
+	if (!strcmp(path, "-")) {
+		if (stream) {
+			src->file = stdin;
+			return src;
+		}
+		text = read_stream(stdin, &src->length);
+		if (!text)
+			goto err;
+		src->text = text;
+		return src;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "error: cannot open '%s'\n", path);
+		goto err;
+	}
+
+	text = map_file(fd, &src->length);
+	if (text) {
+		close(fd);
+		src->text   = text;
+		src->mapped = 1;
+		return src;
+	}
+
+	/* Not mappable: read the descriptor we already hold. */
+	file = fdopen(fd, "r");
+	if (!file) {
+		fprintf(stderr, "error: cannot open '%s'\n", path);
+		close(fd);
+		goto err;
+	}
+	if (stream) {
+		src->file = file;
+		return src;
+	}
+
+	text = read_stream(file, &src->length);
+	fclose(file);
+	if (!text)
+		goto err;
+	src->text = text;
+	return src;
+
+err:
+	free(src);
+	return NULL;
+}
+
+/**
+ * source_open() - Load a program from @path.
+ */
+struct source *source_open(const char *path)
+{
+	return open_source(path, 0);
+}
+
+/**
+ * source_open_stream() - Open a program from @path for a single pass.
+ */
+struct source *source_open_stream(const char *path)
+{
+	return open_source(path, 1);
+}
+
+/**
+ * source_close() - Release a loaded source.
+ */
+void source_close(struct source *src)
+{
+	if (!src)
+		return;
+
+	if (src->mapped)
+		munmap((void *)src->text, src->length);
+	else
+		free((void *)src->text);
+	if (src->file && src->file != stdin)
+		fclose(src->file);
+	free(src);
+}
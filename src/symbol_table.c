@@ -2,7 +2,6 @@
 #include "symbol_table.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
 #define INIT_CAP 64
 
@@ -16,139 +15,166 @@ static void value_release(struct value *v)
 }
 
 /**
- * symbol_table_create() - Allocate a new symbol table scope.
+ * symbol_table_create() - Allocate an empty table at the top level.
  */
-struct symbol_table *symbol_table_create(struct symbol_table *parent)
+struct symbol_table *symbol_table_create(void)
 {
 	struct symbol_table *table;
 
 	table = calloc(1, sizeof(*table));
-	if (!table)
-		goto err_table;
-
-	table->symbols = malloc(sizeof(struct symbol) * INIT_CAP);
-	if (!table->symbols)
-		goto err_symbols;
-
-	table->count = 0;
-	table->capacity = INIT_CAP;
-	table->parent = parent;
+	if (!table) {
+		fprintf(stderr, "symbol_table: out of memory\n");
+		return NULL;
+	}
 	return table;
-
-err_symbols:
-	free(table);
-err_table:
-	fprintf(stderr, "symbol_table: out of memory\n");
-	return NULL;
 }
 
 /**
- * symbol_table_destroy() - Free a scope and all of its bindings.
+ * symbol_table_destroy() - Free a table and all of its bindings.
  */
 void symbol_table_destroy(struct symbol_table *table)
 {
-	int j;
+	uint32_t j;
 
 	if (!table)
 		return;
 
-	for (j = 0; j < table->count; j++) {
-		free(table->symbols[j].name);
-		value_release(&table->symbols[j].value);
-	}
+	while (table->depth > 0)
+		symbol_table_pop(table);
+	for (j = 0; j < table->cell_count; j++)
+		if (table->cells[j].depth >= 0)
+			value_release(&table->cells[j].value);
 
-	free(table->symbols);
+	free(table->cells);
+	free(table->saved);
 	free(table);
 }
 
 /**
- * symbol_table_find() - Walk the scope chain to find a binding.
+ * symbol_table_find() - Look up the binding of a name.
  */
 struct symbol *symbol_table_find(struct symbol_table *table,
-				 const char *name)
+				 uint32_t name)
 {
-	int j;
-
-	if (!table || !name)
+	if (!table || name >= table->cell_count ||
+	    table->cells[name].depth < 0)
 		return NULL;
+	return &table->cells[name];
+}
+
+/**
+ * symbol_table_push() - Enter a function call.
+ */
+void symbol_table_push(struct symbol_table *table)
+{
+	table->depth++;
+}
 
-	while (table) {
-		for (j = 0; j < table->count; j++) {
-			if (!strcmp(table->symbols[j].name, name))
-				return &table->symbols[j];
-		}
-		table = table->parent;
+/**
+ * symbol_table_pop() - Leave the innermost call.
+ */
+void symbol_table_pop(struct symbol_table *table)
+{
+	struct symbol_save *save;
+
+	while (table->saved_count) {
+		save = &table->saved[table->saved_count - 1];
+		if (save->depth != table->depth)
+			break;
+		value_release(&table->cells[save->name].value);
+		table->cells[save->name] = save->old;
+		table->saved_count--;
+	}
+	table->depth--;
+}
+
+/* grow_cells() - Make room for the cell of atom @name. */
+static int grow_cells(struct symbol_table *table, uint32_t name)
+{
+	struct symbol *cells;
+	uint32_t cap = table->cell_count ? table->cell_count : INIT_CAP;
+	uint32_t j;
+
+	while (cap <= name)
+		cap *= 2;
+	cells = realloc(table->cells, sizeof(*cells) * cap);
+	if (!cells) {
+		fprintf(stderr, "symbol_table: out of memory\n");
+		return 0;
 	}
 
-	return NULL;
+	for (j = table->cell_count; j < cap; j++)
+		cells[j].depth = -1;
+	table->cells      = cells;
+	table->cell_count = cap;
+	return 1;
 }
 
-/* grow_symbols() - Double the symbol array capacity. */
-static int grow_symbols(struct symbol_table *table)
+/* grow_saved() - Double the capacity of the stack of hidden bindings. */
+static int grow_saved(struct symbol_table *table)
 {
-	struct symbol *new_syms;
-	int new_cap;
+	struct symbol_save *saved;
+	size_t cap = table->saved_cap ? table->saved_cap * 2 : INIT_CAP;
 
-	new_cap = table->capacity * 2;
-	new_syms = realloc(table->symbols,
-			   sizeof(struct symbol) * new_cap);
-	if (!new_syms) {
+	saved = realloc(table->saved, sizeof(*saved) * cap);
+	if (!saved) {
 		fprintf(stderr, "symbol_table: out of memory\n");
 		return 0;
 	}
 
-	table->symbols  = new_syms;
-	table->capacity = new_cap;
+	table->saved     = saved;
+	table->saved_cap = cap;
 	return 1;
 }
 
 /**
- * symbol_table_set_local() - Bind a name in the current scope only.
+ * symbol_table_set_local() - Bind a name in the innermost call only.
  */
 void symbol_table_set_local(struct symbol_table *table,
-			    const char *name,
+			    uint32_t name,
 			    struct value value)
 {
-	int j;
+	struct symbol *cell;
+	struct symbol_save *save;
 
-	if (!table || !name)
+	if (!table)
+		return;
+	if (name >= table->cell_count && !grow_cells(table, name))
 		return;
 
 	/* Update in place if the name already exists here. */
-	for (j = 0; j < table->count; j++) {
-		if (strcmp(table->symbols[j].name, name) != 0)
-			continue;
-		value_release(&table->symbols[j].value);
-		table->symbols[j].value = value;
+	cell = &table->cells[name];
+	if (cell->depth == table->depth) {
+		value_release(&cell->value);
+		cell->value = value;
 		return;
 	}
 
-	/* Grow if needed. */
-	if (table->count >= table->capacity) {
-		if (!grow_symbols(table))
+	/* Hide what the name meant outside; globals are never left. */
+	if (table->depth > 0) {
+		if (table->saved_count >= table->saved_cap &&
+		    !grow_saved(table))
 			return;
+		save = &table->saved[table->saved_count++];
+		save->name  = name;
+		save->depth = table->depth;
+		save->old   = *cell;
 	}
 
-	table->symbols[table->count].name = strdup(name);
-	if (!table->symbols[table->count].name) {
-		fprintf(stderr, "symbol_table: out of memory\n");
-		return;
-	}
-
-	table->symbols[table->count].value = value;
-	table->count++;
+	cell->value = value;
+	cell->depth = table->depth;
 }
 
 /**
  * symbol_table_set() - Assign respecting the full scope chain.
  */
 void symbol_table_set(struct symbol_table *table,
-		      const char *name,
+		      uint32_t name,
 		      struct value value)
 {
 	struct symbol *existing;
 
-	if (!table || !name)
+	if (!table)
 		return;
 
 	existing = symbol_table_find(table, name);
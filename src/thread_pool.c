@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Cap on pool size, whatever the CPU count says. */
+#define POOL_MAX_THREADS	256
+
+/**
+ * thread_pool_cpus() - Number of online CPUs, at least 1.
+ */
+int thread_pool_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	return n > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)n;
+}
+
+/*
+ * drain() - Claim and run items of the current job until none are
+ *           left.  Called and returns with @pool->lock held.
+ */
+static void drain(struct thread_pool *pool)
+{
+	void (*fn)(void *, int) = pool->fn;
+	void *arg = pool->arg;
+	int index;
+
+	while (pool->next < pool->count) {
+		index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		fn(arg, index);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->idle);
+	}
+}
+
+/* worker() - Thread body: wait for a job, help drain it, repeat. */
+static void *worker(void *data)
+{
+	struct thread_pool *pool = data;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		drain(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * thread_pool_create() - Start a pool.
+ */
+struct thread_pool *thread_pool_create(int nthreads)
+{
+	struct thread_pool *pool;
+	int j;
+
+	if (nthreads <= 0)
+		nthreads = thread_pool_cpus();
+	if (nthreads > POOL_MAX_THREADS)
+		nthreads = POOL_MAX_THREADS;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		goto err;
+
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	if (!pool->threads)
+		goto err_pool;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	/* The caller is thread 0; only the others are spawned. */
+	pool->nthreads = 1;
+	for (j = 1; j < nthreads; j++) {
+		if (pthread_create(&pool->threads[j], NULL, worker, pool)) {
+			fprintf(stderr, "thread_pool: cannot start thread\n");
+			break;
+		}
+		pool->nthreads++;
+	}
+	return pool;
+
+err_pool:
+	free(pool);
+err:
+	fprintf(stderr, "thread_pool: out of memory\n");
+	return NULL;
+}
+
+/**
+ * thread_pool_destroy() - Stop every worker and free the pool.
+ */
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	int j;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (j = 1; j < pool->nthreads; j++)
+		pthread_join(pool->threads[j], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/**
+ * thread_pool_size() - Threads a job runs on, counting the caller.
+ */
+int thread_pool_size(const struct thread_pool *pool)
+{
+	return pool ? pool->nthreads : 1;
+}
+
+/**
+ * thread_pool_run() - Run @fn(@arg, i) for i in [0, @count) and wait.
+ */
+void thread_pool_run(struct thread_pool *pool,
+		     void (*fn)(void *arg, int index), void *arg, int count)
+{
+	int j;
+
+	if (count <= 0)
+		return;
+
+	if (!pool || pool->nthreads == 1) {
+		for (j = 0; j < count; j++)
+			fn(arg, j);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn      = fn;
+	pool->arg     = arg;
+	pool->count   = count;
+	pool->next    = 0;
+	pool->pending = count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+
+	drain(pool);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
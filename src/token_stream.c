@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: MIT */
+#include "utils.h"
+#include "token_stream.h"
+#include "intern.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STREAM_INIT_TOKENS	1024
+#define STREAM_INIT_VALUES	64
+
+/**
+ * token_stream_create() - Allocate an empty stream.
+ */
+struct token_stream *token_stream_create(void)
+{
+	struct token_stream *stream;
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		fprintf(stderr, "token_stream: out of memory\n");
+	return stream;
+}
+
+/**
+ * token_stream_destroy() - Free a stream and the strings it owns.
+ */
+void token_stream_destroy(struct token_stream *stream)
+{
+	int j;
+
+	if (!stream)
+		return;
+	for (j = 0; j < stream->nstrings; j++)
+		free(stream->strings[j]);
+	free(stream->strings);
+	free(stream->lengths);
+	free(stream->numbers);
+	free(stream->tokens);
+	free(stream);
+}
+
+/*
+ * stream_grow() - Make room for @need elements of @size bytes in *@array,
+ *                 doubling from @init up to INT_MAX.  Returns 0 on
+ *                 allocation failure.
+ */
+static int stream_grow(void **array, int *cap, int need, size_t size,
+		       int init)
+{
+	void *grown;
+	int new_cap = *cap ? *cap : init;
+
+	if (need <= *cap)
+		return 1;
+	if (need < 0)
+		return 0;
+	while (new_cap < need)
+		new_cap = new_cap > INT_MAX / 2 ? INT_MAX : new_cap * 2;
+
+	grown = realloc(*array, size * new_cap);
+	if (!grown)
+		return 0;
+	*array = grown;
+	*cap   = new_cap;
+	return 1;
+}
+
+/**
+ * token_stream_reserve() - Make room without growing again.
+ */
+int token_stream_reserve(struct token_stream *stream, int tokens,
+			 int numbers, int strings, int lengths)
+{
+	if (!stream_grow((void **)&stream->tokens, &stream->capacity,
+			 tokens, sizeof(*stream->tokens), STREAM_INIT_TOKENS) ||
+	    !stream_grow((void **)&stream->numbers, &stream->number_cap,
+			 numbers, sizeof(*stream->numbers),
+			 STREAM_INIT_VALUES) ||
+	    !stream_grow((void **)&stream->strings, &stream->string_cap,
+			 strings, sizeof(*stream->strings),
+			 STREAM_INIT_VALUES) ||
+	    !stream_grow((void **)&stream->lengths, &stream->length_cap,
+			 lengths, sizeof(*stream->lengths),
+			 STREAM_INIT_VALUES)) {
+		fprintf(stderr, "token_stream: out of memory\n");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * token_stream_push() - Pack @tok onto the end of @stream.
+ */
+int token_stream_push(struct token_stream *stream, struct token *tok)
+{
+	struct packed_token *out;
+	struct token_length *len;
+	uint32_t value = 0;
+	int is_long = (uint32_t)tok->length >= TOKEN_LENGTH_MAX;
+
+	if (tok->offset > UINT32_MAX) {
+		fprintf(stderr, "token_stream: source too large\n");
+		goto err;
+	}
+	if (!token_stream_reserve(stream, stream->count + 1,
+				  stream->nnumbers + (tok->type == TOKEN_NUMBER),
+				  stream->nstrings + (tok->owned != NULL),
+				  stream->nlengths + is_long))
+		goto err;
+
+	if (is_long) {
+		len = &stream->lengths[stream->nlengths++];
+		len->offset = (uint32_t)tok->offset;
+		len->length = tok->length;
+	}
+
+	switch (tok->type) {
+	case TOKEN_NUMBER:
+		value = (uint32_t)stream->nnumbers;
+		stream->numbers[stream->nnumbers++] = tok->number;
+		break;
+	case TOKEN_STRING:
+		value = TOKEN_NO_ENTRY;
+		if (tok->owned) {
+			value = (uint32_t)stream->nstrings;
+			stream->strings[stream->nstrings++] = tok->owned;
+		}
+		break;
+	case TOKEN_IDENTIFIER:
+		value = tok->atom;
+		break;
+	default:
+		break;
+	}
+
+	out = &stream->tokens[stream->count++];
+	out->type   = tok->type;
+	out->length = is_long ? TOKEN_LENGTH_MAX : (uint32_t)tok->length;
+	out->offset = (uint32_t)tok->offset;
+	out->value  = value;
+	return 1;
+
+err:
+	free(tok->owned);
+	return 0;
+}
+
+/*
+ * long_length() - Look the length of the token at @offset up in the
+ *                 lengths table.
+ */
+static int long_length(const struct token_stream *stream, uint32_t offset)
+{
+	int lo = 0;
+	int hi = stream->nlengths - 1;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (stream->lengths[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return stream->lengths[lo].length;
+}
+
+/**
+ * token_stream_get() - Unpack token @index of @stream.
+ */
+void token_stream_get(const struct token_stream *stream, int index,
+		      struct token *tok)
+{
+	const struct packed_token *in = &stream->tokens[index];
+
+	tok->type   = (enum token_type)in->type;
+	tok->offset = in->offset;
+	tok->length = in->length == TOKEN_LENGTH_MAX ?
+		      long_length(stream, in->offset) : (int)in->length;
+	tok->owned  = NULL;
+	tok->number = 0.0;
+	tok->atom   = ATOM_INVALID;
+
+	switch (tok->type) {
+	case TOKEN_NUMBER:
+		tok->number = stream->numbers[in->value];
+		break;
+	case TOKEN_STRING:
+		if (in->value != TOKEN_NO_ENTRY)
+			tok->owned = stream->strings[in->value];
+		break;
+	case TOKEN_IDENTIFIER:
+		tok->atom = in->value;
+		break;
+	default:
+		break;
+	}
+}
@@ -2,6 +2,57 @@
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define READ_CHUNK	65536
+
+/**
+ * read_stream() - Read a stream to EOF into a heap-allocated string.
+ */
+char *read_stream(FILE *file, size_t *length)
+{
+	size_t	 cap = READ_CHUNK;
+	size_t	 len = 0;
+	size_t	 nread;
+	char	*buf;
+	char	*grown;
+
+	buf = malloc(cap);
+	if (!buf)
+		goto err_oom;
+
+	for (;;) {
+		/* Keep a full chunk plus the terminator free. */
+		if (cap - len < READ_CHUNK + 1) {
+			grown = realloc(buf, cap * 2);
+			if (!grown)
+				goto err_oom;
+			buf  = grown;
+			cap *= 2;
+		}
+
+		nread = fread(buf + len, 1, READ_CHUNK, file);
+		len  += nread;
+		if (nread < READ_CHUNK)
+			break;
+	}
+
+	if (ferror(file)) {
+		fprintf(stderr, "error: read failed\n");
+		free(buf);
+		return NULL;
+	}
+
+	buf[len] = '\0';
+	if (length)
+		*length = len;
+	return buf;
+
+err_oom:
+	fprintf(stderr, "error: out of memory\n");
+	free(buf);
+	return NULL;
+}
 
 /**
  * read_file() - Read a file into a heap-allocated string.
@@ -9,41 +60,23 @@
 char *read_file(const char *filename)
 {
 	FILE	*file;
-	long	 size;
 	char	*buf;
-	size_t	 nread;
 
 	if (!filename) {
 		fprintf(stderr, "error: null filename\n");
 		return NULL;
 	}
 
+	if (!strcmp(filename, "-"))
+		return read_stream(stdin, NULL);
+
 	file = fopen(filename, "r");
 	if (!file) {
 		fprintf(stderr, "error: cannot open '%s'\n", filename);
 		return NULL;
 	}
 
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-
-	if (size < 0) {
-		fprintf(stderr, "error: cannot stat '%s'\n", filename);
-		fclose(file);
-		return NULL;
-	}
-
-	buf = malloc(size + 1);
-	if (!buf) {
-		fprintf(stderr, "error: out of memory\n");
-		fclose(file);
-		return NULL;
-	}
-
-	nread      = fread(buf, 1, size, file);
-	buf[nread] = '\0';
-
+	buf = read_stream(file, NULL);
 	fclose(file);
 	return buf;
 }